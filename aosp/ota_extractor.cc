@@ -14,48 +14,33 @@
 // limitations under the License.
 //
 
+#include "update_engine/aosp/ota_extractor.h"
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
-#include <iterator>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <android-base/strings.h>
 #include <base/files/file_path.h>
-#include <gflags/gflags.h>
 #include <unistd.h>
-#include <xz.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
-#include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
-#include "update_engine/update_metadata.pb.h"
-
-DEFINE_string(payload, "", "Path to payload.bin");
-DEFINE_string(
-    input_dir,
-    "",
-    "Directory to read input images. Only required for incremental OTAs");
-DEFINE_string(output_dir, "", "Directory to put output images");
-DEFINE_int64(payload_offset,
-             0,
-             "Offset to start of payload.bin. Useful if payload path actually "
-             "points to a .zip file containing payload.bin");
-DEFINE_string(partitions,
-              "",
-              "Comma separated list of partitions to extract, leave empty for "
-              "extracting all partitions");
-
-using chromeos_update_engine::DeltaArchiveManifest;
-using chromeos_update_engine::PayloadMetadata;
 
 namespace chromeos_update_engine {
 
@@ -93,188 +78,342 @@ void WriteVerity(const PartitionUpdate& partition,
   return;
 }
 
-bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
-                          const PayloadMetadata& metadata,
+namespace {
+
+// Maximum size of the operation data read ahead of the operations being
+// applied, per partition.
+constexpr size_t kMaxPrefetchBytes = 64 * 1024 * 1024;
+
+// Reads and verifies the data of the operations of a partition on a separate
+// thread, so that the payload is read while the previous operations are
+// applied.
+class OperationDataPrefetcher {
+ public:
+  OperationDataPrefetcher(const PartitionUpdate& partition,
                           int payload_fd,
-                          size_t payload_offset,
-                          std::string_view input_dir,
-                          std::string_view output_dir,
-                          const std::set<std::string>& partitions) {
-  InstallOperationExecutor executor(manifest.block_size());
-  const size_t data_begin = metadata.GetMetadataSize() +
-                            metadata.GetMetadataSignatureSize() +
-                            payload_offset;
-  const base::FilePath output_dir_path(
-      base::StringPiece(output_dir.data(), output_dir.size()));
-  const base::FilePath input_dir_path(
-      base::StringPiece(input_dir.data(), input_dir.size()));
-  std::vector<unsigned char> blob;
-  for (const auto& partition : manifest.partitions()) {
-    if (!partitions.empty() &&
-        partitions.count(partition.partition_name()) == 0) {
-      continue;
+                          size_t data_begin)
+      : partition_(partition),
+        payload_fd_(payload_fd),
+        data_begin_(data_begin),
+        thread_(&OperationDataPrefetcher::ReadLoop, this) {}
+
+  ~OperationDataPrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cancelled_ = true;
     }
-    LOG(INFO) << "Extracting partition " << partition.partition_name()
-              << " size: " << partition.new_partition_info().size();
-    const auto output_path =
-        output_dir_path.Append(partition.partition_name() + ".img").value();
-    auto out_fd =
-        std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
-    TEST_AND_RETURN_FALSE_ERRNO(
-        out_fd->Open(output_path.c_str(), O_RDWR | O_CREAT, 0644));
-    auto in_fd =
-        std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
-    if (partition.has_old_partition_info()) {
-      const auto input_path =
-          input_dir_path.Append(partition.partition_name() + ".img").value();
-      LOG(INFO) << "Incremental OTA detected for partition "
-                << partition.partition_name() << " opening source image "
-                << input_path;
-      CHECK(in_fd->Open(input_path.c_str(), O_RDONLY))
-          << " failed to open " << input_path;
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Returns the data of the next operation of the partition in |blob|.
+  bool Next(brillo::Blob* blob) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !blobs_.empty() || failed_; });
+    if (blobs_.empty()) {
+      return false;
     }
+    *blob = std::move(blobs_.front());
+    blobs_.pop_front();
+    queued_bytes_ -= blob->size();
+    cv_.notify_all();
+    return true;
+  }
 
-    for (const auto& op : partition.operations()) {
-      if (op.has_src_sha256_hash()) {
-        brillo::Blob actual_hash;
-        TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
-            in_fd, op.src_extents(), manifest.block_size(), &actual_hash));
-        CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-                 HexEncode(op.src_sha256_hash()));
+ private:
+  void ReadLoop() {
+    for (const auto& op : partition_.operations()) {
+      {
+        // Always let at least one blob through, however large it is.
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this, &op] {
+          return cancelled_ || blobs_.empty() ||
+                 queued_bytes_ + op.data_length() <= kMaxPrefetchBytes;
+        });
+        if (cancelled_) {
+          return;
+        }
       }
-
-      blob.resize(op.data_length());
-      const auto op_data_offset = data_begin + op.data_offset();
+      brillo::Blob blob(op.data_length());
       ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(
-          payload_fd, blob.data(), blob.size(), op_data_offset, &bytes_read));
+      if (!utils::PReadAll(payload_fd_,
+                           blob.data(),
+                           blob.size(),
+                           data_begin_ + op.data_offset(),
+                           &bytes_read) ||
+          static_cast<size_t>(bytes_read) != blob.size()) {
+        PLOG(ERROR) << "Failed to read " << blob.size() << " bytes at offset "
+                    << data_begin_ + op.data_offset() << " of the payload";
+        std::lock_guard<std::mutex> lock(mutex_);
+        failed_ = true;
+        cv_.notify_all();
+        return;
+      }
       if (op.has_data_sha256_hash()) {
         brillo::Blob actual_hash;
-        TEST_AND_RETURN_FALSE(
-            HashCalculator::RawHashOfData(blob, &actual_hash));
+        CHECK(HashCalculator::RawHashOfData(blob, &actual_hash));
         CHECK_EQ(HexEncode(ToStringView(actual_hash)),
                  HexEncode(op.data_sha256_hash()));
       }
-      auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
-      if (op.type() == InstallOperation::ZERO) {
-        TEST_AND_RETURN_FALSE(executor.ExecuteZeroOrDiscardOperation(
-            op, std::move(direct_writer)));
-      } else if (op.type() == InstallOperation::REPLACE ||
-                 op.type() == InstallOperation::REPLACE_BZ ||
-                 op.type() == InstallOperation::REPLACE_XZ) {
-        TEST_AND_RETURN_FALSE(executor.ExecuteReplaceOperation(
-            op, std::move(direct_writer), blob.data(), blob.size()));
-      } else if (op.type() == InstallOperation::SOURCE_COPY) {
-        CHECK(in_fd->IsOpen());
-        TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
-            op, std::move(direct_writer), in_fd));
-      } else {
-        CHECK(in_fd->IsOpen());
-        TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
-            op, std::move(direct_writer), in_fd, blob.data(), blob.size()));
-      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_bytes_ += blob.size();
+      blobs_.push_back(std::move(blob));
+      cv_.notify_all();
     }
-    WriteVerity(partition, out_fd, manifest.block_size());
-    int err =
-        truncate64(output_path.c_str(), partition.new_partition_info().size());
-    if (err) {
-      PLOG(ERROR) << "Failed to truncate " << output_path << " to "
-                  << partition.new_partition_info().size();
-    }
-    brillo::Blob actual_hash;
-    TEST_AND_RETURN_FALSE(
-        HashCalculator::RawHashOfFile(output_path, &actual_hash));
-    CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-             HexEncode(partition.new_partition_info().hash()))
-        << " Partition " << partition.partition_name()
-        << " hash mismatches. Either the source image or OTA package is "
-           "corrupted.";
   }
-  return true;
-}
 
-}  // namespace chromeos_update_engine
+  const PartitionUpdate& partition_;
+  const int payload_fd_;
+  const size_t data_begin_;
 
-namespace {
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<brillo::Blob> blobs_;
+  size_t queued_bytes_{0};
+  bool failed_{false};
+  bool cancelled_{false};
+
+  // Started last, once all the members above are initialized.
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(OperationDataPrefetcher);
+};
+
+// A FileDescriptor which hashes the data written to the wrapped one, as long
+// as it is written in order. Skipped ranges are hashed as zeros, so the file
+// must be empty when opened.
+class HashingFileDescriptor final : public FileDescriptor {
+ public:
+  explicit HashingFileDescriptor(FileDescriptorPtr fd) : fd_(std::move(fd)) {}
 
-bool IsIncrementalOTA(const DeltaArchiveManifest& manifest) {
-  for (const auto& part : manifest.partitions()) {
-    if (part.has_old_partition_info()) {
-      return true;
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override {
+    ssize_t bytes_read = fd_->Read(buf, count);
+    if (bytes_read > 0 && offset_ >= 0) {
+      offset_ += bytes_read;
     }
+    return bytes_read;
   }
-  return false;
-}
+  ssize_t Write(const void* buf, size_t count) override {
+    ssize_t bytes_written = fd_->Write(buf, count);
+    if (bytes_written > 0) {
+      if (offset_ < 0 || static_cast<uint64_t>(offset_) < hashed_size_) {
+        // Rewriting data which was hashed already.
+        in_order_ = false;
+      } else if (in_order_) {
+        in_order_ = HashZerosUpTo(offset_) &&
+                    hasher_.Update(buf, bytes_written);
+        hashed_size_ += bytes_written;
+      }
+      offset_ += bytes_written;
+    }
+    return bytes_written;
+  }
+  bool ReadScattered(const struct iovec* iov,
+                     const off64_t* offsets,
+                     size_t iovcnt) override {
+    offset_ = -1;
+    return fd_->ReadScattered(iov, offsets, iovcnt);
+  }
+  off64_t Seek(off64_t offset, int whence) override {
+    offset_ = fd_->Seek(offset, whence);
+    return offset_;
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    // The ioctls may change the data of the file.
+    in_order_ = false;
+    return fd_->BlkIoctl(request, start, length, result);
+  }
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override { return fd_->Close(); }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  int Fd() override { return fd_->Fd(); }
 
-}  // namespace
+  // Stores in |hash| the hash of the first |size| bytes of the file. Returns
+  // false if it's unknown because the data wasn't written in order.
+  bool GetHash(uint64_t size, brillo::Blob* hash) {
+    if (!in_order_ || hashed_size_ > size) {
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(HashZerosUpTo(size));
+    TEST_AND_RETURN_FALSE(hasher_.Finalize());
+    *hash = hasher_.raw_hash();
+    return true;
+  }
 
-int main(int argc, char* argv[]) {
-  gflags::SetUsageMessage(
-      "A tool to extract device images from Android OTA packages");
-  gflags::ParseCommandLineFlags(&argc, &argv, true);
-  xz_crc32_init();
-  auto tokens = android::base::Tokenize(FLAGS_partitions, ",");
-  const std::set<std::string> partitions(
-      std::make_move_iterator(tokens.begin()),
-      std::make_move_iterator(tokens.end()));
-  if (FLAGS_payload.empty()) {
-    LOG(ERROR) << "--payload <payload path> is required";
-    return 1;
+ private:
+  bool HashZerosUpTo(uint64_t size) {
+    static const std::vector<uint8_t> kZeros(1024 * 1024);
+    while (hashed_size_ < size) {
+      const size_t length =
+          std::min<uint64_t>(kZeros.size(), size - hashed_size_);
+      TEST_AND_RETURN_FALSE(hasher_.Update(kZeros.data(), length));
+      hashed_size_ += length;
+    }
+    return true;
   }
-  if (!partitions.empty()) {
-    LOG(INFO) << "Extracting " << android::base::Join(partitions, ", ");
+
+  FileDescriptorPtr fd_;
+  HashCalculator hasher_;
+  // Offset of the wrapped file descriptor, or -1 if unknown.
+  off64_t offset_{0};
+  uint64_t hashed_size_{0};
+  bool in_order_{true};
+
+  DISALLOW_COPY_AND_ASSIGN(HashingFileDescriptor);
+};
+
+bool ExtractPartition(const PartitionUpdate& partition,
+                      size_t block_size,
+                      int payload_fd,
+                      size_t data_begin,
+                      const base::FilePath& input_dir_path,
+                      const base::FilePath& output_dir_path) {
+  InstallOperationExecutor executor(block_size);
+  LOG(INFO) << "Extracting partition " << partition.partition_name()
+            << " size: " << partition.new_partition_info().size();
+  const auto output_path =
+      output_dir_path.Append(partition.partition_name() + ".img").value();
+  auto out_fd = std::make_shared<HashingFileDescriptor>(
+      std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>());
+  TEST_AND_RETURN_FALSE_ERRNO(
+      out_fd->Open(output_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+  auto in_fd =
+      std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+  if (partition.has_old_partition_info()) {
+    const auto input_path =
+        input_dir_path.Append(partition.partition_name() + ".img").value();
+    LOG(INFO) << "Incremental OTA detected for partition "
+              << partition.partition_name() << " opening source image "
+              << input_path;
+    CHECK(in_fd->Open(input_path.c_str(), O_RDONLY))
+        << " failed to open " << input_path;
   }
-  int payload_fd = open(FLAGS_payload.c_str(), O_RDONLY | O_CLOEXEC);
-  if (payload_fd < 0) {
-    PLOG(ERROR) << "Failed to open payload file";
-    return 1;
+
+  OperationDataPrefetcher prefetcher(partition, payload_fd, data_begin);
+  brillo::Blob blob;
+  for (const auto& op : partition.operations()) {
+    if (op.has_src_sha256_hash()) {
+      brillo::Blob actual_hash;
+      TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
+          in_fd, op.src_extents(), block_size, &actual_hash));
+      CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+               HexEncode(op.src_sha256_hash()));
+    }
+
+    TEST_AND_RETURN_FALSE(prefetcher.Next(&blob));
+    auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
+    if (op.type() == InstallOperation::ZERO) {
+      TEST_AND_RETURN_FALSE(executor.ExecuteZeroOrDiscardOperation(
+          op, std::move(direct_writer)));
+    } else if (op.type() == InstallOperation::REPLACE ||
+               op.type() == InstallOperation::REPLACE_BZ ||
+               op.type() == InstallOperation::REPLACE_XZ) {
+      TEST_AND_RETURN_FALSE(executor.ExecuteReplaceOperation(
+          op, std::move(direct_writer), blob.data(), blob.size()));
+    } else if (op.type() == InstallOperation::SOURCE_COPY) {
+      CHECK(in_fd->IsOpen());
+      TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
+          op, std::move(direct_writer), in_fd));
+    } else {
+      CHECK(in_fd->IsOpen());
+      TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
+          op, std::move(direct_writer), in_fd, blob.data(), blob.size()));
+    }
+  }
+  WriteVerity(partition, out_fd, block_size);
+  int err =
+      truncate64(output_path.c_str(), partition.new_partition_info().size());
+  if (err) {
+    PLOG(ERROR) << "Failed to truncate " << output_path << " to "
+                << partition.new_partition_info().size();
   }
-  chromeos_update_engine::ScopedFdCloser closer{&payload_fd};
-  auto payload_size = chromeos_update_engine::utils::FileSize(payload_fd);
-  if (payload_size <= 0) {
-    PLOG(ERROR)
-        << "Couldn't determine size of payload file, or payload file is empty";
-    return 1;
+  brillo::Blob actual_hash;
+  if (!out_fd->GetHash(partition.new_partition_info().size(), &actual_hash)) {
+    LOG(INFO) << "Partition " << partition.partition_name()
+              << " wasn't written in order, reading it back to hash it.";
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfFile(output_path, &actual_hash));
   }
+  CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+           HexEncode(partition.new_partition_info().hash()))
+      << " Partition " << partition.partition_name()
+      << " hash mismatches. Either the source image or OTA package is "
+         "corrupted.";
+  return true;
+}
 
-  PayloadMetadata payload_metadata;
-  auto payload = static_cast<unsigned char*>(
-      mmap(nullptr, payload_size, PROT_READ, MAP_PRIVATE, payload_fd, 0));
+}  // namespace
 
-  if (payload == MAP_FAILED) {
-    PLOG(ERROR) << "Failed to mmap() payload file";
-    return 1;
+bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
+                          const PayloadMetadata& metadata,
+                          int payload_fd,
+                          size_t payload_offset,
+                          std::string_view input_dir,
+                          std::string_view output_dir,
+                          const std::set<std::string>& partitions,
+                          size_t num_threads) {
+  const size_t data_begin = metadata.GetMetadataSize() +
+                            metadata.GetMetadataSignatureSize() +
+                            payload_offset;
+  const base::FilePath output_dir_path(
+      base::StringPiece(output_dir.data(), output_dir.size()));
+  const base::FilePath input_dir_path(
+      base::StringPiece(input_dir.data(), input_dir.size()));
+  std::vector<const PartitionUpdate*> selected_partitions;
+  for (const auto& partition : manifest.partitions()) {
+    if (partitions.empty() || partitions.count(partition.partition_name())) {
+      selected_partitions.push_back(&partition);
+    }
   }
+  // Start with the largest partitions, so that they don't end up being
+  // extracted alone at the end.
+  std::stable_sort(selected_partitions.begin(),
+                   selected_partitions.end(),
+                   [](const PartitionUpdate* a, const PartitionUpdate* b) {
+                     return a->new_partition_info().size() >
+                            b->new_partition_info().size();
+                   });
 
-  auto munmap_deleter = [payload_size](auto payload) {
-    munmap(payload, payload_size);
+  std::atomic<size_t> next_partition{0};
+  std::atomic<bool> success{true};
+  auto worker = [&]() {
+    while (success) {
+      const size_t index = next_partition++;
+      if (index >= selected_partitions.size()) {
+        return;
+      }
+      if (!ExtractPartition(*selected_partitions[index],
+                            manifest.block_size(),
+                            payload_fd,
+                            data_begin,
+                            input_dir_path,
+                            output_dir_path)) {
+        success = false;
+      }
+    }
   };
-  std::unique_ptr<unsigned char, decltype(munmap_deleter)> munmapper{
-      payload, munmap_deleter};
-  if (payload_metadata.ParsePayloadHeader(payload + FLAGS_payload_offset,
-                                          payload_size - FLAGS_payload_offset,
-                                          nullptr) !=
-      chromeos_update_engine::MetadataParseResult::kSuccess) {
-    LOG(ERROR) << "Payload header parse failed!";
-    return 1;
-  }
-  DeltaArchiveManifest manifest;
-  if (!payload_metadata.GetManifest(payload + FLAGS_payload_offset,
-                                    payload_size - FLAGS_payload_offset,
-                                    &manifest)) {
-    LOG(ERROR) << "Failed to parse manifest!";
-    return 1;
+  num_threads = std::max<size_t>(
+      1, std::min(num_threads, selected_partitions.size()));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(worker);
   }
-  if (IsIncrementalOTA(manifest) && FLAGS_input_dir.empty()) {
-    LOG(ERROR) << FLAGS_payload
-               << " is an incremental OTA, --input_dir parameter is required.";
-    return 1;
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
   }
-  return !ExtractImagesFromOTA(manifest,
-                               payload_metadata,
-                               payload_fd,
-                               FLAGS_payload_offset,
-                               FLAGS_input_dir,
-                               FLAGS_output_dir,
-                               partitions);
+  return success;
 }
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,44 @@
+//
+// Copyright (C) 2022 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_AOSP_OTA_EXTRACTOR_H_
+#define UPDATE_ENGINE_AOSP_OTA_EXTRACTOR_H_
+
+#include <set>
+#include <string>
+#include <string_view>
+
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Extracts the images of |partitions| of the payload in |payload_fd|, or all
+// of them if |partitions| is empty, to |output_dir|. The source images of
+// incremental payloads are read from |input_dir|. Up to |num_threads|
+// partitions are extracted in parallel. Returns false on failure.
+bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
+                          const PayloadMetadata& metadata,
+                          int payload_fd,
+                          size_t payload_offset,
+                          std::string_view input_dir,
+                          std::string_view output_dir,
+                          const std::set<std::string>& partitions,
+                          size_t num_threads);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_AOSP_OTA_EXTRACTOR_H_
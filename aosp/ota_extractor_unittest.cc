@@ -0,0 +1,174 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/ota_extractor.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iterator>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+struct TestPartition {
+  const char* name;
+  size_t size;
+};
+
+// Partitions of different sizes, so that they finish at different times when
+// extracted in parallel.
+constexpr TestPartition kTestPartitions[] = {
+    {"system", 3 * 1024 * 1024},
+    {"vendor", 1024 * 1024 + 4096},
+    {"product", 512 * 1024},
+    {"odm", 4096},
+};
+
+}  // namespace
+
+class OtaExtractorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    PayloadGenerationConfig config;
+    config.is_delta = false;
+    config.version.major = kBrilloMajorPayloadVersion;
+    config.version.minor = kFullPayloadMinorVersion;
+    // Small chunks, so that each partition has several operations queued in
+    // the prefetcher.
+    config.hard_chunk_size = 64 * 1024;
+    for (const auto& partition : kTestPartitions) {
+      images_.push_back(std::make_unique<ScopedTempFile>(
+          string("OtaExtractorTest-") + partition.name + ".XXXXXX"));
+      brillo::Blob data(partition.size);
+      test_utils::FillWithData(&data);
+      ASSERT_TRUE(test_utils::WriteFileVector(images_.back()->path(), data));
+      image_data_.push_back(std::move(data));
+
+      config.target.partitions.emplace_back(partition.name);
+      config.target.partitions.back().path = images_.back()->path();
+    }
+    ASSERT_TRUE(config.target.LoadImageSize());
+    for (PartitionConfig& part : config.target.partitions) {
+      ASSERT_TRUE(part.OpenFilesystem());
+    }
+    ASSERT_TRUE(config.Validate());
+    ASSERT_TRUE(GenerateUpdatePayloadFile(
+        config, payload_file_.path(), "", &metadata_size_));
+
+    brillo::Blob payload;
+    ASSERT_TRUE(utils::ReadFile(payload_file_.path(), &payload));
+    ASSERT_TRUE(metadata_.ParsePayloadHeader(payload));
+    ASSERT_EQ(metadata_size_, metadata_.GetMetadataSize());
+    ASSERT_TRUE(metadata_.GetManifest(payload, &manifest_));
+    ASSERT_EQ(std::size(kTestPartitions),
+              static_cast<size_t>(manifest_.partitions_size()));
+  }
+
+  // Extracts |partitions| from the payload to a new directory in |dir| using
+  // |num_threads| threads.
+  bool Extract(const std::set<string>& partitions,
+               size_t num_threads,
+               base::ScopedTempDir* dir) {
+    TEST_AND_RETURN_FALSE(dir->CreateUniqueTempDir());
+    int payload_fd = open(payload_file_.path().c_str(), O_RDONLY | O_CLOEXEC);
+    TEST_AND_RETURN_FALSE_ERRNO(payload_fd >= 0);
+    ScopedFdCloser closer(&payload_fd);
+    return ExtractImagesFromOTA(manifest_,
+                                metadata_,
+                                payload_fd,
+                                0,
+                                "",
+                                dir->GetPath().value(),
+                                partitions,
+                                num_threads);
+  }
+
+  // Returns the contents of the image of |partition_name| extracted to |dir|.
+  brillo::Blob ReadImage(const base::ScopedTempDir& dir,
+                         const string& partition_name) {
+    brillo::Blob data;
+    EXPECT_TRUE(utils::ReadFile(
+        dir.GetPath().Append(partition_name + ".img").value(), &data));
+    return data;
+  }
+
+  vector<std::unique_ptr<ScopedTempFile>> images_;
+  vector<brillo::Blob> image_data_;
+  ScopedTempFile payload_file_{"OtaExtractorTest-payload.XXXXXX"};
+  uint64_t metadata_size_{0};
+  PayloadMetadata metadata_;
+  DeltaArchiveManifest manifest_;
+};
+
+TEST_F(OtaExtractorTest, MultiThreadedExtractionMatchesSingleThreaded) {
+  base::ScopedTempDir single_threaded_dir;
+  ASSERT_TRUE(Extract({}, 1, &single_threaded_dir));
+  base::ScopedTempDir multi_threaded_dir;
+  ASSERT_TRUE(Extract({}, 3, &multi_threaded_dir));
+
+  for (size_t i = 0; i < std::size(kTestPartitions); i++) {
+    const string name = kTestPartitions[i].name;
+    const brillo::Blob single_threaded_image =
+        ReadImage(single_threaded_dir, name);
+    EXPECT_EQ(image_data_[i], single_threaded_image) << name;
+    EXPECT_EQ(single_threaded_image, ReadImage(multi_threaded_dir, name))
+        << name;
+  }
+}
+
+TEST_F(OtaExtractorTest, MoreThreadsThanSelectedPartitions) {
+  base::ScopedTempDir dir;
+  ASSERT_TRUE(Extract({"vendor", "odm"}, 8, &dir));
+
+  for (size_t i = 0; i < std::size(kTestPartitions); i++) {
+    const string name = kTestPartitions[i].name;
+    const auto path = dir.GetPath().Append(name + ".img").value();
+    if (name == "vendor" || name == "odm") {
+      EXPECT_EQ(image_data_[i], ReadImage(dir, name)) << name;
+    } else {
+      EXPECT_FALSE(utils::FileExists(path.c_str())) << name;
+    }
+  }
+}
+
+TEST_F(OtaExtractorTest, TruncatedPayloadFails) {
+  // Drop the data of the last operations, so that the prefetcher fails to
+  // read them.
+  ASSERT_EQ(0, truncate(payload_file_.path().c_str(), metadata_size_ + 4096));
+  base::ScopedTempDir dir;
+  EXPECT_FALSE(Extract({}, 2, &dir));
+}
+
+}  // namespace chromeos_update_engine
@@ -43,6 +43,7 @@
 #include "update_engine/common/file_fetcher.h"
 #include "update_engine/common/metrics_reporter_interface.h"
 #include "update_engine/common/network_selector.h"
+#include "update_engine/common/parallel_http_fetcher.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
@@ -333,13 +334,30 @@ bool UpdateAttempterAndroid::ApplyPayload(
     return false;  // NOLINT, unreached but analyzer might not know.
                    // Suppress warnings about null 'fetcher' after this.
 #else
-    LibcurlHttpFetcher* libcurl_fetcher = new LibcurlHttpFetcher(hardware_);
-    if (!headers[kPayloadDownloadRetry].empty()) {
-      libcurl_fetcher->set_max_retry_count(
-          atoi(headers[kPayloadDownloadRetry].c_str()));
+    const int parallel_downloads =
+        std::clamp(atoi(headers[kPayloadParallelDownloads].c_str()),
+                   1,
+                   ParallelHttpFetcher::kMaxParallelDownloads);
+    std::vector<std::unique_ptr<HttpFetcher>> libcurl_fetchers;
+    for (int i = 0; i < parallel_downloads; i++) {
+      LibcurlHttpFetcher* libcurl_fetcher = new LibcurlHttpFetcher(hardware_);
+      if (!headers[kPayloadDownloadRetry].empty()) {
+        libcurl_fetcher->set_max_retry_count(
+            atoi(headers[kPayloadDownloadRetry].c_str()));
+      }
+      libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
+      libcurl_fetchers.emplace_back(libcurl_fetcher);
+    }
+    if (parallel_downloads == 1) {
+      fetcher = libcurl_fetchers.front().release();
+    } else {
+      LOG(INFO) << "Downloading the payload over " << parallel_downloads
+                << " connections.";
+      fetcher = new ParallelHttpFetcher(
+          std::move(libcurl_fetchers),
+          ParallelHttpFetcher::kDefaultChunkSize,
+          parallel_downloads * ParallelHttpFetcher::kDefaultChunkSize);
     }
-    libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
-    fetcher = libcurl_fetcher;
 #endif  // _UE_SIDELOAD
   }
   // Setup extra headers.
@@ -362,6 +380,28 @@ bool UpdateAttempterAndroid::ApplyPayload(
   if (!headers[kPayloadBatchedWrites].empty()) {
     install_plan_.batched_writes = true;
   }
+  if (!headers[kPayloadPipelinedApplyThreads].empty()) {
+    install_plan_.pipelined_apply_threads =
+        std::max(0, atoi(headers[kPayloadPipelinedApplyThreads].c_str()));
+  }
+  if (!headers[kPayloadIoUringQueueDepth].empty()) {
+    install_plan_.io_uring_queue_depth =
+        std::max(0, atoi(headers[kPayloadIoUringQueueDepth].c_str()));
+  }
+  if (!headers[kPayloadVerifyThreads].empty()) {
+    install_plan_.verify_threads =
+        std::max(0, atoi(headers[kPayloadVerifyThreads].c_str()));
+  }
+  if (!headers[kPayloadSourcePrefetchOperations].empty()) {
+    install_plan_.source_prefetch_operations =
+        std::max(0, atoi(headers[kPayloadSourcePrefetchOperations].c_str()));
+  }
+  if (!headers[kPayloadSourceBlockCacheMb].empty()) {
+    install_plan_.source_block_cache_mb =
+        std::clamp(atoi(headers[kPayloadSourceBlockCacheMb].c_str()),
+                   0,
+                   kMaxSourceBlockCacheMb);
+  }
 
   BuildUpdateActions(fetcher);
 
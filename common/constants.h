@@ -185,6 +185,33 @@ static constexpr const auto& kPayloadDisableVABC = "DISABLE_VABC";
 static constexpr const auto& kPayloadEnableThreading = "ENABLE_THREADING";
 // Enable batched writes for VABC
 static constexpr const auto& kPayloadBatchedWrites = "BATCHED_WRITES";
+// Number of worker threads applying install operations while the payload is
+// being downloaded. Unset or 0 applies operations on the download thread.
+static constexpr const auto& kPayloadPipelinedApplyThreads =
+    "PIPELINED_APPLY_THREADS";
+// Queue depth of the io_uring used to read and write partitions. Unset or 0
+// uses regular read and write syscalls.
+static constexpr const auto& kPayloadIoUringQueueDepth = "IO_URING_QUEUE_DEPTH";
+// Number of connections downloading the payload from an HTTP server at once,
+// up to ParallelHttpFetcher::kMaxParallelDownloads. Unset or 1 downloads over
+// a single connection.
+static constexpr const auto& kPayloadParallelDownloads = "PARALLEL_DOWNLOADS";
+// Number of threads verifying the partitions at once after the update is
+// applied. Unset or 0 verifies them one at a time.
+static constexpr const auto& kPayloadVerifyThreads = "VERIFY_THREADS";
+// Number of upcoming operations whose source extents are read ahead into the
+// page cache. Unset or 0 reads source extents only when they are needed.
+static constexpr const auto& kPayloadSourcePrefetchOperations =
+    "SOURCE_PREFETCH_OPERATIONS";
+// Size in MiB of the cache keeping the source blocks read while applying the
+// operations of a partition, up to kMaxSourceBlockCacheMb. Each writer of the
+// partition has its own cache, so with PIPELINED_APPLY_THREADS the size is
+// split among the writers and each caches fewer blocks. Unset or 0 reads them
+// from the partition each time.
+static constexpr const auto& kPayloadSourceBlockCacheMb =
+    "SOURCE_BLOCK_CACHE_MB";
+// The largest SOURCE_BLOCK_CACHE_MB accepted.
+constexpr int kMaxSourceBlockCacheMb = 256;
 
 // Max retry count for download
 static constexpr const auto& kPayloadDownloadRetry = "DOWNLOAD_RETRY";
@@ -21,10 +21,15 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <deque>
 #include <memory>
 #include <string>
 #include <utility>
 
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/http_fetcher.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
@@ -118,6 +123,31 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // Writes |length| bytes of payload to |delta_performer_|, terminating the
+  // processing on failure. Returns whether the data was written.
+  bool WriteToDeltaPerformer(const void* bytes, size_t length);
+
+  // When the operations are applied in the background, the received data is
+  // queued and written to |delta_performer_| from the message loop whenever
+  // it can take more, so that the download doesn't stall on a busy
+  // performer. The fetcher is paused while the queue is above a high
+  // watermark, until it drains below a low watermark.
+  void QueueReceivedData(const void* bytes, size_t length);
+  void ScheduleWriteQueuedData(base::TimeDelta delay);
+  void WriteQueuedData();
+  void ClearQueuedData();
+
+  // Pauses or unpauses |http_fetcher_| as needed by SuspendAction() and
+  // ResumeAction() and by the queue.
+  void UpdateFetcherPaused();
+
+  // Finishes the download of the current payload once all its data was
+  // written.
+  void CompleteTransfer(bool successful);
+
+  // Logs the throughput of the download and how the queue behaved.
+  void LogFlowControlStats();
+
   // Pointer to the current payload in install_plan_.payloads.
   InstallPlan::Payload* payload_{nullptr};
 
@@ -156,6 +186,29 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // The path to the zip file with X509 certificates.
   const std::string update_certificates_path_;
 
+  // The data received but not written to |delta_performer_| yet, if the
+  // received data is queued.
+  bool queue_received_data_{false};
+  std::deque<brillo::Blob> queued_data_;
+  size_t queued_bytes_{0};
+  brillo::MessageLoop::TaskId write_queued_data_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  // Whether the fetcher is paused, and why it should be.
+  bool fetcher_paused_{false};
+  bool suspended_{false};
+  bool throttled_{false};
+
+  // Whether the transfer completed successfully with data left in the queue.
+  bool transfer_complete_pending_{false};
+
+  // Flow control stats of the current payload.
+  base::TimeTicks download_start_time_;
+  base::TimeTicks throttle_start_time_;
+  base::TimeDelta throttled_time_;
+  uint64_t total_queued_bytes_{0};
+  size_t max_queued_bytes_{0};
+
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
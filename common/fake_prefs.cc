@@ -174,6 +174,31 @@ bool FakePrefs::GetValue(std::string_view key, T* value) const {
   return true;
 }
 
+bool FakePrefs::StartTransaction() {
+  EXPECT_FALSE(transaction_values_) << "Transactions can't be nested.";
+  if (transaction_values_)
+    return false;
+  transaction_values_ = values_;
+  return true;
+}
+
+bool FakePrefs::CancelTransaction() {
+  EXPECT_TRUE(transaction_values_) << "No transaction to cancel.";
+  if (!transaction_values_)
+    return false;
+  values_ = std::move(*transaction_values_);
+  transaction_values_.reset();
+  return true;
+}
+
+bool FakePrefs::SubmitTransaction() {
+  EXPECT_TRUE(transaction_values_) << "No transaction to submit.";
+  if (!transaction_values_)
+    return false;
+  transaction_values_.reset();
+  return true;
+}
+
 void FakePrefs::AddObserver(std::string_view key, ObserverInterface* observer) {
   observers_[string{key}].push_back(observer);
 }
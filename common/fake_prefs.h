@@ -19,6 +19,7 @@
 
 #include <functional>
 #include <map>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -60,6 +61,12 @@ class FakePrefs : public PrefsInterface {
   void RemoveObserver(std::string_view key,
                       ObserverInterface* observer) override;
 
+  // Unlike with the real prefs, observers are called as soon as the values
+  // change. Canceling a transaction restores the values from before it.
+  bool StartTransaction() override;
+  bool CancelTransaction() override;
+  bool SubmitTransaction() override;
+
  private:
   enum class PrefType {
     kString,
@@ -108,6 +115,10 @@ class FakePrefs : public PrefsInterface {
   // Container for all the key/value pairs.
   std::map<std::string, PrefTypeValue, std::less<>> values_;
 
+  // The values from before the current transaction, if any.
+  std::optional<std::map<std::string, PrefTypeValue, std::less<>>>
+      transaction_values_;
+
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>, std::less<>>
       observers_;
@@ -16,6 +16,11 @@
 
 #include "update_engine/common/file_fetcher.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <string>
 
@@ -23,6 +28,7 @@
 #include <base/format_macros.h>
 #include <base/location.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/streams/file_stream.h>
@@ -36,6 +42,11 @@ namespace {
 
 size_t kReadBufferSize = 16 * 1024;
 
+// The size of the windows passed to the delegate when the file is mapped. It
+// is large enough for most operations of a payload to be applied from a single
+// window, and bounds the address space used on 32-bit devices.
+constexpr uint64_t kMappedWindowSize = 8 * 1024 * 1024;
+
 }  // namespace
 
 namespace chromeos_update_engine {
@@ -71,16 +82,17 @@ void FileFetcher::BeginTransfer(const string& url) {
   string file_path;
 
   if (base::StartsWith(url, "fd://", base::CompareCase::INSENSITIVE_ASCII)) {
-    int fd = std::stoi(url.substr(strlen("fd://")));
+    fd_ = std::stoi(url.substr(strlen("fd://")));
     file_path = url;
-    stream_ = brillo::FileStream::FromFileDescriptor(fd, false, nullptr);
+    stream_ = brillo::FileStream::FromFileDescriptor(fd_, false, nullptr);
   } else {
     file_path = url.substr(strlen("file://"));
-    stream_ =
-        brillo::FileStream::Open(base::FilePath(file_path),
-                                 brillo::Stream::AccessMode::READ,
-                                 brillo::FileStream::Disposition::OPEN_EXISTING,
-                                 nullptr);
+    fd_ = HANDLE_EINTR(open(file_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd_ >= 0) {
+      stream_ = brillo::FileStream::FromFileDescriptor(fd_, true, nullptr);
+      if (!stream_)
+        IGNORE_EINTR(close(fd_));
+    }
   }
 
   if (!stream_) {
@@ -95,6 +107,10 @@ void FileFetcher::BeginTransfer(const string& url) {
 
   if (offset_)
     stream_->SetPosition(offset_, nullptr);
+  // Payloads are regular files most of the time, map them to avoid copying
+  // them and to pass them in fewer, larger chunks.
+  struct stat stbuf;
+  use_mmap_ = fstat(fd_, &stbuf) == 0 && S_ISREG(stbuf.st_mode);
   bytes_copied_ = 0;
   transfer_in_progress_ = true;
   ScheduleRead();
@@ -112,6 +128,15 @@ void FileFetcher::ScheduleRead() {
   if (transfer_paused_ || ongoing_read_ || !transfer_in_progress_)
     return;
 
+  if (use_mmap_) {
+    mapped_read_task_ = brillo::MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&FileFetcher::OnMappedReadCallback,
+                   base::Unretained(this)));
+    ongoing_read_ = true;
+    return;
+  }
+
   buffer_.resize(kReadBufferSize);
   size_t bytes_to_read = buffer_.size();
   if (data_length_ >= 0) {
@@ -154,6 +179,55 @@ void FileFetcher::OnReadDoneCallback(size_t bytes_read) {
   }
 }
 
+void FileFetcher::OnMappedReadCallback() {
+  mapped_read_task_ = brillo::MessageLoop::kTaskIdNull;
+  ongoing_read_ = false;
+
+  // Stop at the end of the file as it is now, as accessing the mapping past it
+  // would fail.
+  struct stat stbuf;
+  uint64_t bytes_to_read = 0;
+  const uint64_t offset = offset_ + bytes_copied_;
+  if (fstat(fd_, &stbuf) == 0 &&
+      static_cast<uint64_t>(stbuf.st_size) > offset) {
+    bytes_to_read = std::min(kMappedWindowSize,
+                             static_cast<uint64_t>(stbuf.st_size) - offset);
+  }
+  if (data_length_ >= 0) {
+    bytes_to_read = std::min(bytes_to_read, data_length_ - bytes_copied_);
+  }
+
+  if (!bytes_to_read) {
+    OnReadDoneCallback(0);
+    return;
+  }
+
+  // The offset of the mapping must be a multiple of the page size.
+  const uint64_t map_offset = offset - offset % sysconf(_SC_PAGESIZE);
+  const size_t map_size = offset - map_offset + bytes_to_read;
+  void* map_addr =
+      mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd_, map_offset);
+  if (map_addr == MAP_FAILED) {
+    PLOG(WARNING) << "Unable to map the file, reading it instead";
+    use_mmap_ = false;
+    stream_->SetPosition(offset, nullptr);
+    ScheduleRead();
+    return;
+  }
+  madvise(map_addr, map_size, MADV_SEQUENTIAL);
+
+  const uint8_t* data =
+      static_cast<const uint8_t*>(map_addr) + (offset - map_offset);
+  bytes_copied_ += bytes_to_read;
+  // The delegate may terminate the transfer and even destroy this object, so
+  // only the local variables may be used after the callback.
+  const bool keep_reading =
+      !delegate_ || delegate_->ReceivedBytes(this, data, bytes_to_read);
+  munmap(map_addr, map_size);
+  if (keep_reading)
+    ScheduleRead();
+}
+
 void FileFetcher::OnReadErrorCallback(const brillo::Error* error) {
   LOG(ERROR) << "Asynchronous read failed: " << error->GetMessage();
   CleanUp();
@@ -184,9 +258,15 @@ void FileFetcher::CleanUp() {
     stream_->CloseBlocking(nullptr);
     stream_.reset();
   }
+  if (mapped_read_task_ != brillo::MessageLoop::kTaskIdNull) {
+    brillo::MessageLoop::current()->CancelTask(mapped_read_task_);
+    mapped_read_task_ = brillo::MessageLoop::kTaskIdNull;
+  }
   // Destroying the |stream_| releases the callback, so we don't have any
   // ongoing read at this point.
   ongoing_read_ = false;
+  use_mmap_ = false;
+  fd_ = -1;
   buffer_ = brillo::Blob();
 
   transfer_in_progress_ = false;
@@ -23,12 +23,15 @@
 
 #include <base/logging.h>
 #include <base/macros.h>
+#include <brillo/message_loops/message_loop.h>
 #include <brillo/streams/stream.h>
 
 #include "update_engine/common/http_fetcher.h"
 
 // This is a concrete implementation of HttpFetcher that reads files
-// asynchronously.
+// asynchronously. Regular files are mapped into memory and passed to the
+// delegate in large windows, without copying them; other files are read in
+// small chunks from a stream.
 
 namespace chromeos_update_engine {
 
@@ -92,6 +95,11 @@ class FileFetcher : public HttpFetcher {
   void OnReadDoneCallback(size_t bytes_read);
   void OnReadErrorCallback(const brillo::Error* error);
 
+  // Called from the main loop to map the next window of the file and pass it
+  // to the delegate, when |use_mmap_| is set. Falls back to reading from
+  // |stream_| if the file can't be mapped.
+  void OnMappedReadCallback();
+
   // Whether the transfer was started and didn't finish yet.
   bool transfer_in_progress_{false};
 
@@ -99,9 +107,17 @@ class FileFetcher : public HttpFetcher {
   bool transfer_paused_{false};
 
   // Whether there's an ongoing asynchronous read. When this value is true, the
-  // the |buffer_| is being used by the |stream_|.
+  // the |buffer_| is being used by the |stream_|, or |mapped_read_task_| is
+  // pending.
   bool ongoing_read_{false};
 
+  // Whether the file is read by mapping it instead of reading from |stream_|.
+  bool use_mmap_{false};
+
+  // The task reading the next mapped window, if any.
+  brillo::MessageLoop::TaskId mapped_read_task_{
+      brillo::MessageLoop::kTaskIdNull};
+
   // Total number of bytes copied.
   uint64_t bytes_copied_{0};
 
@@ -113,6 +129,10 @@ class FileFetcher : public HttpFetcher {
 
   brillo::StreamPtr stream_;
 
+  // The file descriptor of the file, owned by |stream_| unless passed in the
+  // URL.
+  int fd_{-1};
+
   // The buffer used for reading from the stream.
   brillo::Blob buffer_;
 
@@ -18,9 +18,12 @@
 
 #include <fcntl.h>
 
+#include <algorithm>
+
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
 
+#include "update_engine/common/sha256_blocks.h"
 #include "update_engine/common/utils.h"
 
 using std::string;
@@ -43,6 +46,60 @@ bool HashCalculator::Update(const void* data, size_t length) {
   return true;
 }
 
+// static
+bool HashCalculator::UpdateAll(const std::vector<HashCalculator*>& calculators,
+                               const void* data,
+                               size_t length) {
+  if (calculators.size() < 2 || !HasSha256Instructions()) {
+    for (HashCalculator* calculator : calculators)
+      TEST_AND_RETURN_FALSE(calculator->Update(data, length));
+    return true;
+  }
+
+  // Complete the partial block of each context, so that the whole blocks of
+  // each stream start at |offsets[i]|. Streams don't need to be aligned with
+  // each other.
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  std::vector<size_t> offsets(calculators.size());
+  for (size_t i = 0; i < calculators.size(); i++) {
+    SHA256_CTX* ctx = &calculators[i]->ctx_;
+    if (ctx->num)
+      offsets[i] = std::min<size_t>(length, SHA256_CBLOCK - ctx->num);
+    TEST_AND_RETURN_FALSE(calculators[i]->Update(bytes, offsets[i]));
+  }
+
+  for (size_t i = 0; i + 1 < calculators.size(); i += 2) {
+    SHA256_CTX* ctx_a = &calculators[i]->ctx_;
+    SHA256_CTX* ctx_b = &calculators[i + 1]->ctx_;
+    const size_t num_blocks = std::min(length - offsets[i],
+                                       length - offsets[i + 1]) /
+                              SHA256_CBLOCK;
+    if (!num_blocks)
+      continue;
+    Sha256Blocks2x(ctx_a->h,
+                   bytes + offsets[i],
+                   ctx_b->h,
+                   bytes + offsets[i + 1],
+                   num_blocks);
+    // The contexts count the bits hashed in |Nh| and |Nl|.
+    for (SHA256_CTX* ctx : {ctx_a, ctx_b}) {
+      const uint64_t num_bits =
+          ((static_cast<uint64_t>(ctx->Nh) << 32) | ctx->Nl) +
+          num_blocks * SHA256_CBLOCK * 8;
+      ctx->Nl = static_cast<uint32_t>(num_bits);
+      ctx->Nh = static_cast<uint32_t>(num_bits >> 32);
+    }
+    offsets[i] += num_blocks * SHA256_CBLOCK;
+    offsets[i + 1] += num_blocks * SHA256_CBLOCK;
+  }
+
+  for (size_t i = 0; i < calculators.size(); i++) {
+    TEST_AND_RETURN_FALSE(
+        calculators[i]->Update(bytes + offsets[i], length - offsets[i]));
+  }
+  return true;
+}
+
 off_t HashCalculator::UpdateFile(const string& name, off_t length) {
   int fd = HANDLE_EINTR(open(name.c_str(), O_RDONLY));
   if (fd < 0) {
@@ -0,0 +1,65 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Compares hashing the same data into two streams, as done for the payload
+// hash and the signed hash while applying a payload, with two separate
+// updates and with HashCalculator::UpdateAll().
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+brillo::Blob MakeData(size_t size) {
+  brillo::Blob data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<uint8_t>(i * 7 + (i >> 8));
+  return data;
+}
+
+void BM_UpdateSeparately(benchmark::State& state) {
+  const brillo::Blob data = MakeData(state.range(0));
+  HashCalculator payload_calc;
+  HashCalculator signed_calc;
+  for (auto _ : state) {
+    payload_calc.Update(data.data(), data.size());
+    signed_calc.Update(data.data(), data.size());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_UpdateSeparately)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+
+void BM_UpdateAll(benchmark::State& state) {
+  const brillo::Blob data = MakeData(state.range(0));
+  HashCalculator payload_calc;
+  HashCalculator signed_calc;
+  for (auto _ : state) {
+    HashCalculator::UpdateAll(
+        {&payload_calc, &signed_calc}, data.data(), data.size());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_UpdateAll)->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
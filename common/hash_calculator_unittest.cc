@@ -103,6 +103,31 @@ TEST_F(HashCalculatorTest, BigTest) {
             brillo::data_encoding::Base64Encode(calc.raw_hash()));
 }
 
+TEST_F(HashCalculatorTest, UpdateAllTest) {
+  brillo::Blob data(10000);
+  test_utils::FillWithData(&data);
+
+  // The contexts start at different offsets within a block, and the data
+  // covers partial and whole blocks.
+  for (const size_t length : {0, 1, 63, 64, 200, 10000}) {
+    HashCalculator calcs[3];
+    HashCalculator expected_calcs[3];
+    for (size_t i = 0; i < 3; i++) {
+      calcs[i].Update(data.data(), i * 10);
+      expected_calcs[i].Update(data.data(), i * 10);
+    }
+    ASSERT_TRUE(HashCalculator::UpdateAll(
+        {&calcs[0], &calcs[1], &calcs[2]}, data.data(), length));
+    for (size_t i = 0; i < 3; i++) {
+      expected_calcs[i].Update(data.data(), length);
+      ASSERT_TRUE(calcs[i].Finalize());
+      ASSERT_TRUE(expected_calcs[i].Finalize());
+      EXPECT_EQ(expected_calcs[i].raw_hash(), calcs[i].raw_hash())
+          << "length = " << length << ", i = " << i;
+    }
+  }
+}
+
 TEST_F(HashCalculatorTest, UpdateFileSimpleTest) {
   ScopedTempFile data_file("data.XXXXXX");
   ASSERT_TRUE(test_utils::WriteFileString(data_file.path(), "hi"));
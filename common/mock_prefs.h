@@ -29,6 +29,13 @@ namespace chromeos_update_engine {
 
 class MockPrefs : public PrefsInterface {
  public:
+  MockPrefs() {
+    // Transactions succeed by default.
+    ON_CALL(*this, StartTransaction()).WillByDefault(testing::Return(true));
+    ON_CALL(*this, CancelTransaction()).WillByDefault(testing::Return(true));
+    ON_CALL(*this, SubmitTransaction()).WillByDefault(testing::Return(true));
+  }
+
   MOCK_CONST_METHOD2(GetString, bool(std::string_view key, std::string* value));
   MOCK_METHOD2(SetString, bool(std::string_view key, std::string_view value));
   MOCK_CONST_METHOD2(GetInt64, bool(std::string_view key, int64_t* value));
@@ -47,6 +54,10 @@ class MockPrefs : public PrefsInterface {
 
   MOCK_METHOD2(AddObserver, void(std::string_view key, ObserverInterface*));
   MOCK_METHOD2(RemoveObserver, void(std::string_view key, ObserverInterface*));
+
+  MOCK_METHOD0(StartTransaction, bool());
+  MOCK_METHOD0(CancelTransaction, bool());
+  MOCK_METHOD0(SubmitTransaction, bool());
 };
 
 }  // namespace chromeos_update_engine
@@ -0,0 +1,339 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/parallel_http_fetcher.h"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include <base/bind.h>
+#include <base/location.h>
+#include <base/logging.h>
+
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+ParallelHttpFetcher::ParallelHttpFetcher(
+    std::vector<std::unique_ptr<HttpFetcher>> fetchers,
+    size_t chunk_size,
+    size_t max_buffered_bytes)
+    : chunk_size_(chunk_size), max_buffered_bytes_(max_buffered_bytes) {
+  CHECK(!fetchers.empty());
+  CHECK_GT(chunk_size_, 0u);
+  CHECK_GE(max_buffered_bytes_, chunk_size_);
+  for (auto& fetcher : fetchers)
+    connections_.emplace_back(new Connection(this, std::move(fetcher)));
+}
+
+ParallelHttpFetcher::~ParallelHttpFetcher() {
+  MessageLoop::current()->CancelTask(end_transfer_task_);
+}
+
+void ParallelHttpFetcher::BeginTransfer(const string& url) {
+  CHECK(!transfer_in_progress_) << "BeginTransfer but already active.";
+  url_ = url;
+  http_response_code_ = 0;
+  auxiliary_error_code_ = ErrorCode::kSuccess;
+  transfer_in_progress_ = true;
+  terminating_ = false;
+  failed_ = false;
+  next_chunk_offset_ = offset_;
+  all_chunks_started_ = false;
+  chunks_.clear();
+  StartChunks();
+}
+
+void ParallelHttpFetcher::TerminateTransfer() {
+  if (!transfer_in_progress_) {
+    LOG(INFO) << "Called TerminateTransfer but not active.";
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  terminating_ = true;
+  TerminateConnections();
+  MaybeEndTransfer();
+}
+
+void ParallelHttpFetcher::SetHeader(const string& header_name,
+                                    const string& header_value) {
+  for (auto& connection : connections_)
+    connection->fetcher->SetHeader(header_name, header_value);
+}
+
+bool ParallelHttpFetcher::GetHeader(const string& header_name,
+                                    string* header_value) const {
+  return connections_.front()->fetcher->GetHeader(header_name, header_value);
+}
+
+void ParallelHttpFetcher::Pause() {
+  if (transfer_paused_) {
+    LOG(ERROR) << "Fetcher already paused.";
+    return;
+  }
+  transfer_paused_ = true;
+  for (auto& connection : connections_) {
+    if (connection->chunk && !connection->paused) {
+      connection->paused = true;
+      connection->fetcher->Pause();
+    }
+  }
+}
+
+void ParallelHttpFetcher::Unpause() {
+  if (!transfer_paused_) {
+    LOG(ERROR) << "Resume attempted when fetcher not paused.";
+    return;
+  }
+  transfer_paused_ = false;
+  DeliverChunks();
+  for (auto& connection : connections_) {
+    // The delegate may pause the transfer again while data is delivered.
+    if (transfer_paused_)
+      break;
+    if (connection->paused) {
+      connection->paused = false;
+      connection->fetcher->Unpause();
+    }
+  }
+  StartChunks();
+  MaybeEndTransfer();
+}
+
+void ParallelHttpFetcher::set_idle_seconds(int seconds) {
+  for (auto& connection : connections_)
+    connection->fetcher->set_idle_seconds(seconds);
+}
+
+void ParallelHttpFetcher::set_retry_seconds(int seconds) {
+  for (auto& connection : connections_)
+    connection->fetcher->set_retry_seconds(seconds);
+}
+
+void ParallelHttpFetcher::SetProxies(const std::deque<string>& proxies) {
+  HttpFetcher::SetProxies(proxies);
+  for (auto& connection : connections_)
+    connection->fetcher->SetProxies(proxies);
+}
+
+void ParallelHttpFetcher::set_low_speed_limit(int low_speed_bps,
+                                              int low_speed_sec) {
+  for (auto& connection : connections_)
+    connection->fetcher->set_low_speed_limit(low_speed_bps, low_speed_sec);
+}
+
+void ParallelHttpFetcher::set_connect_timeout(int connect_timeout_seconds) {
+  for (auto& connection : connections_)
+    connection->fetcher->set_connect_timeout(connect_timeout_seconds);
+}
+
+void ParallelHttpFetcher::set_max_retry_count(int max_retry_count) {
+  for (auto& connection : connections_)
+    connection->fetcher->set_max_retry_count(max_retry_count);
+}
+
+size_t ParallelHttpFetcher::GetBytesDownloaded() {
+  size_t bytes_downloaded = 0;
+  for (auto& connection : connections_)
+    bytes_downloaded += connection->fetcher->GetBytesDownloaded();
+  return bytes_downloaded;
+}
+
+void ParallelHttpFetcher::StartChunks() {
+  for (auto& connection : connections_) {
+    if (all_chunks_started_ || transfer_paused_ || terminating_ || failed_)
+      return;
+    if (connection->chunk)
+      continue;
+    // Every chunk after the first one may have to be held in memory.
+    if (!chunks_.empty() && chunks_.size() * chunk_size_ > max_buffered_bytes_)
+      return;
+
+    Chunk chunk{next_chunk_offset_, 0};
+    if (length_ == 0) {
+      all_chunks_started_ = true;
+    } else {
+      const size_t remaining = offset_ + length_ - next_chunk_offset_;
+      // There is no point in splitting the range for a single connection.
+      chunk.length = connections_.size() > 1 ? std::min(chunk_size_, remaining)
+                                              : remaining;
+      next_chunk_offset_ += chunk.length;
+      all_chunks_started_ = chunk.length == remaining;
+    }
+    chunks_.push_back(std::move(chunk));
+    connection->chunk = &chunks_.back();
+    connection->terminate_requested = false;
+
+    HttpFetcher* fetcher = connection->fetcher.get();
+    fetcher->SetOffset(connection->chunk->offset);
+    if (connection->chunk->length)
+      fetcher->SetLength(connection->chunk->length);
+    else
+      fetcher->UnsetLength();
+    // This may fail the transfer right away, which the loop checks above.
+    fetcher->BeginTransfer(url_);
+  }
+}
+
+void ParallelHttpFetcher::DeliverChunks() {
+  while (!chunks_.empty() && !transfer_paused_ && !terminating_ && !failed_) {
+    Chunk& chunk = chunks_.front();
+    if (!chunk.data.empty()) {
+      brillo::Blob data;
+      data.swap(chunk.data);
+      if (delegate_)
+        delegate_->ReceivedBytes(this, data.data(), data.size());
+      continue;
+    }
+    if (!chunk.complete)
+      break;
+    chunks_.pop_front();
+  }
+}
+
+void ParallelHttpFetcher::ConnectionReceivedBytes(Connection* connection,
+                                                  const void* bytes,
+                                                  size_t length) {
+  Chunk* chunk = connection->chunk;
+  CHECK(chunk);
+  if (terminating_ || failed_)
+    return;
+  if (chunk->length && chunk->bytes_received + length > chunk->length) {
+    // The server most likely ignored the range of the request.
+    LOG(ERROR) << "Received more than the " << chunk->length
+               << " bytes requested at offset " << chunk->offset;
+    Fail();
+    return;
+  }
+  chunk->bytes_received += length;
+  http_response_code_ = connection->fetcher->http_response_code();
+
+  if (chunk == &chunks_.front() && chunk->data.empty() && !transfer_paused_) {
+    // Nothing comes before this data, pass it along without copying it.
+    if (delegate_)
+      delegate_->ReceivedBytes(this, bytes, length);
+    return;
+  }
+  const uint8_t* data = static_cast<const uint8_t*>(bytes);
+  chunk->data.insert(chunk->data.end(), data, data + length);
+}
+
+void ParallelHttpFetcher::ConnectionEnded(Connection* connection,
+                                          bool successful) {
+  Chunk* chunk = connection->chunk;
+  connection->chunk = nullptr;
+  connection->paused = false;
+  if (!chunk)
+    return;
+
+  if (!terminating_ && !failed_) {
+    http_response_code_ = connection->fetcher->http_response_code();
+    if (!successful ||
+        (chunk->length && chunk->bytes_received != chunk->length)) {
+      LOG(ERROR) << "Failed to fetch the chunk at offset " << chunk->offset
+                 << ", received " << chunk->bytes_received << " of "
+                 << chunk->length << " bytes.";
+      auxiliary_error_code_ = connection->fetcher->GetAuxiliaryErrorCode();
+      Fail();
+      return;
+    }
+    chunk->complete = true;
+    DeliverChunks();
+    StartChunks();
+  }
+  MaybeEndTransfer();
+}
+
+void ParallelHttpFetcher::TerminateConnections() {
+  for (auto& connection : connections_) {
+    if (connection->chunk && !connection->terminate_requested) {
+      connection->terminate_requested = true;
+      connection->fetcher->TerminateTransfer();
+    }
+  }
+}
+
+void ParallelHttpFetcher::Fail() {
+  failed_ = true;
+  TerminateConnections();
+  MaybeEndTransfer();
+}
+
+void ParallelHttpFetcher::MaybeEndTransfer() {
+  if (!transfer_in_progress_ ||
+      end_transfer_task_ != MessageLoop::kTaskIdNull) {
+    return;
+  }
+  for (auto& connection : connections_) {
+    if (connection->chunk)
+      return;
+  }
+  if (!terminating_ && !failed_ && !(all_chunks_started_ && chunks_.empty()))
+    return;
+  end_transfer_task_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&ParallelHttpFetcher::EndTransfer, base::Unretained(this)));
+}
+
+void ParallelHttpFetcher::EndTransfer() {
+  end_transfer_task_ = MessageLoop::kTaskIdNull;
+  const bool terminated = terminating_;
+  const bool successful = !failed_;
+  transfer_in_progress_ = false;
+  transfer_paused_ = false;
+  terminating_ = false;
+  failed_ = false;
+  chunks_.clear();
+
+  if (!delegate_)
+    return;
+  // Note that after the callback returns this object may be destroyed.
+  if (terminated)
+    delegate_->TransferTerminated(this);
+  else
+    delegate_->TransferComplete(this, successful);
+}
+
+ParallelHttpFetcher::Connection::Connection(
+    ParallelHttpFetcher* parent_fetcher,
+    std::unique_ptr<HttpFetcher> base_fetcher)
+    : parent(parent_fetcher), fetcher(std::move(base_fetcher)) {
+  fetcher->set_delegate(this);
+}
+
+bool ParallelHttpFetcher::Connection::ReceivedBytes(HttpFetcher* fetcher,
+                                                    const void* bytes,
+                                                    size_t length) {
+  parent->ConnectionReceivedBytes(this, bytes, length);
+  // The transfer of this connection may have been terminated meanwhile.
+  return chunk && !terminate_requested;
+}
+
+void ParallelHttpFetcher::Connection::TransferComplete(HttpFetcher* fetcher,
+                                                       bool successful) {
+  parent->ConnectionEnded(this, successful);
+}
+
+void ParallelHttpFetcher::Connection::TransferTerminated(
+    HttpFetcher* fetcher) {
+  parent->ConnectionEnded(this, false);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,171 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
+#define UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/http_fetcher.h"
+
+// This class is an HttpFetcher downloading a range over several connections at
+// once, each one made by one of the fetchers passed to the ctor. The range is
+// split in chunks of |chunk_size| bytes, fetched in order by the first idle
+// connection, and the data is passed to the delegate in order: data of the
+// first chunk not delivered yet goes straight through, while data of the
+// following chunks is held until the chunks before are delivered. No more
+// than |max_buffered_bytes| are held, which bounds how far ahead connections
+// can get.
+//
+// A range without length is fetched over a single connection. This is meant
+// to be the base fetcher of a MultiRangeHttpFetcher, which sets the range.
+
+namespace chromeos_update_engine {
+
+class ParallelHttpFetcher : public HttpFetcher {
+ public:
+  static constexpr size_t kDefaultChunkSize = 4 * 1024 * 1024;  // 4 MiB
+  // Maximum number of connections a payload is downloaded over. Each one
+  // lets up to a chunk more data be buffered.
+  static constexpr int kMaxParallelDownloads = 8;
+
+  // Takes ownership of the |fetchers|, of which there must be at least one.
+  // |max_buffered_bytes| must be at least |chunk_size|.
+  ParallelHttpFetcher(std::vector<std::unique_ptr<HttpFetcher>> fetchers,
+                      size_t chunk_size,
+                      size_t max_buffered_bytes);
+  ~ParallelHttpFetcher() override;
+
+  // HttpFetcher overrides.
+  void SetOffset(off_t offset) override { offset_ = offset; }
+  void SetLength(size_t length) override { length_ = length; }
+  void UnsetLength() override { length_ = 0; }
+
+  void BeginTransfer(const std::string& url) override;
+  void TerminateTransfer() override;
+
+  void SetHeader(const std::string& header_name,
+                 const std::string& header_value) override;
+  bool GetHeader(const std::string& header_name,
+                 std::string* header_value) const override;
+
+  void Pause() override;
+  void Unpause() override;
+
+  void set_idle_seconds(int seconds) override;
+  void set_retry_seconds(int seconds) override;
+  void SetProxies(const std::deque<std::string>& proxies) override;
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override;
+  void set_connect_timeout(int connect_timeout_seconds) override;
+  void set_max_retry_count(int max_retry_count) override;
+
+  size_t GetBytesDownloaded() override;
+
+ private:
+  // A part of the range fetched by a single request.
+  struct Chunk {
+    off_t offset;
+    // Zero for a chunk running to the end of the file.
+    size_t length;
+    size_t bytes_received{0};
+    // The data received but not passed to the delegate yet.
+    brillo::Blob data;
+    // Whether all the data of the chunk was received.
+    bool complete{false};
+  };
+
+  // A connection, forwarding the callbacks of its fetcher to the parent.
+  struct Connection : public HttpFetcherDelegate {
+    Connection(ParallelHttpFetcher* parent_fetcher,
+               std::unique_ptr<HttpFetcher> base_fetcher);
+
+    // HttpFetcherDelegate overrides.
+    bool ReceivedBytes(HttpFetcher* fetcher,
+                       const void* bytes,
+                       size_t length) override;
+    void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+    void TransferTerminated(HttpFetcher* fetcher) override;
+
+    ParallelHttpFetcher* const parent;
+    const std::unique_ptr<HttpFetcher> fetcher;
+    // The chunk being fetched, or null if the connection is idle.
+    Chunk* chunk{nullptr};
+    bool paused{false};
+    bool terminate_requested{false};
+
+    DISALLOW_COPY_AND_ASSIGN(Connection);
+  };
+
+  // Starts fetching the next chunks on the idle connections, as long as the
+  // chunks that can't be delivered yet fit in |max_buffered_bytes_|.
+  void StartChunks();
+
+  // Passes the data of the first chunks to the delegate, dropping the chunks
+  // completely delivered.
+  void DeliverChunks();
+
+  void ConnectionReceivedBytes(Connection* connection,
+                               const void* bytes,
+                               size_t length);
+  void ConnectionEnded(Connection* connection, bool successful);
+
+  // Terminates the transfers of all the connections.
+  void TerminateConnections();
+
+  // Fails the whole transfer once all the connections are idle.
+  void Fail();
+
+  // Notifies the delegate of the end of the transfer if all the connections
+  // are idle and the transfer is done, failed or terminated. The delegate is
+  // notified from the message loop, so that it may destroy this object.
+  void MaybeEndTransfer();
+  void EndTransfer();
+
+  std::vector<std::unique_ptr<Connection>> connections_;
+  const size_t chunk_size_;
+  const size_t max_buffered_bytes_;
+
+  // The range to fetch; a zero |length_| fetches until the end of the file.
+  off_t offset_{0};
+  size_t length_{0};
+
+  bool transfer_in_progress_{false};
+  bool transfer_paused_{false};
+  bool terminating_{false};
+  bool failed_{false};
+
+  // The offset of the first chunk not started yet, and whether there is none.
+  off_t next_chunk_offset_{0};
+  bool all_chunks_started_{false};
+
+  // The chunks started but not completely delivered yet, in order.
+  std::deque<Chunk> chunks_;
+
+  brillo::MessageLoop::TaskId end_transfer_task_{
+      brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
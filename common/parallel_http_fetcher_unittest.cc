@@ -0,0 +1,219 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/parallel_http_fetcher.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/location.h>
+#if BASE_VER < 780000  // Android
+#include <base/message_loop/message_loop.h>
+#endif  // BASE_VER < 780000
+#if BASE_VER >= 780000  // CrOS
+#include <base/task/single_thread_task_executor.h>
+#endif  // BASE_VER >= 780000
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/message_loops/message_loop_utils.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kChunkSize = 1000;
+constexpr size_t kNumConnections = 3;
+
+class ParallelHttpFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    data_.insert(data_.end(), data, data + length);
+    if (pause_every_call_) {
+      fetcher->Pause();
+      MessageLoop::current()->PostTask(
+          FROM_HERE,
+          base::Bind([](HttpFetcher* fetcher) { fetcher->Unpause(); },
+                     base::Unretained(fetcher)));
+    }
+    if (terminate_after_ && data_.size() >= terminate_after_) {
+      fetcher->TerminateTransfer();
+      return false;
+    }
+    return true;
+  }
+
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    completed_ = true;
+    successful_ = successful;
+    MessageLoop::current()->BreakLoop();
+  }
+
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    terminated_ = true;
+    MessageLoop::current()->BreakLoop();
+  }
+
+  bool pause_every_call_{false};
+  size_t terminate_after_{0};
+
+  brillo::Blob data_;
+  bool completed_{false};
+  bool successful_{false};
+  bool terminated_{false};
+};
+
+}  // namespace
+
+class ParallelHttpFetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    file_data_.resize(10 * kChunkSize + 123);
+    for (size_t i = 0; i < file_data_.size(); i++)
+      file_data_[i] = static_cast<uint8_t>(i * 13 + (i >> 8));
+    ASSERT_TRUE(utils::WriteFile(
+        temp_file_.path().c_str(), file_data_.data(), file_data_.size()));
+    url_ = "file://" + temp_file_.path();
+  }
+
+  void TearDown() override {
+    EXPECT_EQ(0, brillo::MessageLoopRunMaxIterations(&loop_, 1));
+  }
+
+  std::unique_ptr<ParallelHttpFetcher> MakeFetcher(size_t max_buffered_bytes) {
+    std::vector<std::unique_ptr<HttpFetcher>> fetchers;
+    for (size_t i = 0; i < kNumConnections; i++)
+      fetchers.emplace_back(new FileFetcher());
+    return std::make_unique<ParallelHttpFetcher>(
+        std::move(fetchers), kChunkSize, max_buffered_bytes);
+  }
+
+  brillo::Blob FileData(size_t offset, size_t length) {
+    return brillo::Blob(file_data_.begin() + offset,
+                        file_data_.begin() + offset + length);
+  }
+
+#if BASE_VER < 780000  // Android
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+#else   // Chrome OS
+  base::SingleThreadTaskExecutor base_loop_{base::MessagePumpType::IO};
+  brillo::BaseMessageLoop loop_{base_loop_.task_runner()};
+#endif  // BASE_VER < 780000
+
+  ScopedTempFile temp_file_{"ue_parallel_fetcher.XXXXXX"};
+  brillo::Blob file_data_;
+  string url_;
+  ParallelHttpFetcherTestDelegate delegate_;
+};
+
+TEST_F(ParallelHttpFetcherTest, FetchesRangeInOrderTest) {
+  auto fetcher = MakeFetcher(kNumConnections * kChunkSize);
+  fetcher->set_delegate(&delegate_);
+  fetcher->SetOffset(456);
+  fetcher->SetLength(7890);
+  fetcher->BeginTransfer(url_);
+  loop_.Run();
+
+  EXPECT_TRUE(delegate_.completed_);
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(FileData(456, 7890), delegate_.data_);
+  EXPECT_EQ(7890u, fetcher->GetBytesDownloaded());
+}
+
+TEST_F(ParallelHttpFetcherTest, FetchesWithoutLengthTest) {
+  auto fetcher = MakeFetcher(kChunkSize);
+  fetcher->set_delegate(&delegate_);
+  fetcher->SetOffset(100);
+  fetcher->UnsetLength();
+  fetcher->BeginTransfer(url_);
+  loop_.Run();
+
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(FileData(100, file_data_.size() - 100), delegate_.data_);
+}
+
+TEST_F(ParallelHttpFetcherTest, PauseTest) {
+  auto fetcher = MakeFetcher(kChunkSize);
+  delegate_.pause_every_call_ = true;
+  fetcher->set_delegate(&delegate_);
+  fetcher->SetOffset(0);
+  fetcher->SetLength(file_data_.size());
+  fetcher->BeginTransfer(url_);
+  loop_.Run();
+
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(file_data_, delegate_.data_);
+}
+
+TEST_F(ParallelHttpFetcherTest, TerminateTest) {
+  auto fetcher = MakeFetcher(kNumConnections * kChunkSize);
+  delegate_.terminate_after_ = 2 * kChunkSize;
+  fetcher->set_delegate(&delegate_);
+  fetcher->SetOffset(0);
+  fetcher->SetLength(file_data_.size());
+  fetcher->BeginTransfer(url_);
+  loop_.Run();
+
+  EXPECT_TRUE(delegate_.terminated_);
+  EXPECT_FALSE(delegate_.completed_);
+}
+
+TEST_F(ParallelHttpFetcherTest, RangePastEndOfFileFailsTest) {
+  auto fetcher = MakeFetcher(kNumConnections * kChunkSize);
+  fetcher->set_delegate(&delegate_);
+  fetcher->SetOffset(0);
+  fetcher->SetLength(file_data_.size() + kChunkSize);
+  fetcher->BeginTransfer(url_);
+  loop_.Run();
+
+  EXPECT_TRUE(delegate_.completed_);
+  EXPECT_FALSE(delegate_.successful_);
+}
+
+TEST_F(ParallelHttpFetcherTest, MultiRangeTest) {
+  MultiRangeHttpFetcher fetcher(
+      MakeFetcher(kNumConnections * kChunkSize).release());
+  fetcher.ClearRanges();
+  fetcher.AddRange(2500, 3000);
+  fetcher.AddRange(8000, 1500);
+  fetcher.set_delegate(&delegate_);
+  fetcher.BeginTransfer(url_);
+  loop_.Run();
+
+  brillo::Blob expected = FileData(2500, 3000);
+  brillo::Blob second_range = FileData(8000, 1500);
+  expected.insert(expected.end(), second_range.begin(), second_range.end());
+  EXPECT_TRUE(delegate_.successful_);
+  EXPECT_EQ(expected, delegate_.data_);
+}
+
+}  // namespace chromeos_update_engine
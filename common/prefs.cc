@@ -24,6 +24,7 @@
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
 
 #include "update_engine/common/utils.h"
 
@@ -49,20 +50,100 @@ void DeleteEmptyDirectories(const base::FilePath& path) {
   }
 }
 
+// The journal of Prefs holds a line "set <key> <size>" followed by the value
+// and a newline for each set key, and a line "delete <key>" for each deleted
+// key. Keys can't contain spaces nor newlines.
+constexpr char kJournalFileName[] = ".journal";
+constexpr char kJournalSet[] = "set";
+constexpr char kJournalDelete[] = "delete";
+
+using KeyChanges = PrefsBase::StorageInterface::KeyChanges;
+
+string SerializeJournal(const KeyChanges& changes) {
+  string data;
+  for (const auto& [key, value] : changes) {
+    if (value) {
+      data += base::StringPrintf(
+          "%s %s %zu\n", kJournalSet, key.c_str(), value->size());
+      data += *value;
+      data += '\n';
+    } else {
+      data += base::StringPrintf("%s %s\n", kJournalDelete, key.c_str());
+    }
+  }
+  return data;
+}
+
+bool ParseJournal(std::string_view data, KeyChanges* changes) {
+  while (!data.empty()) {
+    const size_t line_end = data.find('\n');
+    TEST_AND_RETURN_FALSE(line_end != std::string_view::npos);
+    std::string_view line = data.substr(0, line_end);
+    data.remove_prefix(line_end + 1);
+
+    const size_t key_begin = line.find(' ');
+    TEST_AND_RETURN_FALSE(key_begin != std::string_view::npos);
+    const std::string_view op = line.substr(0, key_begin);
+    line.remove_prefix(key_begin + 1);
+    if (op == kJournalDelete) {
+      (*changes)[string{line}] = std::nullopt;
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(op == kJournalSet);
+    const size_t key_end = line.find(' ');
+    TEST_AND_RETURN_FALSE(key_end != std::string_view::npos);
+    size_t size = 0;
+    TEST_AND_RETURN_FALSE(
+        base::StringToSizeT(string{line.substr(key_end + 1)}, &size));
+    TEST_AND_RETURN_FALSE(size < data.size() && data[size] == '\n');
+    (*changes)[string{line.substr(0, key_end)}] = string{data.substr(0, size)};
+    data.remove_prefix(size + 1);
+  }
+  return true;
+}
+
+bool DeletePath(const base::FilePath& path) {
+#if BASE_VER < 800000
+  return base::DeleteFile(path, false);
+#else
+  return base::DeleteFile(path);
+#endif
+}
+
 }  // namespace
 
+bool PrefsBase::StorageInterface::SetKeys(const KeyChanges& changes) {
+  for (const auto& [key, value] : changes) {
+    if (value) {
+      TEST_AND_RETURN_FALSE(SetKey(key, *value));
+    } else {
+      TEST_AND_RETURN_FALSE(DeleteKey(key));
+    }
+  }
+  return true;
+}
+
 bool PrefsBase::GetString(const std::string_view key, string* value) const {
+  if (in_transaction_) {
+    const auto it = transaction_changes_.find(key);
+    if (it != transaction_changes_.end()) {
+      if (!it->second)
+        return false;
+      *value = *it->second;
+      return true;
+    }
+  }
   return storage_->GetKey(key, value);
 }
 
 bool PrefsBase::SetString(std::string_view key, std::string_view value) {
-  TEST_AND_RETURN_FALSE(storage_->SetKey(key, value));
-  const auto observers_for_key = observers_.find(key);
-  if (observers_for_key != observers_.end()) {
-    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
-    for (ObserverInterface* observer : copy_observers)
-      observer->OnPrefSet(key);
+  if (in_transaction_) {
+    TEST_AND_RETURN_FALSE(storage_->IsValidKey(key));
+    transaction_changes_[string{key}] = string{value};
+    return true;
   }
+  TEST_AND_RETURN_FALSE(storage_->SetKey(key, value));
+  NotifyPrefSet(key);
   return true;
 }
 
@@ -100,17 +181,22 @@ bool PrefsBase::SetBoolean(std::string_view key, const bool value) {
 }
 
 bool PrefsBase::Exists(std::string_view key) const {
+  if (in_transaction_) {
+    const auto it = transaction_changes_.find(key);
+    if (it != transaction_changes_.end())
+      return it->second.has_value();
+  }
   return storage_->KeyExists(key);
 }
 
 bool PrefsBase::Delete(std::string_view key) {
-  TEST_AND_RETURN_FALSE(storage_->DeleteKey(key));
-  const auto observers_for_key = observers_.find(key);
-  if (observers_for_key != observers_.end()) {
-    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
-    for (ObserverInterface* observer : copy_observers)
-      observer->OnPrefDeleted(key);
+  if (in_transaction_) {
+    TEST_AND_RETURN_FALSE(storage_->IsValidKey(key));
+    transaction_changes_[string{key}] = std::nullopt;
+    return true;
   }
+  TEST_AND_RETURN_FALSE(storage_->DeleteKey(key));
+  NotifyPrefDeleted(key);
   return true;
 }
 
@@ -133,7 +219,19 @@ bool PrefsBase::Delete(std::string_view pref_key, const vector<string>& nss) {
 }
 
 bool PrefsBase::GetSubKeys(std::string_view ns, vector<string>* keys) const {
-  return storage_->GetSubKeys(ns, keys);
+  if (!in_transaction_)
+    return storage_->GetSubKeys(ns, keys);
+  vector<string> stored_keys;
+  TEST_AND_RETURN_FALSE(storage_->GetSubKeys(ns, &stored_keys));
+  for (auto& key : stored_keys) {
+    if (transaction_changes_.find(key) == transaction_changes_.end())
+      keys->push_back(std::move(key));
+  }
+  for (const auto& [key, value] : transaction_changes_) {
+    if (value && key.compare(0, ns.length(), ns) == 0)
+      keys->push_back(key);
+  }
+  return true;
 }
 
 void PrefsBase::AddObserver(std::string_view key, ObserverInterface* observer) {
@@ -150,6 +248,52 @@ void PrefsBase::RemoveObserver(std::string_view key,
     observers_for_key.erase(observer_it);
 }
 
+bool PrefsBase::StartTransaction() {
+  TEST_AND_RETURN_FALSE(!in_transaction_);
+  in_transaction_ = true;
+  return true;
+}
+
+bool PrefsBase::CancelTransaction() {
+  TEST_AND_RETURN_FALSE(in_transaction_);
+  in_transaction_ = false;
+  transaction_changes_.clear();
+  return true;
+}
+
+bool PrefsBase::SubmitTransaction() {
+  TEST_AND_RETURN_FALSE(in_transaction_);
+  in_transaction_ = false;
+  StorageInterface::KeyChanges changes;
+  changes.swap(transaction_changes_);
+  TEST_AND_RETURN_FALSE(storage_->SetKeys(changes));
+  for (const auto& [key, value] : changes) {
+    if (value)
+      NotifyPrefSet(key);
+    else
+      NotifyPrefDeleted(key);
+  }
+  return true;
+}
+
+void PrefsBase::NotifyPrefSet(std::string_view key) {
+  const auto observers_for_key = observers_.find(key);
+  if (observers_for_key != observers_.end()) {
+    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
+    for (ObserverInterface* observer : copy_observers)
+      observer->OnPrefSet(key);
+  }
+}
+
+void PrefsBase::NotifyPrefDeleted(std::string_view key) {
+  const auto observers_for_key = observers_.find(key);
+  if (observers_for_key != observers_.end()) {
+    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
+    for (ObserverInterface* observer : copy_observers)
+      observer->OnPrefDeleted(key);
+  }
+}
+
 string PrefsInterface::CreateSubKey(const vector<string>& ns_and_key) {
   return base::JoinString(ns_and_key, string(1, kKeySeparator));
 }
@@ -162,11 +306,38 @@ bool Prefs::Init(const base::FilePath& prefs_dir) {
 
 bool Prefs::FileStorage::Init(const base::FilePath& prefs_dir) {
   prefs_dir_ = prefs_dir;
+  journal_.clear();
+  ReplayJournal();
   // Delete empty directories. Ignore errors when deleting empty directories.
   DeleteEmptyDirectories(prefs_dir_);
   return true;
 }
 
+void Prefs::FileStorage::ReplayJournal() {
+  const base::FilePath journal_path = GetJournalPath();
+  if (!base::PathExists(journal_path))
+    return;
+  string data;
+  KeyChanges changes;
+  if (!base::ReadFileToString(journal_path, &data) ||
+      !ParseJournal(data, &changes)) {
+    LOG(ERROR) << "Ignoring invalid prefs journal " << journal_path.value();
+  } else {
+    for (const auto& [key, value] : changes) {
+      if (!WriteKey(key, value, true)) {
+        LOG(ERROR) << "Failed to apply the prefs journal, keeping it.";
+        journal_ = std::move(changes);
+        return;
+      }
+    }
+  }
+  DeletePath(journal_path);
+}
+
+base::FilePath Prefs::FileStorage::GetJournalPath() const {
+  return prefs_dir_.Append(kJournalFileName);
+}
+
 bool Prefs::FileStorage::GetKey(std::string_view key, string* value) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
@@ -195,16 +366,11 @@ bool Prefs::FileStorage::GetSubKeys(std::string_view ns,
 }
 
 bool Prefs::FileStorage::SetKey(std::string_view key, std::string_view value) {
-  base::FilePath filename;
-  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
-  if (!base::DirectoryExists(filename.DirName())) {
-    // Only attempt to create the directory if it doesn't exist to avoid calls
-    // to parent directories where we might not have permission to write to.
-    TEST_AND_RETURN_FALSE(base::CreateDirectory(filename.DirName()));
+  if (journal_.find(key) != journal_.end()) {
+    // The journal would overwrite the key on the next Init() otherwise.
+    return SetKeys({{string{key}, string{value}}});
   }
-  TEST_AND_RETURN_FALSE(
-      utils::WriteStringToFileAtomic(filename.value(), value));
-  return true;
+  return WriteKey(key, string{value}, true);
 }
 
 bool Prefs::FileStorage::KeyExists(std::string_view key) const {
@@ -214,13 +380,60 @@ bool Prefs::FileStorage::KeyExists(std::string_view key) const {
 }
 
 bool Prefs::FileStorage::DeleteKey(std::string_view key) {
+  if (journal_.find(key) != journal_.end()) {
+    return SetKeys({{string{key}, std::nullopt}});
+  }
+  return WriteKey(key, std::nullopt, true);
+}
+
+bool Prefs::FileStorage::SetKeys(const KeyChanges& changes) {
+  for (const auto& [key, value] : changes) {
+    TEST_AND_RETURN_FALSE(IsValidKey(key));
+  }
+  KeyChanges journal = journal_;
+  for (const auto& [key, value] : changes) {
+    journal[key] = value;
+  }
+  if (!base::DirectoryExists(prefs_dir_)) {
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(prefs_dir_));
+  }
+  TEST_AND_RETURN_FALSE(utils::WriteStringToFileAtomic(
+      GetJournalPath().value(), SerializeJournal(journal)));
+  journal_ = std::move(journal);
+  // The journal persists the changes already, so the files of the keys don't
+  // need to be synced.
+  for (const auto& [key, value] : changes) {
+    TEST_AND_RETURN_FALSE(WriteKey(key, value, false));
+  }
+  return true;
+}
+
+bool Prefs::FileStorage::IsValidKey(std::string_view key) const {
+  base::FilePath filename;
+  return GetFileNameForKey(key, &filename);
+}
+
+bool Prefs::FileStorage::WriteKey(std::string_view key,
+                                  const std::optional<string>& value,
+                                  bool sync) {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
-#if BASE_VER < 800000
-  TEST_AND_RETURN_FALSE(base::DeleteFile(filename, false));
-#else
-  TEST_AND_RETURN_FALSE(base::DeleteFile(filename));
-#endif
+  if (!value) {
+    TEST_AND_RETURN_FALSE(DeletePath(filename));
+    return true;
+  }
+  if (!base::DirectoryExists(filename.DirName())) {
+    // Only attempt to create the directory if it doesn't exist to avoid calls
+    // to parent directories where we might not have permission to write to.
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(filename.DirName()));
+  }
+  if (sync) {
+    TEST_AND_RETURN_FALSE(
+        utils::WriteStringToFileAtomic(filename.value(), *value));
+  } else {
+    TEST_AND_RETURN_FALSE(utils::WriteFile(
+        filename.value().c_str(), value->data(), value->size()));
+  }
   return true;
 }
 
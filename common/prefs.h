@@ -19,6 +19,7 @@
 
 #include <functional>
 #include <map>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -37,6 +38,11 @@ class PrefsBase : public PrefsInterface {
   // Storage interface used to set and retrieve keys.
   class StorageInterface {
    public:
+    // The new value of each key changed by a transaction, or std::nullopt for
+    // the deleted keys.
+    using KeyChanges =
+        std::map<std::string, std::optional<std::string>, std::less<>>;
+
     StorageInterface() = default;
     virtual ~StorageInterface() = default;
 
@@ -60,6 +66,14 @@ class PrefsBase : public PrefsInterface {
     // key was deleted.
     virtual bool DeleteKey(std::string_view key) = 0;
 
+    // Applies all the |changes| together. The default implementation applies
+    // them one at a time, so that only some of them may persist if the device
+    // shuts down in the middle. Returns whether all of them were applied.
+    virtual bool SetKeys(const KeyChanges& changes);
+
+    // Returns whether |key| is a valid key name.
+    virtual bool IsValidKey(std::string_view key) const { return true; }
+
    private:
     DISALLOW_COPY_AND_ASSIGN(StorageInterface);
   };
@@ -86,11 +100,23 @@ class PrefsBase : public PrefsInterface {
   void RemoveObserver(std::string_view key,
                       ObserverInterface* observer) override;
 
+  bool StartTransaction() override;
+  bool CancelTransaction() override;
+  bool SubmitTransaction() override;
+
  private:
+  // Calls the observers of |key| after it was set or deleted.
+  void NotifyPrefSet(std::string_view key);
+  void NotifyPrefDeleted(std::string_view key);
+
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>, std::less<>>
       observers_;
 
+  // Whether a transaction was started, and the changes made since then.
+  bool in_transaction_{false};
+  StorageInterface::KeyChanges transaction_changes_;
+
   // The concrete implementation of the storage used for the keys.
   StorageInterface* storage_;
 
@@ -100,6 +126,12 @@ class PrefsBase : public PrefsInterface {
 // Implements a preference store by storing the value associated with
 // a key in a separate file named after the key under a preference
 // store directory.
+//
+// Transactions are first written to a journal file in the same directory
+// with a single atomic write, and then to the files of their keys without
+// syncing them. The keys set by transactions stay in the journal, which
+// Init() applies in case the files weren't written to disk, until the next
+// Init().
 
 class Prefs : public PrefsBase {
  public:
@@ -128,6 +160,8 @@ class Prefs : public PrefsBase {
     bool SetKey(std::string_view key, std::string_view value) override;
     bool KeyExists(std::string_view key) const override;
     bool DeleteKey(std::string_view key) override;
+    bool SetKeys(const KeyChanges& changes) override;
+    bool IsValidKey(std::string_view key) const override;
 
    private:
     FRIEND_TEST(PrefsTest, GetFileNameForKey);
@@ -139,8 +173,23 @@ class Prefs : public PrefsBase {
     bool GetFileNameForKey(std::string_view key,
                            base::FilePath* filename) const;
 
+    // Writes |value| to the file of |key|, or deletes it if |value| is
+    // std::nullopt. The file is synced to disk if |sync| is true.
+    bool WriteKey(std::string_view key,
+                  const std::optional<std::string>& value,
+                  bool sync);
+
+    // Applies the journal left by the previous instance, if any.
+    void ReplayJournal();
+
+    base::FilePath GetJournalPath() const;
+
     // Preference store directory.
     base::FilePath prefs_dir_;
+
+    // The latest changes of the keys set by transactions since Init(), as
+    // stored in the journal.
+    KeyChanges journal_;
   };
 
   // The concrete file storage implementation.
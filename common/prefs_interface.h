@@ -105,6 +105,22 @@ class PrefsInterface {
   virtual void RemoveObserver(std::string_view key,
                               ObserverInterface* observer) = 0;
 
+  // Starts a transaction. Until it's submitted or canceled, the changes made
+  // with the Set*() and Delete() methods are only visible through this object,
+  // and observers aren't called. Transactions can't be nested. Returns true on
+  // success, false otherwise.
+  virtual bool StartTransaction() = 0;
+
+  // Drops the changes made since StartTransaction(). Returns true on success,
+  // false if no transaction was started.
+  virtual bool CancelTransaction() = 0;
+
+  // Stores the changes made since StartTransaction() together, so that either
+  // all or none of them persist if the device shuts down in the middle, and
+  // calls the observers of the changed keys. Returns true on success, false
+  // otherwise. The transaction is over in both cases.
+  virtual bool SubmitTransaction() = 0;
+
  protected:
   // Key separator used to create sub key and get file names,
   static const char kKeySeparator = '/';
@@ -584,6 +584,110 @@ TEST_F(PrefsTest, MultiNamespaceKeyTest) {
   MultiNamespaceKeyTest();
 }
 
+TEST_F(PrefsTest, TransactionSubmitted) {
+  const string key2 = prefs_.CreateSubKey({"ns", "key2"});
+  EXPECT_TRUE(prefs_.SetString(kKey, "old value"));
+  EXPECT_TRUE(prefs_.SetString(key2, "value2"));
+
+  MockPrefsObserver mock_obserser;
+  prefs_.AddObserver(kKey, &mock_obserser);
+  prefs_.AddObserver(key2, &mock_obserser);
+  EXPECT_CALL(mock_obserser, OnPrefSet(_)).Times(0);
+  EXPECT_CALL(mock_obserser, OnPrefDeleted(_)).Times(0);
+
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_FALSE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "new value"));
+  EXPECT_TRUE(prefs_.Delete(key2));
+  EXPECT_FALSE(prefs_.SetString("no spaces", "value"));
+
+  // The changes are visible through the prefs, but not stored yet.
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("new value", value);
+  EXPECT_FALSE(prefs_.Exists(key2));
+  vector<string> keys;
+  EXPECT_TRUE(prefs_.GetSubKeys("ns", &keys));
+  EXPECT_TRUE(keys.empty());
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &value));
+  EXPECT_EQ("old value", value);
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(key2)));
+  testing::Mock::VerifyAndClearExpectations(&mock_obserser);
+
+  EXPECT_CALL(mock_obserser, OnPrefSet(Eq(kKey)));
+  EXPECT_CALL(mock_obserser, OnPrefDeleted(Eq(key2)));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_FALSE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &value));
+  EXPECT_EQ("new value", value);
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(key2)));
+
+  prefs_.RemoveObserver(kKey, &mock_obserser);
+  prefs_.RemoveObserver(key2, &mock_obserser);
+}
+
+TEST_F(PrefsTest, TransactionCanceled) {
+  EXPECT_TRUE(prefs_.SetString(kKey, "old value"));
+  EXPECT_FALSE(prefs_.CancelTransaction());
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "new value"));
+  EXPECT_TRUE(prefs_.SetString("other-key", "value"));
+  ASSERT_TRUE(prefs_.CancelTransaction());
+
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("old value", value);
+  EXPECT_FALSE(prefs_.Exists("other-key"));
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append("other-key")));
+}
+
+TEST_F(PrefsTest, TransactionJournalReplayedOnInit) {
+  const string key2 = prefs_.CreateSubKey({"ns", "key2"});
+  const string binary_value("line 1\nline 2\0 3 4", 18);
+  EXPECT_TRUE(prefs_.SetString(key2, "value2"));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, binary_value));
+  EXPECT_TRUE(prefs_.Delete(key2));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  // Keys set by a transaction go through the journal afterwards too.
+  EXPECT_TRUE(prefs_.SetInt64("other-key", 1));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64("other-key", 2));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(prefs_.SetInt64("other-key", 3));
+
+  // Simulate that the files weren't written to disk before a shutdown.
+  ASSERT_TRUE(SetValue(kKey, ""));
+  ASSERT_TRUE(SetValue(key2, "value2"));
+  ASSERT_TRUE(SetValue("other-key", "2"));
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ(binary_value, value);
+  EXPECT_FALSE(prefs.Exists(key2));
+  int64_t int_value = 0;
+  EXPECT_TRUE(prefs.GetInt64("other-key", &int_value));
+  EXPECT_EQ(3, int_value);
+
+  // The journal was applied and deleted.
+  ASSERT_TRUE(SetValue(kKey, "value"));
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+}
+
+TEST_F(PrefsTest, InvalidTransactionJournalIgnored) {
+  EXPECT_TRUE(prefs_.SetString(kKey, "value"));
+  ASSERT_TRUE(SetValue(".journal", "set test-key 100\nshort\n"));
+  ASSERT_TRUE(prefs_.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("value", value);
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(".journal")));
+}
+
 class MemoryPrefsTest : public BasePrefsTest {
  protected:
   void SetUp() override { common_prefs_ = &prefs_; }
@@ -611,6 +715,22 @@ TEST_F(MemoryPrefsTest, BasicTest) {
   EXPECT_TRUE(prefs_.Delete(kKey));
 }
 
+TEST_F(MemoryPrefsTest, TransactionTest) {
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 1));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 2));
+  ASSERT_TRUE(prefs_.CancelTransaction());
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(1, value);
+
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 3));
+  ASSERT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(3, value);
+}
+
 TEST_F(MemoryPrefsTest, MultiNamespaceKeyTest) {
   MultiNamespaceKeyTest();
 }
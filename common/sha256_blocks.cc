@@ -0,0 +1,247 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/sha256_blocks.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 64;
+
+alignas(16) constexpr uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// Each stream is processed four rounds at a time by Sha256Rounds(), which also
+// computes the message words needed four rounds later if |schedule| is set;
+// |msg| always holds the sixteen message words following the current rounds.
+// The two streams are processed in lockstep so that the instructions of each
+// fill the latency of the other's.
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define SHA256_TARGET __attribute__((target("sha,sse4.1")))
+
+bool DetectSha256Instructions() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+    return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return ebx & bit_SHA;
+}
+
+// The SHA instructions work on the state words as ABEF and CDGH.
+SHA256_TARGET inline void LoadState(const uint32_t state[8],
+                                    __m128i* abef,
+                                    __m128i* cdgh) {
+  const __m128i cdab = _mm_shuffle_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1);
+  const __m128i efgh = _mm_shuffle_epi32(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B);
+  *abef = _mm_alignr_epi8(cdab, efgh, 8);
+  *cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+}
+
+SHA256_TARGET inline void StoreState(__m128i abef,
+                                     __m128i cdgh,
+                                     uint32_t state[8]) {
+  const __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+  const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state),
+                   _mm_blend_epi16(feba, dchg, 0xF0));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4),
+                   _mm_alignr_epi8(dchg, feba, 8));
+}
+
+SHA256_TARGET inline void LoadMessage(const uint8_t* data, __m128i msg[4]) {
+  const __m128i byte_swap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  for (size_t j = 0; j < 4; j++) {
+    msg[j] = _mm_shuffle_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + j),
+        byte_swap);
+  }
+}
+
+SHA256_TARGET inline void Sha256Rounds(const uint32_t* k,
+                                       bool schedule,
+                                       __m128i* abef,
+                                       __m128i* cdgh,
+                                       __m128i msg[4]) {
+  const __m128i wk = _mm_add_epi32(
+      msg[0], _mm_load_si128(reinterpret_cast<const __m128i*>(k)));
+  *cdgh = _mm_sha256rnds2_epu32(*cdgh, *abef, wk);
+  *abef = _mm_sha256rnds2_epu32(*abef, *cdgh, _mm_shuffle_epi32(wk, 0x0E));
+  __m128i next = msg[3];
+  if (schedule) {
+    next = _mm_add_epi32(_mm_sha256msg1_epu32(msg[0], msg[1]),
+                         _mm_alignr_epi8(msg[3], msg[2], 4));
+    next = _mm_sha256msg2_epu32(next, msg[3]);
+  }
+  msg[0] = msg[1];
+  msg[1] = msg[2];
+  msg[2] = msg[3];
+  msg[3] = next;
+}
+
+SHA256_TARGET void Sha256Blocks2xImpl(uint32_t state_a[8],
+                                      const uint8_t* data_a,
+                                      uint32_t state_b[8],
+                                      const uint8_t* data_b,
+                                      size_t num_blocks) {
+  __m128i abef_a, cdgh_a, abef_b, cdgh_b;
+  LoadState(state_a, &abef_a, &cdgh_a);
+  LoadState(state_b, &abef_b, &cdgh_b);
+  for (size_t block = 0; block < num_blocks; block++) {
+    const __m128i abef_a_save = abef_a, cdgh_a_save = cdgh_a;
+    const __m128i abef_b_save = abef_b, cdgh_b_save = cdgh_b;
+    __m128i msg_a[4], msg_b[4];
+    LoadMessage(data_a + block * kBlockSize, msg_a);
+    LoadMessage(data_b + block * kBlockSize, msg_b);
+    for (size_t i = 0; i < 16; i++) {
+      const bool schedule = i < 12;
+      Sha256Rounds(kRoundConstants + i * 4, schedule, &abef_a, &cdgh_a, msg_a);
+      Sha256Rounds(kRoundConstants + i * 4, schedule, &abef_b, &cdgh_b, msg_b);
+    }
+    abef_a = _mm_add_epi32(abef_a, abef_a_save);
+    cdgh_a = _mm_add_epi32(cdgh_a, cdgh_a_save);
+    abef_b = _mm_add_epi32(abef_b, abef_b_save);
+    cdgh_b = _mm_add_epi32(cdgh_b, cdgh_b_save);
+  }
+  StoreState(abef_a, cdgh_a, state_a);
+  StoreState(abef_b, cdgh_b, state_b);
+}
+
+#elif defined(__aarch64__)
+
+#if defined(__clang__)
+#define SHA256_TARGET __attribute__((target("crypto")))
+#else
+#define SHA256_TARGET __attribute__((target("+crypto")))
+#endif
+
+bool DetectSha256Instructions() {
+  return getauxval(AT_HWCAP) & HWCAP_SHA2;
+}
+
+SHA256_TARGET inline void LoadMessage(const uint8_t* data, uint32x4_t msg[4]) {
+  for (size_t j = 0; j < 4; j++)
+    msg[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + j * 16)));
+}
+
+SHA256_TARGET inline void Sha256Rounds(const uint32_t* k,
+                                       bool schedule,
+                                       uint32x4_t* abcd,
+                                       uint32x4_t* efgh,
+                                       uint32x4_t msg[4]) {
+  const uint32x4_t wk = vaddq_u32(msg[0], vld1q_u32(k));
+  const uint32x4_t abcd_prev = *abcd;
+  *abcd = vsha256hq_u32(*abcd, *efgh, wk);
+  *efgh = vsha256h2q_u32(*efgh, abcd_prev, wk);
+  uint32x4_t next = msg[3];
+  if (schedule) {
+    next = vsha256su1q_u32(
+        vsha256su0q_u32(msg[0], msg[1]), msg[2], msg[3]);
+  }
+  msg[0] = msg[1];
+  msg[1] = msg[2];
+  msg[2] = msg[3];
+  msg[3] = next;
+}
+
+SHA256_TARGET void Sha256Blocks2xImpl(uint32_t state_a[8],
+                                      const uint8_t* data_a,
+                                      uint32_t state_b[8],
+                                      const uint8_t* data_b,
+                                      size_t num_blocks) {
+  uint32x4_t abcd_a = vld1q_u32(state_a), efgh_a = vld1q_u32(state_a + 4);
+  uint32x4_t abcd_b = vld1q_u32(state_b), efgh_b = vld1q_u32(state_b + 4);
+  for (size_t block = 0; block < num_blocks; block++) {
+    const uint32x4_t abcd_a_save = abcd_a, efgh_a_save = efgh_a;
+    const uint32x4_t abcd_b_save = abcd_b, efgh_b_save = efgh_b;
+    uint32x4_t msg_a[4], msg_b[4];
+    LoadMessage(data_a + block * kBlockSize, msg_a);
+    LoadMessage(data_b + block * kBlockSize, msg_b);
+    for (size_t i = 0; i < 16; i++) {
+      const bool schedule = i < 12;
+      Sha256Rounds(kRoundConstants + i * 4, schedule, &abcd_a, &efgh_a, msg_a);
+      Sha256Rounds(kRoundConstants + i * 4, schedule, &abcd_b, &efgh_b, msg_b);
+    }
+    abcd_a = vaddq_u32(abcd_a, abcd_a_save);
+    efgh_a = vaddq_u32(efgh_a, efgh_a_save);
+    abcd_b = vaddq_u32(abcd_b, abcd_b_save);
+    efgh_b = vaddq_u32(efgh_b, efgh_b_save);
+  }
+  vst1q_u32(state_a, abcd_a);
+  vst1q_u32(state_a + 4, efgh_a);
+  vst1q_u32(state_b, abcd_b);
+  vst1q_u32(state_b + 4, efgh_b);
+}
+
+#else
+
+bool DetectSha256Instructions() {
+  return false;
+}
+
+void Sha256Blocks2xImpl(uint32_t state_a[8],
+                        const uint8_t* data_a,
+                        uint32_t state_b[8],
+                        const uint8_t* data_b,
+                        size_t num_blocks) {
+  LOG(FATAL) << "SHA-256 instructions are not supported on this platform.";
+}
+
+#endif
+
+}  // namespace
+
+bool HasSha256Instructions() {
+  static const bool has_sha256_instructions = DetectSha256Instructions();
+  return has_sha256_instructions;
+}
+
+void Sha256Blocks2x(uint32_t state_a[8],
+                    const uint8_t* data_a,
+                    uint32_t state_b[8],
+                    const uint8_t* data_b,
+                    size_t num_blocks) {
+  DCHECK(HasSha256Instructions());
+  Sha256Blocks2xImpl(state_a, data_a, state_b, data_b, num_blocks);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,46 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_SHA256_BLOCKS_H_
+#define UPDATE_ENGINE_COMMON_SHA256_BLOCKS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 block functions using the SHA instructions of the CPU, i.e. the
+// SHA extensions on x86 and the cryptography extensions on ARMv8. These only
+// process whole 64 byte blocks; padding and lengths are left to the caller.
+
+namespace chromeos_update_engine {
+
+// Returns whether the SHA-256 instructions are available on this CPU. The
+// functions below must not be called otherwise.
+bool HasSha256Instructions();
+
+// Processes |num_blocks| blocks at |data_a| and |data_b| into the independent
+// SHA-256 states |state_a| and |state_b|, each made of the eight 32 bit words
+// a to h. A single stream is bound by the latency of the SHA instructions, so
+// interleaving two of them is close to twice as fast as processing them one
+// after the other.
+void Sha256Blocks2x(uint32_t state_a[8],
+                    const uint8_t* data_a,
+                    uint32_t state_b[8],
+                    const uint8_t* data_b,
+                    size_t num_blocks);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_SHA256_BLOCKS_H_
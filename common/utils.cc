@@ -1003,20 +1003,28 @@ bool ReadExtents(FileDescriptorPtr fd,
   brillo::Blob data(out_data_size);
   ssize_t bytes_read = 0;
 
+  // Read all the extents in one batch, which some file descriptors can issue
+  // concurrently.
+  vector<struct iovec> iov;
+  vector<off64_t> offsets;
+  iov.reserve(extents.size());
+  offsets.reserve(extents.size());
   for (const Extent& extent : extents) {
-    ssize_t bytes_read_this_iteration = 0;
     ssize_t bytes = extent.num_blocks() * block_size;
     TEST_LE(bytes_read + bytes, out_data_size);
-    TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
-                                          &data[bytes_read],
-                                          bytes,
-                                          extent.start_block() * block_size,
-                                          &bytes_read_this_iteration));
-    TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes);
-    bytes_read += bytes_read_this_iteration;
+    iov.push_back({&data[bytes_read], static_cast<size_t>(bytes)});
+    offsets.push_back(extent.start_block() * block_size);
+    bytes_read += bytes;
   }
   TEST_AND_RETURN_FALSE(out_data_size == bytes_read);
-  *out_data = data;
+
+  // Like PReadAll(), leave the file offset unchanged.
+  auto old_off = fd->Seek(0, SEEK_CUR);
+  TEST_AND_RETURN_FALSE_ERRNO(old_off >= 0);
+  TEST_AND_RETURN_FALSE(
+      fd->ReadScattered(iov.data(), offsets.data(), iov.size()));
+  TEST_AND_RETURN_FALSE_ERRNO(fd->Seek(old_off, SEEK_SET) == old_off);
+  *out_data = std::move(data);
   return true;
 }
 
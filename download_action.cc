@@ -21,7 +21,10 @@
 #include <algorithm>
 #include <string>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
+#include <base/location.h>
+#include <base/metrics/histogram_macros.h>
 #include <base/metrics/statistics_recorder.h>
 #include <base/strings/stringprintf.h>
 
@@ -32,10 +35,31 @@
 #include "update_engine/common/utils.h"
 
 using base::FilePath;
+using base::TimeDelta;
+using base::TimeTicks;
+using brillo::MessageLoop;
 using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Bounds of the payload data queued while the operations are applied in the
+// background. The fetcher is paused when the queue reaches the high
+// watermark, and unpaused once it drains to the low watermark.
+const size_t kQueueHighWatermark = 16 * 1024 * 1024;
+const size_t kQueueLowWatermark = 4 * 1024 * 1024;
+
+// Maximum number of bytes written to the DeltaPerformer by a single message
+// loop task, so that the fetcher is serviced in between.
+const size_t kMaxBytesWrittenPerTask = 1024 * 1024;
+
+// Delay before trying again to write to a DeltaPerformer that can't take
+// more data.
+const int kBusyDeltaPerformerRetryMs = 5;
+
+}  // namespace
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -51,7 +75,9 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       delegate_(nullptr),
       update_certificates_path_(std::move(update_certificates_path)) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  ClearQueuedData();
+}
 
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
@@ -124,6 +150,16 @@ void DownloadAction::StartDownloading() {
   download_active_ = true;
   http_fetcher_->ClearRanges();
 
+  // Queuing only helps if writing to the DeltaPerformer may block on
+  // operations applied by other threads.
+  queue_received_data_ = install_plan_.pipelined_apply_threads > 0;
+  ClearQueuedData();
+  transfer_complete_pending_ = false;
+  download_start_time_ = TimeTicks::Now();
+  throttled_time_ = TimeDelta();
+  total_queued_bytes_ = 0;
+  max_queued_bytes_ = 0;
+
   if (delta_performer_ != nullptr) {
     LOG(INFO) << "Using writer for test.";
   } else {
@@ -190,14 +226,20 @@ void DownloadAction::StartDownloading() {
 }
 
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  suspended_ = true;
+  UpdateFetcherPaused();
 }
 
 void DownloadAction::ResumeAction() {
-  http_fetcher_->Unpause();
+  suspended_ = false;
+  UpdateFetcherPaused();
+  if (!queued_data_.empty())
+    ScheduleWriteQueuedData(TimeDelta());
 }
 
 void DownloadAction::TerminateProcessing() {
+  ClearQueuedData();
+  transfer_complete_pending_ = false;
   if (delta_performer_) {
     delta_performer_->Close();
     delta_performer_.reset();
@@ -221,6 +263,14 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
   if (delegate_ && download_active_) {
     delegate_->BytesReceived(length, bytes_downloaded_total, bytes_total_);
   }
+  if (queue_received_data_ && delta_performer_) {
+    QueueReceivedData(bytes, length);
+    return true;
+  }
+  return WriteToDeltaPerformer(bytes, length);
+}
+
+bool DownloadAction::WriteToDeltaPerformer(const void* bytes, size_t length) {
   if (delta_performer_ && !delta_performer_->Write(bytes, length, &code_)) {
     if (code_ != ErrorCode::kSuccess) {
       LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
@@ -233,11 +283,125 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
     TerminateProcessing();
     return false;
   }
-
   return true;
 }
 
+void DownloadAction::QueueReceivedData(const void* bytes, size_t length) {
+  const uint8_t* data = static_cast<const uint8_t*>(bytes);
+  queued_data_.emplace_back(data, data + length);
+  queued_bytes_ += length;
+  total_queued_bytes_ += length;
+  max_queued_bytes_ = std::max(max_queued_bytes_, queued_bytes_);
+  ScheduleWriteQueuedData(TimeDelta());
+
+  if (!throttled_ && queued_bytes_ >= kQueueHighWatermark) {
+    throttled_ = true;
+    throttle_start_time_ = TimeTicks::Now();
+    UpdateFetcherPaused();
+  }
+}
+
+void DownloadAction::ScheduleWriteQueuedData(TimeDelta delay) {
+  if (write_queued_data_id_ != MessageLoop::kTaskIdNull)
+    return;
+  write_queued_data_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&DownloadAction::WriteQueuedData, base::Unretained(this)),
+      delay);
+}
+
+void DownloadAction::WriteQueuedData() {
+  write_queued_data_id_ = MessageLoop::kTaskIdNull;
+  // ResumeAction() schedules the writes again.
+  if (suspended_)
+    return;
+
+  size_t bytes_written = 0;
+  bool performer_busy = false;
+  while (!queued_data_.empty() && bytes_written < kMaxBytesWrittenPerTask) {
+    // Rather than blocking the message loop until the operations being
+    // applied are done, keep downloading into the queue meanwhile.
+    performer_busy = delta_performer_->IsOperationPipelineFull();
+    if (performer_busy)
+      break;
+    brillo::Blob data = std::move(queued_data_.front());
+    queued_data_.pop_front();
+    queued_bytes_ -= data.size();
+    // On failure the processing is terminated, and this object may be gone.
+    if (!WriteToDeltaPerformer(data.data(), data.size()))
+      return;
+    bytes_written += data.size();
+  }
+
+  if (throttled_ && queued_bytes_ <= kQueueLowWatermark) {
+    const TimeDelta throttled_time = TimeTicks::Now() - throttle_start_time_;
+    throttled_time_ += throttled_time;
+    LOCAL_HISTOGRAM_CUSTOM_TIMES("UpdateEngine.DownloadAction.ThrottledTime",
+                                 throttled_time,
+                                 TimeDelta::FromMilliseconds(1),
+                                 TimeDelta::FromMinutes(5),
+                                 20);
+    throttled_ = false;
+    UpdateFetcherPaused();
+  }
+
+  if (!queued_data_.empty()) {
+    ScheduleWriteQueuedData(
+        performer_busy
+            ? TimeDelta::FromMilliseconds(kBusyDeltaPerformerRetryMs)
+            : TimeDelta());
+  } else if (transfer_complete_pending_) {
+    transfer_complete_pending_ = false;
+    CompleteTransfer(true);
+  }
+}
+
+void DownloadAction::ClearQueuedData() {
+  if (write_queued_data_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(write_queued_data_id_);
+    write_queued_data_id_ = MessageLoop::kTaskIdNull;
+  }
+  queued_data_.clear();
+  queued_bytes_ = 0;
+}
+
+void DownloadAction::UpdateFetcherPaused() {
+  const bool pause = suspended_ || throttled_;
+  if (pause == fetcher_paused_)
+    return;
+  fetcher_paused_ = pause;
+  if (pause)
+    http_fetcher_->Pause();
+  else
+    http_fetcher_->Unpause();
+}
+
+void DownloadAction::LogFlowControlStats() {
+  const TimeDelta elapsed = TimeTicks::Now() - download_start_time_;
+  const int64_t bytes_per_second =
+      elapsed.InMilliseconds() > 0
+          ? total_queued_bytes_ * 1000 / elapsed.InMilliseconds()
+          : 0;
+  LOG(INFO) << "Downloaded " << total_queued_bytes_ << " bytes in "
+            << utils::FormatTimeDelta(elapsed) << " (" << bytes_per_second
+            << " bytes/s); the queue of data to apply peaked at "
+            << max_queued_bytes_ << " bytes and paused the download for "
+            << utils::FormatTimeDelta(throttled_time_) << ".";
+}
+
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  if (successful && !queued_data_.empty()) {
+    // Finish once all the data is written, see WriteQueuedData().
+    transfer_complete_pending_ = true;
+    return;
+  }
+  ClearQueuedData();
+  CompleteTransfer(successful);
+}
+
+void DownloadAction::CompleteTransfer(bool successful) {
+  if (queue_received_data_)
+    LogFlowControlStats();
   if (delta_performer_) {
     LOG_IF(WARNING, delta_performer_->Close() != 0)
         << "Error closing the writer.";
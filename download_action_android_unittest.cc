@@ -18,6 +18,7 @@
 #include <cstdint>
 #include <memory>
 
+#include <brillo/message_loops/fake_message_loop.h>
 #include <gmock/gmock.h>
 #include <gmock/gmock-actions.h>
 #include <gmock/gmock-function-mocker.h>
@@ -43,9 +44,33 @@
 namespace chromeos_update_engine {
 using testing::_;
 using testing::DoAll;
+using testing::Invoke;
 using testing::Return;
 using testing::SetArgPointee;
 
+namespace {
+
+// A DeltaPerformer keeping the data written to it, and reporting its
+// operations as busy until told otherwise.
+class BusyDeltaPerformer : public DeltaPerformer {
+ public:
+  using DeltaPerformer::DeltaPerformer;
+  using DeltaPerformer::Write;
+
+  bool Write(const void* bytes, size_t count, ErrorCode* error) override {
+    const uint8_t* data = static_cast<const uint8_t*>(bytes);
+    written_.insert(written_.end(), data, data + count);
+    return true;
+  }
+  bool IsOperationPipelineFull() const override { return busy_; }
+  int Close() override { return 0; }
+
+  brillo::Blob written_;
+  bool busy_{true};
+};
+
+}  // namespace
+
 class DownloadActionTest : public ::testing::Test {
  public:
   static constexpr int64_t METADATA_SIZE = 1024;
@@ -172,4 +197,65 @@ TEST_F(DownloadActionTest, CacheManifestValid) {
   // Manifest is cached, so no data should be downloaded from http fetcher.
   ASSERT_EQ(download_action->http_fetcher()->GetBytesDownloaded(), 0UL);
 }
+
+TEST_F(DownloadActionTest, QueueDataWhileOperationsAreBusyTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  brillo::Blob data(24 * 1024 * 1024);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<uint8_t>(i * 7 + (i >> 12));
+
+  MockPrefs prefs;
+  BootControlStub boot_control;
+  FakeHardware hardware;
+  MockHttpFetcher* http_fetcher = new MockHttpFetcher(data.data(), data.size());
+  InstallPlan install_plan;
+  auto& payload = install_plan.payloads.emplace_back();
+  install_plan.download_url = "http://fake_url.invalid";
+  install_plan.pipelined_apply_threads = 1;
+  payload.size = data.size();
+  // Skips the verification of the payload.
+  payload.already_applied = true;
+  action_pipe->set_contents(install_plan);
+
+  auto download_action = std::make_unique<DownloadAction>(
+      &prefs, &boot_control, &hardware, http_fetcher, false /* interactive */);
+  auto delta_performer = std::make_unique<BusyDeltaPerformer>(&prefs,
+                                                              &boot_control,
+                                                              &hardware,
+                                                              nullptr,
+                                                              &install_plan,
+                                                              &payload,
+                                                              false);
+  BusyDeltaPerformer* performer = delta_performer.get();
+  download_action->SetTestFileWriter(std::move(delta_performer));
+  download_action->set_in_pipe(action_pipe);
+  MockActionProcessor mock_processor;
+  bool completed = false;
+  EXPECT_CALL(mock_processor,
+              ActionComplete(download_action.get(), ErrorCode::kSuccess))
+      .WillOnce(Invoke([&completed](AbstractAction*, ErrorCode) {
+        completed = true;
+      }));
+  download_action->SetProcessor(&mock_processor);
+  download_action->PerformAction();
+
+  // The download stops once enough data is queued for the busy performer.
+  for (int i = 0; i < 5000; i++)
+    loop.RunOnce(true);
+  const size_t bytes_downloaded = http_fetcher->GetBytesDownloaded();
+  EXPECT_GT(bytes_downloaded, 0u);
+  EXPECT_LT(bytes_downloaded, data.size());
+  EXPECT_TRUE(performer->written_.empty());
+  for (int i = 0; i < 1000; i++)
+    loop.RunOnce(true);
+  EXPECT_EQ(bytes_downloaded, http_fetcher->GetBytesDownloaded());
+
+  performer->busy_ = false;
+  while (!completed && loop.PendingTasks())
+    loop.RunOnce(true);
+  EXPECT_TRUE(completed);
+  EXPECT_EQ(data, performer->written_);
+}
+
 }  // namespace chromeos_update_engine
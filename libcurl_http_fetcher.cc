@@ -22,6 +22,8 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <map>
+#include <set>
 #include <string>
 
 #include <base/bind.h>
@@ -72,19 +74,28 @@ int LibcurlSockoptCallback(void* /* clientp */,
   return CURL_SOCKOPT_OK;
 }
 
+// The fetchers alive. Sockets may be closed by libcurl after the fetcher that
+// opened them is gone, as connections are shared between fetchers, so the
+// close callback doesn't point to a particular fetcher.
+std::set<LibcurlHttpFetcher*>& GetLiveFetchers() {
+  static auto* live_fetchers = new std::set<LibcurlHttpFetcher*>();
+  return *live_fetchers;
+}
+
 }  // namespace
 
 // static
-int LibcurlHttpFetcher::LibcurlCloseSocketCallback(void* clientp,
+int LibcurlHttpFetcher::LibcurlCloseSocketCallback(void* /* clientp */,
                                                    curl_socket_t item) {
 #ifdef __ANDROID__
   qtaguid_untagSocket(item);
 #endif  // __ANDROID__
 
-  LibcurlHttpFetcher* fetcher = static_cast<LibcurlHttpFetcher*>(clientp);
   // Stop watching the socket before closing it.
-  for (size_t t = 0; t < base::size(fetcher->fd_controller_maps_); ++t) {
-    fetcher->fd_controller_maps_[t].erase(item);
+  for (LibcurlHttpFetcher* fetcher : GetLiveFetchers()) {
+    for (size_t t = 0; t < base::size(fetcher->fd_controller_maps_); ++t) {
+      fetcher->fd_controller_maps_[t].erase(item);
+    }
   }
 
   // Documentation for this callback says to return 0 on success or 1 on error.
@@ -101,12 +112,36 @@ LibcurlHttpFetcher::LibcurlHttpFetcher(HardwareInterface* hardware)
     low_speed_time_seconds_ = kDownloadDevModeLowSpeedTimeSeconds;
   if (hardware_->IsOOBEEnabled() && !hardware_->IsOOBEComplete(nullptr))
     max_retry_count_ = kDownloadMaxRetryCountOobeNotComplete;
+  GetLiveFetchers().insert(this);
 }
 
 LibcurlHttpFetcher::~LibcurlHttpFetcher() {
   LOG_IF(ERROR, transfer_in_progress_)
       << "Destroying the fetcher while a transfer is in progress.";
   CleanUp();
+  GetLiveFetchers().erase(this);
+}
+
+// static
+CURLSH* LibcurlHttpFetcher::GetCurlShareHandle(ServerToCheck server_to_check) {
+  // Connections and TLS sessions are only shared between fetchers checking the
+  // same server, so that a server certificate is always checked as the one of
+  // the server the fetcher expects.
+  static auto* share_handles = new std::map<ServerToCheck, CURLSH*>();
+  CURLSH*& share_handle = (*share_handles)[server_to_check];
+  if (!share_handle) {
+    share_handle = curl_share_init();
+    CHECK(share_handle);
+    for (curl_lock_data data : {CURL_LOCK_DATA_CONNECT,
+                                CURL_LOCK_DATA_SSL_SESSION,
+                                CURL_LOCK_DATA_DNS}) {
+      if (curl_share_setopt(share_handle, CURLSHOPT_SHARE, data) !=
+          CURLSHE_OK) {
+        LOG(WARNING) << "Unable to share libcurl data " << data;
+      }
+    }
+  }
+  return share_handle;
 }
 
 bool LibcurlHttpFetcher::GetProxyType(const string& proxy,
@@ -154,7 +189,15 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
       curl_handle_, CURLOPT_SOCKOPTFUNCTION, LibcurlSockoptCallback);
   curl_easy_setopt(
       curl_handle_, CURLOPT_CLOSESOCKETFUNCTION, LibcurlCloseSocketCallback);
-  curl_easy_setopt(curl_handle_, CURLOPT_CLOSESOCKETDATA, this);
+
+  // Reuse the connections, TLS sessions and DNS entries of the previous
+  // transfers, which saves the handshakes of every retry and range request.
+  CHECK_EQ(curl_easy_setopt(curl_handle_,
+                            CURLOPT_SHARE,
+                            GetCurlShareHandle(server_to_check_)),
+           CURLE_OK);
+  // Use HTTP/2 if the server supports it, otherwise HTTP/1.1.
+  curl_easy_setopt(curl_handle_, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
 
   CHECK(HasProxy());
   bool is_direct = (GetCurrentProxy() == kNoProxy);
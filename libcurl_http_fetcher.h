@@ -159,11 +159,18 @@ class LibcurlHttpFetcher : public HttpFetcher {
 
  private:
   FRIEND_TEST(LibcurlHttpFetcherTest, HostResolvedTest);
+  FRIEND_TEST(LibcurlHttpFetcherTest, CurlShareHandleTest);
 
   // libcurl's CURLOPT_CLOSESOCKETFUNCTION callback function. Called when
   // closing a socket created with the CURLOPT_OPENSOCKETFUNCTION callback.
   static int LibcurlCloseSocketCallback(void* clientp, curl_socket_t item);
 
+  // Returns the libcurl share handle of the fetchers checking the certificate
+  // of |server_to_check|, holding their connection cache, TLS sessions and DNS
+  // cache. Transfers made one after the other, or by several fetchers, reuse
+  // these instead of connecting again.
+  static CURLSH* GetCurlShareHandle(ServerToCheck server_to_check);
+
   // Asks libcurl for the http response code and stores it in the object.
   virtual void GetHttpResponseCode();
 
@@ -182,6 +182,19 @@ TEST_F(LibcurlHttpFetcherTest, HostResolvedTest) {
             no_network_max_retries + 1);
 }
 
+TEST_F(LibcurlHttpFetcherTest, CurlShareHandleTest) {
+  CURLSH* download_share =
+      LibcurlHttpFetcher::GetCurlShareHandle(ServerToCheck::kDownload);
+  ASSERT_NE(nullptr, download_share);
+  EXPECT_EQ(download_share,
+            LibcurlHttpFetcher::GetCurlShareHandle(ServerToCheck::kDownload));
+  // Connections are never shared with fetchers checking another server.
+  EXPECT_NE(download_share,
+            LibcurlHttpFetcher::GetCurlShareHandle(ServerToCheck::kUpdate));
+  EXPECT_NE(download_share,
+            LibcurlHttpFetcher::GetCurlShareHandle(ServerToCheck::kNone));
+}
+
 TEST_F(LibcurlHttpFetcherTest, HttpFetcherStateMachineRetryFailedTest) {
   state_machine_.UpdateState(true);
   state_machine_.UpdateState(true);
@@ -61,6 +61,12 @@ class IoUringInterface {
   // this write operation completes.
   virtual IoUringSQE PrepWrite(int fd, const void *buf, unsigned nbytes,
                                uint64_t offset) = 0;
+  // Same as |PrepRead()| and |PrepWrite()|, but |buf| must be within the
+  // |buf_index|-th buffer registered with |RegisterBuffers()|.
+  virtual IoUringSQE PrepReadFixed(int fd, void *buf, unsigned nbytes,
+                                   uint64_t offset, int buf_index) = 0;
+  virtual IoUringSQE PrepWriteFixed(int fd, const void *buf, unsigned nbytes,
+                                    uint64_t offset, int buf_index) = 0;
 
   // Return number of SQEs available in the queue. If this is 0, subsequent
   // calls to Prep*() functions will fail.
@@ -100,6 +100,24 @@ class IoUring final : public IoUringInterface {
     io_uring_prep_write(sqe, fd, buf, nbytes, offset);
     return IoUringSQE{static_cast<void*>(sqe)};
   }
+  IoUringSQE PrepReadFixed(int fd, void* buf, unsigned nbytes,
+                           uint64_t offset, int buf_index) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_read_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepWriteFixed(int fd, const void* buf, unsigned nbytes,
+                            uint64_t offset, int buf_index) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_write_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
 
   size_t SQELeft() const override { return io_uring_sq_space_left(&ring); }
   size_t SQEReady() const override { return io_uring_sq_ready(&ring); }
@@ -191,4 +191,36 @@ TEST_F(IoUringTest, ExtentRead) {
   for (int i = 0; i < data.size(); ++i) {
     ASSERT_EQ(data[i], i % 256);
   }
-}
\ No newline at end of file
+}
+TEST_F(IoUringTest, FixedBufferReadWrite) {
+  const int fd = fileno(fp);
+  std::vector<unsigned char> buffer(kBlockSize * 2);
+  struct iovec iov {
+    buffer.data(), buffer.size()
+  };
+  const auto err = ring->RegisterBuffers(&iov, 1);
+  ASSERT_TRUE(err.IsOk()) << err.ErrMsg();
+
+  const auto data = GetArbitraryPageData();
+  std::copy(data.begin(), data.end(), buffer.begin());
+  ASSERT_TRUE(
+      ring->PrepWriteFixed(fd, buffer.data(), kBlockSize, 4 * kBlockSize, 0)
+          .IsOk());
+  ASSERT_TRUE(ring->Submit().IsOk());
+  auto cqe = ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk());
+  ASSERT_EQ(cqe.GetResult().res, static_cast<int32_t>(kBlockSize));
+
+  ASSERT_TRUE(ring->PrepReadFixed(fd,
+                                  buffer.data() + kBlockSize,
+                                  kBlockSize,
+                                  4 * kBlockSize,
+                                  0)
+                  .IsOk());
+  ASSERT_TRUE(ring->Submit().IsOk());
+  cqe = ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk());
+  ASSERT_EQ(cqe.GetResult().res, static_cast<int32_t>(kBlockSize));
+  ASSERT_TRUE(
+      std::equal(data.begin(), data.end(), buffer.begin() + kBlockSize));
+}
@@ -148,6 +148,24 @@ Blob TryCompressBlob(std::string_view blob,
   return output;
 }
 
+int DecompressBlock(std::string_view cluster,
+                    const CompressedBlock& block,
+                    const bool zero_padding_enabled,
+                    uint8_t* output) {
+  size_t inputmargin = 0;
+  if (zero_padding_enabled) {
+    while (inputmargin < std::min(kBlockSize, cluster.size()) &&
+           cluster[inputmargin] == 0) {
+      inputmargin++;
+    }
+  }
+  return LZ4_decompress_safe_partial(cluster.data() + inputmargin,
+                                     reinterpret_cast<char*>(output),
+                                     cluster.size() - inputmargin,
+                                     block.uncompressed_length,
+                                     block.uncompressed_length);
+}
+
 Blob TryDecompressBlob(std::string_view blob,
                        const std::vector<CompressedBlock>& block_info,
                        const bool zero_padding_enabled) {
@@ -180,22 +198,13 @@ Blob TryDecompressBlob(std::string_view blob,
       compressed_offset += cluster.size();
       continue;
     }
-    size_t inputmargin = 0;
-    if (zero_padding_enabled) {
-      while (inputmargin < std::min(kBlockSize, cluster.size()) &&
-             cluster[inputmargin] == 0) {
-        inputmargin++;
-      }
-    }
     output.resize(output.size() + block.uncompressed_length);
 
-    const auto bytes_decompressed = LZ4_decompress_safe_partial(
-        cluster.data() + inputmargin,
-        reinterpret_cast<char*>(output.data()) + output.size() -
-            block.uncompressed_length,
-        cluster.size() - inputmargin,
-        block.uncompressed_length,
-        block.uncompressed_length);
+    const auto bytes_decompressed = DecompressBlock(
+        cluster,
+        block,
+        zero_padding_enabled,
+        output.data() + output.size() - block.uncompressed_length);
     if (bytes_decompressed < 0) {
       LOG(FATAL) << "Failed to decompress, " << bytes_decompressed
                  << ", output_cursor = "
@@ -203,8 +212,7 @@ Blob TryDecompressBlob(std::string_view blob,
                  << ", input_cursor = " << compressed_offset
                  << ", blob.size() = " << blob.size()
                  << ", cluster_size = " << block.compressed_length
-                 << ", dest capacity = " << block.uncompressed_length
-                 << ", input margin = " << inputmargin << " "
+                 << ", dest capacity = " << block.uncompressed_length << " "
                  << HashCalculator::SHA256Digest(cluster) << " "
                  << HashCalculator::SHA256Digest(blob);
       return {};
@@ -50,6 +50,14 @@ Blob TryDecompressBlob(const Blob& blob,
                        const std::vector<CompressedBlock>& block_info,
                        const bool zero_padding_enabled);
 
+// Decompresses the compressed block |cluster| described by |block| into
+// |output|, which must have room for |block.uncompressed_length| bytes. Returns
+// the number of bytes decompressed, or a negative value on error.
+int DecompressBlock(std::string_view cluster,
+                    const CompressedBlock& block,
+                    const bool zero_padding_enabled,
+                    uint8_t* output);
+
 std::ostream& operator<<(std::ostream& out, const CompressedBlockInfo& info);
 
 std::ostream& operator<<(std::ostream& out, const CompressedBlock& block);
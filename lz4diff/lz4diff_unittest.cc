@@ -103,6 +103,28 @@ TEST_F(Lz4diffTest, DiffElfBinary) {
   Blob patched_new_data;
   ASSERT_TRUE(Lz4Patch(old_data, diff_blob, &patched_new_data));
   ASSERT_EQ(patched_new_data, new_data);
+
+  // Patching again, reading the source one compressed block at a time.
+  Blob streamed_new_data;
+  size_t max_read_size = 0;
+  ASSERT_TRUE(Lz4Patch(
+      [&old_data, &max_read_size](
+          uint64_t offset, uint8_t* buffer, size_t count) {
+        max_read_size = std::max(max_read_size, count);
+        if (offset + count > old_data.size()) {
+          return false;
+        }
+        memcpy(buffer, old_data.data() + offset, count);
+        return true;
+      },
+      old_data.size(),
+      ToStringView(diff_blob),
+      [&streamed_new_data](const uint8_t* data, size_t size) -> size_t {
+        streamed_new_data.insert(streamed_new_data.end(), data, data + size);
+        return size;
+      }));
+  ASSERT_EQ(streamed_new_data, new_data);
+  ASSERT_LT(max_read_size, old_data.size());
 }
 
 }  // namespace
@@ -21,11 +21,15 @@
 #include <fcntl.h>
 
 #include <algorithm>
+#include <memory>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #include <bsdiff/bspatch.h>
 #include <bsdiff/memory_file.h>
 #include <bsdiff/file.h>
+#include <bsdiff/file_interface.h>
 #include <puffin/memory_stream.h>
 
 #include "android-base/strings.h"
@@ -64,14 +68,219 @@ struct Lz4diffPatch {
   std::string_view inner_patch;
 };
 
-// Utility class to interact with puffin API. C++ does not have standard
-// Read/Write trait. So everybody invent their own file descriptor wrapper.
-class StringViewStream : public puffin::StreamInterface {
+// Random access to the decompressed source data of an LZ4diff patch. The
+// compressed blocks are read with |read_src| and decompressed when they are
+// first accessed, and only the last few of them are kept in memory.
+class DecompressedSource {
  public:
-  ~StringViewStream() override = default;
+  DecompressedSource(const SourceReadFunc& read_src,
+                     uint64_t src_size,
+                     const CompressionInfo& info)
+      : read_src_(read_src),
+        src_size_(src_size),
+        zero_padding_enabled_(info.zero_padding_enabled()) {
+    blocks_.reserve(info.block_info_size());
+    for (const auto& block : info.block_info()) {
+      blocks_.emplace_back(block.uncompressed_offset(),
+                           block.compressed_length(),
+                           block.uncompressed_length());
+    }
+  }
+
+  bool Init() {
+    TEST_AND_RETURN_FALSE(!blocks_.empty());
+    uint64_t compressed_offset = 0;
+    uint64_t offset = 0;
+    for (const auto& block : blocks_) {
+      TEST_EQ(block.uncompressed_offset, offset);
+      compressed_offsets_.push_back(compressed_offset);
+      offsets_.push_back(size_);
+      compressed_offset += block.compressed_length;
+      offset += block.uncompressed_length;
+      // Blocks which aren't compressed are copied as is.
+      size_ += block.IsCompressed() ? block.uncompressed_length
+                                    : block.compressed_length;
+    }
+    if (src_size_ < compressed_offset) {
+      LOG(ERROR) << "File is chunked. Skip lz4 decompress. Expected size: "
+                 << compressed_offset << ", actual size: " << src_size_;
+      return false;
+    }
+    // Trailing data not recorded by compressed block info will be treated as
+    // uncompressed, most of the time these are xattrs or trailing zeros.
+    trailing_offset_ = size_;
+    size_ += src_size_ - compressed_offset;
+    return true;
+  }
+
+  uint64_t size() const { return size_; }
+
+  bool Read(uint64_t offset, uint8_t* buffer, size_t count) {
+    TEST_AND_RETURN_FALSE(offset + count <= size_);
+    while (count > 0) {
+      if (offset >= trailing_offset_) {
+        const uint64_t src_offset = src_size_ - (size_ - offset);
+        return read_src_(src_offset, buffer, count);
+      }
+      // The block containing |offset|.
+      const size_t index =
+          std::upper_bound(offsets_.begin(), offsets_.end(), offset) -
+          offsets_.begin() - 1;
+      const Blob* data = GetBlock(index);
+      TEST_AND_RETURN_FALSE(data != nullptr);
+      const size_t block_offset = offset - offsets_[index];
+      const size_t length =
+          std::min<uint64_t>(count, data->size() - block_offset);
+      memcpy(buffer, data->data() + block_offset, length);
+      buffer += length;
+      offset += length;
+      count -= length;
+    }
+    return true;
+  }
+
+ private:
+  // The number of decompressed blocks kept in memory. The inner patches read
+  // the source mostly sequentially, with few jumps back.
+  static constexpr size_t kNumCachedBlocks = 8;
+
+  // Returns the decompressed block |index|, or nullptr on error.
+  const Blob* GetBlock(size_t index) {
+    for (auto& entry : cache_) {
+      if (entry.first == index) {
+        return &entry.second;
+      }
+    }
+    const auto& block = blocks_[index];
+    Blob cluster(block.compressed_length);
+    if (!read_src_(
+            compressed_offsets_[index], cluster.data(), cluster.size())) {
+      LOG(ERROR) << "Failed to read " << block;
+      return nullptr;
+    }
+    Blob data;
+    if (!block.IsCompressed()) {
+      data = std::move(cluster);
+    } else {
+      data.resize(block.uncompressed_length);
+      const auto bytes_decompressed = DecompressBlock(
+          ToStringView(cluster), block, zero_padding_enabled_, data.data());
+      if (bytes_decompressed < 0 ||
+          static_cast<uint64_t>(bytes_decompressed) !=
+              block.uncompressed_length) {
+        LOG(ERROR) << "Failed to decompress " << block << ": "
+                   << bytes_decompressed;
+        return nullptr;
+      }
+    }
+    if (cache_.size() < kNumCachedBlocks) {
+      cache_.emplace_back(index, std::move(data));
+      return &cache_.back().second;
+    }
+    auto& entry = cache_[next_evicted_];
+    next_evicted_ = (next_evicted_ + 1) % kNumCachedBlocks;
+    entry = {index, std::move(data)};
+    return &entry.second;
+  }
+
+  const SourceReadFunc& read_src_;
+  const uint64_t src_size_;
+  const bool zero_padding_enabled_;
+  std::vector<CompressedBlock> blocks_;
+  // The offsets of each block in the compressed and decompressed source.
+  std::vector<uint64_t> compressed_offsets_;
+  std::vector<uint64_t> offsets_;
+  // The offset of the trailing data in the decompressed source.
+  uint64_t trailing_offset_{};
+  uint64_t size_{};
+
+  // The cached decompressed blocks and their index, evicted in FIFO order.
+  std::vector<std::pair<size_t, Blob>> cache_;
+  size_t next_evicted_{};
+};
+
+// Utility classes to interact with the bsdiff and puffin APIs. C++ does not
+// have standard Read/Write trait. So everybody invent their own file
+// descriptor wrapper.
+class DecompressedSourceFile : public bsdiff::FileInterface {
+ public:
+  explicit DecompressedSourceFile(DecompressedSource* source)
+      : source_(source) {}
+  ~DecompressedSourceFile() override = default;
+
+  bool Read(void* buf, size_t count, size_t* bytes_read) override {
+    count = std::min<uint64_t>(count, source_->size() - offset_);
+    TEST_AND_RETURN_FALSE(
+        source_->Read(offset_, static_cast<uint8_t*>(buf), count));
+    *bytes_read = count;
+    offset_ += count;
+    return true;
+  }
+
+  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
+    LOG(ERROR) << "Unsupported operation " << __FUNCTION__;
+    return false;
+  }
+
+  bool Seek(off_t pos) override {
+    TEST_AND_RETURN_FALSE(pos >= 0 &&
+                          static_cast<uint64_t>(pos) <= source_->size());
+    offset_ = pos;
+    return true;
+  }
+
+  bool Close() override { return true; }
+
+  bool GetSize(uint64_t* size) override {
+    *size = source_->size();
+    return true;
+  }
+
+ private:
+  DecompressedSource* source_;
+  uint64_t offset_{};
+};
+
+class BlobWriteFile : public bsdiff::FileInterface {
+ public:
+  explicit BlobWriteFile(Blob* output) : output_(output) {}
+  ~BlobWriteFile() override = default;
+
+  bool Read(void* buf, size_t count, size_t* bytes_read) override {
+    LOG(ERROR) << "Unsupported operation " << __FUNCTION__;
+    return false;
+  }
+
+  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
+    const auto data = static_cast<const uint8_t*>(buf);
+    output_->insert(output_->end(), data, data + count);
+    *bytes_written = count;
+    return true;
+  }
+
+  bool Seek(off_t pos) override {
+    return static_cast<uint64_t>(pos) == output_->size();
+  }
+
+  bool Close() override { return true; }
+
+  bool GetSize(uint64_t* size) override {
+    *size = output_->size();
+    return true;
+  }
+
+ private:
+  Blob* output_;
+};
+
+class DecompressedSourceStream : public puffin::StreamInterface {
+ public:
+  explicit DecompressedSourceStream(DecompressedSource* source)
+      : source_(source) {}
+  ~DecompressedSourceStream() override = default;
 
   bool GetSize(uint64_t* size) const override {
-    *size = read_memory_.size();
+    *size = source_->size();
     return true;
   }
 
@@ -81,18 +290,14 @@ class StringViewStream : public puffin::StreamInterface {
   }
 
   bool Seek(uint64_t offset) override {
-    TEST_AND_RETURN_FALSE(open_);
-    uint64_t size;
-    GetSize(&size);
-    TEST_AND_RETURN_FALSE(offset <= size);
+    TEST_AND_RETURN_FALSE(offset <= source_->size());
     offset_ = offset;
     return true;
   }
 
   bool Read(void* buffer, size_t length) override {
-    TEST_AND_RETURN_FALSE(open_);
-    TEST_AND_RETURN_FALSE(offset_ + length <= read_memory_.size());
-    memcpy(buffer, read_memory_.data() + offset_, length);
+    TEST_AND_RETURN_FALSE(
+        source_->Read(offset_, static_cast<uint8_t*>(buffer), length));
     offset_ += length;
     return true;
   }
@@ -102,23 +307,11 @@ class StringViewStream : public puffin::StreamInterface {
     return false;
   }
 
-  bool Close() override {
-    open_ = false;
-    return true;
-  }
-
-  constexpr StringViewStream(std::string_view read_memory)
-      : read_memory_(read_memory) {
-    CHECK(!read_memory.empty());
-  }
+  bool Close() override { return true; }
 
  private:
-  // The memory buffer for reading.
-  std::string_view read_memory_;
-
-  // The current offset.
+  DecompressedSource* source_;
   uint64_t offset_{};
-  bool open_{true};
 };
 
 bool ParseLz4DifffPatch(std::string_view patch_data, Lz4diffPatch* output) {
@@ -169,15 +362,6 @@ bool bspatch(std::string_view input_data,
   return err == 0;
 }
 
-bool puffpatch(std::string_view input_data,
-               std::string_view patch_data,
-               Blob* output) {
-  return puffin::PuffPatch(std::make_unique<StringViewStream>(input_data),
-                           puffin::MemoryStream::CreateForWrite(output),
-                           reinterpret_cast<const uint8_t*>(patch_data.data()),
-                           patch_data.size());
-}
-
 std::vector<CompressedBlock> ToCompressedBlockVec(
     const google::protobuf::RepeatedPtrField<CompressedBlockInfo>& rpf) {
   std::vector<CompressedBlock> ret;
@@ -218,17 +402,29 @@ size_t GetDecompressedSize(
   return decompressed_size;
 }
 
-bool ApplyInnerPatch(Blob decompressed_src,
+bool ApplyInnerPatch(DecompressedSource* decompressed_src,
                      const Lz4diffPatch& patch,
                      Blob* decompressed_dst) {
+  const auto patch_data =
+      reinterpret_cast<const uint8_t*>(patch.inner_patch.data());
   switch (patch.pb_header.inner_type()) {
-    case InnerPatchType::BSDIFF:
-      TEST_AND_RETURN_FALSE(bspatch(
-          ToStringView(decompressed_src), patch.inner_patch, decompressed_dst));
+    case InnerPatchType::BSDIFF: {
+      const std::unique_ptr<bsdiff::FileInterface> src_file =
+          std::make_unique<DecompressedSourceFile>(decompressed_src);
+      const std::unique_ptr<bsdiff::FileInterface> dst_file =
+          std::make_unique<BlobWriteFile>(decompressed_dst);
+      TEST_AND_RETURN_FALSE(bsdiff::bspatch(src_file,
+                                            dst_file,
+                                            patch_data,
+                                            patch.inner_patch.size()) == 0);
       break;
+    }
     case InnerPatchType::PUFFDIFF:
-      TEST_AND_RETURN_FALSE(puffpatch(
-          ToStringView(decompressed_src), patch.inner_patch, decompressed_dst));
+      TEST_AND_RETURN_FALSE(puffin::PuffPatch(
+          std::make_unique<DecompressedSourceStream>(decompressed_src),
+          puffin::MemoryStream::CreateForWrite(decompressed_dst),
+          patch_data,
+          patch.inner_patch.size()));
       break;
     default:
       LOG(ERROR) << "Unsupported patch type: " << patch.pb_header.inner_type();
@@ -239,20 +435,24 @@ bool ApplyInnerPatch(Blob decompressed_src,
 
 // TODO(zhangkelvin) Rewrite this in C++ 20 coroutine once that's available.
 // Hand coding CPS is not fun.
-bool Lz4Patch(std::string_view src_data,
+bool Lz4Patch(const SourceReadFunc& read_src,
+              uint64_t src_size,
               const Lz4diffPatch& patch,
               const SinkFunc& sink) {
-  auto decompressed_src = TryDecompressBlob(
-      src_data,
-      ToCompressedBlockVec(patch.pb_header.src_info().block_info()),
-      patch.pb_header.src_info().zero_padding_enabled());
-  TEST_AND_RETURN_FALSE(!decompressed_src.empty());
+  DecompressedSource decompressed_src(
+      read_src, src_size, patch.pb_header.src_info());
+  TEST_AND_RETURN_FALSE(decompressed_src.Init());
+  // The whole patched data is needed before recompressing it, as the
+  // compressor looks past the end of each block. The patch generator expects
+  // that too, so it can't be done one window at a time without changing the
+  // patch format.
   Blob decompressed_dst;
   const auto decompressed_dst_size =
       GetDecompressedSize(patch.pb_header.dst_info().block_info());
   decompressed_dst.reserve(decompressed_dst_size);
 
-  ApplyInnerPatch(std::move(decompressed_src), patch, &decompressed_dst);
+  TEST_AND_RETURN_FALSE(
+      ApplyInnerPatch(&decompressed_src, patch, &decompressed_dst));
 
   if (!HasPosfixPatches(patch)) {
     return TryCompressBlob(
@@ -307,7 +507,8 @@ bool Lz4Patch(std::string_view src_data,
       postfix_patcher);
 }
 
-bool Lz4Patch(std::string_view src_data,
+bool Lz4Patch(const SourceReadFunc& read_src,
+              uint64_t src_size,
               const Lz4diffPatch& patch,
               Blob* output) {
   Blob blob;
@@ -315,7 +516,10 @@ bool Lz4Patch(std::string_view src_data,
       GetCompressedSize(patch.pb_header.dst_info().block_info());
   blob.reserve(output_size);
   TEST_AND_RETURN_FALSE(Lz4Patch(
-      src_data, patch, [&blob](const uint8_t* data, size_t size) -> size_t {
+      read_src,
+      src_size,
+      patch,
+      [&blob](const uint8_t* data, size_t size) -> size_t {
         blob.insert(blob.end(), data, data + size);
         return size;
       }));
@@ -323,6 +527,14 @@ bool Lz4Patch(std::string_view src_data,
   return true;
 }
 
+SourceReadFunc ReadFromMemory(std::string_view src_data) {
+  return [src_data](uint64_t offset, uint8_t* buffer, size_t count) {
+    TEST_AND_RETURN_FALSE(offset + count <= src_data.size());
+    memcpy(buffer, src_data.data() + offset, count);
+    return true;
+  };
+}
+
 }  // namespace
 
 bool Lz4Patch(std::string_view src_data,
@@ -330,7 +542,7 @@ bool Lz4Patch(std::string_view src_data,
               Blob* output) {
   Lz4diffPatch patch;
   TEST_AND_RETURN_FALSE(ParseLz4DifffPatch(patch_data, &patch));
-  return Lz4Patch(src_data, patch, output);
+  return Lz4Patch(ReadFromMemory(src_data), src_data.size(), patch, output);
 }
 
 bool Lz4Patch(std::string_view src_data,
@@ -338,7 +550,16 @@ bool Lz4Patch(std::string_view src_data,
               const SinkFunc& sink) {
   Lz4diffPatch patch;
   TEST_AND_RETURN_FALSE(ParseLz4DifffPatch(patch_data, &patch));
-  return Lz4Patch(src_data, patch, sink);
+  return Lz4Patch(ReadFromMemory(src_data), src_data.size(), patch, sink);
+}
+
+bool Lz4Patch(const SourceReadFunc& read_src,
+              uint64_t src_size,
+              std::string_view patch_data,
+              const SinkFunc& sink) {
+  Lz4diffPatch patch;
+  TEST_AND_RETURN_FALSE(ParseLz4DifffPatch(patch_data, &patch));
+  return Lz4Patch(read_src, src_size, patch, sink);
 }
 
 bool Lz4Patch(const Blob& src_data, const Blob& patch_data, Blob* output) {
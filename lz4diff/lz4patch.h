@@ -17,6 +17,9 @@
 #ifndef UPDATE_ENGINE_LZ4DIFF_LZ4PATCH_H_
 #define UPDATE_ENGINE_LZ4DIFF_LZ4PATCH_H_
 
+#include <functional>
+#include <string_view>
+
 #include "lz4diff/lz4diff_compress.h"
 #include "lz4diff_format.h"
 
@@ -31,6 +34,19 @@ bool Lz4Patch(std::string_view src_data,
               Blob* output);
 bool Lz4Patch(const Blob& src_data, const Blob& patch_data, Blob* output);
 
+// Reads |count| bytes at |offset| of the compressed source data into |buffer|.
+using SourceReadFunc =
+    std::function<bool(uint64_t offset, uint8_t* buffer, size_t count)>;
+
+// Same as above, but reads the |src_size| bytes of compressed source data with
+// |read_src| one compressed block at a time, when the inner patch needs them.
+// Only a few decompressed source blocks are kept in memory at once, instead of
+// the whole compressed and decompressed source data.
+bool Lz4Patch(const SourceReadFunc& read_src,
+              uint64_t src_size,
+              std::string_view patch_data,
+              const SinkFunc& sink);
+
 std::ostream& operator<<(std::ostream& out, const CompressionAlgorithm& info);
 
 std::ostream& operator<<(std::ostream& out, const Lz4diffHeader&);
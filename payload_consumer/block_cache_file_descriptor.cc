@@ -0,0 +1,260 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+BlockCacheFileDescriptor::BlockCacheFileDescriptor(FileDescriptorPtr fd,
+                                                   size_t block_size,
+                                                   size_t cache_size)
+    : fd_(fd), block_size_(block_size), max_blocks_(cache_size / block_size) {
+  CHECK(fd_);
+  CHECK_GT(block_size_, 0u);
+}
+
+bool BlockCacheFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  blocks_.clear();
+  block_index_.clear();
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool BlockCacheFileDescriptor::Open(const char* path, int flags) {
+  blocks_.clear();
+  block_index_.clear();
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t BlockCacheFileDescriptor::Read(void* buf, size_t count) {
+  uint8_t* out = static_cast<uint8_t*>(buf);
+  const uint64_t end_block = (offset_ + count + block_size_ - 1) / block_size_;
+  size_t bytes_read = 0;
+  while (bytes_read < count) {
+    const uint64_t block = (offset_ + bytes_read) / block_size_;
+    const size_t block_offset = (offset_ + bytes_read) % block_size_;
+    const uint8_t* data = LookUp(block);
+    if (data) {
+      const size_t length =
+          std::min(count - bytes_read, block_size_ - block_offset);
+      memcpy(out + bytes_read, data + block_offset, length);
+      bytes_read += length;
+      hits_++;
+      continue;
+    }
+
+    // Read all the blocks missing in a row at once.
+    uint64_t num_blocks = 1;
+    while (block + num_blocks < end_block &&
+           block_index_.find(block + num_blocks) == block_index_.end()) {
+      num_blocks++;
+    }
+    const ssize_t rc = ReadBlocks(block, num_blocks);
+    if (rc < 0) {
+      if (bytes_read == 0)
+        return -1;
+      break;
+    }
+    const size_t available =
+        static_cast<size_t>(rc) > block_offset ? rc - block_offset : 0;
+    const size_t length = std::min(count - bytes_read, available);
+    memcpy(out + bytes_read, read_buffer_.data() + block_offset, length);
+    bytes_read += length;
+    // Stop at the end of the file.
+    if (static_cast<uint64_t>(rc) < num_blocks * block_size_)
+      break;
+  }
+  offset_ += bytes_read;
+  return bytes_read;
+}
+
+ssize_t BlockCacheFileDescriptor::Write(const void* buf, size_t count) {
+  Invalidate(offset_, count);
+  if (fd_->Seek(offset_, SEEK_SET) < 0)
+    return -1;
+  const ssize_t rc = fd_->Write(buf, count);
+  if (rc > 0)
+    offset_ += rc;
+  return rc;
+}
+
+bool BlockCacheFileDescriptor::ReadScattered(const struct iovec* iov,
+                                             const off64_t* offsets,
+                                             size_t iovcnt) {
+  // Buffers entirely cached are filled right away, the other ones are passed
+  // to |fd_| all at once so that it may read them concurrently.
+  std::vector<struct iovec> missing_iov;
+  std::vector<off64_t> missing_offsets;
+  for (size_t i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0)
+      continue;
+    const uint64_t start_block = offsets[i] / block_size_;
+    const uint64_t end_block =
+        (offsets[i] + iov[i].iov_len + block_size_ - 1) / block_size_;
+    bool cached = true;
+    for (uint64_t block = start_block; block < end_block && cached; block++)
+      cached = block_index_.find(block) != block_index_.end();
+    if (!cached) {
+      missing_iov.push_back(iov[i]);
+      missing_offsets.push_back(offsets[i]);
+      misses_ += end_block - start_block;
+      continue;
+    }
+    uint8_t* out = static_cast<uint8_t*>(iov[i].iov_base);
+    size_t bytes_read = 0;
+    while (bytes_read < iov[i].iov_len) {
+      const uint64_t block = (offsets[i] + bytes_read) / block_size_;
+      const size_t block_offset = (offsets[i] + bytes_read) % block_size_;
+      const size_t length =
+          std::min(iov[i].iov_len - bytes_read, block_size_ - block_offset);
+      memcpy(out + bytes_read, LookUp(block) + block_offset, length);
+      bytes_read += length;
+    }
+    hits_ += end_block - start_block;
+  }
+  if (missing_iov.empty())
+    return true;
+  TEST_AND_RETURN_FALSE(fd_->ReadScattered(
+      missing_iov.data(), missing_offsets.data(), missing_iov.size()));
+
+  // Cache the blocks read entirely.
+  for (size_t i = 0; i < missing_iov.size(); i++) {
+    const uint8_t* data = static_cast<const uint8_t*>(missing_iov[i].iov_base);
+    const uint64_t start_block =
+        (missing_offsets[i] + block_size_ - 1) / block_size_;
+    const uint64_t end_block =
+        (missing_offsets[i] + missing_iov[i].iov_len) / block_size_;
+    for (uint64_t block = start_block; block < end_block; block++)
+      Insert(block, data + block * block_size_ - missing_offsets[i]);
+  }
+  return true;
+}
+
+off64_t BlockCacheFileDescriptor::Seek(off64_t offset, int whence) {
+  // Reading from the cache doesn't move the offset of |fd_|, which is only
+  // sought before reading missing blocks or writing.
+  if (whence == SEEK_END) {
+    const off64_t rc = fd_->Seek(offset, whence);
+    if (rc >= 0)
+      offset_ = rc;
+    return rc;
+  }
+  const off64_t next_offset = whence == SEEK_CUR ? offset_ + offset : offset;
+  if ((whence != SEEK_SET && whence != SEEK_CUR) || next_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = next_offset;
+  return offset_;
+}
+
+bool BlockCacheFileDescriptor::BlkIoctl(int request,
+                                        uint64_t start,
+                                        uint64_t length,
+                                        int* result) {
+  Invalidate(start, length);
+  return fd_->BlkIoctl(request, start, length, result);
+}
+
+bool BlockCacheFileDescriptor::Close() {
+  blocks_.clear();
+  block_index_.clear();
+  return fd_->Close();
+}
+
+const uint8_t* BlockCacheFileDescriptor::LookUp(uint64_t block) {
+  auto it = block_index_.find(block);
+  if (it == block_index_.end())
+    return nullptr;
+  blocks_.splice(blocks_.begin(), blocks_, it->second);
+  return it->second->second.data();
+}
+
+void BlockCacheFileDescriptor::Insert(uint64_t block, const uint8_t* data) {
+  if (max_blocks_ == 0)
+    return;
+  auto it = block_index_.find(block);
+  if (it != block_index_.end()) {
+    blocks_.splice(blocks_.begin(), blocks_, it->second);
+  } else if (blocks_.size() < max_blocks_) {
+    blocks_.emplace_front(block, brillo::Blob(block_size_));
+    block_index_[block] = blocks_.begin();
+  } else {
+    // Reuse the buffer of the least recently used block.
+    block_index_.erase(blocks_.back().first);
+    blocks_.splice(blocks_.begin(), blocks_, std::prev(blocks_.end()));
+    blocks_.front().first = block;
+    block_index_[block] = blocks_.begin();
+  }
+  memcpy(blocks_.front().second.data(), data, block_size_);
+}
+
+void BlockCacheFileDescriptor::Invalidate(uint64_t offset, uint64_t length) {
+  if (length == 0 || blocks_.empty())
+    return;
+  const uint64_t start_block = offset / block_size_;
+  const uint64_t end_block = (offset + length + block_size_ - 1) / block_size_;
+  if (end_block - start_block > blocks_.size()) {
+    for (auto it = blocks_.begin(); it != blocks_.end();) {
+      if (it->first >= start_block && it->first < end_block) {
+        block_index_.erase(it->first);
+        it = blocks_.erase(it);
+      } else {
+        it++;
+      }
+    }
+    return;
+  }
+  for (uint64_t block = start_block; block < end_block; block++) {
+    auto it = block_index_.find(block);
+    if (it != block_index_.end()) {
+      blocks_.erase(it->second);
+      block_index_.erase(it);
+    }
+  }
+}
+
+ssize_t BlockCacheFileDescriptor::ReadBlocks(uint64_t start_block,
+                                             uint64_t num_blocks) {
+  read_buffer_.resize(num_blocks * block_size_);
+  ssize_t bytes_read = 0;
+  if (!utils::ReadAll(fd_,
+                      read_buffer_.data(),
+                      read_buffer_.size(),
+                      start_block * block_size_,
+                      &bytes_read)) {
+    return -1;
+  }
+  misses_ += num_blocks;
+  for (uint64_t i = 0; i < bytes_read / block_size_; i++)
+    Insert(start_block + i, read_buffer_.data() + i * block_size_);
+  return bytes_read;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
+
+#include <sys/types.h>
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// A file descriptor keeping the blocks read from the wrapped one in memory, so
+// that reading them again doesn't hit the device. At most |cache_size| bytes
+// worth of blocks are kept, the least recently used ones being dropped first.
+//
+// This is meant for the source partition of a delta update, whose blocks are
+// usually read several times: once to verify the source hash of an operation
+// and once more to apply it, and again by the other operations sharing them.
+// Blocks overlapping a write are dropped from the cache, but the wrapped file
+// descriptor must not be modified by other means.
+class BlockCacheFileDescriptor final : public FileDescriptor {
+ public:
+  BlockCacheFileDescriptor(FileDescriptorPtr fd,
+                           size_t block_size,
+                           size_t cache_size);
+  ~BlockCacheFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  bool ReadScattered(const struct iovec* iov,
+                     const off64_t* offsets,
+                     size_t iovcnt) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  // The cached blocks hold the same data as the wrapped file descriptor.
+  int Fd() override { return fd_->Fd(); }
+
+  // The number of blocks read from the cache and from the wrapped file
+  // descriptor so far.
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+ private:
+  using CacheList = std::list<std::pair<uint64_t, brillo::Blob>>;
+
+  // Returns the data of |block| if it is cached, marking it as the most
+  // recently used one, or null otherwise.
+  const uint8_t* LookUp(uint64_t block);
+
+  // Caches a copy of the |block_size_| bytes of |data| as |block|, dropping
+  // the least recently used block if the cache is full.
+  void Insert(uint64_t block, const uint8_t* data);
+
+  // Drops the cached blocks overlapping |length| bytes at |offset|.
+  void Invalidate(uint64_t offset, uint64_t length);
+
+  // Reads |num_blocks| blocks from |start_block| of |fd_| into
+  // |read_buffer_| and caches them. Returns the number of bytes read, which
+  // is short at the end of the file, or -1 on error.
+  ssize_t ReadBlocks(uint64_t start_block, uint64_t num_blocks);
+
+  const FileDescriptorPtr fd_;
+  const size_t block_size_;
+  const size_t max_blocks_;
+  off64_t offset_{0};
+
+  // The cached blocks along with their data, most recently used first, and
+  // their position in the list by block number.
+  CacheList blocks_;
+  std::unordered_map<uint64_t, CacheList::iterator> block_index_;
+
+  brillo::Blob read_buffer_;
+
+  uint64_t hits_{0};
+  uint64_t misses_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BlockCacheFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kTestBlockSize = 16;
+constexpr size_t kFileBlocks = 8;
+}  // namespace
+
+class BlockCacheFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    file_data_.resize(kFileBlocks * kTestBlockSize);
+    for (size_t i = 0; i < file_data_.size(); i++)
+      file_data_[i] = static_cast<uint8_t>(i * 7);
+    ASSERT_TRUE(utils::WriteFile(
+        temp_file_.path().c_str(), file_data_.data(), file_data_.size()));
+  }
+
+  void Open(size_t cache_blocks) {
+    cfd_.reset(new BlockCacheFileDescriptor(
+        fd_, kTestBlockSize, cache_blocks * kTestBlockSize));
+    ASSERT_TRUE(cfd_->Open(temp_file_.path().c_str(), O_RDWR));
+  }
+
+  // Reads |count| bytes at |offset| and checks them against the file data.
+  void ExpectRead(size_t offset, size_t count) {
+    brillo::Blob data(count);
+    ssize_t bytes_read = 0;
+    ASSERT_TRUE(utils::PReadAll(cfd_, data.data(), count, offset, &bytes_read));
+    ASSERT_EQ(static_cast<ssize_t>(count), bytes_read);
+    EXPECT_EQ(brillo::Blob(file_data_.begin() + offset,
+                           file_data_.begin() + offset + count),
+              data);
+  }
+
+  FileDescriptorPtr fd_{new EintrSafeFileDescriptor};
+  ScopedTempFile temp_file_{"BlockCacheFileDescriptor-file.XXXXXX"};
+  brillo::Blob file_data_;
+  std::shared_ptr<BlockCacheFileDescriptor> cfd_;
+};
+
+TEST_F(BlockCacheFileDescriptorTest, CachesBlocksReadTest) {
+  Open(kFileBlocks);
+  ExpectRead(0, 3 * kTestBlockSize);
+  EXPECT_EQ(0u, cfd_->hits());
+  EXPECT_EQ(3u, cfd_->misses());
+
+  // Reading the same blocks again, even partially, doesn't read the file.
+  ExpectRead(5, 2 * kTestBlockSize);
+  EXPECT_EQ(3u, cfd_->hits());
+  EXPECT_EQ(3u, cfd_->misses());
+
+  // Only the blocks missing are read from the file.
+  ExpectRead(kTestBlockSize, 4 * kTestBlockSize);
+  EXPECT_EQ(5u, cfd_->hits());
+  EXPECT_EQ(5u, cfd_->misses());
+  EXPECT_TRUE(cfd_->Close());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, DropsLeastRecentlyUsedBlockTest) {
+  Open(2);
+  ExpectRead(0, kTestBlockSize);
+  ExpectRead(kTestBlockSize, kTestBlockSize);
+  ExpectRead(0, kTestBlockSize);
+  EXPECT_EQ(1u, cfd_->hits());
+
+  // Block 1 is dropped to make room for block 2.
+  ExpectRead(2 * kTestBlockSize, kTestBlockSize);
+  ExpectRead(0, kTestBlockSize);
+  EXPECT_EQ(2u, cfd_->hits());
+  EXPECT_EQ(3u, cfd_->misses());
+  ExpectRead(kTestBlockSize, kTestBlockSize);
+  EXPECT_EQ(2u, cfd_->hits());
+  EXPECT_EQ(4u, cfd_->misses());
+  EXPECT_TRUE(cfd_->Close());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, ReadScatteredTest) {
+  Open(kFileBlocks);
+  ExpectRead(2 * kTestBlockSize, kTestBlockSize);
+
+  brillo::Blob first(2 * kTestBlockSize), second(kTestBlockSize);
+  struct iovec iov[] = {{first.data(), first.size()},
+                        {second.data(), second.size()}};
+  off64_t offsets[] = {4 * kTestBlockSize, 2 * kTestBlockSize};
+  ASSERT_TRUE(cfd_->ReadScattered(iov, offsets, 2));
+  EXPECT_EQ(brillo::Blob(file_data_.begin() + 4 * kTestBlockSize,
+                         file_data_.begin() + 6 * kTestBlockSize),
+            first);
+  EXPECT_EQ(brillo::Blob(file_data_.begin() + 2 * kTestBlockSize,
+                         file_data_.begin() + 3 * kTestBlockSize),
+            second);
+  EXPECT_EQ(1u, cfd_->hits());
+  EXPECT_EQ(3u, cfd_->misses());
+
+  // The blocks read scattered are cached as well.
+  ExpectRead(4 * kTestBlockSize, 2 * kTestBlockSize);
+  EXPECT_EQ(3u, cfd_->hits());
+  EXPECT_EQ(3u, cfd_->misses());
+  EXPECT_TRUE(cfd_->Close());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, ReadPastEndOfFileTest) {
+  Open(kFileBlocks);
+  brillo::Blob data(2 * kTestBlockSize);
+  ASSERT_EQ(static_cast<off64_t>(file_data_.size() - kTestBlockSize / 2),
+            cfd_->Seek(-static_cast<off64_t>(kTestBlockSize / 2), SEEK_END));
+  EXPECT_EQ(static_cast<ssize_t>(kTestBlockSize / 2),
+            cfd_->Read(data.data(), data.size()));
+  EXPECT_EQ(0, cfd_->Read(data.data(), data.size()));
+  EXPECT_TRUE(cfd_->Close());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, WriteDropsCachedBlocksTest) {
+  Open(kFileBlocks);
+  ExpectRead(0, 2 * kTestBlockSize);
+
+  brillo::Blob new_data(kTestBlockSize / 2, 0xff);
+  ASSERT_TRUE(utils::PWriteAll(cfd_, new_data.data(), new_data.size(), 20));
+  std::copy(new_data.begin(), new_data.end(), file_data_.begin() + 20);
+  ExpectRead(0, 2 * kTestBlockSize);
+  EXPECT_EQ(1u, cfd_->hits());
+  EXPECT_EQ(3u, cfd_->misses());
+  EXPECT_TRUE(cfd_->Close());
+}
+
+}  // namespace chromeos_update_engine
@@ -72,6 +72,16 @@ ssize_t CachedFileDescriptorBase::Write(const void* buf, size_t count) {
   return total_bytes_wrote;
 }
 
+bool CachedFileDescriptorBase::ReadScattered(const struct iovec* iov,
+                                             const off64_t* offsets,
+                                             size_t iovcnt) {
+  // The reads must see the cached writes. They may also move the offset of
+  // |fd_|, where the cache is written next.
+  TEST_AND_RETURN_FALSE(FlushCache());
+  TEST_AND_RETURN_FALSE(GetFd()->ReadScattered(iov, offsets, iovcnt));
+  return GetFd()->Seek(offset_, SEEK_SET) == offset_;
+}
+
 bool CachedFileDescriptorBase::Flush() {
   return FlushCache() && GetFd()->Flush();
 }
@@ -44,6 +44,9 @@ class CachedFileDescriptorBase : public FileDescriptor {
     return GetFd()->Read(buf, count);
   }
   ssize_t Write(const void* buf, size_t count) override;
+  bool ReadScattered(const struct iovec* iov,
+                     const off64_t* offsets,
+                     size_t iovcnt) override;
   off64_t Seek(off64_t offset, int whence) override;
   uint64_t BlockDevSize() override { return GetFd()->BlockDevSize(); }
   bool BlkIoctl(int request,
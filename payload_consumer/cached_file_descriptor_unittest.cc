@@ -201,4 +201,31 @@ TEST_F(CachedFileDescriptorTest, SeekAfterWriteTest) {
   EXPECT_EQ(blob_in, blob_out);
 }
 
+TEST_F(CachedFileDescriptorTest, ReadScatteredAfterWriteTest) {
+  off64_t seek = 100;
+  size_t less_than_cache_size = kCacheSize - 3;
+  EXPECT_EQ(cfd_->Seek(seek, SEEK_SET), seek);
+  brillo::Blob blob_in(kFileSize, 0);
+  std::fill_n(&blob_in[seek], less_than_cache_size, value_);
+  // The cached data isn't flushed before reading it back.
+  Write(&blob_in[seek], less_than_cache_size);
+
+  brillo::Blob first(10), second(20);
+  struct iovec iov[] = {{first.data(), first.size()},
+                        {second.data(), second.size()}};
+  off64_t offsets[] = {seek - 5, seek + 50};
+  ASSERT_TRUE(cfd_->ReadScattered(iov, offsets, 2));
+  EXPECT_EQ(brillo::Blob(&blob_in[seek - 5], &blob_in[seek + 5]), first);
+  EXPECT_EQ(brillo::Blob(&blob_in[seek + 50], &blob_in[seek + 70]), second);
+
+  // Writing continues where it left off.
+  std::fill_n(&blob_in[seek + less_than_cache_size], 10, value_ + 1);
+  Write(&blob_in[seek + less_than_cache_size], 10);
+  EXPECT_TRUE(cfd_->Flush());
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+}
+
 }  // namespace chromeos_update_engine
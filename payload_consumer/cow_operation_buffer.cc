@@ -0,0 +1,160 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/cow_operation_buffer.h"
+
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using android::snapshot::ICowWriter;
+
+namespace chromeos_update_engine {
+
+bool CowOperationBuffer::AddTo(ICowWriter* cow_writer) {
+  for (const auto& op : operations_) {
+    const uint8_t* data = data_.data() + op.data_offset;
+    switch (op.type) {
+      case Operation::kCopy:
+        TEST_AND_RETURN_FALSE(
+            cow_writer->AddCopy(op.new_block, op.old_block, op.num_blocks));
+        break;
+      case Operation::kRaw:
+        TEST_AND_RETURN_FALSE(
+            cow_writer->AddRawBlocks(op.new_block, data, op.data_size));
+        break;
+      case Operation::kXor:
+        TEST_AND_RETURN_FALSE(cow_writer->AddXorBlocks(
+            op.new_block, data, op.data_size, op.old_block, op.offset));
+        break;
+      case Operation::kZero:
+        TEST_AND_RETURN_FALSE(
+            cow_writer->AddZeroBlocks(op.new_block, op.num_blocks));
+        break;
+    }
+  }
+  operations_.clear();
+  data_.clear();
+  return true;
+}
+
+bool CowOperationBuffer::EmitCopy(uint64_t new_block,
+                                  uint64_t old_block,
+                                  uint64_t num_blocks) {
+  operations_.push_back(
+      {Operation::kCopy, new_block, old_block, num_blocks, 0, 0, 0});
+  return true;
+}
+
+bool CowOperationBuffer::EmitRawBlocks(uint64_t new_block_start,
+                                       const void* data,
+                                       size_t size) {
+  operations_.push_back({Operation::kRaw,
+                         new_block_start,
+                         0,
+                         0,
+                         0,
+                         AppendData(data, size),
+                         size});
+  return true;
+}
+
+bool CowOperationBuffer::EmitXorBlocks(uint32_t new_block_start,
+                                       const void* data,
+                                       size_t size,
+                                       uint32_t old_block,
+                                       uint16_t offset) {
+  operations_.push_back({Operation::kXor,
+                         new_block_start,
+                         old_block,
+                         0,
+                         offset,
+                         AppendData(data, size),
+                         size});
+  return true;
+}
+
+bool CowOperationBuffer::EmitZeroBlocks(uint64_t new_block_start,
+                                        uint64_t num_blocks) {
+  operations_.push_back(
+      {Operation::kZero, new_block_start, 0, num_blocks, 0, 0, 0});
+  return true;
+}
+
+bool CowOperationBuffer::EmitLabel(uint64_t label) {
+  LOG(ERROR) << "Labels can't be buffered.";
+  return false;
+}
+
+bool CowOperationBuffer::EmitSequenceData(size_t num_ops,
+                                          const uint32_t* data) {
+  LOG(ERROR) << "Sequence data can't be buffered.";
+  return false;
+}
+
+size_t CowOperationBuffer::AppendData(const void* data, size_t size) {
+  const size_t offset = data_.size();
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  data_.insert(data_.end(), bytes, bytes + size);
+  return offset;
+}
+
+bool CowOperationSequencer::Commit(size_t op_index,
+                                   std::unique_ptr<CowOperationBuffer> buffer) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (failed_)
+    return false;
+  CHECK_GE(op_index, next_op_index_);
+  pending_.emplace(op_index, std::move(buffer));
+  // The thread already writing adds this output too once it gets to it.
+  if (writing_)
+    return true;
+
+  writing_ = true;
+  while (!failed_ && !pending_.empty() &&
+         pending_.begin()->first == next_op_index_) {
+    std::unique_ptr<CowOperationBuffer> next =
+        std::move(pending_.begin()->second);
+    pending_.erase(pending_.begin());
+    // Let the other threads queue their output meanwhile.
+    lock.unlock();
+    const bool success = !next || next->AddTo(cow_writer_);
+    lock.lock();
+    if (!success) {
+      LOG(ERROR) << "Failed to write the output of operation "
+                 << next_op_index_ << " to the COW image.";
+      failed_ = true;
+      break;
+    }
+    next_op_index_++;
+  }
+  writing_ = false;
+  return !failed_;
+}
+
+size_t CowOperationSequencer::next_op_index() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return next_op_index_;
+}
+
+bool CowOperationSequencer::HasPendingOperations() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !pending_.empty();
+}
+
+}  // namespace chromeos_update_engine
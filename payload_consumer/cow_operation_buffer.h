@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_COW_OPERATION_BUFFER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_COW_OPERATION_BUFFER_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <libsnapshot/cow_writer.h>
+
+namespace chromeos_update_engine {
+
+// A COW writer keeping the operations emitted in memory, so that they can be
+// added to the actual COW image later on. This lets the install operations of
+// a partition be performed on several threads while the COW image receives
+// their output in order. Labels and sequence data can't be buffered.
+class CowOperationBuffer final : public android::snapshot::ICowWriter {
+ public:
+  explicit CowOperationBuffer(const android::snapshot::CowOptions& options)
+      : ICowWriter(options) {}
+  ~CowOperationBuffer() override = default;
+
+  // Adds the buffered operations to |cow_writer| in the order they were
+  // emitted, and clears them. Returns false if |cow_writer| fails.
+  [[nodiscard]] bool AddTo(android::snapshot::ICowWriter* cow_writer);
+
+  bool Finalize() override { return true; }
+  // Returns the size of the buffered data.
+  uint64_t GetCowSize() override { return data_.size(); }
+
+ protected:
+  bool EmitCopy(uint64_t new_block,
+                uint64_t old_block,
+                uint64_t num_blocks) override;
+  bool EmitRawBlocks(uint64_t new_block_start,
+                     const void* data,
+                     size_t size) override;
+  bool EmitXorBlocks(uint32_t new_block_start,
+                     const void* data,
+                     size_t size,
+                     uint32_t old_block,
+                     uint16_t offset) override;
+  bool EmitZeroBlocks(uint64_t new_block_start, uint64_t num_blocks) override;
+  bool EmitLabel(uint64_t label) override;
+  bool EmitSequenceData(size_t num_ops, const uint32_t* data) override;
+
+ private:
+  struct Operation {
+    enum Type { kCopy, kRaw, kXor, kZero } type;
+    uint64_t new_block;
+    // The source block of kCopy and kXor operations.
+    uint64_t old_block;
+    // The number of blocks of kCopy and kZero operations.
+    uint64_t num_blocks;
+    // The offset in the source block of kXor operations.
+    uint16_t offset;
+    // The part of |data_| holding the data of kRaw and kXor operations.
+    size_t data_offset;
+    size_t data_size;
+  };
+
+  // Appends |size| bytes of |data| to |data_|, returning where they start.
+  size_t AppendData(const void* data, size_t size);
+
+  std::vector<Operation> operations_;
+  brillo::Blob data_;
+
+  DISALLOW_COPY_AND_ASSIGN(CowOperationBuffer);
+};
+
+// Hands the output of the install operations of a partition, buffered while
+// they are performed concurrently, to the COW writer of the partition in the
+// order of the operations. Thread-safe.
+class CowOperationSequencer {
+ public:
+  // |next_op_index| is the index in the partition of the first operation
+  // whose output is committed.
+  CowOperationSequencer(android::snapshot::ICowWriter* cow_writer,
+                        size_t next_op_index)
+      : cow_writer_(cow_writer), next_op_index_(next_op_index) {}
+
+  // Queues the output of the operation |op_index|, or null if it has none.
+  // The output of the queued operations is added to the COW writer as soon as
+  // all the operations before them are, by the thread committing the missing
+  // operation. This call returns once the output of the operations it adds is
+  // written, and false if adding any output failed so far.
+  [[nodiscard]] bool Commit(size_t op_index,
+                            std::unique_ptr<CowOperationBuffer> buffer);
+
+  // Returns the index of the first operation whose output isn't written yet.
+  size_t next_op_index() const;
+
+  // Returns whether some operations are queued, waiting for the operations
+  // before them.
+  bool HasPendingOperations() const;
+
+ private:
+  android::snapshot::ICowWriter* const cow_writer_;
+
+  mutable std::mutex mutex_;
+  size_t next_op_index_;
+  // The output of the operations committed but not written yet, by index.
+  std::map<size_t, std::unique_ptr<CowOperationBuffer>> pending_;
+  // Whether a thread is adding the output of operations to |cow_writer_|.
+  bool writing_{false};
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(CowOperationSequencer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_COW_OPERATION_BUFFER_H_
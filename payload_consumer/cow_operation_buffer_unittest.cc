@@ -0,0 +1,215 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/cow_operation_buffer.h"
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr uint32_t kTestBlockSize = 16;
+
+// A COW writer recording the operations emitted, one line each.
+class RecordingCowWriter : public android::snapshot::ICowWriter {
+ public:
+  struct CowOp {
+    enum { COW_COPY, COW_RAW, COW_XOR, COW_ZERO } type;
+    uint64_t new_block;
+    uint64_t old_block;
+    uint64_t num_blocks;
+    uint16_t offset;
+    brillo::Blob data;
+  };
+  using ICowWriter::ICowWriter;
+
+  bool EmitCopy(uint64_t new_block,
+                uint64_t old_block,
+                uint64_t num_blocks) override {
+    operations_.push_back(
+        {CowOp::COW_COPY, new_block, old_block, num_blocks, 0, {}});
+    return true;
+  }
+  bool EmitRawBlocks(uint64_t new_block_start,
+                     const void* data,
+                     size_t size) override {
+    if (fail_raw_blocks_)
+      return false;
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    operations_.push_back({CowOp::COW_RAW,
+                           new_block_start,
+                           0,
+                           0,
+                           0,
+                           brillo::Blob(bytes, bytes + size)});
+    return true;
+  }
+  bool EmitXorBlocks(uint32_t new_block_start,
+                     const void* data,
+                     size_t size,
+                     uint32_t old_block,
+                     uint16_t offset) override {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    operations_.push_back({CowOp::COW_XOR,
+                           new_block_start,
+                           old_block,
+                           0,
+                           offset,
+                           brillo::Blob(bytes, bytes + size)});
+    return true;
+  }
+  bool EmitZeroBlocks(uint64_t new_block_start, uint64_t num_blocks) override {
+    operations_.push_back(
+        {CowOp::COW_ZERO, new_block_start, 0, num_blocks, 0, {}});
+    return true;
+  }
+  bool EmitLabel(uint64_t label) override { return true; }
+  bool EmitSequenceData(size_t num_ops, const uint32_t* data) override {
+    return true;
+  }
+  bool Finalize() override { return true; }
+  uint64_t GetCowSize() override { return 0; }
+
+  bool fail_raw_blocks_{false};
+  std::vector<CowOp> operations_;
+};
+}  // namespace
+
+class CowOperationBufferTest : public ::testing::Test {
+ protected:
+  // Returns a buffer holding a raw block at |new_block| filled with |value|.
+  std::unique_ptr<CowOperationBuffer> RawBlockBuffer(uint64_t new_block,
+                                                     uint8_t value) {
+    auto buffer = std::make_unique<CowOperationBuffer>(options_);
+    brillo::Blob data(kTestBlockSize, value);
+    EXPECT_TRUE(buffer->AddRawBlocks(new_block, data.data(), data.size()));
+    return buffer;
+  }
+
+  android::snapshot::CowOptions options_{.block_size = kTestBlockSize};
+  RecordingCowWriter cow_writer_{options_};
+};
+
+TEST_F(CowOperationBufferTest, AddsOperationsInOrderTest) {
+  CowOperationBuffer buffer{options_};
+  brillo::Blob raw_data(2 * kTestBlockSize, 0x11);
+  brillo::Blob xor_data(kTestBlockSize, 0x22);
+  ASSERT_TRUE(buffer.AddZeroBlocks(20, 3));
+  ASSERT_TRUE(buffer.AddRawBlocks(10, raw_data.data(), raw_data.size()));
+  ASSERT_TRUE(buffer.AddCopy(30, 5, 2));
+  ASSERT_TRUE(
+      buffer.AddXorBlocks(40, xor_data.data(), xor_data.size(), 7, 100));
+  EXPECT_EQ(raw_data.size() + xor_data.size(), buffer.GetCowSize());
+
+  ASSERT_TRUE(buffer.AddTo(&cow_writer_));
+  const auto& ops = cow_writer_.operations_;
+  ASSERT_EQ(4u, ops.size());
+  EXPECT_EQ(RecordingCowWriter::CowOp::COW_ZERO, ops[0].type);
+  EXPECT_EQ(20u, ops[0].new_block);
+  EXPECT_EQ(3u, ops[0].num_blocks);
+  EXPECT_EQ(RecordingCowWriter::CowOp::COW_RAW, ops[1].type);
+  EXPECT_EQ(10u, ops[1].new_block);
+  EXPECT_EQ(raw_data, ops[1].data);
+  EXPECT_EQ(RecordingCowWriter::CowOp::COW_COPY, ops[2].type);
+  EXPECT_EQ(30u, ops[2].new_block);
+  EXPECT_EQ(5u, ops[2].old_block);
+  EXPECT_EQ(2u, ops[2].num_blocks);
+  EXPECT_EQ(RecordingCowWriter::CowOp::COW_XOR, ops[3].type);
+  EXPECT_EQ(40u, ops[3].new_block);
+  EXPECT_EQ(7u, ops[3].old_block);
+  EXPECT_EQ(100u, ops[3].offset);
+  EXPECT_EQ(xor_data, ops[3].data);
+
+  // The operations added are dropped from the buffer.
+  EXPECT_EQ(0u, buffer.GetCowSize());
+  ASSERT_TRUE(buffer.AddTo(&cow_writer_));
+  EXPECT_EQ(4u, ops.size());
+}
+
+TEST_F(CowOperationBufferTest, LabelsAreNotBufferedTest) {
+  CowOperationBuffer buffer{options_};
+  EXPECT_FALSE(buffer.AddLabel(1));
+}
+
+TEST_F(CowOperationBufferTest, SequencerWritesInOrderTest) {
+  CowOperationSequencer sequencer{&cow_writer_, 5};
+  ASSERT_TRUE(sequencer.Commit(7, RawBlockBuffer(7, 7)));
+  ASSERT_TRUE(sequencer.Commit(5, RawBlockBuffer(5, 5)));
+  // Operation 7 waits for operation 6.
+  EXPECT_EQ(1u, cow_writer_.operations_.size());
+  EXPECT_EQ(6u, sequencer.next_op_index());
+  EXPECT_TRUE(sequencer.HasPendingOperations());
+
+  // Operations without output still count.
+  ASSERT_TRUE(sequencer.Commit(6, nullptr));
+  EXPECT_EQ(8u, sequencer.next_op_index());
+  EXPECT_FALSE(sequencer.HasPendingOperations());
+  ASSERT_EQ(2u, cow_writer_.operations_.size());
+  EXPECT_EQ(5u, cow_writer_.operations_[0].new_block);
+  EXPECT_EQ(7u, cow_writer_.operations_[1].new_block);
+}
+
+TEST_F(CowOperationBufferTest, SequencerFailureTest) {
+  CowOperationSequencer sequencer{&cow_writer_, 0};
+  ASSERT_TRUE(sequencer.Commit(1, RawBlockBuffer(1, 1)));
+  cow_writer_.fail_raw_blocks_ = true;
+  EXPECT_FALSE(sequencer.Commit(0, RawBlockBuffer(0, 0)));
+  EXPECT_EQ(0u, sequencer.next_op_index());
+
+  // Once failed, nothing else is written.
+  cow_writer_.fail_raw_blocks_ = false;
+  EXPECT_FALSE(sequencer.Commit(2, RawBlockBuffer(2, 2)));
+  EXPECT_TRUE(cow_writer_.operations_.empty());
+}
+
+TEST_F(CowOperationBufferTest, SequencerConcurrentCommitsTest) {
+  constexpr size_t kNumOperations = 200;
+  constexpr size_t kNumThreads = 4;
+  std::vector<size_t> op_indexes(kNumOperations);
+  for (size_t i = 0; i < kNumOperations; i++)
+    op_indexes[i] = i;
+  std::shuffle(op_indexes.begin(), op_indexes.end(), std::mt19937(1234));
+
+  CowOperationSequencer sequencer{&cow_writer_, 0};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&, t] {
+      for (size_t i = t; i < kNumOperations; i += kNumThreads) {
+        const size_t op_index = op_indexes[i];
+        EXPECT_TRUE(
+            sequencer.Commit(op_index, RawBlockBuffer(op_index, op_index)));
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  EXPECT_EQ(kNumOperations, sequencer.next_op_index());
+  EXPECT_FALSE(sequencer.HasPendingOperations());
+  ASSERT_EQ(kNumOperations, cow_writer_.operations_.size());
+  for (size_t i = 0; i < kNumOperations; i++) {
+    EXPECT_EQ(i, cow_writer_.operations_[i].new_block);
+    EXPECT_EQ(brillo::Blob(kTestBlockSize, i), cow_writer_.operations_[i].data);
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -70,6 +70,9 @@ const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
 const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
+const size_t DeltaPerformer::kMaxPipelinedApplyThreads = 8;
+const size_t DeltaPerformer::kPipelineMaxPendingOps = 64;
+const size_t DeltaPerformer::kPipelineMaxPendingBytes = 32 * 1024 * 1024;
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
@@ -83,8 +86,14 @@ static uint64_t IntRatio(uint64_t part, uint64_t total, uint64_t norm) {
   return part * norm / total;
 }
 
+size_t DeltaPerformer::NumAppliedOperations() const {
+  return operation_pipeline_ ? operation_pipeline_->next_unfinished_op()
+                             : next_operation_num_;
+}
+
 void DeltaPerformer::LogProgress(const char* message_prefix) {
   // Format operations total count and percentage.
+  const size_t num_applied_operations = NumAppliedOperations();
   string total_operations_str("?");
   string completed_percentage_str("");
   if (num_total_operations_) {
@@ -92,7 +101,7 @@ void DeltaPerformer::LogProgress(const char* message_prefix) {
     // Upcasting to 64-bit to avoid overflow, back to size_t for formatting.
     completed_percentage_str = base::StringPrintf(
         " (%" PRIu64 "%%)",
-        IntRatio(next_operation_num_, num_total_operations_, 100));
+        IntRatio(num_applied_operations, num_total_operations_, 100));
   }
 
   // Format download total count and percentage.
@@ -106,7 +115,8 @@ void DeltaPerformer::LogProgress(const char* message_prefix) {
         " (%" PRIu64 "%%)", IntRatio(total_bytes_received_, payload_size, 100));
   }
 
-  LOG(INFO) << (message_prefix ? message_prefix : "") << next_operation_num_
+  LOG(INFO) << (message_prefix ? message_prefix : "")
+            << num_applied_operations
             << "/" << total_operations_str << " operations"
             << completed_percentage_str << ", " << total_bytes_received_ << "/"
             << payload_size_str << " bytes downloaded"
@@ -144,8 +154,9 @@ void DeltaPerformer::UpdateOverallProgress(bool force_log,
   // expect an update to have at least one operation, so the expectation is that
   // this will eventually reach |actual_operations_weight|.
   if (num_total_operations_)
-    new_overall_progress += IntRatio(
-        next_operation_num_, num_total_operations_, actual_operations_weight);
+    new_overall_progress += IntRatio(NumAppliedOperations(),
+                                     num_total_operations_,
+                                     actual_operations_weight);
 
   // Progress ratio cannot recede, unless our assumptions about the total
   // payload size, total number of operations, or the monotonicity of progress
@@ -222,7 +233,20 @@ int DeltaPerformer::CloseCurrentPartition() {
   if (!partition_writer_) {
     return 0;
   }
-  int err = partition_writer_->Close();
+  // Stop the workers before closing the writers they use.
+  operation_pipeline_.reset();
+  pipeline_checkpoints_.clear();
+  pipeline_barrier_pending_ = false;
+  int err = 0;
+  for (auto& writer : pipeline_partition_writers_) {
+    int writer_err = writer->Close();
+    if (err == 0)
+      err = writer_err;
+  }
+  pipeline_partition_writers_.clear();
+  int writer_err = partition_writer_->Close();
+  if (err == 0)
+    err = writer_err;
   partition_writer_ = nullptr;
   return err;
 }
@@ -250,12 +274,87 @@ bool DeltaPerformer::OpenCurrentPartition() {
                                 payload_->type == InstallPayloadType::kDelta;
   const size_t partition_operation_num = GetPartitionOperationNum();
 
+  // Several workers can only share the partition if the writer supports it.
+  const bool concurrent_operations =
+      install_plan_->pipelined_apply_threads > 1 &&
+      partition_writer_->EnableConcurrentOperations();
+  const size_t num_writers =
+      concurrent_operations
+          ? min<size_t>(install_plan_->pipelined_apply_threads,
+                        kMaxPipelinedApplyThreads)
+          : 1;
+  partition_writer_->SetNumConcurrentWriters(num_writers);
   TEST_AND_RETURN_FALSE(partition_writer_->Init(
       install_plan_, source_may_exist, partition_operation_num));
+  if (install_plan_->pipelined_apply_threads > 0) {
+    TEST_AND_RETURN_FALSE(StartOperationPipeline(
+        partition, install_part, source_may_exist, num_writers));
+  }
   CheckpointUpdateProgress(true);
   return true;
 }
 
+bool DeltaPerformer::StartOperationPipeline(
+    const PartitionUpdate& partition_update,
+    const InstallPlan::Partition& install_part,
+    bool source_may_exist,
+    size_t num_workers) {
+  num_workers = min(num_workers, kMaxPipelinedApplyThreads);
+  const size_t partition_operation_num = GetPartitionOperationNum();
+  for (size_t i = 1; i < num_workers; i++) {
+    // Writers sharing the state of |partition_writer_| are created by it.
+    auto writer = partition_writer_->CreateConcurrentWriter();
+    if (!writer) {
+      writer = CreatePartitionWriter(
+          partition_update,
+          install_part,
+          boot_control_->GetDynamicPartitionControl(),
+          block_size_,
+          interactive_,
+          IsDynamicPartition(install_part.name, install_plan_->target_slot));
+      TEST_AND_RETURN_FALSE(writer->EnableConcurrentOperations());
+    }
+    writer->SetNumConcurrentWriters(num_workers);
+    TEST_AND_RETURN_FALSE(
+        writer->Init(install_plan_, source_may_exist, partition_operation_num));
+    pipeline_partition_writers_.push_back(std::move(writer));
+  }
+  pipeline_checkpoints_.clear();
+  pipeline_checkpoints_.push_back(CurrentCheckpoint());
+  pipeline_barrier_pending_ = false;
+  operation_pipeline_ = std::make_unique<InstallOperationPipeline>(
+      num_workers,
+      next_operation_num_,
+      kPipelineMaxPendingOps,
+      kPipelineMaxPendingBytes,
+      [this](size_t worker_index,
+             size_t op_index,
+             const InstallOperation& operation,
+             const brillo::Blob& data) {
+        return ApplyPipelinedOperation(
+            worker_index, op_index, operation, data);
+      });
+  LOG(INFO) << "Applying operations of partition "
+            << partition_update.partition_name() << " on " << num_workers
+            << " worker thread(s).";
+  return true;
+}
+
+bool DeltaPerformer::IsOperationPipelineFull() const {
+  return operation_pipeline_ && operation_pipeline_->IsFull();
+}
+
+bool DeltaPerformer::WaitForOperationPipeline(ErrorCode* error) {
+  if (!operation_pipeline_)
+    return true;
+  ErrorCode pipeline_error = operation_pipeline_->Wait();
+  if (pipeline_error != ErrorCode::kSuccess) {
+    *error = pipeline_error;
+    return false;
+  }
+  return true;
+}
+
 size_t DeltaPerformer::GetPartitionOperationNum() {
   return next_operation_num_ -
          (current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0);
@@ -590,9 +689,17 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     if (download_delegate_ && download_delegate_->ShouldCancel(error))
       return false;
 
+    // Report failures of operations applied by the pipeline workers.
+    if (operation_pipeline_ &&
+        (*error = operation_pipeline_->error()) != ErrorCode::kSuccess) {
+      return false;
+    }
+
     // We know there are more operations to perform because we didn't reach the
     // |num_total_operations_| limit yet.
     if (next_operation_num_ >= acc_num_operations_[current_partition_]) {
+      if (!WaitForOperationPipeline(error))
+        return false;
       if (partition_writer_) {
         if (!partition_writer_->FinishedInstallOps()) {
           *error = ErrorCode::kDownloadWriteError;
@@ -613,11 +720,37 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     const InstallOperation& op =
         partitions_[current_partition_].operations(GetPartitionOperationNum());
 
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    // When all the data of the operation is in |bytes|, typically because the
+    // payload is read from a local file in large chunks, use it in place
+    // rather than copying it to |buffer_| first. The pipeline needs its own
+    // copy of the data anyway.
+    const bool data_in_place = !operation_pipeline_ && buffer_.empty() &&
+                               op.data_length() > 0 &&
+                               op.data_offset() == buffer_offset_ &&
+                               count >= op.data_length();
+    const uint8_t* op_data = reinterpret_cast<const uint8_t*>(c_bytes);
+    size_t op_data_size = op.data_length();
+    if (!data_in_place) {
+      CopyDataToBuffer(&c_bytes, &count, op.data_length());
+
+      // Check whether we received all of the next operation's data payload.
+      if (!CanPerformInstallOperation(op))
+        return true;
+      op_data = buffer_.data();
+      op_data_size = buffer_.size();
+    }
 
-    // Check whether we received all of the next operation's data payload.
-    if (!CanPerformInstallOperation(op))
-      return true;
+    // Start reading the source of the next operations in the background.
+    partition_writer_->PrepareForOperation(GetPartitionOperationNum());
+
+    if (operation_pipeline_) {
+      // Makes sure we unblock exit when this operation is submitted.
+      ScopedTerminatorExitUnblocker exit_unblocker =
+          ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+      if (!SubmitToOperationPipeline(op, error))
+        return false;
+      continue;
+    }
 
     // Validate the operation unconditionally. This helps prevent the
     // exploitation of vulnerabilities in the patching libraries, e.g. bspatch.
@@ -627,7 +760,7 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     // Note: Validate must be called only if CanPerformInstallOperation is
     // called. Otherwise, we might be failing operations before even if there
     // isn't sufficient data to compute the proper hash.
-    *error = ValidateOperationHash(op);
+    *error = ValidateOperationHash(op, op_data, next_operation_num_);
     if (*error != ErrorCode::kSuccess) {
       if (install_plan_->hash_checks_mandatory) {
         LOG(ERROR) << "Mandatory operation hash check failed";
@@ -651,7 +784,7 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       case InstallOperation::REPLACE:
       case InstallOperation::REPLACE_BZ:
       case InstallOperation::REPLACE_XZ:
-        op_result = PerformReplaceOperation(op);
+        op_result = PerformReplaceOperation(op, op_data, op_data_size);
         OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
         break;
       case InstallOperation::ZERO:
@@ -669,7 +802,7 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       case InstallOperation::ZUCCHINI:
       case InstallOperation::LZ4DIFF_PUFFDIFF:
       case InstallOperation::LZ4DIFF_BSDIFF:
-        op_result = PerformDiffOperation(op, error);
+        op_result = PerformDiffOperation(op, op_data, op_data_size, error);
         OP_DURATION_HISTOGRAM(op_name, op_start_time);
         break;
       default:
@@ -678,11 +811,26 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     if (!HandleOpResult(op_result, op_name.c_str(), error))
       return false;
 
+    // Hash and drop the data of the operation.
+    if (data_in_place) {
+      HashCalculator::UpdateAll(
+          {&payload_hash_calculator_, &signed_hash_calculator_},
+          c_bytes,
+          op_data_size);
+      buffer_offset_ += op_data_size;
+      c_bytes += op_data_size;
+      count -= op_data_size;
+    } else if (!buffer_.empty()) {
+      DiscardBuffer(true, buffer_.size());
+    }
+
     next_operation_num_++;
     UpdateOverallProgress(false, "Completed ");
     CheckpointUpdateProgress(false);
   }
 
+  if (!WaitForOperationPipeline(error))
+    return false;
   if (partition_writer_) {
     TEST_AND_RETURN_FALSE(partition_writer_->FinishedInstallOps());
   }
@@ -873,19 +1021,15 @@ bool DeltaPerformer::CanPerformInstallOperation(
 }
 
 bool DeltaPerformer::PerformReplaceOperation(
-    const InstallOperation& operation) {
+    const InstallOperation& operation, const void* data, size_t count) {
   CHECK(operation.type() == InstallOperation::REPLACE ||
         operation.type() == InstallOperation::REPLACE_BZ ||
         operation.type() == InstallOperation::REPLACE_XZ);
 
-  // Since we delete data off the beginning of the buffer as we use it,
-  // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(count >= operation.data_length());
 
-  TEST_AND_RETURN_FALSE(partition_writer_->PerformReplaceOperation(
-      operation, buffer_.data(), buffer_.size()));
-  // Update buffer
-  DiscardBuffer(true, buffer_.size());
+  TEST_AND_RETURN_FALSE(
+      partition_writer_->PerformReplaceOperation(operation, data, count));
   return true;
 }
 
@@ -933,22 +1077,132 @@ bool DeltaPerformer::ExtentsToBsdiffPositionsString(
 }
 
 bool DeltaPerformer::PerformDiffOperation(const InstallOperation& operation,
+                                          const void* data,
+                                          size_t count,
                                           ErrorCode* error) {
-  // Since we delete data off the beginning of the buffer as we use it,
-  // the data we need should be exactly at the beginning of the buffer.
+  // Since we drop data as we use it, the data we need should start exactly at
+  // the current offset.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(count >= operation.data_length());
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
 
-  TEST_AND_RETURN_FALSE(partition_writer_->PerformDiffOperation(
-      operation, error, buffer_.data(), buffer_.size()));
-  DiscardBuffer(true, buffer_.size());
+  TEST_AND_RETURN_FALSE(
+      partition_writer_->PerformDiffOperation(operation, error, data, count));
+  return true;
+}
+
+bool DeltaPerformer::SubmitToOperationPipeline(
+    const InstallOperation& operation, ErrorCode* error) {
+  // The payload hashes are computed here, in payload order, while the blob is
+  // validated against the operation hash by the worker.
+  brillo::Blob data;
+  HashCalculator::UpdateAll(
+      {&payload_hash_calculator_, &signed_hash_calculator_},
+      buffer_.data(),
+      buffer_.size());
+  buffer_offset_ += buffer_.size();
+  data.swap(buffer_);
+
+  if (!operation_pipeline_->Submit(&operation, std::move(data))) {
+    *error = operation_pipeline_->error();
+    return false;
+  }
+  next_operation_num_++;
+  pipeline_checkpoints_.push_back(CurrentCheckpoint());
+
+  // Drop the states that can't be persisted anymore, as later operations are
+  // already applied.
+  size_t oldest_needed = operation_pipeline_->next_unfinished_op();
+  if (pipeline_barrier_pending_)
+    oldest_needed = min(oldest_needed, pipeline_barrier_op_);
+  while (pipeline_checkpoints_.front().next_operation < oldest_needed) {
+    pipeline_checkpoints_.pop_front();
+  }
+
+  UpdateOverallProgress(false, "Completed ");
+  CheckpointUpdateProgress(false);
   return true;
 }
 
+ErrorCode DeltaPerformer::ApplyPipelinedOperation(
+    size_t worker_index,
+    size_t op_index,
+    const InstallOperation& operation,
+    const brillo::Blob& data) {
+  // Validate the operation unconditionally, see Write().
+  ErrorCode error = ValidateOperationHash(operation, data.data(), op_index);
+  if (error != ErrorCode::kSuccess) {
+    if (install_plan_->hash_checks_mandatory) {
+      LOG(ERROR) << "Mandatory operation hash check failed";
+      return error;
+    }
+    LOG(WARNING) << "Ignoring operation validation errors";
+    error = ErrorCode::kSuccess;
+  }
+
+  PartitionWriterInterface* writer =
+      worker_index == 0 ? partition_writer_.get()
+                        : pipeline_partition_writers_[worker_index - 1].get();
+  base::TimeTicks op_start_time = base::TimeTicks::Now();
+  const bool aligned = (!operation.has_src_length() ||
+                        operation.src_length() % block_size_ == 0) &&
+                       (!operation.has_dst_length() ||
+                        operation.dst_length() % block_size_ == 0);
+  bool op_result{};
+  const string op_name = InstallOperationTypeName(operation.type());
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+      op_result = data.size() >= operation.data_length() &&
+                  writer->PerformReplaceOperation(
+                      operation, data.data(), data.size());
+      OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
+      break;
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      op_result = !operation.has_data_offset() &&
+                  !operation.has_data_length() &&
+                  writer->PerformZeroOrDiscardOperation(operation);
+      OP_DURATION_HISTOGRAM("ZERO_OR_DISCARD", op_start_time);
+      break;
+    case InstallOperation::SOURCE_COPY:
+      op_result =
+          aligned && writer->PerformSourceCopyOperation(operation, &error);
+      OP_DURATION_HISTOGRAM("SOURCE_COPY", op_start_time);
+      break;
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+      op_result = aligned && data.size() >= operation.data_length() &&
+                  writer->PerformDiffOperation(
+                      operation, &error, data.data(), data.size());
+      OP_DURATION_HISTOGRAM(op_name, op_start_time);
+      break;
+    default:
+      op_result = false;
+  }
+  // The partition is only switched once the pipeline is idle.
+  const size_t partition_op_index =
+      op_index -
+      (current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0);
+  op_result = op_result && writer->FinishOperation(partition_op_index);
+  if (!op_result) {
+    LOG(ERROR) << "Failed to perform " << op_name << " operation " << op_index
+               << " in partition \""
+               << partitions_[current_partition_].partition_name() << "\"";
+    if (error == ErrorCode::kSuccess)
+      error = ErrorCode::kDownloadOperationExecutionError;
+  }
+  return error;
+}
+
 bool DeltaPerformer::ExtractSignatureMessage() {
   TEST_AND_RETURN_FALSE(signatures_message_data_.empty());
   TEST_AND_RETURN_FALSE(buffer_offset_ == manifest_.signatures_offset());
@@ -1168,7 +1422,9 @@ ErrorCode DeltaPerformer::CheckTimestampError() const {
 }
 
 ErrorCode DeltaPerformer::ValidateOperationHash(
-    const InstallOperation& operation) {
+    const InstallOperation& operation,
+    const void* data,
+    size_t op_index) const {
   if (!operation.data_sha256_hash().size()) {
     if (!operation.data_length()) {
       // Operations that do not have any data blob won't have any operation
@@ -1191,15 +1447,15 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
     if (manifest_.signatures_offset() &&
         manifest_.signatures_offset() == operation.data_offset()) {
       LOG(INFO) << "Skipping hash verification for signature operation "
-                << next_operation_num_ + 1;
+                << op_index + 1;
     } else {
       if (install_plan_->hash_checks_mandatory) {
         LOG(ERROR) << "Missing mandatory operation hash for operation "
-                   << next_operation_num_ + 1;
+                   << op_index + 1;
         return ErrorCode::kDownloadOperationHashMissingError;
       }
 
-      LOG(WARNING) << "Cannot validate operation " << next_operation_num_ + 1
+      LOG(WARNING) << "Cannot validate operation " << op_index + 1
                    << " as there's no operation hash in manifest";
     }
     return ErrorCode::kSuccess;
@@ -1212,15 +1468,13 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
 
   brillo::Blob calculated_op_hash;
   if (!HashCalculator::RawHashOfBytes(
-          buffer_.data(), operation.data_length(), &calculated_op_hash)) {
-    LOG(ERROR) << "Unable to compute actual hash of operation "
-               << next_operation_num_;
+          data, operation.data_length(), &calculated_op_hash)) {
+    LOG(ERROR) << "Unable to compute actual hash of operation " << op_index;
     return ErrorCode::kDownloadOperationHashVerificationError;
   }
 
   if (calculated_op_hash != expected_op_hash) {
-    LOG(ERROR) << "Hash verification failed for operation "
-               << next_operation_num_
+    LOG(ERROR) << "Hash verification failed for operation " << op_index
                << ". Expected hash = " << HexEncode(expected_op_hash);
     LOG(ERROR) << "Calculated hash over " << operation.data_length()
                << " bytes at offset: " << operation.data_offset() << " = "
@@ -1299,8 +1553,15 @@ void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
     buffer_offset_ += buffer_.size();
 
   // Hash the content.
-  payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
-  signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  if (signed_hash_buffer_size == buffer_.size()) {
+    HashCalculator::UpdateAll(
+        {&payload_hash_calculator_, &signed_hash_calculator_},
+        buffer_.data(),
+        buffer_.size());
+  } else {
+    payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
+    signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  }
 
   // Swap content with an empty vector to ensure that all memory is released.
   brillo::Blob().swap(buffer_);
@@ -1408,8 +1669,108 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   if (!force && !ShouldCheckpoint()) {
     return false;
   }
+  if (operation_pipeline_) {
+    return CheckpointPipelinedUpdateProgress(force);
+  }
   Terminator::set_exit_blocked(true);
-  if (last_updated_operation_num_ != next_operation_num_ || force) {
+  return PersistCheckpoint(CurrentCheckpoint(), force, true);
+}
+
+DeltaPerformer::UpdateCheckpoint DeltaPerformer::CurrentCheckpoint() const {
+  return {next_operation_num_,
+          buffer_offset_,
+          payload_hash_calculator_.GetContext(),
+          signed_hash_calculator_.GetContext()};
+}
+
+DeltaPerformer::UpdateCheckpoint DeltaPerformer::PipelineCheckpoint(
+    size_t next_operation) {
+  if (next_operation == next_operation_num_) {
+    return CurrentCheckpoint();
+  }
+  while (!pipeline_checkpoints_.empty() &&
+         pipeline_checkpoints_.front().next_operation < next_operation) {
+    pipeline_checkpoints_.pop_front();
+  }
+  CHECK(!pipeline_checkpoints_.empty() &&
+        pipeline_checkpoints_.front().next_operation == next_operation)
+      << "Missing the progress state of operation " << next_operation;
+  return pipeline_checkpoints_.front();
+}
+
+bool DeltaPerformer::CheckpointPipelinedUpdateProgress(bool force) {
+  if (force) {
+    // Forced checkpoints happen when opening or closing a partition, or when
+    // closing the performer. Let the queued operations finish, so that the
+    // writers are idle. Failures are reported by Write().
+    operation_pipeline_->Wait();
+    pipeline_barrier_pending_ = false;
+    Terminator::set_exit_blocked(true);
+    return PersistCheckpoint(
+        PipelineCheckpoint(operation_pipeline_->next_unfinished_op()),
+        force,
+        true);
+  }
+
+  // The partition writers can't be checkpointed while the workers use them,
+  // so it's done by a barrier on the workers. Its state is persisted on the
+  // next checkpoint after it ran, without blocking the download.
+  bool persisted = false;
+  if (pipeline_barrier_pending_ && pipeline_barrier_done_) {
+    pipeline_barrier_pending_ = false;
+    if (pipeline_barrier_failed_) {
+      LOG(ERROR) << "Failed to checkpoint the partition writers before "
+                 << "operation " << pipeline_barrier_op_;
+    } else {
+      Terminator::set_exit_blocked(true);
+      persisted = PersistCheckpoint(
+          PipelineCheckpoint(pipeline_barrier_op_), false, false);
+    }
+  }
+  if (!pipeline_barrier_pending_ &&
+      last_updated_operation_num_ != next_operation_num_) {
+    pipeline_barrier_pending_ = true;
+    pipeline_barrier_done_ = false;
+    pipeline_barrier_op_ = next_operation_num_;
+    const size_t partition_operation_num = GetPartitionOperationNum();
+    operation_pipeline_->SubmitBarrier([this, partition_operation_num]() {
+      pipeline_barrier_failed_ =
+          !CheckpointPartitionWriters(partition_operation_num);
+      pipeline_barrier_done_ = true;
+    });
+  }
+  return persisted;
+}
+
+bool DeltaPerformer::CheckpointPartitionWriters(
+    size_t partition_operation_num) {
+  bool success =
+      partition_writer_->CheckpointUpdateProgress(partition_operation_num);
+  for (auto& writer : pipeline_partition_writers_) {
+    success =
+        writer->CheckpointUpdateProgress(partition_operation_num) && success;
+  }
+  return success;
+}
+
+bool DeltaPerformer::PersistCheckpoint(const UpdateCheckpoint& checkpoint,
+                                       bool force,
+                                       bool checkpoint_writers) {
+  // Commit all the keys at once, so that a resumed update never sees parts of
+  // two checkpoints, and they are synced to disk only once.
+  TEST_AND_RETURN_FALSE(prefs_->StartTransaction());
+  if (!WriteCheckpoint(checkpoint, force, checkpoint_writers)) {
+    prefs_->CancelTransaction();
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(prefs_->SubmitTransaction());
+  return true;
+}
+
+bool DeltaPerformer::WriteCheckpoint(const UpdateCheckpoint& checkpoint,
+                                     bool force,
+                                     bool checkpoint_writers) {
+  if (last_updated_operation_num_ != checkpoint.next_operation || force) {
     // Resets the progress in case we die in the middle of the state update.
     ResetUpdateProgress(prefs_, true);
     if (!signatures_message_data_.empty()) {
@@ -1427,22 +1788,22 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
                                 signatures_message_data_))
           << "Unable to store the signature blob.";
     }
-    TEST_AND_RETURN_FALSE(prefs_->SetString(
-        kPrefsUpdateStateSHA256Context, payload_hash_calculator_.GetContext()));
+    TEST_AND_RETURN_FALSE(prefs_->SetString(kPrefsUpdateStateSHA256Context,
+                                            checkpoint.sha256_context));
     TEST_AND_RETURN_FALSE(
         prefs_->SetString(kPrefsUpdateStateSignedSHA256Context,
-                          signed_hash_calculator_.GetContext()));
-    TEST_AND_RETURN_FALSE(
-        prefs_->SetInt64(kPrefsUpdateStateNextDataOffset, buffer_offset_));
-    last_updated_operation_num_ = next_operation_num_;
+                          checkpoint.signed_sha256_context));
+    TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextDataOffset,
+                                           checkpoint.next_data_offset));
 
-    if (next_operation_num_ < num_total_operations_) {
+    if (checkpoint.next_operation < num_total_operations_) {
       size_t partition_index = current_partition_;
-      while (next_operation_num_ >= acc_num_operations_[partition_index]) {
+      while (checkpoint.next_operation >=
+             acc_num_operations_[partition_index]) {
         partition_index++;
       }
       const size_t partition_operation_num =
-          next_operation_num_ -
+          checkpoint.next_operation -
           (partition_index ? acc_num_operations_[partition_index - 1] : 0);
       const InstallOperation& op =
           partitions_[partition_index].operations(partition_operation_num);
@@ -1452,17 +1813,23 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
       TEST_AND_RETURN_FALSE(
           prefs_->SetInt64(kPrefsUpdateStateNextDataLength, 0));
     }
-    if (partition_writer_) {
-      partition_writer_->CheckpointUpdateProgress(GetPartitionOperationNum());
-    } else {
-      CHECK_EQ(next_operation_num_, num_total_operations_)
+    if (checkpoint_writers && partition_writer_) {
+      const size_t partition_operation_num =
+          checkpoint.next_operation -
+          (current_partition_ ? acc_num_operations_[current_partition_ - 1]
+                              : 0);
+      TEST_AND_RETURN_FALSE(
+          CheckpointPartitionWriters(partition_operation_num));
+    } else if (checkpoint_writers) {
+      CHECK_EQ(checkpoint.next_operation, num_total_operations_)
           << "Partition writer is null, we are expected to finish all "
              "operations: "
-          << next_operation_num_ << "/" << num_total_operations_;
+          << checkpoint.next_operation << "/" << num_total_operations_;
     }
+    last_updated_operation_num_ = checkpoint.next_operation;
   }
-  TEST_AND_RETURN_FALSE(
-      prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
+  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStateNextOperation,
+                                         checkpoint.next_operation));
   return true;
 }
 
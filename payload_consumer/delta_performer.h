@@ -19,6 +19,8 @@
 
 #include <inttypes.h>
 
+#include <atomic>
+#include <deque>
 #include <limits>
 #include <memory>
 #include <string>
@@ -33,6 +35,7 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/platform_constants.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/install_operation_pipeline.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
@@ -63,6 +66,12 @@ class DeltaPerformer : public FileWriter {
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
   static const uint64_t kCheckpointFrequencySeconds;
+  // Limits of the pipelined apply mode: the maximum number of worker threads
+  // per partition, and how many operations and bytes of operation data may
+  // be downloaded ahead of the operations being applied.
+  static const size_t kMaxPipelinedApplyThreads;
+  static const size_t kPipelineMaxPendingOps;
+  static const size_t kPipelineMaxPendingBytes;
 
   DeltaPerformer(
       PrefsInterface* prefs,
@@ -111,6 +120,10 @@ class DeltaPerformer : public FileWriter {
   // Returns |true| only if the manifest has been processed and it's valid.
   bool IsManifestValid();
 
+  // Returns whether the operations applied in the background can't take more
+  // work for now, in which case Write() may block until some are done.
+  virtual bool IsOperationPipelineFull() const;
+
   // Verifies the downloaded payload against the signed hash included in the
   // payload, against the update check hash and size using the public key and
   // returns ErrorCode::kSuccess on success, an error code on failure.
@@ -209,6 +222,14 @@ class DeltaPerformer : public FileWriter {
   FRIEND_TEST(DeltaPerformerTest, BrilloParsePayloadMetadataTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
 
+  // The progress state persisted by CheckpointUpdateProgress().
+  struct UpdateCheckpoint {
+    size_t next_operation{0};
+    uint64_t next_data_offset{0};
+    std::string sha256_context;
+    std::string signed_sha256_context;
+  };
+
   // Obtain the operation index for current partition. If all operations for
   // current partition is are finished, return # of operations. This is mostly
   // intended to be used by CheckpointUpdateProgress, where partition writer
@@ -232,6 +253,11 @@ class DeltaPerformer : public FileWriter {
                       const char* op_type_name,
                       ErrorCode* error);
 
+  // Returns the number of operations applied so far. With the operation
+  // pipeline, operations submitted but not yet applied by the workers don't
+  // count.
+  size_t NumAppliedOperations() const;
+
   // Logs the progress of downloading/applying an update.
   void LogProgress(const char* message_prefix);
 
@@ -246,22 +272,29 @@ class DeltaPerformer : public FileWriter {
   // false otherwise.
   ErrorCode ValidateManifest();
 
-  // Validates that the hash of the blobs corresponding to the given |operation|
+  // Validates that the hash of the blob |data| of the |op_index|-th operation
   // matches what's specified in the manifest in the payload.
   // Returns ErrorCode::kSuccess on match or a suitable error code otherwise.
-  ErrorCode ValidateOperationHash(const InstallOperation& operation);
+  ErrorCode ValidateOperationHash(const InstallOperation& operation,
+                                  const void* data,
+                                  size_t op_index) const;
 
   // Returns true on success.
   bool PerformInstallOperation(const InstallOperation& operation);
 
   // These perform a specific type of operation and return true on success.
   // |error| will be set if source hash mismatch, otherwise |error| might not be
-  // set even if it fails.
-  bool PerformReplaceOperation(const InstallOperation& operation);
+  // set even if it fails. |data| holds the |count| bytes of the blob of the
+  // operation, if any.
+  bool PerformReplaceOperation(const InstallOperation& operation,
+                               const void* data,
+                               size_t count);
   bool PerformZeroOrDiscardOperation(const InstallOperation& operation);
   bool PerformSourceCopyOperation(const InstallOperation& operation,
                                   ErrorCode* error);
   bool PerformDiffOperation(const InstallOperation& operation,
+                            const void* data,
+                            size_t count,
                             ErrorCode* error);
 
   // Extracts the payload signature message from the current |buffer_| if the
@@ -276,6 +309,56 @@ class DeltaPerformer : public FileWriter {
   // accordingly.
   void DiscardBuffer(bool do_advance_offset, size_t signed_hash_buffer_size);
 
+  // Returns the progress state of the operations applied so far.
+  UpdateCheckpoint CurrentCheckpoint() const;
+
+  // Checkpoints |partition_writer_| and |pipeline_partition_writers_| before
+  // the |partition_operation_num|-th operation of the partition. Returns false
+  // if any of them failed.
+  bool CheckpointPartitionWriters(size_t partition_operation_num);
+
+  // Writes |checkpoint| to the prefs in a single transaction. Also checkpoints
+  // the partition writers if |checkpoint_writers|.
+  bool PersistCheckpoint(const UpdateCheckpoint& checkpoint,
+                         bool force,
+                         bool checkpoint_writers);
+
+  // Does the work of PersistCheckpoint() within its transaction.
+  bool WriteCheckpoint(const UpdateCheckpoint& checkpoint,
+                       bool force,
+                       bool checkpoint_writers);
+
+  // Starts |num_workers| threads applying the operations of the current
+  // partition in the pipelined apply mode. Creates one more partition writer
+  // per extra worker, initialized the same way as |partition_writer_|.
+  bool StartOperationPipeline(const PartitionUpdate& partition_update,
+                              const InstallPlan::Partition& install_part,
+                              bool source_may_exist,
+                              size_t num_workers);
+
+  // Waits for the operations queued in |operation_pipeline_|. Returns false
+  // and sets |error| if any of them failed.
+  bool WaitForOperationPipeline(ErrorCode* error);
+
+  // Hands |operation|, whose data is in |buffer_|, to |operation_pipeline_|.
+  bool SubmitToOperationPipeline(const InstallOperation& operation,
+                                 ErrorCode* error);
+
+  // Validates and applies |operation| on the pipeline worker |worker_index|.
+  ErrorCode ApplyPipelinedOperation(size_t worker_index,
+                                    size_t op_index,
+                                    const InstallOperation& operation,
+                                    const brillo::Blob& data);
+
+  // Returns the progress state recorded when every operation before
+  // |next_operation| had been submitted to |operation_pipeline_|.
+  UpdateCheckpoint PipelineCheckpoint(size_t next_operation);
+
+  // CheckpointUpdateProgress() for the pipelined apply mode. Operations are
+  // applied behind the download, so only the state up to the last operation
+  // known to be applied is persisted.
+  bool CheckpointPipelinedUpdateProgress(bool force);
+
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
   // update. Returns false otherwise.
@@ -422,6 +505,26 @@ class DeltaPerformer : public FileWriter {
 
   std::unique_ptr<PartitionWriterInterface> partition_writer_;
 
+  // Worker threads applying the operations of the current partition, when
+  // |install_plan_->pipelined_apply_threads| is set. The first worker uses
+  // |partition_writer_|, and the i-th extra worker uses
+  // |pipeline_partition_writers_[i - 1]|.
+  std::unique_ptr<InstallOperationPipeline> operation_pipeline_;
+  std::vector<std::unique_ptr<PartitionWriterInterface>>
+      pipeline_partition_writers_;
+  // The progress state after submitting each operation to
+  // |operation_pipeline_|, starting with the state when it was created. Older
+  // entries are dropped once the matching operations are applied.
+  std::deque<UpdateCheckpoint> pipeline_checkpoints_;
+  // Whether a barrier checkpointing the partition writers before operation
+  // |pipeline_barrier_op_| was queued, and whether it ran.
+  bool pipeline_barrier_pending_{false};
+  size_t pipeline_barrier_op_{0};
+  std::atomic<bool> pipeline_barrier_done_{false};
+  // Whether the partition writers failed to checkpoint in the last barrier.
+  // Written by the barrier before |pipeline_barrier_done_|.
+  bool pipeline_barrier_failed_{false};
+
   DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
 };
 
@@ -1175,8 +1175,10 @@ TEST_F(DeltaPerformerTest, SetNextOpIndex) {
   Sequence seq;
   std::vector<size_t> indices;
   EXPECT_CALL(writer1, CheckpointUpdateProgress(_))
-      .WillRepeatedly(
-          [&indices](size_t index) mutable { indices.emplace_back(index); });
+      .WillRepeatedly([&indices](size_t index) mutable {
+        indices.emplace_back(index);
+        return true;
+      });
   EXPECT_CALL(writer1, Init(_, true, _)).Times(1).WillOnce(Return(true));
   EXPECT_CALL(writer1, PerformSourceCopyOperation(_, _))
       .Times(2)
@@ -1197,4 +1199,68 @@ TEST_F(DeltaPerformerTest, SetNextOpIndex) {
   ASSERT_EQ(indices[indices.size() - 1], 2UL);
 }
 
+TEST_F(DeltaPerformerTest, FailedWriterCheckpointIsNotPersisted) {
+  // Records the next operations persisted.
+  class NextOperationObserver : public PrefsInterface::ObserverInterface {
+   public:
+    explicit NextOperationObserver(PrefsInterface* prefs) : prefs_(prefs) {}
+    void OnPrefSet(std::string_view key) override {
+      int64_t value{};
+      if (prefs_->GetInt64(key, &value) && value >= 0)
+        values_.push_back(value);
+    }
+    void OnPrefDeleted(std::string_view key) override {}
+
+    PrefsInterface* prefs_;
+    std::vector<int64_t> values_;
+  };
+
+  TestDeltaPerformer delta_performer{&prefs_,
+                                     &fake_boot_control_,
+                                     &fake_hardware_,
+                                     &mock_delegate_,
+                                     &install_plan_,
+                                     &payload_,
+                                     false};
+  brillo::Blob expected_data(std::begin(kRandomString),
+                             std::end(kRandomString));
+  expected_data.resize(4096 * 2);  // block size
+
+  ScopedTempFile source("Source-XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileVector(source.path(), expected_data));
+
+  PartitionConfig old_part(kPartitionNameRoot);
+  old_part.path = source.path();
+  old_part.size = expected_data.size();
+
+  delta_performer.partition_writers_[kPartitionNameRoot] =
+      std::make_unique<MockPartitionWriter>();
+  auto& writer1 = *delta_performer.partition_writers_[kPartitionNameRoot];
+
+  // The data written by the first operation never reaches the disk.
+  EXPECT_CALL(writer1, CheckpointUpdateProgress(_))
+      .WillRepeatedly([](size_t index) { return index == 0; });
+  EXPECT_CALL(writer1, Init(_, true, _)).Times(1).WillOnce(Return(true));
+  EXPECT_CALL(writer1, PerformSourceCopyOperation(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+
+  brillo::Blob payload_data = GeneratePayload(
+      brillo::Blob(),
+      {GetSourceCopyOp(0, 0, expected_data.data(), 4096),
+       GetSourceCopyOp(1, 1, expected_data.data() + 4096, 4096)},
+      false,
+      &old_part);
+
+  NextOperationObserver observer{&prefs_};
+  prefs_.AddObserver(kPrefsUpdateStateNextOperation, &observer);
+  ApplyPayloadToData(&delta_performer, payload_data, source.path(), {}, true);
+  prefs_.RemoveObserver(kPrefsUpdateStateNextOperation, &observer);
+
+  // The progress is never persisted past the first operation while the
+  // writer is open.
+  EXPECT_THAT(observer.values_, testing::Contains(0));
+  EXPECT_THAT(observer.values_, testing::Not(testing::Contains(1)));
+}
+
 }  // namespace chromeos_update_engine
@@ -55,7 +55,9 @@ class ExtentMap {
   std::optional<T> Get(const Extent& extent) const {
     const auto it = map_.find(extent);
     if (it == map_.end()) {
-      for (const auto& ext : set_.GetCandidateRange(extent)) {
+      for (const auto& interval : set_.GetCandidateRange(extent)) {
+        const Extent ext =
+            ExtentForRange(interval.start_block, interval.num_blocks);
         // Sometimes there are operations like
         // map.AddExtent({0, 5}, 42);
         // map.Get({2, 1})
@@ -99,7 +101,7 @@ class ExtentMap {
  private:
   // Get a range of exents that potentially intersect with parameter |extent|
   std::map<Extent, T, Comparator> map_;
-  ExtentRanges set_{false};
+  FlatExtentRanges set_{false};
 };
 }  // namespace chromeos_update_engine
 
@@ -67,6 +67,10 @@ bool DirectExtentReader::Seek(uint64_t offset) {
 bool DirectExtentReader::Read(void* buffer, size_t count) {
   auto bytes = reinterpret_cast<uint8_t*>(buffer);
   uint64_t bytes_read = 0;
+  // Collect the pieces of all the extents covered by this read, so that the
+  // file descriptor can read them in one batch.
+  std::vector<struct iovec> iov;
+  std::vector<off64_t> offsets;
   while (bytes_read < count) {
     if (cur_extent_ == extents_.end()) {
       TEST_AND_RETURN_FALSE(bytes_read == count);
@@ -76,15 +80,9 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
     uint64_t bytes_to_read =
         std::min(count - bytes_read, cur_extent_bytes_left);
 
-    ssize_t out_bytes_read;
-    TEST_AND_RETURN_FALSE(utils::ReadAll(
-        fd_,
-        bytes + bytes_read,
-        bytes_to_read,
-        cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_,
-        &out_bytes_read));
-    TEST_AND_RETURN_FALSE(out_bytes_read ==
-                          static_cast<ssize_t>(bytes_to_read));
+    iov.push_back({bytes + bytes_read, static_cast<size_t>(bytes_to_read)});
+    offsets.push_back(cur_extent_->start_block() * block_size_ +
+                      cur_extent_bytes_read_);
 
     bytes_read += bytes_to_read;
     cur_extent_bytes_read_ += bytes_to_read;
@@ -95,7 +93,7 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
       cur_extent_bytes_read_ = 0;
     }
   }
-  return true;
+  return fd_->ReadScattered(iov.data(), offsets.data(), iov.size());
 }
 
 }  // namespace chromeos_update_engine
@@ -29,6 +29,18 @@
 
 namespace chromeos_update_engine {
 
+bool FileDescriptor::ReadScattered(const struct iovec* iov,
+                                   const off64_t* offsets,
+                                   size_t iovcnt) {
+  for (size_t i = 0; i < iovcnt; i++) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::ReadAll(
+        this, iov[i].iov_base, iov[i].iov_len, offsets[i], &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(iov[i].iov_len));
+  }
+  return true;
+}
+
 EintrSafeFileDescriptor::~EintrSafeFileDescriptor() {
   if (IsOpen()) {
     Close();
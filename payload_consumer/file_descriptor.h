@@ -19,6 +19,7 @@
 
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <memory>
 
 #include <base/macros.h>
@@ -67,6 +68,15 @@ class FileDescriptor {
   // no bytes were written. Specific implementations may set errno accordingly.
   virtual ssize_t Write(const void* buf, size_t count) = 0;
 
+  // Fills each of the |iovcnt| buffers in |iov| with the data found at the
+  // matching entry of |offsets|. Returns true only if all the buffers were
+  // filled completely. The file offset is undefined afterwards.
+  // Implementations may issue the reads concurrently; the default one seeks
+  // and reads each buffer in turn.
+  virtual bool ReadScattered(const struct iovec* iov,
+                             const off64_t* offsets,
+                             size_t iovcnt);
+
   // Seeks to an offset. Returns the resulting offset location as measured in
   // bytes from the beginning. On error, return -1. Specific implementations
   // may set errno accordingly.
@@ -82,9 +82,15 @@ namespace {
 const off_t kReadFileBufferSize = 128 * 1024;
 constexpr float kVerityProgressPercent = 0.3;
 constexpr float kEncodeFECPercent = 0.3;
+// How often the progress of the partitions verified in parallel is checked.
+constexpr int kParallelHashingPollIntervalMs = 100;
 
 }  // namespace
 
+FilesystemVerifierAction::~FilesystemVerifierAction() {
+  StopVerifyWorkers();
+}
+
 void FilesystemVerifierAction::PerformAction() {
   // Will tell the ActionProcessor we've failed if we return.
   ScopedActionCompleter abort_action_completer(processor_, this);
@@ -123,7 +129,11 @@ void FilesystemVerifierAction::PerformAction() {
       !install_plan_.write_verity) {
     dynamic_control_->MapAllPartitions();
   }
-  StartPartitionHashing();
+  if (install_plan_.verify_threads > 0) {
+    StartParallelHashing();
+  } else {
+    StartPartitionHashing();
+  }
   abort_action_completer.set_should_complete(false);
 }
 
@@ -133,6 +143,10 @@ void FilesystemVerifierAction::TerminateProcessing() {
 }
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
+  // The workers must be done with the partitions before they are unmapped.
+  StopVerifyWorkers();
+  jobs_.clear();
+  pending_jobs_.clear();
   partition_fd_.reset();
   // This memory is not used anymore.
   buffer_.clear();
@@ -241,7 +255,12 @@ void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
         return;
       }
     }
-    HashPartition(0, partition_size_, buffer, buffer_size);
+    // The data before the hash tree was hashed already, unless it has to be
+    // read again through snapuserd.
+    HashPartition(hash_data_with_verity_ ? filesystem_data_end_ : 0,
+                  partition_size_,
+                  buffer,
+                  buffer_size);
     return;
   }
   if (!verity_writer_->IncrementalFinalize(fd, fd)) {
@@ -294,6 +313,11 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
     Cleanup(ErrorCode::kVerityCalculationError);
     return;
   }
+  if (hash_data_with_verity_ && !hasher_->Update(buffer, read_size)) {
+    LOG(ERROR) << "Hasher updated failed on offset" << start_offset;
+    Cleanup(ErrorCode::kFilesystemVerifierError);
+    return;
+  }
   UpdatePartitionProgress((start_offset + bytes_read) * 1.0f / partition_size_ *
                           kVerityProgressPercent);
   CHECK(pending_task_id_.PostTask(
@@ -414,17 +438,11 @@ void FilesystemVerifierAction::StartPartitionHashing() {
   hasher_ = std::make_unique<HashCalculator>();
 
   offset_ = 0;
-  filesystem_data_end_ = partition_size_;
-  if (partition.fec_offset > 0) {
-    CHECK_LE(partition.hash_tree_offset, partition.fec_offset)
-        << " Hash tree is expected to come before FEC data";
-  }
   CHECK_NE(partition_fd_, nullptr);
-  if (partition.hash_tree_offset != 0) {
-    filesystem_data_end_ = partition.hash_tree_offset;
-  } else if (partition.fec_offset != 0) {
-    filesystem_data_end_ = partition.fec_offset;
-  }
+  filesystem_data_end_ = GetFilesystemDataEnd();
+  // With VABC, the partition is read through the COW writer to write verity,
+  // and has to be hashed through snapuserd afterwards.
+  hash_data_with_verity_ = ShouldWriteVerity() && !IsVABC(partition);
   if (ShouldWriteVerity()) {
     LOG(INFO) << "Verity writes enabled on partition " << partition.name;
     if (!verity_writer_->Init(partition)) {
@@ -474,6 +492,21 @@ size_t FilesystemVerifierAction::GetPartitionSize() const {
   }
 }
 
+uint64_t FilesystemVerifierAction::GetFilesystemDataEnd() const {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  if (partition.fec_offset > 0) {
+    CHECK_LE(partition.hash_tree_offset, partition.fec_offset)
+        << " Hash tree is expected to come before FEC data";
+  }
+  if (partition.hash_tree_offset != 0) {
+    return partition.hash_tree_offset;
+  } else if (partition.fec_offset != 0) {
+    return partition.fec_offset;
+  }
+  return partition_size_;
+}
+
 bool FilesystemVerifierAction::ShouldWriteVerity() {
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
@@ -558,4 +591,302 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
   StartPartitionHashing();
 }
 
+void FilesystemVerifierAction::StartParallelHashing() {
+  LOG(INFO) << "Verifying " << install_plan_.partitions.size()
+            << " partitions on " << install_plan_.verify_threads
+            << " threads.";
+  jobs_.clear();
+  pending_jobs_.clear();
+  for (partition_index_ = 0;
+       partition_index_ < install_plan_.partitions.size();
+       partition_index_++) {
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[partition_index_];
+    const auto& part_path = GetPartitionPath();
+    partition_size_ = GetPartitionSize();
+    const bool write_verity = ShouldWriteVerity();
+
+    auto job = std::make_unique<PartitionJob>();
+    job->partition_index = partition_index_;
+    job->partition_size = partition_size_;
+    job->filesystem_data_end = GetFilesystemDataEnd();
+    // As when verifying one partition at a time, a partition of a VABC update
+    // is hashed through snapuserd after writing verity, see
+    // InitializeFdVABC().
+    job->hash_after_remap = IsVABC(partition) && install_plan_.write_verity;
+    job->hash_progress_start =
+        write_verity ? kVerityProgressPercent + kEncodeFECPercent : 0;
+    if (job->hash_after_remap && !write_verity) {
+      // There is nothing to do until the partitions are remapped.
+      jobs_.push_back(std::move(job));
+      continue;
+    }
+
+    LOG(INFO) << "Hashing partition " << partition_index_ << " ("
+              << partition.name << ") on device " << part_path;
+    auto success = false;
+    if (IsVABC(partition)) {
+      success = InitializeFdVABC(write_verity);
+    } else {
+      if (part_path.empty()) {
+        if (partition_size_ == 0) {
+          LOG(INFO) << "Skip hashing partition " << partition_index_ << " ("
+                    << partition.name << ") because size is 0.";
+          continue;
+        }
+        LOG(ERROR) << "Cannot hash partition " << partition_index_ << " ("
+                   << partition.name
+                   << ") because its device path cannot be determined.";
+        Cleanup(ErrorCode::kFilesystemVerifierError);
+        return;
+      }
+      success = InitializeFd(part_path);
+    }
+    if (!success) {
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    job->fd = std::move(partition_fd_);
+    if (write_verity) {
+      LOG(INFO) << "Verity writes enabled on partition " << partition.name;
+      job->verity_writer = verity_writer::CreateVerityWriter();
+      if (!job->verity_writer->Init(partition)) {
+        LOG(ERROR) << "Failed to initialize verity writes on partition "
+                   << partition.name;
+        Cleanup(ErrorCode::kVerityCalculationError);
+        return;
+      }
+    }
+    pending_jobs_.push_back(job.get());
+    jobs_.push_back(std::move(job));
+  }
+  StartVerifyWorkers();
+  CheckParallelHashing();
+}
+
+void FilesystemVerifierAction::StartVerifyWorkers() {
+  CHECK(workers_.empty());
+  next_job_ = 0;
+  stop_workers_ = false;
+  const size_t num_workers = std::min<size_t>(install_plan_.verify_threads,
+                                              pending_jobs_.size());
+  running_workers_ = num_workers;
+  for (size_t i = 0; i < num_workers; i++)
+    workers_.emplace_back(&FilesystemVerifierAction::RunVerifyWorker, this);
+}
+
+void FilesystemVerifierAction::StopVerifyWorkers() {
+  stop_workers_ = true;
+  for (auto& worker : workers_)
+    worker.join();
+  workers_.clear();
+}
+
+void FilesystemVerifierAction::RunVerifyWorker() {
+  for (size_t i = next_job_++; i < pending_jobs_.size() && !stop_workers_;
+       i = next_job_++) {
+    if (!VerifyPartitionJob(pending_jobs_[i]))
+      stop_workers_ = true;
+  }
+  running_workers_--;
+}
+
+bool FilesystemVerifierAction::VerifyPartitionJob(PartitionJob* job) {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[job->partition_index];
+  brillo::Blob buffer(kReadFileBufferSize);
+  HashCalculator hasher;
+
+  // Reads [start_offset, end_offset) of the partition in chunks passed to
+  // |process|, moving the progress from |progress_start| to |progress_end|
+  // over the whole partition.
+  auto read_partition =
+      [&](uint64_t start_offset,
+          uint64_t end_offset,
+          double progress_start,
+          double progress_end,
+          const std::function<bool(uint64_t, size_t)>& process) {
+        for (uint64_t offset = start_offset; offset < end_offset;) {
+          if (stop_workers_)
+            return false;
+          if (job->fd->Seek(offset, SEEK_SET) != static_cast<off64_t>(offset)) {
+            PLOG(ERROR) << "Failed to seek to offset " << offset << " of "
+                        << partition.name;
+            return false;
+          }
+          const auto read_size =
+              std::min<size_t>(buffer.size(), end_offset - offset);
+          const auto bytes_read = job->fd->Read(buffer.data(), read_size);
+          if (bytes_read < 0 || static_cast<size_t>(bytes_read) != read_size) {
+            PLOG(ERROR) << "Failed to read offset " << offset << " of "
+                        << partition.name << " expected " << read_size
+                        << " bytes, actual: " << bytes_read;
+            return false;
+          }
+          if (!process(offset, read_size))
+            return false;
+          offset += read_size;
+          job->progress = progress_start + (progress_end - progress_start) *
+                                               offset / job->partition_size;
+        }
+        return true;
+      };
+  // Failures caused by stopping the workers are not errors of the partition.
+  auto fail = [&](ErrorCode code) {
+    if (!stop_workers_)
+      job->error = code;
+    return false;
+  };
+
+  uint64_t hash_start_offset = 0;
+  if (job->verity_writer) {
+    // The filesystem data is hashed while it's read, unless it has to be read
+    // again through snapuserd.
+    const bool hash_data = !job->hash_after_remap;
+    if (!read_partition(0,
+                        job->filesystem_data_end,
+                        0,
+                        kVerityProgressPercent,
+                        [&](uint64_t offset, size_t size) {
+                          if (!job->verity_writer->Update(
+                                  offset, buffer.data(), size)) {
+                            LOG(ERROR) << "VerityWriter::Update() failed";
+                            return false;
+                          }
+                          return !hash_data ||
+                                 hasher.Update(buffer.data(), size);
+                        })) {
+      return fail(ErrorCode::kVerityCalculationError);
+    }
+    while (!job->verity_writer->FECFinished()) {
+      if (stop_workers_)
+        return false;
+      if (!job->verity_writer->IncrementalFinalize(job->fd.get(),
+                                                   job->fd.get())) {
+        LOG(ERROR) << "Failed to write verity data of " << partition.name;
+        return fail(ErrorCode::kVerityCalculationError);
+      }
+      job->progress = kVerityProgressPercent +
+                      job->verity_writer->GetProgress() * kEncodeFECPercent;
+    }
+    if (job->hash_after_remap)
+      return true;
+    hash_start_offset = job->filesystem_data_end;
+  }
+  if (!read_partition(hash_start_offset,
+                      job->partition_size,
+                      job->hash_progress_start,
+                      1.0,
+                      [&](uint64_t offset, size_t size) {
+                        return hasher.Update(buffer.data(), size);
+                      })) {
+    return fail(ErrorCode::kFilesystemVerifierError);
+  }
+  if (!hasher.Finalize()) {
+    LOG(ERROR) << "Unable to finalize the hash of " << partition.name;
+    return fail(ErrorCode::kError);
+  }
+  job->hash = hasher.raw_hash();
+  return true;
+}
+
+void FilesystemVerifierAction::CheckParallelHashing() {
+  if (cancelled_)
+    return;
+  // Weight the progress of each partition like UpdatePartitionProgress().
+  double progress = 0;
+  for (const auto& job : jobs_) {
+    const size_t index = job->partition_index;
+    progress += (partition_weight_[index + 1] - partition_weight_[index]) *
+                job->progress;
+  }
+  UpdateProgress(progress / partition_weight_.back());
+
+  if (running_workers_ > 0) {
+    CHECK(pending_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&FilesystemVerifierAction::CheckParallelHashing,
+                       base::Unretained(this)),
+        base::TimeDelta::FromMilliseconds(kParallelHashingPollIntervalMs)));
+    return;
+  }
+  StopVerifyWorkers();
+  for (const PartitionJob* job : pending_jobs_) {
+    if (job->error != ErrorCode::kSuccess) {
+      Cleanup(job->error);
+      return;
+    }
+  }
+  pending_jobs_.clear();
+  for (const auto& job : jobs_) {
+    if (job->hash_after_remap) {
+      StartRemappedHashing();
+      return;
+    }
+  }
+  FinishParallelHashing();
+}
+
+void FilesystemVerifierAction::StartRemappedHashing() {
+  // All the fds have to be closed before remapping the partitions.
+  for (const auto& job : jobs_) {
+    if (job->fd) {
+      job->fd->Close();
+      job->fd.reset();
+    }
+  }
+  // Respin snapuserd so that it sees the verity data written.
+  dynamic_control_->UnmapAllPartitions();
+  dynamic_control_->MapAllPartitions();
+
+  for (const auto& job : jobs_) {
+    if (!job->hash_after_remap)
+      continue;
+    partition_index_ = job->partition_index;
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[partition_index_];
+    LOG(INFO) << "Hashing partition " << partition_index_ << " ("
+              << partition.name << ") on device "
+              << partition.readonly_target_path;
+    if (!InitializeFd(partition.readonly_target_path)) {
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    job->fd = std::move(partition_fd_);
+    job->verity_writer.reset();
+    job->hash_after_remap = false;
+    pending_jobs_.push_back(job.get());
+  }
+  StartVerifyWorkers();
+  CheckParallelHashing();
+}
+
+void FilesystemVerifierAction::FinishParallelHashing() {
+  for (const auto& job : jobs_) {
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[job->partition_index];
+    LOG(INFO) << "Hash of " << partition.name << ": " << HexEncode(job->hash);
+    if (partition.target_hash == job->hash)
+      continue;
+    LOG(ERROR) << "New '" << partition.name
+               << "' partition verification failed.";
+    if (partition.source_hash.empty()) {
+      // No need to verify source if it is a full payload.
+      Cleanup(ErrorCode::kNewRootfsVerificationError);
+      return;
+    }
+    // Check whether the source partition is the cause of the mismatch, the
+    // same way FinishPartitionHashing() does.
+    partition_index_ = job->partition_index;
+    jobs_.clear();
+    verifier_step_ = VerifierStep::kVerifySourceHash;
+    StartPartitionHashing();
+    return;
+  }
+  jobs_.clear();
+  // Verifies the untouched partitions, if any, and finishes the action.
+  partition_index_ = install_plan_.partitions.size();
+  StartPartitionHashing();
+}
+
 }  // namespace chromeos_update_engine
@@ -20,8 +20,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -67,7 +69,7 @@ class FilesystemVerifierAction : public InstallPlanAction {
     CHECK(dynamic_control_);
   }
 
-  ~FilesystemVerifierAction() override = default;
+  ~FilesystemVerifierAction() override;
 
   void PerformAction() override;
   void TerminateProcessing() override;
@@ -86,6 +88,28 @@ class FilesystemVerifierAction : public InstallPlanAction {
 
  private:
   friend class FilesystemVerifierActionTestDelegate;
+
+  // A partition verified by the worker pool. The worker owns the job until it
+  // is done with it, except for |progress| which the message loop reads.
+  struct PartitionJob {
+    size_t partition_index{0};
+    std::unique_ptr<FileDescriptor> fd;
+    // Writes the verity data of the partition, if not null.
+    std::unique_ptr<VerityWriterInterface> verity_writer;
+    uint64_t partition_size{0};
+    uint64_t filesystem_data_end{0};
+    // Whether the partition is hashed through snapuserd once the verity data
+    // of all the partitions was written and the partitions were remapped.
+    bool hash_after_remap{false};
+    // The progress the hashing of the partition starts at.
+    double hash_progress_start{0};
+    // The progress of the partition, in range [0, 1].
+    std::atomic<double> progress{0};
+    // Results of the job, once the worker is done with it.
+    ErrorCode error{ErrorCode::kSuccess};
+    brillo::Blob hash;
+  };
+
   // Wrapper function that schedules calls of EncodeFEC. Returns true on success
   void WriteVerityData(FileDescriptor* fd,
                        void* buffer,
@@ -105,12 +129,40 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // remaining to be hashed, it finishes the action.
   void StartPartitionHashing();
 
+  // Starts verifying all the partitions on a pool of
+  // |install_plan_.verify_threads| workers.
+  void StartParallelHashing();
+
+  // Starts the workers verifying the |pending_jobs_|.
+  void StartVerifyWorkers();
+  // Stops and joins the workers, abandoning the jobs in progress.
+  void StopVerifyWorkers();
+  void RunVerifyWorker();
+
+  // Writes the verity data of the partition of |job| and hashes it, on a
+  // worker thread. Returns false and sets the error of |job| on failure.
+  bool VerifyPartitionJob(PartitionJob* job);
+
+  // Reports the progress of the workers until they are done, then starts
+  // the next phase or checks the hashes of the partitions.
+  void CheckParallelHashing();
+
+  // Opens the partitions hashed after remapping them and verifies them.
+  void StartRemappedHashing();
+
+  // Compares the hashes computed by the workers with the expected ones.
+  void FinishParallelHashing();
+
   const std::string& GetPartitionPath() const;
 
   bool IsVABC(const InstallPlan::Partition& partition) const;
 
   size_t GetPartitionSize() const;
 
+  // Returns the end of the filesystem data of the current partition, which is
+  // where its verity data starts if any.
+  uint64_t GetFilesystemDataEnd() const;
+
   // When the read is done, finalize the hash checking of the current partition
   // and continue checking the next one.
   void FinishPartitionHashing();
@@ -169,6 +221,10 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // The end offset of filesystem data, first byte position of hashtree.
   uint64_t filesystem_data_end_{0};
 
+  // Whether the filesystem data is hashed while it's read to write verity, so
+  // that only the verity data is read again to hash it.
+  bool hash_data_with_verity_{false};
+
   // An observer that observes progress updates of this action.
   FilesystemVerifyDelegate* delegate_{};
 
@@ -181,6 +237,19 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // partitions.
   std::vector<size_t> partition_weight_;
 
+  // The partitions verified in parallel, if |install_plan_.verify_threads| is
+  // not 0, and the ones handed to the running workers.
+  std::vector<std::unique_ptr<PartitionJob>> jobs_;
+  std::vector<PartitionJob*> pending_jobs_;
+
+  // The index in |pending_jobs_| of the next job picked up by a worker.
+  std::atomic<size_t> next_job_{0};
+  // The number of workers that didn't run out of jobs yet.
+  std::atomic<size_t> running_workers_{0};
+  // Set to make the workers stop as soon as possible.
+  std::atomic<bool> stop_workers_{false};
+  std::vector<std::thread> workers_;
+
   DISALLOW_COPY_AND_ASSIGN(FilesystemVerifierAction);
 };
 
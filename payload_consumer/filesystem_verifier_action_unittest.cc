@@ -367,6 +367,17 @@ void FilesystemVerifierActionTest::BuildActions(
   BuildActions(install_plan, &dynamic_control_stub_);
 }
 
+class FilesystemVerifierActionProgressDelegate
+    : public FilesystemVerifyDelegate {
+ public:
+  void OnVerifyProgressUpdate(double progress) override {
+    EXPECT_GE(progress, last_progress_);
+    EXPECT_LE(progress, 1.0);
+    last_progress_ = progress;
+  }
+  double last_progress_{0};
+};
+
 class FilesystemVerifierActionTest2Delegate : public ActionProcessorDelegate {
  public:
   void ActionCompleted(ActionProcessor* processor,
@@ -688,4 +699,92 @@ TEST_F(FilesystemVerifierActionTest, VABC_Verity_Target_Mismatch) {
   DoTestVABC(true, true);
 }
 
+TEST_F(FilesystemVerifierActionTest, VABC_Verity_Parallel_Success) {
+  install_plan_.verify_threads = 2;
+  DoTestVABC(false, true);
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelVerifyTest) {
+  for (int i = 0; i < 5; i++) {
+    AddFakePartition(&install_plan_, "part" + std::to_string(i));
+  }
+  install_plan_.verify_threads = 3;
+  auto feeder_action = std::make_unique<ObjectFeederAction<InstallPlan>>();
+  auto verifier_action =
+      std::make_unique<FilesystemVerifierAction>(&dynamic_control_stub_);
+  auto collector_action =
+      std::make_unique<ObjectCollectorAction<InstallPlan>>();
+  feeder_action->set_obj(install_plan_);
+  FilesystemVerifierActionProgressDelegate progress_delegate;
+  verifier_action->set_delegate(&progress_delegate);
+  BondActions(feeder_action.get(), verifier_action.get());
+  BondActions(verifier_action.get(), collector_action.get());
+  processor_.EnqueueAction(std::move(feeder_action));
+  processor_.EnqueueAction(std::move(verifier_action));
+  processor_.EnqueueAction(std::move(collector_action));
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+  EXPECT_EQ(1.0, progress_delegate.last_progress_);
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelVerifyTargetMismatchTest) {
+  for (int i = 0; i < 4; i++) {
+    AddFakePartition(&install_plan_, "part" + std::to_string(i));
+  }
+  // The source partition matches, so the target partition is at fault.
+  install_plan_.partitions[2].target_hash.clear();
+  install_plan_.verify_threads = 2;
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelWriteVerityTest) {
+  auto part = AddFakePartition(&install_plan_);
+  ASSERT_NO_FATAL_FAILURE(SetHashWithVerity(part));
+  install_plan_.write_verity = true;
+  install_plan_.verify_threads = 2;
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+  brillo::Blob actual_hash_tree(hash_tree_size);
+  ssize_t bytes_read = 0;
+  ASSERT_TRUE(utils::PReadAll(target_part_.fd(),
+                              actual_hash_tree.data(),
+                              actual_hash_tree.size(),
+                              HASH_TREE_START_OFFSET,
+                              &bytes_read));
+  ASSERT_EQ(hash_tree_data_, actual_hash_tree);
+}
+
 }  // namespace chromeos_update_engine
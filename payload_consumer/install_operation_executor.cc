@@ -267,12 +267,16 @@ bool InstallOperationExecutor::ExecuteLz4diffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  brillo::Blob src_data;
-
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(
-      source_fd, operation.src_extents(), &src_data, block_size_));
+  // The source data is read one compressed block at a time as the patch needs
+  // it, instead of all at once.
+  DirectExtentReader reader;
+  TEST_AND_RETURN_FALSE(
+      reader.Init(source_fd, operation.src_extents(), block_size_));
   TEST_AND_RETURN_FALSE(Lz4Patch(
-      ToStringView(src_data),
+      [&reader](uint64_t offset, uint8_t* buffer, size_t size) {
+        return reader.Seek(offset) && reader.Read(buffer, size);
+      },
+      utils::BlocksInExtents(operation.src_extents()) * block_size_,
       ToStringView(data, count),
       [writer(writer.get())](const uint8_t* data, size_t size) -> size_t {
         if (!writer->Write(data, size)) {
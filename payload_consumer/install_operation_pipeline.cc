@@ -0,0 +1,213 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/install_operation_pipeline.h"
+
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+bool DstExtentsOverlap(const InstallOperation& a, const InstallOperation& b) {
+  for (const auto& a_ext : a.dst_extents()) {
+    for (const auto& b_ext : b.dst_extents()) {
+      if (ExtentRanges::ExtentsOverlap(a_ext, b_ext)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+InstallOperationPipeline::InstallOperationPipeline(size_t num_workers,
+                                                   size_t first_op_index,
+                                                   size_t max_pending_ops,
+                                                   size_t max_pending_bytes,
+                                                   ExecuteCallback execute)
+    : max_pending_ops_(max_pending_ops),
+      max_pending_bytes_(max_pending_bytes),
+      execute_(std::move(execute)),
+      next_op_index_(first_op_index) {
+  CHECK_GT(num_workers, 0U);
+  CHECK_GT(max_pending_ops_, 0U);
+  workers_.reserve(num_workers);
+  for (size_t i = 0; i < num_workers; i++) {
+    workers_.emplace_back(&InstallOperationPipeline::WorkerLoop, this, i);
+  }
+}
+
+InstallOperationPipeline::~InstallOperationPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  task_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool InstallOperationPipeline::Submit(const InstallOperation* operation,
+                                      brillo::Blob data) {
+  CHECK(operation);
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Always accept a task when nothing is pending, so that a single operation
+  // larger than |max_pending_bytes_| can't stall the pipeline.
+  space_cv_.wait(lock, [this, &data] {
+    return error_ != ErrorCode::kSuccess || pending_.empty() ||
+           (pending_.size() < max_pending_ops_ &&
+            pending_bytes_ + data.size() <= max_pending_bytes_);
+  });
+  if (error_ != ErrorCode::kSuccess) {
+    return false;
+  }
+  pending_bytes_ += data.size();
+  pending_.push_back(Task{next_op_index_++, operation, std::move(data), {}});
+  task_cv_.notify_all();
+  return true;
+}
+
+void InstallOperationPipeline::SubmitBarrier(std::function<void()> callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (error_ != ErrorCode::kSuccess) {
+    return;
+  }
+  pending_.push_back(Task{next_op_index_, nullptr, {}, std::move(callback)});
+  task_cv_.notify_all();
+}
+
+ErrorCode InstallOperationPipeline::Wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  space_cv_.wait(lock, [this] {
+    return pending_.empty() ||
+           (error_ != ErrorCode::kSuccess && num_running_ == 0);
+  });
+  return error_;
+}
+
+size_t InstallOperationPipeline::next_unfinished_op() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.empty() ? next_op_index_ : pending_.front().op_index;
+}
+
+ErrorCode InstallOperationPipeline::error() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return error_;
+}
+
+bool InstallOperationPipeline::IsFull() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return error_ == ErrorCode::kSuccess && !pending_.empty() &&
+         (pending_.size() >= max_pending_ops_ ||
+          pending_bytes_ >= max_pending_bytes_);
+}
+
+std::deque<InstallOperationPipeline::Task>::iterator
+InstallOperationPipeline::NextRunnableTask() {
+  if (error_ != ErrorCode::kSuccess) {
+    return pending_.end();
+  }
+  bool earlier_unfinished = false;
+  for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+    if (it->state == TaskState::kDone) {
+      continue;
+    }
+    if (it->operation == nullptr) {
+      // A barrier waits for everything before it, and blocks everything after
+      // it until it's done.
+      if (it->state == TaskState::kQueued && !earlier_unfinished) {
+        return it;
+      }
+      return pending_.end();
+    }
+    if (it->state == TaskState::kQueued) {
+      bool blocked = false;
+      for (auto prev = pending_.begin(); prev != it && !blocked; ++prev) {
+        blocked = prev->state != TaskState::kDone && prev->operation &&
+                  DstExtentsOverlap(*prev->operation, *it->operation);
+      }
+      if (!blocked) {
+        return it;
+      }
+    }
+    earlier_unfinished = true;
+  }
+  return pending_.end();
+}
+
+void InstallOperationPipeline::PopFinishedTasks() {
+  while (!pending_.empty() && pending_.front().state == TaskState::kDone) {
+    pending_bytes_ -= pending_.front().data.size();
+    pending_.pop_front();
+  }
+}
+
+void InstallOperationPipeline::WorkerLoop(size_t worker_index) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    auto it = pending_.end();
+    task_cv_.wait(lock, [this, &it] {
+      if (shutdown_) {
+        return true;
+      }
+      it = NextRunnableTask();
+      return it != pending_.end();
+    });
+    if (shutdown_) {
+      return;
+    }
+    // References to elements of a deque stay valid while other elements are
+    // pushed at the back or popped from the front, and this task won't be
+    // popped before it's marked as done.
+    Task* task = &*it;
+    task->state = TaskState::kRunning;
+    num_running_++;
+    lock.unlock();
+
+    ErrorCode result = ErrorCode::kSuccess;
+    if (task->operation) {
+      result =
+          execute_(worker_index, task->op_index, *task->operation, task->data);
+    } else {
+      task->barrier();
+    }
+
+    lock.lock();
+    num_running_--;
+    if (result == ErrorCode::kSuccess) {
+      task->state = TaskState::kDone;
+    } else {
+      task->state = TaskState::kFailed;
+      LOG(ERROR) << "Operation " << task->op_index
+                 << " failed, stopping the install operation pipeline.";
+      if (error_ == ErrorCode::kSuccess) {
+        error_ = result;
+      }
+    }
+    PopFinishedTasks();
+    task_cv_.notify_all();
+    space_cv_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
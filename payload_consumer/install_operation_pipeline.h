@@ -0,0 +1,154 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_PIPELINE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_PIPELINE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/error_code.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Applies the InstallOperations of a single partition on a pool of worker
+// threads, so that the download thread can keep receiving data while
+// operations are being patched and written.
+//
+// Operations must be submitted in manifest order. An operation is started only
+// when no earlier, unfinished operation writes to any of its destination
+// blocks, so the content of the target partition is the same as if the
+// operations were applied serially. Source blocks are read from the source
+// slot, which is never written, so they don't constrain the order. With a
+// single worker, operations are applied strictly in order.
+class InstallOperationPipeline {
+ public:
+  // Applies |operation| (the |op_index|-th operation of the payload) with its
+  // |data| blob. Called on worker |worker_index|, which is in the range
+  // [0, num_workers). Calls with the same |worker_index| never run
+  // concurrently. Returns ErrorCode::kSuccess, or the error that fails the
+  // whole pipeline.
+  using ExecuteCallback =
+      std::function<ErrorCode(size_t worker_index,
+                              size_t op_index,
+                              const InstallOperation& operation,
+                              const brillo::Blob& data)>;
+
+  // |first_op_index| is the index of the first operation that will be
+  // submitted. Submit() blocks while more than |max_pending_ops| operations or
+  // |max_pending_bytes| bytes of data are waiting to be applied.
+  InstallOperationPipeline(size_t num_workers,
+                           size_t first_op_index,
+                           size_t max_pending_ops,
+                           size_t max_pending_bytes,
+                           ExecuteCallback execute);
+
+  // Discards the operations that haven't started yet, and waits for the
+  // running ones.
+  ~InstallOperationPipeline();
+
+  // Queues |operation| for execution. |operation| must stay valid until it
+  // has been applied. Returns false if the pipeline has already failed, in
+  // which case error() tells why.
+  bool Submit(const InstallOperation* operation, brillo::Blob data);
+
+  // Queues |callback| to run on a worker once every operation submitted so
+  // far has been applied, and before any operation submitted later starts.
+  // No operation is running while |callback| runs. Barriers are skipped once
+  // the pipeline has failed.
+  void SubmitBarrier(std::function<void()> callback);
+
+  // Blocks until all the submitted operations and barriers have run, or until
+  // the pipeline fails. Returns error().
+  ErrorCode Wait();
+
+  // Returns the index of the first operation that hasn't been applied yet.
+  // All the operations before it have been applied successfully.
+  size_t next_unfinished_op() const;
+
+  // Returns the first error reported by an operation, or ErrorCode::kSuccess.
+  ErrorCode error() const;
+
+  // Returns whether the pending operations are at the limits passed to the
+  // ctor, in which case Submit() blocks until some are applied.
+  bool IsFull() const;
+
+  size_t num_workers() const { return workers_.size(); }
+
+ private:
+  enum class TaskState {
+    kQueued,
+    kRunning,
+    kDone,
+    // Failed tasks are never popped, so that next_unfinished_op() doesn't
+    // move past them.
+    kFailed,
+  };
+
+  struct Task {
+    size_t op_index;
+    // nullptr for barriers.
+    const InstallOperation* operation;
+    brillo::Blob data;
+    std::function<void()> barrier;
+    TaskState state{TaskState::kQueued};
+  };
+
+  void WorkerLoop(size_t worker_index);
+
+  // Returns the first queued task that can be started right now, or
+  // |pending_.end()| if there's none. Must be called with |mutex_| held.
+  std::deque<Task>::iterator NextRunnableTask();
+
+  // Pops the finished tasks at the front of |pending_|. Must be called with
+  // |mutex_| held.
+  void PopFinishedTasks();
+
+  const size_t max_pending_ops_;
+  const size_t max_pending_bytes_;
+  ExecuteCallback execute_;
+
+  mutable std::mutex mutex_;
+  // Signaled when a task is queued or finished, and on shutdown.
+  std::condition_variable task_cv_;
+  // Signaled when a task is popped from |pending_| or the pipeline fails.
+  std::condition_variable space_cv_;
+
+  // Submitted tasks that are not known to be finished yet, in order.
+  std::deque<Task> pending_;
+  size_t pending_bytes_{0};
+  size_t num_running_{0};
+  // Index of the next operation to be submitted.
+  size_t next_op_index_;
+  ErrorCode error_{ErrorCode::kSuccess};
+  bool shutdown_{false};
+
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstallOperationPipeline);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_PIPELINE_H_
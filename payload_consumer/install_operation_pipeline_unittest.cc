@@ -0,0 +1,164 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/install_operation_pipeline.h"
+
+#include <atomic>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kMaxPendingOps = 8;
+constexpr size_t kMaxPendingBytes = 1024;
+
+InstallOperation MakeOperation(uint64_t start_block, uint64_t num_blocks) {
+  InstallOperation op;
+  op.set_type(InstallOperation::REPLACE);
+  *op.add_dst_extents() = ExtentForRange(start_block, num_blocks);
+  return op;
+}
+}  // namespace
+
+class InstallOperationPipelineTest : public ::testing::Test {
+ protected:
+  std::unique_ptr<InstallOperationPipeline> CreatePipeline(
+      size_t num_workers, size_t first_op_index = 0) {
+    return std::make_unique<InstallOperationPipeline>(
+        num_workers,
+        first_op_index,
+        kMaxPendingOps,
+        kMaxPendingBytes,
+        [this](size_t worker,
+               size_t op_index,
+               const InstallOperation& op,
+               const brillo::Blob& data) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          applied_.push_back(op_index);
+          return op_index == failing_op_ ? ErrorCode::kDownloadWriteError
+                                         : ErrorCode::kSuccess;
+        });
+  }
+
+  std::mutex mutex_;
+  std::vector<size_t> applied_;
+  size_t failing_op_{std::numeric_limits<size_t>::max()};
+};
+
+TEST_F(InstallOperationPipelineTest, SingleWorkerKeepsOrderTest) {
+  std::vector<InstallOperation> ops;
+  for (size_t i = 0; i < 20; i++) {
+    ops.push_back(MakeOperation(i * 10, 10));
+  }
+  auto pipeline = CreatePipeline(1, 5);
+  for (const auto& op : ops) {
+    ASSERT_TRUE(pipeline->Submit(&op, brillo::Blob(100)));
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline->Wait());
+  ASSERT_EQ(25U, pipeline->next_unfinished_op());
+  ASSERT_EQ(20U, applied_.size());
+  for (size_t i = 0; i < applied_.size(); i++) {
+    ASSERT_EQ(i + 5, applied_[i]);
+  }
+}
+
+TEST_F(InstallOperationPipelineTest, OverlappingOperationsKeepOrderTest) {
+  // Every operation writes block 0, so they must all run in order even with
+  // several workers.
+  std::vector<InstallOperation> ops;
+  for (size_t i = 0; i < 20; i++) {
+    ops.push_back(MakeOperation(0, i + 1));
+  }
+  auto pipeline = CreatePipeline(4);
+  for (const auto& op : ops) {
+    ASSERT_TRUE(pipeline->Submit(&op, {}));
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline->Wait());
+  ASSERT_EQ(20U, applied_.size());
+  for (size_t i = 0; i < applied_.size(); i++) {
+    ASSERT_EQ(i, applied_[i]);
+  }
+}
+
+TEST_F(InstallOperationPipelineTest, BarrierTest) {
+  std::vector<InstallOperation> ops;
+  for (size_t i = 0; i < 10; i++) {
+    ops.push_back(MakeOperation(i, 1));
+  }
+  auto pipeline = CreatePipeline(4);
+  std::atomic<size_t> applied_at_barrier{0};
+  for (size_t i = 0; i < ops.size(); i++) {
+    ASSERT_TRUE(pipeline->Submit(&ops[i], {}));
+    if (i == 4) {
+      pipeline->SubmitBarrier([this, &applied_at_barrier]() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        applied_at_barrier = applied_.size();
+      });
+    }
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline->Wait());
+  ASSERT_EQ(5U, applied_at_barrier);
+  ASSERT_EQ(10U, pipeline->next_unfinished_op());
+}
+
+TEST_F(InstallOperationPipelineTest, IsFullTest) {
+  std::vector<InstallOperation> ops;
+  for (size_t i = 0; i < kMaxPendingOps; i++) {
+    ops.push_back(MakeOperation(i, 1));
+  }
+  auto pipeline = CreatePipeline(1);
+  EXPECT_FALSE(pipeline->IsFull());
+  // Hold the worker on a barrier so that the operations pile up behind it.
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  pipeline->SubmitBarrier([released]() { released.wait(); });
+  for (size_t i = 0; i + 1 < ops.size(); i++) {
+    EXPECT_FALSE(pipeline->IsFull());
+    ASSERT_TRUE(pipeline->Submit(&ops[i], {}));
+  }
+  EXPECT_TRUE(pipeline->IsFull());
+  release.set_value();
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline->Wait());
+  EXPECT_FALSE(pipeline->IsFull());
+}
+
+TEST_F(InstallOperationPipelineTest, FailureStopsPipelineTest) {
+  std::vector<InstallOperation> ops;
+  for (size_t i = 0; i < 10; i++) {
+    ops.push_back(MakeOperation(0, 1));
+  }
+  failing_op_ = 3;
+  auto pipeline = CreatePipeline(2);
+  for (const auto& op : ops) {
+    if (!pipeline->Submit(&op, {}))
+      break;
+  }
+  ASSERT_EQ(ErrorCode::kDownloadWriteError, pipeline->Wait());
+  ASSERT_EQ(ErrorCode::kDownloadWriteError, pipeline->error());
+  ASSERT_EQ(3U, pipeline->next_unfinished_op());
+  ASSERT_FALSE(pipeline->Submit(&ops[0], {}));
+  ASSERT_EQ(4U, applied_.size());
+}
+
+}  // namespace chromeos_update_engine
@@ -202,6 +202,27 @@ struct InstallPlan {
 
   // Whether to enable multi-threaded compression on COW writes
   bool enable_threading = false;
+
+  // Number of worker threads applying install operations in parallel with the
+  // download. 0 applies them serially on the download thread.
+  uint32_t pipelined_apply_threads = 0;
+
+  // Queue depth of the io_uring used to access the source and target
+  // partitions. 0 disables io_uring.
+  uint32_t io_uring_queue_depth = 0;
+
+  // Number of worker threads verifying partitions concurrently after the
+  // update is applied. 0 verifies them one at a time on the message loop.
+  uint32_t verify_threads = 0;
+
+  // Number of operations whose source extents are read ahead while applying
+  // an operation. 0 disables reading ahead.
+  uint32_t source_prefetch_operations = 0;
+
+  // Size in MiB of the cache of source blocks read while applying the
+  // operations of a partition, split among the writers applying them. 0
+  // disables the cache.
+  uint32_t source_block_cache_mb = 0;
 };
 
 class InstallPlanAction;
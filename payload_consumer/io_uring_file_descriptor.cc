@@ -0,0 +1,345 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <optional>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Alignment of the buffers, so that they can also be used with O_DIRECT.
+constexpr size_t kBufferAlignment = 4096;
+}  // namespace
+
+IoUringFileDescriptor::IoUringFileDescriptor(size_t queue_depth,
+                                             size_t buffer_size)
+    : queue_depth_(queue_depth), buffer_size_(buffer_size) {
+  CHECK_GT(queue_depth_, 0U);
+  CHECK_GT(buffer_size_, 0U);
+}
+
+IoUringFileDescriptor::~IoUringFileDescriptor() {
+  if (IsOpen()) {
+    Close();
+  }
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  if (!fd_.Open(path, flags, mode)) {
+    return false;
+  }
+  if (!InitRing()) {
+    int err = errno;
+    fd_.Close();
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags) {
+  return Open(path, flags, 0);
+}
+
+bool IoUringFileDescriptor::InitRing() {
+  ring_ = io_uring_cpp::IoUringInterface::CreateLinuxIoUring(queue_depth_, 0);
+  if (!ring_) {
+    PLOG(ERROR) << "Unable to create an io_uring of depth " << queue_depth_;
+    return false;
+  }
+  void* buffers = nullptr;
+  int err =
+      posix_memalign(&buffers, kBufferAlignment, queue_depth_ * buffer_size_);
+  if (err != 0) {
+    errno = err;
+    PLOG(ERROR) << "Unable to allocate the io_uring buffers";
+    ring_.reset();
+    return false;
+  }
+  buffers_.reset(static_cast<uint8_t*>(buffers));
+
+  std::vector<struct iovec> iovecs(queue_depth_);
+  for (size_t i = 0; i < queue_depth_; i++) {
+    iovecs[i].iov_base = buffer(i);
+    iovecs[i].iov_len = buffer_size_;
+  }
+  const auto ret = ring_->RegisterBuffers(iovecs.data(), iovecs.size());
+  buffers_registered_ = ret.IsOk();
+  if (!buffers_registered_) {
+    // Registered buffers count against RLIMIT_MEMLOCK on older kernels.
+    LOG(WARNING) << "Unable to register the io_uring buffers: " << ret
+                 << ", using unregistered buffers.";
+  }
+
+  requests_.assign(queue_depth_, Request());
+  free_buffers_.clear();
+  for (size_t i = queue_depth_; i > 0; i--) {
+    free_buffers_.push_back(i - 1);
+  }
+  num_in_flight_ = 0;
+  offset_ = 0;
+  io_error_ = 0;
+  return true;
+}
+
+ssize_t IoUringFileDescriptor::Read(void* buf, size_t count) {
+  CHECK(IsOpen());
+  if (!WaitForRequests()) {
+    return -1;
+  }
+  ssize_t rc = HANDLE_EINTR(pread(fd_.Fd(), buf, count, offset_));
+  if (rc > 0) {
+    offset_ += rc;
+  }
+  return rc;
+}
+
+ssize_t IoUringFileDescriptor::Write(const void* buf, size_t count) {
+  CHECK(IsOpen());
+  if (io_error_ != 0) {
+    errno = io_error_;
+    return -1;
+  }
+  const uint8_t* data = static_cast<const uint8_t*>(buf);
+  size_t bytes_written = 0;
+  while (bytes_written < count) {
+    size_t index{};
+    if (!GetFreeBuffer(&index)) {
+      break;
+    }
+    const size_t length = std::min(count - bytes_written, buffer_size_);
+    memcpy(buffer(index), data + bytes_written, length);
+    requests_[index] = {true, offset_, length, nullptr};
+    if (!PrepRequest(index)) {
+      free_buffers_.push_back(index);
+      break;
+    }
+    offset_ += length;
+    bytes_written += length;
+  }
+  return bytes_written > 0 ? bytes_written : -1;
+}
+
+bool IoUringFileDescriptor::ReadScattered(const struct iovec* iov,
+                                          const off64_t* offsets,
+                                          size_t iovcnt) {
+  CHECK(IsOpen());
+  TEST_AND_RETURN_FALSE(WaitForRequests());
+  read_error_ = 0;
+  bool success = true;
+  for (size_t i = 0; i < iovcnt && success; i++) {
+    uint8_t* dest = static_cast<uint8_t*>(iov[i].iov_base);
+    for (size_t pos = 0; pos < iov[i].iov_len; pos += buffer_size_) {
+      size_t index{};
+      if (!GetFreeBuffer(&index)) {
+        success = false;
+        break;
+      }
+      requests_[index] = {false,
+                          offsets[i] + static_cast<off64_t>(pos),
+                          std::min(iov[i].iov_len - pos, buffer_size_),
+                          dest + pos};
+      if (!PrepRequest(index)) {
+        free_buffers_.push_back(index);
+        success = false;
+        break;
+      }
+    }
+  }
+  // The reads copy their data to |iov|, so they must all be done before
+  // returning.
+  success = WaitForRequests() && success;
+  if (read_error_ != 0) {
+    errno = read_error_;
+    return false;
+  }
+  return success;
+}
+
+off64_t IoUringFileDescriptor::Seek(off64_t offset, int whence) {
+  CHECK(IsOpen());
+  // Reads and writes are issued at |offset_|, so the kernel is only asked for
+  // the file offset with SEEK_END and the like.
+  if (whence != SEEK_SET && whence != SEEK_CUR) {
+    const off64_t new_offset = fd_.Seek(offset, whence);
+    if (new_offset >= 0) {
+      offset_ = new_offset;
+    }
+    return new_offset;
+  }
+  const off64_t new_offset = whence == SEEK_SET ? offset : offset_ + offset;
+  if (new_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = new_offset;
+  return offset_;
+}
+
+bool IoUringFileDescriptor::BlkIoctl(int request,
+                                     uint64_t start,
+                                     uint64_t length,
+                                     int* result) {
+  TEST_AND_RETURN_FALSE(WaitForRequests());
+  return fd_.BlkIoctl(request, start, length, result);
+}
+
+bool IoUringFileDescriptor::Flush() {
+  TEST_AND_RETURN_FALSE(WaitForRequests());
+  return fd_.Flush();
+}
+
+bool IoUringFileDescriptor::Close() {
+  if (!IsOpen()) {
+    return false;
+  }
+  bool success = WaitForRequests();
+  // Destroying the ring waits for anything still using the buffers.
+  ring_.reset();
+  buffers_.reset();
+  requests_.clear();
+  free_buffers_.clear();
+  num_in_flight_ = 0;
+  io_error_ = 0;
+  return fd_.Close() && success;
+}
+
+bool IoUringFileDescriptor::PrepRequest(size_t index) {
+  const Request& request = requests_[index];
+  io_uring_cpp::IoUringSQE sqe{nullptr};
+  if (request.write && buffers_registered_) {
+    sqe = ring_->PrepWriteFixed(
+        fd_.Fd(), buffer(index), request.length, request.offset, index);
+  } else if (request.write) {
+    sqe = ring_->PrepWrite(
+        fd_.Fd(), buffer(index), request.length, request.offset);
+  } else if (buffers_registered_) {
+    sqe = ring_->PrepReadFixed(
+        fd_.Fd(), buffer(index), request.length, request.offset, index);
+  } else {
+    sqe = ring_->PrepRead(
+        fd_.Fd(), buffer(index), request.length, request.offset);
+  }
+  if (!sqe.IsOk()) {
+    LOG(ERROR) << "The io_uring submission queue is full.";
+    errno = EBUSY;
+    return false;
+  }
+  sqe.SetData(static_cast<uint64_t>(index));
+  num_in_flight_++;
+  return true;
+}
+
+bool IoUringFileDescriptor::GetFreeBuffer(size_t* index) {
+  while (free_buffers_.empty()) {
+    TEST_AND_RETURN_FALSE(CompleteOneRequest());
+  }
+  *index = free_buffers_.back();
+  free_buffers_.pop_back();
+  return true;
+}
+
+bool IoUringFileDescriptor::CompleteOneRequest() {
+  CHECK_GT(num_in_flight_, 0U);
+  int ring_error = 0;
+  if (ring_->SQEReady() > 0) {
+    const auto ret = ring_->Submit();
+    if (!ret.IsOk()) {
+      ring_error = -ret.ErrCode();
+    }
+  }
+  std::optional<io_uring_cpp::IoUringCQE> cqe;
+  if (ring_error == 0) {
+    auto result = ring_->PopCQE();
+    if (result.IsErr()) {
+      ring_error = result.GetError().ErrCode();
+    } else {
+      cqe = result.GetResult();
+    }
+  }
+  if (ring_error != 0) {
+    errno = ring_error;
+    PLOG(ERROR) << "io_uring failed, abandoning " << num_in_flight_
+                << " requests";
+    if (io_error_ == 0) {
+      io_error_ = ring_error;
+    }
+    num_in_flight_ = 0;
+    return false;
+  }
+
+  num_in_flight_--;
+  const size_t index = cqe->GetData<uint64_t>();
+  const Request& request = requests_[index];
+  int err = 0;
+  if (cqe->res < 0) {
+    err = -cqe->res;
+  } else if (static_cast<size_t>(cqe->res) < request.length) {
+    // Finish short transfers synchronously.
+    const size_t done = cqe->res;
+    uint8_t* data = buffer(index) + done;
+    const size_t length = request.length - done;
+    const off64_t offset = request.offset + done;
+    if (request.write) {
+      if (!utils::PWriteAll(fd_.Fd(), data, length, offset))
+        err = errno;
+    } else {
+      ssize_t bytes_read = 0;
+      if (!utils::PReadAll(fd_.Fd(), data, length, offset, &bytes_read))
+        err = errno;
+      else if (static_cast<size_t>(bytes_read) < length)
+        err = EIO;  // Reached the end of the file.
+    }
+  }
+  if (err != 0) {
+    errno = err;
+    PLOG(ERROR) << "Failed to " << (request.write ? "write " : "read ")
+                << request.length << " bytes at offset " << request.offset;
+    int* error = request.write ? &io_error_ : &read_error_;
+    if (*error == 0) {
+      *error = err;
+    }
+  } else if (!request.write) {
+    memcpy(request.read_dest, buffer(index), request.length);
+  }
+  free_buffers_.push_back(index);
+  return true;
+}
+
+bool IoUringFileDescriptor::WaitForRequests() {
+  while (num_in_flight_ > 0) {
+    if (!CompleteOneRequest()) {
+      break;
+    }
+  }
+  if (io_error_ != 0) {
+    errno = io_error_;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,129 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+
+#include <stdlib.h>
+
+#include <memory>
+#include <vector>
+
+#include <liburing_cpp/IoUring.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// A FileDescriptor which queues reads and writes on an io_uring, so that the
+// extents of an operation are transferred with a few syscalls instead of one
+// pread()/pwrite() per extent.
+//
+// Writes are copied to one of |queue_depth| registered buffers and return
+// immediately. They are submitted once the buffers or the submission queue run
+// out, and waited for by Read(), ReadScattered(), BlkIoctl(), Flush() and
+// Close(). A write failing in the background is reported by the next call to
+// Write(), Flush() or Close(). ReadScattered() keeps up to |queue_depth| reads
+// in flight.
+class IoUringFileDescriptor final : public FileDescriptor {
+ public:
+  static constexpr size_t kDefaultBufferSize = 128 * 1024;
+
+  explicit IoUringFileDescriptor(size_t queue_depth,
+                                 size_t buffer_size = kDefaultBufferSize);
+  ~IoUringFileDescriptor() override;
+
+  // Interface methods.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  bool ReadScattered(const struct iovec* iov,
+                     const off64_t* offsets,
+                     size_t iovcnt) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_.BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override;
+  bool Close() override;
+  bool IsSettingErrno() override { return true; }
+  bool IsOpen() override { return fd_.IsOpen(); }
+  int Fd() override { return fd_.Fd(); }
+
+ private:
+  // A read or write in flight, using the registered buffer of the same index.
+  struct Request {
+    bool write{false};
+    off64_t offset{0};
+    size_t length{0};
+    // Where the data of a read is copied once it completes.
+    uint8_t* read_dest{nullptr};
+  };
+
+  // Sets up the ring and its buffers once |fd_| is open.
+  bool InitRing();
+
+  uint8_t* buffer(size_t index) {
+    return buffers_.get() + index * buffer_size_;
+  }
+
+  // Queues a request on the free buffer |index|. |requests_[index]| must be
+  // filled already. Returns false if the submission queue is full.
+  bool PrepRequest(size_t index);
+
+  // Returns the index of a free buffer in |index|, waiting for a request to
+  // complete if none is free.
+  bool GetFreeBuffer(size_t* index);
+
+  // Submits the queued requests and waits for one of them to complete.
+  // Returns false if the ring itself failed, in which case the requests in
+  // flight are abandoned.
+  bool CompleteOneRequest();
+
+  // Waits for all the requests in flight. Returns false and sets errno if a
+  // write or the ring failed.
+  bool WaitForRequests();
+
+  const size_t queue_depth_;
+  const size_t buffer_size_;
+
+  EintrSafeFileDescriptor fd_;
+  std::unique_ptr<io_uring_cpp::IoUringInterface> ring_;
+  // |queue_depth_| buffers of |buffer_size_| bytes each.
+  std::unique_ptr<uint8_t, decltype(&free)> buffers_{nullptr, &free};
+  // Whether |buffers_| could be registered with the kernel. Otherwise, the
+  // same buffers are used with regular reads and writes.
+  bool buffers_registered_{false};
+  std::vector<Request> requests_;
+  std::vector<size_t> free_buffers_;
+  size_t num_in_flight_{0};
+
+  off64_t offset_{0};
+  // errno of the first write that failed in the background, or of a failure
+  // of the ring. Once set, all the following writes fail.
+  int io_error_{0};
+  // errno of the first read of the current ReadScattered() call that failed.
+  int read_error_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
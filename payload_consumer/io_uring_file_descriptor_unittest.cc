@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kFileBlocks = 64;
+// Small queue and buffers, so that requests have to wait for free buffers.
+constexpr size_t kQueueDepth = 4;
+constexpr size_t kBufferSize = 2 * kBlockSize;
+}  // namespace
+
+class IoUringFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    brillo::Blob zero_blob(kFileBlocks * kBlockSize, 0);
+    ASSERT_TRUE(utils::WriteFile(
+        temp_file_.path().c_str(), zero_blob.data(), zero_blob.size()));
+    fd_ = std::make_shared<IoUringFileDescriptor>(kQueueDepth, kBufferSize);
+    if (!fd_->Open(temp_file_.path().c_str(), O_RDWR)) {
+      GTEST_SKIP() << "io_uring is not supported by this kernel.";
+    }
+  }
+
+  void TearDown() override {
+    if (fd_->IsOpen()) {
+      EXPECT_TRUE(fd_->Close());
+    }
+  }
+
+  ScopedTempFile temp_file_{"IoUringFileDescriptor-file.XXXXXX"};
+  FileDescriptorPtr fd_;
+};
+
+TEST_F(IoUringFileDescriptorTest, WriteExtentsTest) {
+  vector<Extent> extents = {ExtentForRange(40, 3),
+                            ExtentForRange(2, 1),
+                            ExtentForRange(10, 7),
+                            ExtentForRange(30, 2)};
+  const size_t num_blocks = utils::BlocksInExtents(extents);
+  brillo::Blob data(num_blocks * kBlockSize);
+  test_utils::FillWithData(&data);
+
+  DirectExtentWriter writer(fd_);
+  ASSERT_TRUE(writer.Init({extents.begin(), extents.end()}, kBlockSize));
+  ASSERT_TRUE(writer.Write(data.data(), data.size()));
+  ASSERT_TRUE(fd_->Flush());
+
+  brillo::Blob file_data;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &file_data));
+  brillo::Blob expected(kFileBlocks * kBlockSize, 0);
+  size_t offset = 0;
+  for (const auto& extent : extents) {
+    std::copy(data.begin() + offset,
+              data.begin() + offset + extent.num_blocks() * kBlockSize,
+              expected.begin() + extent.start_block() * kBlockSize);
+    offset += extent.num_blocks() * kBlockSize;
+  }
+  ASSERT_EQ(expected, file_data);
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadExtentsAfterWriteTest) {
+  brillo::Blob data(kFileBlocks * kBlockSize);
+  test_utils::FillWithData(&data);
+  ASSERT_EQ(0, fd_->Seek(0, SEEK_SET));
+  ASSERT_TRUE(utils::WriteAll(fd_, data.data(), data.size()));
+
+  // Reads have to see the writes still queued.
+  vector<Extent> extents = {
+      ExtentForRange(5, 9), ExtentForRange(1, 1), ExtentForRange(50, 14)};
+  brillo::Blob read_data;
+  ASSERT_TRUE(utils::ReadExtents(fd_,
+                                 extents,
+                                 &read_data,
+                                 utils::BlocksInExtents(extents) * kBlockSize,
+                                 kBlockSize));
+  brillo::Blob expected;
+  for (const auto& extent : extents) {
+    auto begin = data.begin() + extent.start_block() * kBlockSize;
+    expected.insert(
+        expected.end(), begin, begin + extent.num_blocks() * kBlockSize);
+  }
+  ASSERT_EQ(expected, read_data);
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadPastEndFailsTest) {
+  vector<Extent> extents = {ExtentForRange(kFileBlocks - 1, 2)};
+  brillo::Blob read_data;
+  ASSERT_FALSE(utils::ReadExtents(
+      fd_, extents, &read_data, 2 * kBlockSize, kBlockSize));
+}
+
+TEST_F(IoUringFileDescriptorTest, SeekTest) {
+  ASSERT_EQ(static_cast<off64_t>(kBlockSize), fd_->Seek(kBlockSize, SEEK_SET));
+  ASSERT_EQ(static_cast<off64_t>(2 * kBlockSize),
+            fd_->Seek(kBlockSize, SEEK_CUR));
+  ASSERT_EQ(static_cast<off64_t>(kFileBlocks * kBlockSize),
+            fd_->Seek(0, SEEK_END));
+  ASSERT_EQ(-1, fd_->Seek(-1, SEEK_SET));
+}
+
+}  // namespace chromeos_update_engine
@@ -41,6 +41,7 @@
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
 #include "update_engine/payload_consumer/mount_history.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
@@ -88,25 +89,40 @@ bool DiscardPartitionTail(const FileDescriptorPtr& fd, uint64_t data_size) {
 
 // Opens path for read/write. On success returns an open FileDescriptor
 // and sets *err to 0. On failure, sets *err to errno and returns nullptr.
+// A non-zero |io_uring_queue_depth| does the I/O through an io_uring, if the
+// kernel supports it.
 FileDescriptorPtr OpenFile(const char* path,
                            int mode,
                            bool cache_writes,
+                           size_t io_uring_queue_depth,
                            int* err) {
   // Try to mark the block device read-only based on the mode. Ignore any
   // failure since this won't work when passing regular files.
   bool read_only = (mode & O_ACCMODE) == O_RDONLY;
   utils::SetBlockDeviceReadOnly(path, read_only);
 
-  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+  FileDescriptorPtr fd;
+  if (io_uring_queue_depth > 0) {
+    fd = std::make_shared<IoUringFileDescriptor>(io_uring_queue_depth);
+    if (fd->Open(path, mode, 000)) {
+      LOG(INFO) << "Using io_uring with queue depth " << io_uring_queue_depth;
+    } else {
+      PLOG(WARNING) << "Unable to open " << path << " with io_uring";
+      fd = nullptr;
+    }
+  }
+  if (!fd) {
+    fd = std::make_shared<EintrSafeFileDescriptor>();
+    if (!fd->Open(path, mode, 000)) {
+      *err = errno;
+      PLOG(ERROR) << "Unable to open file " << path;
+      return nullptr;
+    }
+  }
   if (cache_writes && !read_only) {
     fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
     LOG(INFO) << "Caching writes.";
   }
-  if (!fd->Open(path, mode, 000)) {
-    *err = errno;
-    PLOG(ERROR) << "Unable to open file " << path;
-    return nullptr;
-  }
   *err = 0;
   return fd;
 }
@@ -130,14 +146,15 @@ PartitionWriter::~PartitionWriter() {
 }
 
 bool PartitionWriter::OpenSourcePartition(uint32_t source_slot,
-                                          bool source_may_exist) {
+                                          bool source_may_exist,
+                                          size_t io_uring_queue_depth) {
   source_path_.clear();
   if (!source_may_exist) {
     return true;
   }
   if (install_part_.source_size > 0 && !install_part_.source_path.empty()) {
     source_path_ = install_part_.source_path;
-    if (!verified_source_fd_.Open()) {
+    if (!verified_source_fd_.Open(io_uring_queue_depth)) {
       LOG(ERROR) << "Unable to open source partition " << install_part_.name
                  << " on slot " << BootControlInterface::SlotName(source_slot)
                  << ", file " << source_path_;
@@ -153,7 +170,13 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   const PartitionUpdate& partition = partition_update_;
   uint32_t source_slot = install_plan->source_slot;
   uint32_t target_slot = install_plan->target_slot;
-  TEST_AND_RETURN_FALSE(OpenSourcePartition(source_slot, source_may_exist));
+  verified_source_fd_.set_block_cache_size(static_cast<size_t>(
+      uint64_t{install_plan->source_block_cache_mb} * 1024 * 1024 /
+      num_concurrent_writers_));
+  TEST_AND_RETURN_FALSE(OpenSourcePartition(
+      source_slot, source_may_exist, install_plan->io_uring_queue_depth));
+  verified_source_fd_.set_prefetch_operations(
+      install_plan->source_prefetch_operations);
 
   // We shouldn't open the source partition in certain cases, e.g. some dynamic
   // partitions in delta payload, partitions included in the full payload for
@@ -169,7 +192,11 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   LOG(INFO) << "Opening " << target_path_ << " partition with"
             << (interactive_ ? "out" : "") << " O_DSYNC";
 
-  target_fd_ = OpenFile(target_path_.c_str(), flags, true, &err);
+  target_fd_ = OpenFile(target_path_.c_str(),
+                        flags,
+                        cache_writes_,
+                        cache_writes_ ? install_plan->io_uring_queue_depth : 0,
+                        &err);
   if (!target_fd_) {
     LOG(ERROR) << "Unable to open target partition "
                << partition.partition_name() << " on slot "
@@ -265,6 +292,10 @@ bool PartitionWriter::PerformDiffOperation(const InstallOperation& operation,
       operation, std::move(writer), source_fd, data, count);
 }
 
+void PartitionWriter::PrepareForOperation(size_t op_index) {
+  verified_source_fd_.PrefetchSource(partition_update_.operations(), op_index);
+}
+
 FileDescriptorPtr PartitionWriter::ChooseSourceFD(
     const InstallOperation& operation, ErrorCode* error) {
   return verified_source_fd_.ChooseSourceFD(operation, error);
@@ -287,10 +318,14 @@ int PartitionWriter::Close() {
   return -err;
 }
 
-void PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
-  if (target_fd_) {
-    target_fd_->Flush();
+bool PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
+  // Write errors may only be reported by Flush(), e.g. with io_uring.
+  if (target_fd_ && !target_fd_->Flush()) {
+    PLOG(ERROR) << "Failed to flush the target partition before operation "
+                << next_op_index;
+    return false;
   }
+  return true;
 }
 
 std::unique_ptr<ExtentWriter> PartitionWriter::CreateBaseExtentWriter() {
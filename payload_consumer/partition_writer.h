@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PARTITION_WRITER_H_
 #define UPDATE_ENGINE_PARTITION_WRITER_H_
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
 #include <string>
@@ -62,7 +63,7 @@ class PartitionWriter : public PartitionWriterInterface {
   // applied.
   //   |next_op_index| is index of next operation that should be applied.
   // |next_op_index-1| is the last operation that is already applied.
-  void CheckpointUpdateProgress(size_t next_op_index) override;
+  [[nodiscard]] bool CheckpointUpdateProgress(size_t next_op_index) override;
 
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
@@ -90,12 +91,26 @@ class PartitionWriter : public PartitionWriterInterface {
   // the partition writer is expected to be closed soon.
   [[nodiscard]] bool FinishedInstallOps() override { return true; }
 
+  void PrepareForOperation(size_t op_index) override;
+
+  // Disables the write cache and the io_uring of the target partition, as
+  // delayed writes of one writer could overwrite newer data written by
+  // another one.
+  [[nodiscard]] bool EnableConcurrentOperations() override {
+    cache_writes_ = false;
+    return true;
+  }
+  void SetNumConcurrentWriters(size_t num_writers) override {
+    num_concurrent_writers_ = std::max<size_t>(1, num_writers);
+  }
+
  private:
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
 
   [[nodiscard]] bool OpenSourcePartition(uint32_t source_slot,
-                                         bool source_may_exist);
+                                         bool source_may_exist,
+                                         size_t io_uring_queue_depth);
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& op,
                                    ErrorCode* error);
 
@@ -112,6 +127,11 @@ class PartitionWriter : public PartitionWriterInterface {
   FileDescriptorPtr target_fd_;
   const bool interactive_;
   const size_t block_size_;
+  // Whether writes to |target_fd_| can be delayed, by a CachedFileDescriptor
+  // or an IoUringFileDescriptor.
+  bool cache_writes_{true};
+  // The writers of the partition split the source block cache.
+  size_t num_concurrent_writers_{1};
 
   // This instance handles decompression/bsdfif/puffdiff. It's responsible for
   // constructing data which should be written to target partition, actual
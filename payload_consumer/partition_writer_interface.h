@@ -18,6 +18,7 @@
 #define UPDATE_ENGINE_PARTITION_WRITER_INTERFACE_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
 
 #include <brillo/secure_blob.h>
@@ -42,7 +43,10 @@ class PartitionWriterInterface {
   // applied.
   //   |next_op_index| is index of next operation that should be applied.
   // |next_op_index-1| is the last operation that is already applied.
-  virtual void CheckpointUpdateProgress(size_t next_op_index) = 0;
+  // Returns false if the data written so far may not have reached the disk, in
+  // which case no progress past it must be persisted.
+  [[nodiscard]] virtual bool CheckpointUpdateProgress(
+      size_t next_op_index) = 0;
 
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
@@ -69,6 +73,37 @@ class PartitionWriterInterface {
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
   [[nodiscard]] virtual bool FinishedInstallOps() = 0;
+
+  // Called before the operation |op_index| of the partition is applied, or
+  // handed to the operation pipeline. Lets the writer prepare the operations
+  // that follow, e.g. by reading their source ahead.
+  virtual void PrepareForOperation(size_t op_index) {}
+
+  // Must be called before Init(). Prepares this writer to apply operations
+  // while other instances write non-overlapping blocks of the same partition
+  // from other threads. Returns false if the writer doesn't support it, in
+  // which case all operations of the partition must go through one writer.
+  [[nodiscard]] virtual bool EnableConcurrentOperations() { return false; }
+
+  // Returns a writer applying operations of the same partition as this one
+  // from another thread, and sharing its state. This writer must have been
+  // initialized with concurrent operations enabled, and Init() must be called
+  // on the new writer too. Returns nullptr if such writers are independent,
+  // created like this one.
+  virtual std::unique_ptr<PartitionWriterInterface> CreateConcurrentWriter() {
+    return nullptr;
+  }
+
+  // Must be called before Init(). Sets how many writers, this one included,
+  // apply the operations of the partition at once, so that they split the
+  // memory budgets of the install plan instead of each using all of it.
+  virtual void SetNumConcurrentWriters(size_t num_writers) {}
+
+  // Called by the operation pipeline once this writer applied the operation
+  // |op_index| of the partition, from the same thread. Writers holding the
+  // output of concurrent operations back hand it over to the partition here.
+  // Returns false on failure.
+  [[nodiscard]] virtual bool FinishOperation(size_t op_index) { return true; }
 };
 }  // namespace chromeos_update_engine
 
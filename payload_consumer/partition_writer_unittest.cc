@@ -60,6 +60,14 @@ class PartitionWriterTest : public testing::Test {
     return writer_.verified_source_fd_.source_ecc_recovered_failures_;
   }
 
+  size_t GetNextPrefetchOp() const {
+    return writer_.verified_source_fd_.next_prefetch_op_;
+  }
+
+  uint64_t GetPrefetchedBytes() const {
+    return writer_.verified_source_fd_.prefetched_bytes_;
+  }
+
   AnnotatedOperation GenerateSourceCopyOp(const brillo::Blob& copied_data,
                                           bool add_hash,
                                           PartitionConfig* old_part = nullptr) {
@@ -107,7 +115,7 @@ class PartitionWriterTest : public testing::Test {
       return {};
     }
     EXPECT_TRUE(writer_.PerformSourceCopyOperation(op, &error));
-    writer_.CheckpointUpdateProgress(1);
+    EXPECT_TRUE(writer_.CheckpointUpdateProgress(1));
 
     brillo::Blob output_data;
     EXPECT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
@@ -218,4 +226,36 @@ TEST_F(PartitionWriterTest, ChooseSourceFDTest) {
   ASSERT_EQ(1U, GetSourceEccRecoveredFailures());
 }
 
+TEST_F(PartitionWriterTest, PrefetchSourceTest) {
+  constexpr size_t kNumOps = 6;
+  for (size_t i = 0; i < kNumOps; i++) {
+    InstallOperation* op = partition_update_.add_operations();
+    op->set_type(InstallOperation::SOURCE_COPY);
+    *(op->add_src_extents()) = ExtentForRange(2 * i, 1);
+    *(op->add_src_extents()) = ExtentForRange(2 * i + 1, 1);
+  }
+  brillo::Blob source_data = FakeFileDescriptorData(2 * kNumOps * kBlockSize);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), source_data));
+  install_part_.source_size = source_data.size();
+  install_plan_.source_prefetch_operations = 2;
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+
+  // The source of the next two operations is read ahead.
+  writer_.PrepareForOperation(0);
+  EXPECT_EQ(3U, GetNextPrefetchOp());
+  EXPECT_EQ(4 * kBlockSize, GetPrefetchedBytes());
+  // Nothing more is read ahead until the next operation.
+  writer_.PrepareForOperation(0);
+  EXPECT_EQ(3U, GetNextPrefetchOp());
+  EXPECT_EQ(4 * kBlockSize, GetPrefetchedBytes());
+  writer_.PrepareForOperation(1);
+  EXPECT_EQ(4U, GetNextPrefetchOp());
+  EXPECT_EQ(4 * kBlockSize, GetPrefetchedBytes());
+  // There is nothing to read ahead after the last operation.
+  writer_.PrepareForOperation(kNumOps - 1);
+  EXPECT_EQ(kNumOps, GetNextPrefetchOp());
+  EXPECT_EQ(0U, GetPrefetchedBytes());
+}
+
 }  // namespace chromeos_update_engine
@@ -63,6 +63,7 @@ namespace chromeos_update_engine {
 // label 3, Which contains all operation 2's data, but none of operation 3's
 // data.
 
+using android::snapshot::CowOptions;
 using android::snapshot::ICowWriter;
 using ::google::protobuf::RepeatedPtrField;
 
@@ -150,7 +151,17 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   TEST_AND_RETURN_FALSE(install_plan != nullptr);
   if (source_may_exist && install_part_.source_size > 0) {
     TEST_AND_RETURN_FALSE(!install_part_.source_path.empty());
-    TEST_AND_RETURN_FALSE(verified_source_fd_.Open());
+    verified_source_fd_.set_block_cache_size(static_cast<size_t>(
+        uint64_t{install_plan->source_block_cache_mb} * 1024 * 1024 /
+        num_concurrent_writers_));
+    TEST_AND_RETURN_FALSE(
+        verified_source_fd_.Open(install_plan->io_uring_queue_depth));
+  }
+  verified_source_fd_.set_prefetch_operations(
+      install_plan->source_prefetch_operations);
+  if (cow_sequencer_) {
+    // The COW image is initialized by the writer this one was created by.
+    return true;
   }
   std::optional<std::string> source_path;
   if (!install_part_.source_path.empty()) {
@@ -160,6 +171,10 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   cow_writer_ = dynamic_control_->OpenCowWriter(
       install_part_.name, source_path, install_plan->is_resume);
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  if (concurrent_operations_) {
+    cow_sequencer_ = std::make_shared<CowOperationSequencer>(cow_writer_.get(),
+                                                             next_op_index);
+  }
 
   // ===== Resume case handling code goes here ====
   // It is possible that the SOURCE_COPY are already written but
@@ -257,14 +272,43 @@ bool VABCPartitionWriter::WriteMergeSequence(
 }
 
 std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
-  return std::make_unique<SnapshotExtentWriter>(cow_writer_.get());
+  return std::make_unique<SnapshotExtentWriter>(OperationCowWriter());
+}
+
+ICowWriter* VABCPartitionWriter::OperationCowWriter() {
+  if (!concurrent_operations_)
+    return cow_writer_.get();
+  if (!operation_buffer_) {
+    operation_buffer_ = std::make_unique<CowOperationBuffer>(
+        CowOptions{.block_size = static_cast<uint32_t>(block_size_)});
+  }
+  return operation_buffer_.get();
+}
+
+std::unique_ptr<PartitionWriterInterface>
+VABCPartitionWriter::CreateConcurrentWriter() {
+  CHECK(cow_sequencer_) << "Concurrent operations must be enabled.";
+  auto writer = std::make_unique<VABCPartitionWriter>(
+      partition_update_, install_part_, dynamic_control_, block_size_);
+  writer->concurrent_operations_ = true;
+  writer->cow_sequencer_ = cow_sequencer_;
+  return writer;
+}
+
+bool VABCPartitionWriter::FinishOperation(size_t op_index) {
+  if (!concurrent_operations_)
+    return true;
+  // Operations without output still have to be committed, so that the ones
+  // after them are written.
+  return cow_sequencer_->Commit(op_index, std::move(operation_buffer_));
 }
 
 [[nodiscard]] bool VABCPartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
+  ICowWriter* cow_writer = OperationCowWriter();
   for (const auto& extent : operation.dst_extents()) {
     TEST_AND_RETURN_FALSE(
-        cow_writer_->AddZeroBlocks(extent.start_block(), extent.num_blocks()));
+        cow_writer->AddZeroBlocks(extent.start_block(), extent.num_blocks()));
   }
   return true;
 }
@@ -304,18 +348,19 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
     }
   }
   std::vector<uint8_t> buffer;
+  ICowWriter* cow_writer = OperationCowWriter();
   for (const auto& cow_op : converted) {
     if (cow_op.op == CowOperation::CowCopy) {
       if (userSnapshots) {
-        cow_writer_->AddCopy(
+        cow_writer->AddCopy(
             cow_op.dst_block, cow_op.src_block, cow_op.block_count);
       } else {
         // Add blocks in reverse order, because snapused specifically prefers
         // this ordering. Since we already eliminated all self-overlapping
         // SOURCE_COPY during delta generation, this should be safe to do.
         for (size_t i = cow_op.block_count; i > 0; i--) {
-          TEST_AND_RETURN_FALSE(cow_writer_->AddCopy(cow_op.dst_block + i - 1,
-                                                     cow_op.src_block + i - 1));
+          TEST_AND_RETURN_FALSE(cow_writer->AddCopy(cow_op.dst_block + i - 1,
+                                                    cow_op.src_block + i - 1));
         }
       }
       continue;
@@ -331,7 +376,7 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
       LOG(ERROR) << "source_fd->Read failed: " << bytes_read;
       return false;
     }
-    TEST_AND_RETURN_FALSE(cow_writer_->AddRawBlocks(
+    TEST_AND_RETURN_FALSE(cow_writer->AddRawBlocks(
         cow_op.dst_block, buffer.data(), buffer.size()));
   }
   return true;
@@ -360,7 +405,7 @@ bool VABCPartitionWriter::PerformDiffOperation(
       IsXorEnabled() ? std::make_unique<XORExtentWriter>(
                            operation,
                            source_fd,
-                           cow_writer_.get(),
+                           OperationCowWriter(),
                            xor_map_,
                            partition_update_.old_partition_info().size())
                      : CreateBaseExtentWriter();
@@ -368,19 +413,30 @@ bool VABCPartitionWriter::PerformDiffOperation(
       operation, std::move(writer), source_fd, data, count);
 }
 
-void VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
+bool VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
   // No need to call fsync/sync, as CowWriter flushes after a label is added
   // added.
   // if cow_writer_ failed, that means Init() failed. This function shouldn't be
   // called if Init() fails.
-  TEST_AND_RETURN(cow_writer_ != nullptr);
-  cow_writer_->AddLabel(next_op_index);
+  // Writers created by CreateConcurrentWriter() don't own the COW writer.
+  if (cow_writer_ == nullptr && cow_sequencer_ != nullptr)
+    return true;
+  TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  TEST_AND_RETURN_FALSE(cow_writer_->AddLabel(next_op_index));
+  return true;
+}
+
+void VABCPartitionWriter::PrepareForOperation(size_t op_index) {
+  verified_source_fd_.PrefetchSource(partition_update_.operations(), op_index);
 }
 
 [[nodiscard]] bool VABCPartitionWriter::FinishedInstallOps() {
   // Add a hardcoded magic label to indicate end of all install ops. This label
   // is needed by filesystem verification, don't remove.
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  // The output of every operation must have been written by now.
+  TEST_AND_RETURN_FALSE(!cow_sequencer_ ||
+                        !cow_sequencer_->HasPendingOperations());
   TEST_AND_RETURN_FALSE(cow_writer_->AddLabel(kEndOfInstallLabel));
   TEST_AND_RETURN_FALSE(cow_writer_->Finalize());
   TEST_AND_RETURN_FALSE(cow_writer_->VerifyMergeOps());
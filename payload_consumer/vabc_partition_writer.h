@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_VABC_PARTITION_WRITER_H_
 #define UPDATE_ENGINE_VABC_PARTITION_WRITER_H_
 
+#include <algorithm>
 #include <map>
 #include <memory>
 #include <string>
@@ -24,6 +25,7 @@
 
 #include <libsnapshot/snapshot_writer.h>
 
+#include "update_engine/payload_consumer/cow_operation_buffer.h"
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -60,10 +62,25 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
                                           const void* data,
                                           size_t count) override;
 
-  void CheckpointUpdateProgress(size_t next_op_index) override;
+  [[nodiscard]] bool CheckpointUpdateProgress(size_t next_op_index) override;
+
+  void PrepareForOperation(size_t op_index) override;
 
   [[nodiscard]] bool FinishedInstallOps() override;
   int Close() override;
+
+  // Operations are applied concurrently into buffers, and their output is
+  // written to the COW image in order by CowOperationSequencer.
+  [[nodiscard]] bool EnableConcurrentOperations() override {
+    concurrent_operations_ = true;
+    return true;
+  }
+  std::unique_ptr<PartitionWriterInterface> CreateConcurrentWriter() override;
+  [[nodiscard]] bool FinishOperation(size_t op_index) override;
+  void SetNumConcurrentWriters(size_t num_writers) override {
+    num_concurrent_writers_ = std::max<size_t>(1, num_writers);
+  }
+
   // Send merge sequence data to cow writer
   static bool WriteMergeSequence(
       const ::google::protobuf::RepeatedPtrField<CowMergeOperation>& merge_ops,
@@ -77,6 +94,10 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
 
+  // Returns the COW writer receiving the output of the current operation:
+  // |cow_writer_|, or a buffer if operations are applied concurrently.
+  android::snapshot::ICowWriter* OperationCowWriter();
+
   const PartitionUpdate& partition_update_;
   const InstallPlan::Partition& install_part_;
   DynamicPartitionControlInterface* const dynamic_control_;
@@ -88,6 +109,15 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   VerifiedSourceFd verified_source_fd_;
   ExtentMap<const CowMergeOperation*, ExtentLess> xor_map_;
   ExtentRanges copy_blocks_;
+
+  bool concurrent_operations_{false};
+  // The writers of the partition split the source block cache.
+  size_t num_concurrent_writers_{1};
+  // Writes the output of the operations applied concurrently to the COW
+  // writer, which only the writer created first owns.
+  std::shared_ptr<CowOperationSequencer> cow_sequencer_;
+  // The output of the current operation if applied concurrently.
+  std::unique_ptr<CowOperationBuffer> operation_buffer_;
 };
 
 }  // namespace chromeos_update_engine
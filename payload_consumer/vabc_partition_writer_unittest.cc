@@ -214,6 +214,52 @@ void VABCPartitionWriterTest::EmitBlockTest(bool xor_enabled) {
   ASSERT_TRUE(writer_.PerformSourceCopyOperation(install_op, &error));
 }
 
+TEST_F(VABCPartitionWriterTest, ConcurrentOperationsTest) {
+  InstallOperation& first_op = *partition_update_.add_operations();
+  first_op.set_type(InstallOperation::REPLACE);
+  first_op.set_data_length(kBlockSize);
+  *first_op.add_dst_extents() = ExtentForRange(10, 1);
+  InstallOperation& second_op = *partition_update_.add_operations();
+  second_op.set_type(InstallOperation::REPLACE);
+  second_op.set_data_length(kBlockSize);
+  *second_op.add_dst_extents() = ExtentForRange(20, 1);
+  VABCPartitionWriter writer_{
+      partition_update_, install_part_, &dynamic_control_, kBlockSize};
+  EXPECT_CALL(dynamic_control_, OpenCowWriter(fake_part_name, _, false))
+      .WillOnce(Invoke(
+          [](const std::string&, const std::optional<std::string>&, bool) {
+            auto cow_writer =
+                std::make_unique<android::snapshot::MockSnapshotWriter>(
+                    android::snapshot::CowOptions{});
+            ON_CALL(*cow_writer, EmitLabel(_)).WillByDefault(Return(true));
+            ON_CALL(*cow_writer, Initialize()).WillByDefault(Return(true));
+            EXPECT_CALL(*cow_writer, Initialize());
+            Sequence s;
+            EXPECT_CALL(*cow_writer, EmitRawBlocks(10, _, kBlockSize))
+                .InSequence(s)
+                .WillOnce(Return(true));
+            EXPECT_CALL(*cow_writer, EmitRawBlocks(20, _, kBlockSize))
+                .InSequence(s)
+                .WillOnce(Return(true));
+            return cow_writer;
+          }));
+  ASSERT_TRUE(writer_.EnableConcurrentOperations());
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+  auto other_writer = writer_.CreateConcurrentWriter();
+  ASSERT_NE(nullptr, other_writer);
+  ASSERT_TRUE(other_writer->Init(&install_plan_, true, 0));
+
+  // The second operation is applied first, but its output is only written to
+  // the COW image after the output of the first one.
+  brillo::Blob data(kBlockSize, 0x42);
+  ASSERT_TRUE(other_writer->PerformReplaceOperation(
+      second_op, data.data(), data.size()));
+  ASSERT_TRUE(other_writer->FinishOperation(1));
+  ASSERT_TRUE(
+      writer_.PerformReplaceOperation(first_op, data.data(), data.size()));
+  ASSERT_TRUE(writer_.FinishOperation(0));
+}
+
 std::string GetNoopBSDIFF(size_t data_size) {
   auto zeros = GetReadonlyZeroBlock(data_size);
   TemporaryFile patch_file;
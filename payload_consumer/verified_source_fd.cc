@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <memory>
 #include <utility>
 #include <vector>
@@ -29,12 +30,29 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
 #include "update_engine/payload_consumer/mount_history.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 
 namespace chromeos_update_engine {
 using std::string;
 
+namespace {
+// The most source data read ahead by PrefetchSource() and not used yet, so
+// that it isn't dropped from the page cache before it's needed.
+constexpr uint64_t kMaxPrefetchBytes = 32 * 1024 * 1024;  // 32 MiB
+}  // namespace
+
+VerifiedSourceFd::~VerifiedSourceFd() {
+  if (!source_block_cache_)
+    return;
+  const uint64_t hits = source_block_cache_->hits();
+  const uint64_t reads = hits + source_block_cache_->misses();
+  LOG(INFO) << "Source block cache of " << source_path_ << ": " << hits
+            << " of " << reads << " blocks read from the cache ("
+            << (reads ? hits * 100 / reads : 0) << "% hit rate).";
+}
+
 bool VerifiedSourceFd::OpenCurrentECCPartition() {
   // No support for ECC for full payloads.
   // Full payload should not have any opeartion that requires ECC partitions.
@@ -113,12 +131,79 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
   return nullptr;
 }
 
-bool VerifiedSourceFd::Open() {
-  source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
-  if (source_fd_ == nullptr)
-    return false;
-  TEST_AND_RETURN_FALSE_ERRNO(source_fd_->Open(source_path_.c_str(), O_RDONLY));
+bool VerifiedSourceFd::Open(size_t io_uring_queue_depth) {
+  source_block_cache_.reset();
+  source_fd_.reset();
+  if (io_uring_queue_depth > 0) {
+    source_fd_ = std::make_shared<IoUringFileDescriptor>(io_uring_queue_depth);
+    if (!source_fd_->Open(source_path_.c_str(), O_RDONLY)) {
+      PLOG(WARNING) << "Unable to open " << source_path_ << " with io_uring";
+      source_fd_.reset();
+    }
+  }
+  if (source_fd_ == nullptr) {
+    source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+    TEST_AND_RETURN_FALSE_ERRNO(
+        source_fd_->Open(source_path_.c_str(), O_RDONLY));
+  }
+  if (block_cache_size_ >= block_size_) {
+    source_block_cache_ = std::make_shared<BlockCacheFileDescriptor>(
+        source_fd_, block_size_, block_cache_size_);
+    source_fd_ = source_block_cache_;
+  }
   return true;
 }
 
+void VerifiedSourceFd::PrefetchSource(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    size_t op_index) {
+  if (prefetch_operations_ == 0 || source_fd_ == nullptr)
+    return;
+  // The source of the operations up to |op_index| is read by now.
+  while (!prefetched_ops_.empty() &&
+         prefetched_ops_.front().first <= op_index) {
+    prefetched_bytes_ -= prefetched_ops_.front().second;
+    prefetched_ops_.pop_front();
+  }
+  next_prefetch_op_ = std::max(next_prefetch_op_, op_index + 1);
+  const size_t end_op = std::min<size_t>(
+      operations.size(), op_index + 1 + prefetch_operations_);
+  for (; next_prefetch_op_ < end_op && prefetched_bytes_ < kMaxPrefetchBytes;
+       next_prefetch_op_++) {
+    // Adjacent extents are read ahead together.
+    uint64_t bytes = 0;
+    uint64_t start_block = 0;
+    uint64_t num_blocks = 0;
+    for (const Extent& extent : operations[next_prefetch_op_].src_extents()) {
+      if (num_blocks > 0 && extent.start_block() == start_block + num_blocks) {
+        num_blocks += extent.num_blocks();
+        continue;
+      }
+      bytes += ReadAhead(start_block, num_blocks);
+      start_block = extent.start_block();
+      num_blocks = extent.num_blocks();
+    }
+    bytes += ReadAhead(start_block, num_blocks);
+    if (bytes > 0) {
+      prefetched_ops_.emplace_back(next_prefetch_op_, bytes);
+      prefetched_bytes_ += bytes;
+    }
+  }
+}
+
+uint64_t VerifiedSourceFd::ReadAhead(uint64_t start_block,
+                                     uint64_t num_blocks) {
+  if (num_blocks == 0)
+    return 0;
+  const int fd = source_fd_->Fd();
+  // This is only a hint, the data is read when needed if it fails.
+  if (fd >= 0) {
+    posix_fadvise(fd,
+                  start_block * block_size_,
+                  num_blocks * block_size_,
+                  POSIX_FADV_WILLNEED);
+  }
+  return num_blocks * block_size_;
+}
+
 }  // namespace chromeos_update_engine
@@ -18,6 +18,8 @@
 
 #include <cstddef>
 
+#include <deque>
+#include <memory>
 #include <string>
 #include <utility>
 
@@ -25,6 +27,7 @@
 #include <update_engine/update_metadata.pb.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 namespace chromeos_update_engine {
@@ -33,18 +36,51 @@ class VerifiedSourceFd {
  public:
   explicit VerifiedSourceFd(size_t block_size, std::string source_path)
       : block_size_(block_size), source_path_(std::move(source_path)) {}
+  ~VerifiedSourceFd();
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& operation,
                                    ErrorCode* error);
 
-  [[nodiscard]] bool Open();
+  // Opens the source partition. A non-zero |io_uring_queue_depth| reads it
+  // through an io_uring, if the kernel supports it.
+  [[nodiscard]] bool Open(size_t io_uring_queue_depth);
+
+  // Sets how many bytes of source blocks Open() caches in memory, so that the
+  // blocks read several times are only read once from the device. 0 disables
+  // the cache.
+  void set_block_cache_size(size_t block_cache_size) {
+    block_cache_size_ = block_cache_size;
+  }
+
+  // Sets how many operations PrefetchSource() reads ahead. 0 disables it.
+  void set_prefetch_operations(size_t prefetch_operations) {
+    prefetch_operations_ = prefetch_operations;
+  }
+
+  // Hints the kernel to read the source extents of the operations following
+  // |op_index| in |operations| into the page cache, so that they don't have
+  // to be read from the device when the operations are applied. Called before
+  // applying each operation, this keeps the source of the next few operations
+  // in flight.
+  void PrefetchSource(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      size_t op_index);
 
  private:
   bool OpenCurrentECCPartition();
+
+  // Hints the kernel to read |num_blocks| blocks from |start_block| of the
+  // source partition. Returns the number of bytes hinted.
+  uint64_t ReadAhead(uint64_t start_block, uint64_t num_blocks);
+
   const size_t block_size_;
   const std::string source_path_;
   FileDescriptorPtr source_ecc_fd_;
   FileDescriptorPtr source_fd_;
 
+  size_t block_cache_size_{0};
+  // The cache wrapping the source partition as |source_fd_|, if any.
+  std::shared_ptr<BlockCacheFileDescriptor> source_block_cache_;
+
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
   // The total number of operations that failed source hash verification but
@@ -55,6 +91,14 @@ class VerifiedSourceFd {
   // Used to avoid re-opening the same source partition if it is not actually
   // error corrected.
   bool source_ecc_open_failure_{false};
+
+  size_t prefetch_operations_{0};
+  // The first operation whose source wasn't prefetched yet.
+  size_t next_prefetch_op_{0};
+  // The index of the operations prefetched but not applied yet, along with
+  // the size of their source extents, and the sum of these sizes.
+  std::deque<std::pair<size_t, uint64_t>> prefetched_ops_;
+  uint64_t prefetched_bytes_{0};
 };
 }  // namespace chromeos_update_engine
 
@@ -17,9 +17,11 @@
 #include "update_engine/payload_consumer/verity_writer_android.h"
 
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <memory>
+#include <thread>
 #include <utility>
 
 #include <base/logging.h>
@@ -35,6 +37,221 @@ extern "C" {
 
 namespace chromeos_update_engine {
 
+namespace {
+// The primitive polynomial of the GF(2^8) used by FEC_PARAMS().
+constexpr unsigned kFecGfPoly = 0x11d;
+// Size of the batches of blocks encoded by StreamingEncodeFEC.
+constexpr size_t kStreamingFecBatchSize = 2 * 1024 * 1024;
+// Maximum number of threads encoding the FEC.
+constexpr size_t kMaxFecThreads = 4;
+// Size of the reads of the data which wasn't passed to Update(), after the
+// hash tree is written.
+constexpr size_t kStreamingFecReadSize = 1024 * 1024;
+
+uint8_t GfMultiply(uint8_t a, uint8_t b) {
+  unsigned product = 0;
+  unsigned factor = a;
+  for (; b != 0; b >>= 1) {
+    if (b & 1)
+      product ^= factor;
+    factor <<= 1;
+    if (factor & 0x100)
+      factor ^= kFecGfPoly;
+  }
+  return product;
+}
+}  // namespace
+
+// static
+uint64_t StreamingEncodeFEC::MemoryBudget() {
+  const long pages = sysconf(_SC_PHYS_PAGES);     // NOLINT(runtime/int)
+  const long page_size = sysconf(_SC_PAGESIZE);  // NOLINT(runtime/int)
+  if (pages <= 0 || page_size <= 0) {
+    return 0;
+  }
+  // 64 MiB on a device with 4 GiB of RAM, enough for the FEC of a 7 GiB
+  // partition with 2 roots.
+  return static_cast<uint64_t>(pages) * page_size / 64;
+}
+
+StreamingEncodeFEC::~StreamingEncodeFEC() {
+  StopWorkers();
+}
+
+bool StreamingEncodeFEC::Init(uint64_t data_size,
+                              uint64_t fec_size,
+                              uint32_t fec_roots,
+                              uint32_t block_size,
+                              size_t num_threads) {
+  StopWorkers();
+  TEST_AND_RETURN_FALSE(block_size > 0 && data_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(fec_roots > 0 && fec_roots < FEC_RSM);
+  const size_t rs_n = FEC_RSM - fec_roots;
+  num_rounds_ = utils::DivRoundUp(data_size / block_size, rs_n);
+  TEST_AND_RETURN_FALSE(num_rounds_ * fec_roots * block_size == fec_size);
+  data_size_ = data_size;
+  fec_roots_ = fec_roots;
+  block_size_ = block_size;
+  num_threads_ = std::max<uint64_t>(1, std::min<uint64_t>(num_threads,
+                                                          num_rounds_));
+
+  // The generator polynomial is the product of (x + alpha^i) for i in
+  // [0, fec_roots), as FEC_PARAMS() uses 0 as first root and 1 as primitive
+  // element. |generator[i]| is the coefficient of x^i.
+  std::vector<uint8_t> generator{1};
+  uint8_t root = 1;
+  for (size_t i = 0; i < fec_roots_; i++) {
+    std::vector<uint8_t> product(generator.size() + 1, 0);
+    for (size_t j = 0; j < generator.size(); j++) {
+      product[j + 1] ^= generator[j];
+      product[j] ^= GfMultiply(generator[j], root);
+    }
+    generator = std::move(product);
+    root = GfMultiply(root, 2);
+  }
+  gen_mul_.resize(fec_roots_);
+  for (size_t i = 0; i < fec_roots_; i++) {
+    for (unsigned x = 0; x < 256; x++) {
+      gen_mul_[i][x] = GfMultiply(x, generator[i]);
+    }
+  }
+
+  fec_.assign(fec_size, 0);
+  pending_.clear();
+  pending_.reserve(kStreamingFecBatchSize);
+  bytes_encoded_ = 0;
+
+  batch_id_ = 0;
+  for (size_t i = 1; i < num_threads_; i++) {
+    workers_.emplace_back(&StreamingEncodeFEC::WorkerLoop, this, i);
+  }
+  return true;
+}
+
+bool StreamingEncodeFEC::Update(const uint8_t* data, size_t size) {
+  TEST_AND_RETURN_FALSE(bytes_encoded_ + size <= data_size_);
+  const size_t batch_size =
+      std::max<size_t>(1, kStreamingFecBatchSize / block_size_) * block_size_;
+  while (size > 0) {
+    const uint64_t next_block =
+        (bytes_encoded_ - pending_.size()) / block_size_;
+    if (pending_.empty() && size >= batch_size) {
+      // Encode directly from |data|.
+      EncodeBlocks(next_block, batch_size / block_size_, data);
+      data += batch_size;
+      size -= batch_size;
+      bytes_encoded_ += batch_size;
+      continue;
+    }
+    const size_t length = std::min(size, batch_size - pending_.size());
+    pending_.insert(pending_.end(), data, data + length);
+    data += length;
+    size -= length;
+    bytes_encoded_ += length;
+    if (pending_.size() == batch_size) {
+      EncodeBlocks(next_block, batch_size / block_size_, pending_.data());
+      pending_.clear();
+    }
+  }
+  return true;
+}
+
+bool StreamingEncodeFEC::Finalize() {
+  TEST_AND_RETURN_FALSE(bytes_encoded_ == data_size_);
+  uint64_t next_block = (bytes_encoded_ - pending_.size()) / block_size_;
+  if (!pending_.empty()) {
+    EncodeBlocks(next_block, pending_.size() / block_size_, pending_.data());
+    next_block += pending_.size() / block_size_;
+    pending_.clear();
+  }
+  // The last blocks of the codewords are past the end of the data, and treated
+  // as 0.
+  const uint64_t num_blocks = num_rounds_ * (FEC_RSM - fec_roots_);
+  const brillo::Blob zeros(
+      std::min<uint64_t>(num_blocks - next_block, num_rounds_) * block_size_);
+  while (next_block < num_blocks) {
+    const size_t count =
+        std::min<uint64_t>(num_blocks - next_block, zeros.size() / block_size_);
+    EncodeBlocks(next_block, count, zeros.data());
+    next_block += count;
+  }
+  pending_.shrink_to_fit();
+  StopWorkers();
+  return true;
+}
+
+void StreamingEncodeFEC::EncodeBlocks(uint64_t first_block,
+                                      size_t num_blocks,
+                                      const uint8_t* data) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    batch_first_block_ = first_block;
+    batch_num_blocks_ = num_blocks;
+    batch_data_ = data;
+    batch_id_++;
+    num_busy_workers_ = workers_.size();
+  }
+  batch_cv_.notify_all();
+  EncodeRounds(0);
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return num_busy_workers_ == 0; });
+}
+
+void StreamingEncodeFEC::EncodeRounds(size_t thread_index) {
+  // The blocks of a round must be encoded in order, so each thread encodes all
+  // the blocks of some of the rounds.
+  for (size_t i = 0; i < batch_num_blocks_; i++) {
+    const uint64_t round = (batch_first_block_ + i) % num_rounds_;
+    if (round % num_threads_ != thread_index) {
+      continue;
+    }
+    uint8_t* parity = fec_.data() + round * block_size_ * fec_roots_;
+    const uint8_t* block = batch_data_ + i * block_size_;
+    for (size_t k = 0; k < block_size_; k++, parity += fec_roots_) {
+      // One step of the LFSR of encode_rs_char().
+      const uint8_t feedback = block[k] ^ parity[0];
+      for (size_t j = 1; j < fec_roots_; j++) {
+        parity[j - 1] = parity[j] ^ gen_mul_[fec_roots_ - j][feedback];
+      }
+      parity[fec_roots_ - 1] = gen_mul_[0][feedback];
+    }
+  }
+}
+
+void StreamingEncodeFEC::WorkerLoop(size_t thread_index) {
+  // Workers are started before the first batch.
+  uint64_t last_batch_id = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    batch_cv_.wait(lock, [this, last_batch_id] {
+      return stop_workers_ || batch_id_ != last_batch_id;
+    });
+    if (stop_workers_) {
+      return;
+    }
+    last_batch_id = batch_id_;
+    lock.unlock();
+    EncodeRounds(thread_index);
+    lock.lock();
+    if (--num_busy_workers_ == 0) {
+      done_cv_.notify_one();
+    }
+  }
+}
+
+void StreamingEncodeFEC::StopWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_workers_ = true;
+  }
+  batch_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+  stop_workers_ = false;
+}
+
 bool IncrementalEncodeFEC::Init(const uint64_t _data_offset,
                                 const uint64_t _data_size,
                                 const uint64_t _fec_offset,
@@ -173,6 +390,20 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                                         partition_->fec_roots,
                                         partition_->block_size,
                                         false /* verify_mode */));
+  streaming_fec_.reset();
+  streaming_fec_written_ = false;
+  if (partition_->fec_size != 0 &&
+      partition_->fec_size <= StreamingEncodeFEC::MemoryBudget()) {
+    LOG(INFO) << "Encoding FEC while reading the partition";
+    streaming_fec_ = std::make_unique<StreamingEncodeFEC>();
+    TEST_AND_RETURN_FALSE(streaming_fec_->Init(
+        partition_->fec_data_size,
+        partition_->fec_size,
+        partition_->fec_roots,
+        partition_->block_size,
+        std::min<size_t>(kMaxFecThreads,
+                         std::max(1U, std::thread::hardware_concurrency()))));
+  }
   hash_tree_written_ = false;
   if (partition_->hash_tree_size != 0) {
     auto hash_function =
@@ -230,12 +461,61 @@ bool VerityWriterAndroid::Update(const uint64_t offset,
       }
     }
   }
+  if (streaming_fec_) {
+    TEST_AND_RETURN_FALSE(UpdateStreamingFEC(offset, buffer, size));
+  }
   total_offset_ += size;
 
   return true;
 }
-bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
-                                   FileDescriptor* write_fd) {
+
+bool VerityWriterAndroid::UpdateStreamingFEC(uint64_t offset,
+                                             const uint8_t* buffer,
+                                             size_t size) {
+  const uint64_t start_offset =
+      std::max(offset,
+               partition_->fec_data_offset + streaming_fec_->bytes_encoded());
+  const uint64_t end_offset =
+      std::min(offset + size,
+               partition_->fec_data_offset + partition_->fec_data_size);
+  if (start_offset < end_offset) {
+    TEST_AND_RETURN_FALSE(streaming_fec_->Update(buffer + start_offset - offset,
+                                                 end_offset - start_offset));
+  }
+  return true;
+}
+
+bool VerityWriterAndroid::IncrementalFinalizeStreamingFEC(
+    FileDescriptor* read_fd, FileDescriptor* write_fd) {
+  const uint64_t remaining =
+      streaming_fec_->data_size() - streaming_fec_->bytes_encoded();
+  if (remaining > 0) {
+    brillo::Blob buffer(std::min<uint64_t>(remaining, kStreamingFecReadSize));
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        read_fd,
+        buffer.data(),
+        buffer.size(),
+        partition_->fec_data_offset + streaming_fec_->bytes_encoded(),
+        &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == buffer.size());
+    return streaming_fec_->Update(buffer.data(), buffer.size());
+  }
+  TEST_AND_RETURN_FALSE(streaming_fec_->Finalize());
+  const brillo::Blob& fec = streaming_fec_->fec();
+  TEST_AND_RETURN_FALSE_ERRNO(
+      write_fd->Seek(partition_->fec_offset, SEEK_SET));
+  if (!utils::WriteAll(write_fd, fec.data(), fec.size())) {
+    PLOG(ERROR) << "EncodeFEC write() failed";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(write_fd->Flush());
+  streaming_fec_.reset();
+  streaming_fec_written_ = true;
+  return true;
+}
+
+bool VerityWriterAndroid::WriteHashTree(FileDescriptor* write_fd) {
   const auto hash_tree_data_end =
       partition_->hash_tree_data_offset + partition_->hash_tree_data_size;
   if (total_offset_ < hash_tree_data_end) {
@@ -260,8 +540,20 @@ bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
     TEST_AND_RETURN_FALSE(success);
     hash_tree_builder_.reset();
   }
+  return true;
+}
+bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
+                                   FileDescriptor* write_fd) {
+  TEST_AND_RETURN_FALSE(WriteHashTree(write_fd));
   if (partition_->fec_size != 0) {
     LOG(INFO) << "Writing verity FEC to " << partition_->readonly_target_path;
+    if (streaming_fec_) {
+      while (!streaming_fec_written_) {
+        TEST_AND_RETURN_FALSE(
+            IncrementalFinalizeStreamingFEC(read_fd, write_fd));
+      }
+      return true;
+    }
     TEST_AND_RETURN_FALSE(EncodeFEC(read_fd,
                                     write_fd,
                                     partition_->fec_data_offset,
@@ -279,42 +571,24 @@ bool VerityWriterAndroid::IncrementalFinalize(FileDescriptor* read_fd,
                                               FileDescriptor* write_fd) {
   if (!hash_tree_written_) {
     LOG(INFO) << "Completing prework in Finalize";
-    const auto hash_tree_data_end =
-        partition_->hash_tree_data_offset + partition_->hash_tree_data_size;
-    if (total_offset_ < hash_tree_data_end) {
-      LOG(ERROR) << "Read up to " << total_offset_
-                 << " when we are expecting to read everything "
-                    "before "
-                 << hash_tree_data_end;
-      return false;
-    }
-    // All hash tree data blocks has been hashed, write hash tree to disk.
-    LOG(INFO) << "Writing verity hash tree to "
-              << partition_->readonly_target_path;
-    if (hash_tree_builder_) {
-      TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
-      TEST_AND_RETURN_FALSE_ERRNO(
-          write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-      auto success =
-          hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
-            return utils::WriteAll(write_fd, data, size);
-          });
-      // hashtree builder already prints error messages.
-      TEST_AND_RETURN_FALSE(success);
-      hash_tree_builder_.reset();
-    }
+    TEST_AND_RETURN_FALSE(WriteHashTree(write_fd));
     hash_tree_written_ = true;
     if (partition_->fec_size != 0) {
       LOG(INFO) << "Writing verity FEC to " << partition_->readonly_target_path;
     }
   }
   if (partition_->fec_size != 0) {
-    TEST_AND_RETURN_FALSE(encodeFEC_.Compute(read_fd, write_fd));
+    if (streaming_fec_) {
+      TEST_AND_RETURN_FALSE(IncrementalFinalizeStreamingFEC(read_fd, write_fd));
+    } else if (!streaming_fec_written_) {
+      TEST_AND_RETURN_FALSE(encodeFEC_.Compute(read_fd, write_fd));
+    }
   }
   return true;
 }
 bool VerityWriterAndroid::FECFinished() const {
-  if ((encodeFEC_.Finished() || partition_->fec_size == 0) &&
+  if ((encodeFEC_.Finished() || streaming_fec_written_ ||
+       partition_->fec_size == 0) &&
       hash_tree_written_) {
     return true;
   }
@@ -322,6 +596,16 @@ bool VerityWriterAndroid::FECFinished() const {
 }
 
 double VerityWriterAndroid::GetProgress() {
+  if (streaming_fec_written_) {
+    return 1.0;
+  }
+  if (streaming_fec_) {
+    if (streaming_fec_->data_size() == 0) {
+      return 1.0;
+    }
+    return static_cast<double>(streaming_fec_->bytes_encoded()) /
+           streaming_fec_->data_size();
+  }
   return encodeFEC_.ReportProgress();
 }
 
@@ -17,8 +17,13 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_WRITER_ANDROID_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_VERITY_WRITER_ANDROID_H_
 
+#include <array>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <verity/hash_tree_builder.h>
 #include <base/logging.h>
@@ -79,6 +84,93 @@ class IncrementalEncodeFEC {
   UnownedCachedFileDescriptor cache_fd_;
 };
 
+// Computes the FEC of a partition in a single sequential pass over its data,
+// instead of re-reading the data once per round like IncrementalEncodeFEC.
+//
+// Each round interleaves one block out of every |num_rounds| blocks of the
+// data, so the k-th bytes of the blocks of a round form the k-th RS codeword,
+// in the order the blocks appear in the data. The encoder is an LFSR, so the
+// parity of all the codewords can be updated as the blocks come in. This keeps
+// the parity of all the rounds in memory, i.e. |fec_size| bytes, which is
+// about 0.8% of the data.
+class StreamingEncodeFEC {
+ public:
+  StreamingEncodeFEC() = default;
+  ~StreamingEncodeFEC();
+
+  // Returns the maximum |fec_size| worth encoding in memory on this device.
+  static uint64_t MemoryBudget();
+
+  bool Init(uint64_t data_size,
+            uint64_t fec_size,
+            uint32_t fec_roots,
+            uint32_t block_size,
+            size_t num_threads);
+
+  // Encodes the next |size| bytes of the data.
+  bool Update(const uint8_t* data, size_t size);
+
+  // Number of bytes of data passed to Update() so far.
+  uint64_t bytes_encoded() const { return bytes_encoded_; }
+  uint64_t data_size() const { return data_size_; }
+
+  // Encodes the padding after the data once all of it was passed to Update().
+  // The parity of all the rounds is then in fec(). Stops the worker threads.
+  bool Finalize();
+  const brillo::Blob& fec() const { return fec_; }
+
+ private:
+  // Feeds the |num_blocks| blocks in |data| starting at the block |first_block|
+  // of the data to the encoder, spreading the rounds over the threads.
+  void EncodeBlocks(uint64_t first_block,
+                    size_t num_blocks,
+                    const uint8_t* data);
+
+  // Encodes the blocks of the current batch which belong to the rounds of the
+  // thread |thread_index|.
+  void EncodeRounds(size_t thread_index);
+
+  // Runs the share of each batch of the thread |thread_index| until the
+  // workers are stopped.
+  void WorkerLoop(size_t thread_index);
+  void StopWorkers();
+
+  uint64_t data_size_{0};
+  uint32_t fec_roots_{0};
+  uint32_t block_size_{0};
+  uint64_t num_rounds_{0};
+  size_t num_threads_{1};
+
+  // The threads encoding the batches along with the caller of EncodeBlocks(),
+  // which is thread 0. They live from Init() to Finalize(), since a partition
+  // is encoded in thousands of batches.
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  // Signaled when a batch is started, and when the workers are stopped.
+  std::condition_variable batch_cv_;
+  // Signaled when the last worker is done with the current batch.
+  std::condition_variable done_cv_;
+  // Incremented for each batch, so that the workers tell it from the last one.
+  uint64_t batch_id_{0};
+  size_t num_busy_workers_{0};
+  bool stop_workers_{false};
+  // The batch being encoded. Set before |batch_id_| is incremented, and left
+  // alone until all the workers are done with it.
+  uint64_t batch_first_block_{0};
+  size_t batch_num_blocks_{0};
+  const uint8_t* batch_data_{nullptr};
+
+  // |gen_mul_[i][x]| is the product of |x| and the i-th coefficient of the
+  // generator polynomial of the RS code.
+  std::vector<std::array<uint8_t, 256>> gen_mul_;
+  // The LFSR state of every codeword, which is its parity once all the data
+  // was encoded. Laid out like the FEC on disk.
+  brillo::Blob fec_;
+  // Data not encoded yet, so that the blocks are encoded in batches.
+  brillo::Blob pending_;
+  uint64_t bytes_encoded_{0};
+};
+
 class VerityWriterAndroid : public VerityWriterInterface {
  public:
   VerityWriterAndroid() = default;
@@ -93,10 +185,10 @@ class VerityWriterAndroid : public VerityWriterInterface {
   bool FECFinished() const override;
   // Read [data_offset : data_offset + data_size) from |path| and encode FEC
   // data, if |verify_mode|, then compare the encoded FEC with the one in
-  // |path|, otherwise write the encoded FEC to |path|. We can't encode as we go
-  // in each Update() like hash tree, because for every rs block, its data are
-  // spreaded across entire |data_size|, unless we can cache all data in
-  // memory, we have to re-read them from disk.
+  // |path|, otherwise write the encoded FEC to |path|. For every rs block, its
+  // data are spreaded across entire |data_size|, so they are re-read from disk
+  // for each round. Update() uses StreamingEncodeFEC instead when the FEC fits
+  // in memory.
   static bool EncodeFEC(FileDescriptor* read_fd,
                         FileDescriptor* write_fd,
                         uint64_t data_offset,
@@ -116,8 +208,23 @@ class VerityWriterAndroid : public VerityWriterInterface {
                         bool verify_mode);
 
  private:
+  // Writes the hash tree once all the data it covers was passed to Update().
+  bool WriteHashTree(FileDescriptor* write_fd);
+
+  // Passes the data in [offset, offset + size) of the partition covered by the
+  // FEC to |streaming_fec_|.
+  bool UpdateStreamingFEC(uint64_t offset, const uint8_t* buffer, size_t size);
+
+  // Reads the data covered by the FEC which wasn't passed to Update(), like
+  // the hash tree, one chunk per call. Writes the FEC once done.
+  bool IncrementalFinalizeStreamingFEC(FileDescriptor* read_fd,
+                                       FileDescriptor* write_fd);
+
   // stores the state of EncodeFEC
   IncrementalEncodeFEC encodeFEC_;
+  // Used instead of |encodeFEC_| when the FEC fits in the memory budget.
+  std::unique_ptr<StreamingEncodeFEC> streaming_fec_;
+  bool streaming_fec_written_ = false;
   bool hash_tree_written_ = false;
   const InstallPlan::Partition* partition_ = nullptr;
 
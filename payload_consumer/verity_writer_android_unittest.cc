@@ -165,6 +165,84 @@ TEST_F(VerityWriterAndroidTest, FECTest) {
   ASSERT_EQ(part_data, actual_part);
 }
 
+TEST_F(VerityWriterAndroidTest, StreamingFECMatchesEncodeFECTest) {
+  // 600 blocks take 3 rounds with 2 roots, and 4 rounds with 24 roots, the
+  // last ones partially past the end of the data.
+  constexpr size_t kNumBlocks = 600;
+  for (uint32_t fec_roots : {2, 24}) {
+    const uint64_t rounds = utils::DivRoundUp(kNumBlocks, FEC_RSM - fec_roots);
+    const uint64_t fec_size = rounds * fec_roots * 4096;
+    brillo::Blob part_data(kNumBlocks * 4096 + fec_size);
+    test_utils::FillWithData(&part_data);
+    test_utils::WriteFileVector(partition_.target_path, part_data);
+    ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                               0,
+                                               kNumBlocks * 4096,
+                                               kNumBlocks * 4096,
+                                               fec_size,
+                                               fec_roots,
+                                               4096,
+                                               false /* verify_mode */));
+    brillo::Blob expected_part;
+    ASSERT_TRUE(utils::ReadFile(partition_.target_path, &expected_part));
+
+    // The same encoder is reused, restarting its worker threads.
+    StreamingEncodeFEC encoder;
+    for (size_t num_threads : {1, 3}) {
+      ASSERT_TRUE(encoder.Init(
+          kNumBlocks * 4096, fec_size, fec_roots, 4096, num_threads));
+      // Pass the data in chunks which aren't aligned to blocks.
+      constexpr size_t kChunkSize = 100000;
+      for (size_t offset = 0; offset < kNumBlocks * 4096;
+           offset += kChunkSize) {
+        ASSERT_TRUE(encoder.Update(
+            part_data.data() + offset,
+            std::min(kChunkSize, kNumBlocks * 4096 - offset)));
+      }
+      ASSERT_TRUE(encoder.Finalize());
+      ASSERT_EQ(brillo::Blob(expected_part.begin() + kNumBlocks * 4096,
+                             expected_part.end()),
+                encoder.fec());
+    }
+  }
+}
+
+TEST_F(VerityWriterAndroidTest, IncrementalFinalizeFECTest) {
+  partition_.hash_tree_size = 0;
+  partition_.hash_tree_data_size = 0;
+  partition_.hash_tree_offset = 0;
+  // The FEC covers a block which isn't passed to Update(), like the hash tree.
+  partition_.fec_data_offset = 0;
+  partition_.fec_data_size = 2 * 4096;
+  partition_.fec_offset = 2 * 4096;
+  partition_.fec_size = 2 * 4096;
+  brillo::Blob part_data(4 * 4096);
+  test_utils::FillWithData(&part_data);
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+  ScopedTempFile expected_file;
+  test_utils::WriteFileVector(expected_file.path(), part_data);
+  ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(expected_file.path(),
+                                             0,
+                                             2 * 4096,
+                                             2 * 4096,
+                                             2 * 4096,
+                                             2,
+                                             4096,
+                                             false /* verify_mode */));
+
+  ASSERT_TRUE(verity_writer_.Init(partition_));
+  ASSERT_TRUE(verity_writer_.Update(0, part_data.data(), 4096));
+  while (!verity_writer_.FECFinished()) {
+    ASSERT_TRUE(verity_writer_.IncrementalFinalize(partition_fd_.get(),
+                                                   partition_fd_.get()));
+  }
+  ASSERT_EQ(1.0, verity_writer_.GetProgress());
+  brillo::Blob expected_part, actual_part;
+  ASSERT_TRUE(utils::ReadFile(expected_file.path(), &expected_part));
+  ASSERT_TRUE(utils::ReadFile(partition_.target_path, &actual_part));
+  ASSERT_EQ(expected_part, actual_part);
+}
+
 TEST_F(VerityWriterAndroidTest, HashTreeDisabled) {
   partition_.hash_tree_size = 0;
   partition_.hash_tree_data_size = 0;
@@ -17,6 +17,8 @@
 #include "update_engine/payload_generator/ab_generator.h"
 
 #include <algorithm>
+#include <iterator>
+#include <set>
 #include <utility>
 
 #include <base/strings/stringprintf.h>
@@ -75,6 +77,15 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
   if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
     TEST_AND_RETURN_FALSE(AddSourceHash(aops, old_part.path));
 
+  if (config.reorder_operations) {
+    // Writes to a VABC partition are appended to the COW image wherever
+    // their destination is, so only the source reads are worth ordering.
+    const bool vabc_enabled =
+        config.target.dynamic_partition_metadata &&
+        config.target.dynamic_partition_metadata->vabc_enabled();
+    SortOperationsByLocality(aops, vabc_enabled ? 0 : 1);
+  }
+
   return true;
 }
 
@@ -83,6 +94,125 @@ void ABGenerator::SortOperationsByDestination(
   sort(aops->begin(), aops->end(), diff_utils::CompareAopsByDestination);
 }
 
+namespace {
+// The number of operations considered on each side of the current source
+// and destination positions when picking the next one.
+constexpr size_t kLocalityCandidates = 8;
+
+uint64_t BlockDistance(uint64_t first, uint64_t second) {
+  return first > second ? first - second : second - first;
+}
+
+uint64_t ExtentsEnd(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  const Extent& last = extents[extents.size() - 1];
+  return last.start_block() + last.num_blocks();
+}
+
+// Returns the total distance in blocks skipped between the source extents of
+// consecutive operations, and between their destination extents.
+std::pair<uint64_t, uint64_t> SeekDistances(
+    const vector<AnnotatedOperation>& aops) {
+  uint64_t src_head = 0, dst_head = 0;
+  uint64_t src_distance = 0, dst_distance = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    if (aop.op.src_extents_size() > 0) {
+      src_distance +=
+          BlockDistance(src_head, aop.op.src_extents(0).start_block());
+      src_head = ExtentsEnd(aop.op.src_extents());
+    }
+    if (aop.op.dst_extents_size() > 0) {
+      dst_distance +=
+          BlockDistance(dst_head, aop.op.dst_extents(0).start_block());
+      dst_head = ExtentsEnd(aop.op.dst_extents());
+    }
+  }
+  return {src_distance, dst_distance};
+}
+
+// Adds to |candidates| the operations of |positions| starting closest to
+// |head|, up to kLocalityCandidates on each side.
+void AddClosestOperations(
+    const std::set<std::pair<uint64_t, size_t>>& positions,
+    uint64_t head,
+    vector<size_t>* candidates) {
+  auto after = positions.lower_bound({head, 0});
+  auto before = after;
+  for (size_t i = 0; i < kLocalityCandidates && after != positions.end();
+       i++, after++) {
+    candidates->push_back(after->second);
+  }
+  for (size_t i = 0; i < kLocalityCandidates && before != positions.begin();
+       i++) {
+    candidates->push_back((--before)->second);
+  }
+}
+}  // namespace
+
+void ABGenerator::SortOperationsByLocality(vector<AnnotatedOperation>* aops,
+                                           uint64_t dst_seek_weight) {
+  const auto end = std::stable_partition(
+      aops->begin(), aops->end(), [](const AnnotatedOperation& aop) {
+        return aop.op.dst_extents_size() > 0;
+      });
+  const size_t num_ops = end - aops->begin();
+  if (num_ops < 2)
+    return;
+  const auto old_distances = SeekDistances(*aops);
+
+  // The operations left to pick, by the start of their first source and
+  // destination extents.
+  std::set<std::pair<uint64_t, size_t>> by_src, by_dst;
+  for (size_t i = 0; i < num_ops; i++) {
+    const InstallOperation& op = (*aops)[i].op;
+    if (op.src_extents_size() > 0)
+      by_src.emplace(op.src_extents(0).start_block(), i);
+    by_dst.emplace(op.dst_extents(0).start_block(), i);
+  }
+
+  vector<AnnotatedOperation> sorted_aops;
+  sorted_aops.reserve(aops->size());
+  vector<size_t> candidates;
+  uint64_t src_head = 0, dst_head = 0;
+  while (!by_dst.empty()) {
+    candidates.clear();
+    AddClosestOperations(by_src, src_head, &candidates);
+    AddClosestOperations(by_dst, dst_head, &candidates);
+    // Ties go to the operation coming first by destination.
+    size_t best = num_ops;
+    uint64_t best_cost = 0;
+    for (size_t i : candidates) {
+      const InstallOperation& op = (*aops)[i].op;
+      uint64_t cost = dst_seek_weight *
+                      BlockDistance(dst_head, op.dst_extents(0).start_block());
+      if (op.src_extents_size() > 0)
+        cost += BlockDistance(src_head, op.src_extents(0).start_block());
+      if (best == num_ops || cost < best_cost ||
+          (cost == best_cost && i < best)) {
+        best = i;
+        best_cost = cost;
+      }
+    }
+
+    const InstallOperation& op = (*aops)[best].op;
+    if (op.src_extents_size() > 0) {
+      by_src.erase({op.src_extents(0).start_block(), best});
+      src_head = ExtentsEnd(op.src_extents());
+    }
+    by_dst.erase({op.dst_extents(0).start_block(), best});
+    dst_head = ExtentsEnd(op.dst_extents());
+    sorted_aops.push_back(std::move((*aops)[best]));
+  }
+  std::move(end, aops->end(), std::back_inserter(sorted_aops));
+  *aops = std::move(sorted_aops);
+
+  const auto new_distances = SeekDistances(*aops);
+  LOG(INFO) << "Reordered " << num_ops << " operations, source seek distance "
+            << old_distances.first << " -> " << new_distances.first
+            << " blocks, destination seek distance " << old_distances.second
+            << " -> " << new_distances.second << " blocks.";
+}
+
 bool ABGenerator::FragmentOperations(const PayloadVersion& version,
                                      vector<AnnotatedOperation>* aops,
                                      const string& target_part_path,
@@ -72,6 +72,21 @@ class ABGenerator : public OperationsGenerator {
   static void SortOperationsByDestination(
       std::vector<AnnotatedOperation>* aops);
 
+  // Reorders the operations in |aops| so that each one reads its source
+  // blocks close to where the previous one stopped reading, to cut the seeks
+  // on the source partition while applying them. The cost of picking an
+  // operation next is the distance in blocks between the end of the last
+  // source extent read and its first source extent, plus |dst_seek_weight|
+  // times the same distance for destination extents; the cheapest operation
+  // among the closest ones is picked greedily. Operations without destination
+  // extents stay at the end, like with SortOperationsByDestination().
+  //
+  // Operations of an A/B update are independent of each other, as they read
+  // the source slot and write disjoint destination extents, so any order
+  // applies the same way. Operations must not be merged after this.
+  static void SortOperationsByLocality(std::vector<AnnotatedOperation>* aops,
+                                       uint64_t dst_seek_weight);
+
   // Takes an SOURCE_COPY install operation, |aop|, and adds one operation for
   // each dst extent in |aop| to |ops|. The new operations added to |ops| will
   // have only one dst extent. The src extents are split so the number of blocks
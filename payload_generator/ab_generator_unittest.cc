@@ -428,6 +428,40 @@ TEST_F(ABGeneratorTest, SortOperationsByDestinationTest) {
   EXPECT_EQ(second_aop.name, aops[2].name);
 }
 
+TEST_F(ABGeneratorTest, SortOperationsByLocalityTest) {
+  vector<AnnotatedOperation> aops(4);
+  aops[0].name = "far_source";
+  *aops[0].op.add_src_extents() = ExtentForRange(100, 1);
+  *aops[0].op.add_dst_extents() = ExtentForRange(0, 1);
+  aops[1].name = "near_source";
+  *aops[1].op.add_src_extents() = ExtentForRange(0, 1);
+  *aops[1].op.add_dst_extents() = ExtentForRange(10, 1);
+  aops[2].name = "far_source_and_destination";
+  *aops[2].op.add_src_extents() = ExtentForRange(101, 1);
+  *aops[2].op.add_dst_extents() = ExtentForRange(20, 1);
+  // Operations without destination extents stay at the end.
+  aops[3].name = "no_destination";
+
+  // Only the source blocks matter: they are read in order.
+  vector<AnnotatedOperation> sorted_aops = aops;
+  ABGenerator::SortOperationsByLocality(&sorted_aops, 0);
+  ASSERT_EQ(4U, sorted_aops.size());
+  EXPECT_EQ("near_source", sorted_aops[0].name);
+  EXPECT_EQ("far_source", sorted_aops[1].name);
+  EXPECT_EQ("far_source_and_destination", sorted_aops[2].name);
+  EXPECT_EQ("no_destination", sorted_aops[3].name);
+
+  // Seeking back to destination block 0 from block 11 costs more than
+  // seeking one more source block forward.
+  sorted_aops = aops;
+  ABGenerator::SortOperationsByLocality(&sorted_aops, 1);
+  ASSERT_EQ(4U, sorted_aops.size());
+  EXPECT_EQ("near_source", sorted_aops[0].name);
+  EXPECT_EQ("far_source_and_destination", sorted_aops[1].name);
+  EXPECT_EQ("far_source", sorted_aops[2].name);
+  EXPECT_EQ("no_destination", sorted_aops[3].name);
+}
+
 TEST_F(ABGeneratorTest, MergeSourceCopyOperationsTest) {
   vector<AnnotatedOperation> aops;
   InstallOperation first_op;
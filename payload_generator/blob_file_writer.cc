@@ -16,31 +16,60 @@
 
 #include "update_engine/payload_generator/blob_file_writer.h"
 
+#include <algorithm>
+
 #include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+void UpdateMax(std::atomic<size_t>* max_value, size_t value) {
+  size_t current = max_value->load();
+  while (value > current && !max_value->compare_exchange_weak(current, value)) {
+  }
+}
+}  // namespace
+
 off_t BlobFileWriter::StoreBlob(const brillo::Blob& blob) {
-  base::AutoLock auto_lock(blob_mutex_);
-  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), *blob_file_size_))
+  const size_t in_flight = ++stores_in_flight_;
+  if (in_flight > 1)
+    concurrent_stores_++;
+  UpdateMax(&max_concurrent_stores_, in_flight);
+
+  const off_t result = next_offset_.fetch_add(blob.size());
+  const bool success =
+      utils::PWriteAll(blob_fd_, blob.data(), blob.size(), result);
+  stores_in_flight_--;
+  if (!success)
     return -1;
+  stored_bytes_ += blob.size();
 
-  off_t result = *blob_file_size_;
-  *blob_file_size_ += blob.size();
+  const off_t end = result + blob.size();
+  if (blob_file_size_) {
+    base::AutoLock auto_lock(blob_file_size_mutex_);
+    *blob_file_size_ = std::max(*blob_file_size_, end);
+  }
 
-  stored_blobs_++;
-  if (total_blobs_ > 0 && (10 * (stored_blobs_ - 1) / total_blobs_) !=
-                              (10 * stored_blobs_ / total_blobs_)) {
-    LOG(INFO) << (100 * stored_blobs_ / total_blobs_) << "% complete "
-              << stored_blobs_ << "/" << total_blobs_
-              << " ops (output size: " << *blob_file_size_ << ")";
+  const size_t stored_blobs = ++stored_blobs_;
+  const size_t total_blobs = total_blobs_.load();
+  if (total_blobs > 0 && (10 * (stored_blobs - 1) / total_blobs) !=
+                             (10 * stored_blobs / total_blobs)) {
+    LOG(INFO) << (100 * stored_blobs / total_blobs) << "% complete "
+              << stored_blobs << "/" << total_blobs
+              << " ops (output size: " << next_offset_.load() << ")";
   }
   return result;
 }
 
 void BlobFileWriter::IncTotalBlobs(size_t increment) {
-  base::AutoLock auto_lock(blob_mutex_);
   total_blobs_ += increment;
 }
 
+BlobFileWriter::Stats BlobFileWriter::GetStats() const {
+  return {stored_blobs_.load(),
+          stored_bytes_.load(),
+          concurrent_stores_.load(),
+          max_concurrent_stores_.load()};
+}
+
 }  // namespace chromeos_update_engine
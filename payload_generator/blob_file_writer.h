@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 
+#include <atomic>
+
 #include <base/macros.h>
 
 #include <base/synchronization/lock.h>
@@ -26,27 +28,54 @@ namespace chromeos_update_engine {
 
 class BlobFileWriter {
  public:
+  // Counters of the blobs stored, telling how much the blob file was written
+  // and how much the writes overlapped.
+  struct Stats {
+    size_t stored_blobs;
+    uint64_t stored_bytes;
+    // The number of blobs whose write started while others were being
+    // written, which had to wait for them when writes were serialized.
+    size_t concurrent_stores;
+    // The largest number of blobs written at once.
+    size_t max_concurrent_stores;
+  };
+
   // Create the BlobFileWriter object that will manage the blobs stored to
   // |blob_fd| in a thread safe way.
   BlobFileWriter(int blob_fd, off_t* blob_file_size)
-      : blob_fd_(blob_fd), blob_file_size_(blob_file_size) {}
+      : blob_fd_(blob_fd),
+        next_offset_(blob_file_size ? *blob_file_size : 0),
+        blob_file_size_(blob_file_size) {}
 
   // Store the passed |blob| in the blob file. Returns the offset at which it
-  // was stored, or -1 in case of failure.
+  // was stored, or -1 in case of failure. Blobs are written concurrently, each
+  // to the range of the file it reserved, and can be read back once this
+  // returns.
   off_t StoreBlob(const brillo::Blob& blob);
 
   // Increase |total_blobs| by |increment|. Thread safe.
   void IncTotalBlobs(size_t increment);
 
+  Stats GetStats() const;
+
  private:
-  size_t total_blobs_{0};
-  size_t stored_blobs_{0};
+  std::atomic<size_t> total_blobs_{0};
+  std::atomic<size_t> stored_blobs_{0};
+  std::atomic<uint64_t> stored_bytes_{0};
+
+  std::atomic<size_t> stores_in_flight_{0};
+  std::atomic<size_t> concurrent_stores_{0};
+  std::atomic<size_t> max_concurrent_stores_{0};
 
-  // The file and its size are protected with the |blob_mutex_|.
   int blob_fd_;
-  off_t* blob_file_size_;
+  // The offset at which the next blob is stored. Each blob reserves its range
+  // by moving it forward, so no lock is held while writing.
+  std::atomic<off_t> next_offset_;
 
-  base::Lock blob_mutex_;
+  // The end of the blobs written so far, for the caller. Protected with the
+  // |blob_file_size_mutex_|, held only to update it.
+  off_t* blob_file_size_;
+  base::Lock blob_file_size_mutex_;
 
   DISALLOW_COPY_AND_ASSIGN(BlobFileWriter);
 };
@@ -17,6 +17,8 @@
 #include "update_engine/payload_generator/blob_file_writer.h"
 
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -47,6 +49,58 @@ TEST(BlobFileWriterTest, SimpleTest) {
       blob_file.fd(), stored_blob.data(), kBlobSize, 0, &bytes_read));
   EXPECT_EQ(bytes_read, kBlobSize);
   EXPECT_EQ(blob, stored_blob);
+  EXPECT_EQ(2 * kBlobSize, blob_file_size);
+
+  const BlobFileWriter::Stats stats = blob_file_writer.GetStats();
+  EXPECT_EQ(2U, stats.stored_blobs);
+  EXPECT_EQ(static_cast<uint64_t>(2 * kBlobSize), stats.stored_bytes);
+  EXPECT_EQ(0U, stats.concurrent_stores);
+  EXPECT_EQ(1U, stats.max_concurrent_stores);
+}
+
+TEST(BlobFileWriterTest, ConcurrentStoresTest) {
+  ScopedTempFile blob_file("BlobFileWriterTest.XXXXXX", true);
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file_writer(blob_file.fd(), &blob_file_size);
+
+  constexpr size_t kNumThreads = 8;
+  constexpr size_t kBlobsPerThread = 50;
+  std::vector<std::vector<off_t>> offsets(kNumThreads);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&, t] {
+      for (size_t i = 0; i < kBlobsPerThread; i++) {
+        // Each blob has its own size and contents.
+        brillo::Blob blob(100 + t * kBlobsPerThread + i, 'a' + t);
+        offsets[t].push_back(blob_file_writer.StoreBlob(blob));
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  uint64_t total_size = 0;
+  for (size_t t = 0; t < kNumThreads; t++) {
+    for (size_t i = 0; i < kBlobsPerThread; i++) {
+      brillo::Blob blob(100 + t * kBlobsPerThread + i, 'a' + t);
+      brillo::Blob stored_blob(blob.size());
+      ssize_t bytes_read;
+      ASSERT_GE(offsets[t][i], 0);
+      ASSERT_TRUE(utils::PReadAll(blob_file.fd(),
+                                  stored_blob.data(),
+                                  stored_blob.size(),
+                                  offsets[t][i],
+                                  &bytes_read));
+      EXPECT_EQ(blob, stored_blob);
+      total_size += blob.size();
+    }
+  }
+  // The blobs don't overlap and leave no gaps.
+  EXPECT_EQ(static_cast<off_t>(total_size), blob_file_size);
+  const BlobFileWriter::Stats stats = blob_file_writer.GetStats();
+  EXPECT_EQ(kNumThreads * kBlobsPerThread, stats.stored_blobs);
+  EXPECT_EQ(total_size, stats.stored_bytes);
+  EXPECT_LE(stats.max_concurrent_stores, kNumThreads);
 }
 
 }  // namespace chromeos_update_engine
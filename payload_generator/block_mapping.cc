@@ -20,29 +20,89 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <string>
-#include <utility>
 #include <vector>
 
+#include <base/logging.h>
+#include <openssl/sha.h>
+
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/diff_task_scheduler.h"
 
 using std::string;
 using std::vector;
 
+namespace chromeos_update_engine {
+
 namespace {
 
-size_t HashValue(const brillo::Blob& blob) {
-  std::hash<string> hash_fn;
-  return hash_fn(string(blob.begin(), blob.end()));
+// The size of the initial hash table.
+constexpr size_t kMinSlots = 1024;
+
+// The number of bytes read and hashed by each task of HashDiskBlocks().
+constexpr size_t kHashChunkSize = 4 * 1024 * 1024;
+
+// Submits to |group| the tasks hashing |num_blocks| contiguous blocks of
+// |block_size| bytes of |fd| from |initial_byte_offset| into |block_hashes|.
+// |success| is cleared if any of them fails.
+void SubmitHashDiskBlocks(DiffTaskScheduler::TaskGroup* group,
+                          int fd,
+                          off_t initial_byte_offset,
+                          size_t num_blocks,
+                          size_t block_size,
+                          vector<BlockMapping::BlockHash>* block_hashes,
+                          std::atomic<bool>* success) {
+  block_hashes->resize(num_blocks);
+  const size_t chunk_blocks = std::max<size_t>(1, kHashChunkSize / block_size);
+  for (size_t first = 0; first < num_blocks; first += chunk_blocks) {
+    const size_t count = std::min(chunk_blocks, num_blocks - first);
+    const off_t byte_offset = initial_byte_offset + first * block_size;
+    BlockMapping::BlockHash* hashes = block_hashes->data() + first;
+    group->Submit([=] {
+      brillo::Blob buffer(count * block_size);
+      ssize_t bytes_read = 0;
+      if (!utils::PReadAll(
+              fd, buffer.data(), buffer.size(), byte_offset, &bytes_read) ||
+          static_cast<size_t>(bytes_read) != buffer.size()) {
+        LOG(ERROR) << "Failed to read " << buffer.size() << " bytes at offset "
+                   << byte_offset;
+        *success = false;
+        return;
+      }
+      for (size_t i = 0; i < count; i++) {
+        hashes[i] =
+            BlockMapping::HashBlock(buffer.data() + i * block_size, block_size);
+      }
+    });
+  }
 }
 
 }  // namespace
 
-namespace chromeos_update_engine {
+// static
+BlockMapping::BlockHash BlockMapping::HashBlock(const uint8_t* data,
+                                                size_t size) {
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(data, size, digest);
+  BlockHash hash;
+  static_assert(sizeof(hash) <= sizeof(digest), "BlockHash is too large");
+  memcpy(hash.data(), digest, sizeof(hash));
+  return hash;
+}
+
+void BlockMapping::Reserve(size_t num_blocks) {
+  while (slots_.size() < std::max(kMinSlots, num_blocks * 2)) {
+    Grow();
+  }
+}
 
 BlockMapping::BlockId BlockMapping::AddBlock(const brillo::Blob& block_data) {
-  return AddBlock(-1, 0, block_data);
+  if (block_data.size() != block_size_)
+    return -1;
+  return AddBlockHash(HashBlock(block_data.data(), block_data.size()));
 }
 
 BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
@@ -52,89 +112,76 @@ BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
     return -1;
   if (static_cast<size_t>(bytes_read) != block_size_)
     return -1;
-  return AddBlock(fd, byte_offset, blob);
+  return AddBlock(blob);
 }
 
 bool BlockMapping::AddManyDiskBlocks(int fd,
                                      off_t initial_byte_offset,
                                      size_t num_blocks,
                                      vector<BlockId>* block_ids) {
-  bool ret = true;
-  block_ids->resize(num_blocks);
-  for (size_t block = 0; block < num_blocks; block++) {
-    (*block_ids)[block] =
-        AddDiskBlock(fd, initial_byte_offset + block * block_size_);
-    ret = ret && (*block_ids)[block] != -1;
+  vector<BlockHash> block_hashes;
+  TEST_AND_RETURN_FALSE(HashDiskBlocks(
+      fd, initial_byte_offset, num_blocks, block_size_, &block_hashes));
+  AddBlockHashes(block_hashes, block_ids);
+  return true;
+}
+
+void BlockMapping::AddBlockHashes(const vector<BlockHash>& block_hashes,
+                                  vector<BlockId>* block_ids) {
+  block_ids->resize(block_hashes.size());
+  for (size_t i = 0; i < block_hashes.size(); i++) {
+    (*block_ids)[i] = AddBlockHash(block_hashes[i]);
   }
-  return ret;
 }
 
-BlockMapping::BlockId BlockMapping::AddBlock(int fd,
-                                             off_t byte_offset,
-                                             const brillo::Blob& block_data) {
-  if (block_data.size() != block_size_)
-    return -1;
-  size_t h = HashValue(block_data);
-
-  // We either reuse a UniqueBlock or create a new one. If we need a new
-  // UniqueBlock it could also be part of a new or existing bucket (if there is
-  // a hash collision).
-  vector<UniqueBlock>* bucket = nullptr;
-
-  auto mapping_it = mapping_.find(h);
-  if (mapping_it == mapping_.end()) {
-    bucket = &mapping_[h];
-  } else {
-    for (UniqueBlock& existing_block : mapping_it->second) {
-      bool equals = false;
-      if (!existing_block.CompareData(block_data, &equals))
-        return -1;
-      if (equals)
-        return existing_block.block_id;
+BlockMapping::BlockId BlockMapping::AddBlockHash(const BlockHash& hash) {
+  if (static_cast<size_t>(used_block_ids + 1) * 2 > slots_.size())
+    Grow();
+  // The hash is uniformly distributed, so any part of it is a good index.
+  const size_t mask = slots_.size() - 1;
+  for (size_t index = hash[0] & mask;; index = (index + 1) & mask) {
+    Slot& slot = slots_[index];
+    if (slot.block_id == -1) {
+      slot.hash = hash;
+      slot.block_id = used_block_ids++;
+      return slot.block_id;
     }
-    bucket = &mapping_it->second;
+    if (slot.hash == hash)
+      return slot.block_id;
   }
+}
 
-  // No existing block was found at this point, so we create and fill in a new
-  // one.
-  bucket->emplace_back();
-  UniqueBlock* new_ublock = &bucket->back();
-
-  new_ublock->times_read = 1;
-  new_ublock->fd = fd;
-  new_ublock->byte_offset = byte_offset;
-  new_ublock->block_id = used_block_ids++;
-  // We need to cache blocks that are not referencing any disk location.
-  if (fd == -1)
-    new_ublock->block_data = block_data;
-
-  return new_ublock->block_id;
+void BlockMapping::Grow() {
+  vector<Slot> old_slots(std::max(kMinSlots, slots_.size() * 2));
+  old_slots.swap(slots_);
+  const size_t mask = slots_.size() - 1;
+  for (const Slot& old_slot : old_slots) {
+    if (old_slot.block_id == -1)
+      continue;
+    size_t index = old_slot.hash[0] & mask;
+    while (slots_[index].block_id != -1)
+      index = (index + 1) & mask;
+    slots_[index] = old_slot;
+  }
 }
 
-bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
-                                            bool* equals) {
-  if (!block_data.empty()) {
-    *equals = block_data == other_block;
-    return true;
+bool HashDiskBlocks(int fd,
+                    off_t initial_byte_offset,
+                    size_t num_blocks,
+                    size_t block_size,
+                    vector<BlockMapping::BlockHash>* block_hashes) {
+  std::atomic<bool> success{true};
+  {
+    DiffTaskScheduler::TaskGroup group(DiffTaskScheduler::Get());
+    SubmitHashDiskBlocks(&group,
+                         fd,
+                         initial_byte_offset,
+                         num_blocks,
+                         block_size,
+                         block_hashes,
+                         &success);
   }
-  const size_t block_size = other_block.size();
-  brillo::Blob blob(block_size);
-  ssize_t bytes_read = 0;
-  if (!utils::PReadAll(fd, blob.data(), block_size, byte_offset, &bytes_read))
-    return false;
-  if (static_cast<size_t>(bytes_read) != block_size)
-    return false;
-  *equals = blob == other_block;
-
-  // We increase the number of times we had to read this block from disk and
-  // we cache this block based on that. This caching method is optimized for
-  // the common use case of having two partitions that share blocks between them
-  // but have few repeated blocks inside each partition, such as the block
-  // with all zeros or duplicated files.
-  times_read++;
-  if (times_read > 3)
-    block_data = std::move(blob);
-  return true;
+  return success;
 }
 
 bool MapPartitionBlocks(const string& old_part,
@@ -144,18 +191,32 @@ bool MapPartitionBlocks(const string& old_part,
                         size_t block_size,
                         vector<BlockMapping::BlockId>* old_block_ids,
                         vector<BlockMapping::BlockId>* new_block_ids) {
-  BlockMapping mapping(block_size);
-  if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
-    return false;
   int old_fd = HANDLE_EINTR(open(old_part.c_str(), O_RDONLY));
   int new_fd = HANDLE_EINTR(open(new_part.c_str(), O_RDONLY));
   ScopedFdCloser old_fd_closer(&old_fd);
   ScopedFdCloser new_fd_closer(&new_fd);
 
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      old_fd, 0, old_size / block_size, old_block_ids));
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      new_fd, 0, new_size / block_size, new_block_ids));
+  // Hash both partitions at once, which is where all the time goes. Only
+  // assigning the block ids needs to be done in order.
+  const size_t old_num_blocks = old_size / block_size;
+  const size_t new_num_blocks = new_size / block_size;
+  vector<BlockMapping::BlockHash> old_hashes, new_hashes;
+  std::atomic<bool> success{true};
+  {
+    DiffTaskScheduler::TaskGroup group(DiffTaskScheduler::Get());
+    SubmitHashDiskBlocks(
+        &group, old_fd, 0, old_num_blocks, block_size, &old_hashes, &success);
+    SubmitHashDiskBlocks(
+        &group, new_fd, 0, new_num_blocks, block_size, &new_hashes, &success);
+  }
+  TEST_AND_RETURN_FALSE(success);
+
+  BlockMapping mapping(block_size);
+  mapping.Reserve(old_num_blocks + new_num_blocks + 1);
+  if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
+    return false;
+  mapping.AddBlockHashes(old_hashes, old_block_ids);
+  mapping.AddBlockHashes(new_hashes, new_block_ids);
   return true;
 }
 
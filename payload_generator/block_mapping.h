@@ -17,12 +17,11 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 
-#include <map>
+#include <array>
 #include <string>
 #include <vector>
 
 #include <brillo/secure_blob.h>
-#include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/payload_generator/payload_generation_config.h"
 
@@ -33,20 +32,31 @@ namespace chromeos_update_engine {
 // hash function in that two blocks with the same data will have the same id but
 // also two blocks with the same id will have the same data. This is only valid
 // in the context of the same BlockMapping instance.
+//
+// Blocks are identified by their SHA-256 hash truncated to 128 bits, which is
+// treated as unique like the rest of the update_engine does with SHA-256
+// hashes, so blocks never need to be kept in memory or read again to be
+// compared. The hashes are kept in a flat open-addressed hash table.
 class BlockMapping {
  public:
   using BlockId = int64_t;
+  using BlockHash = std::array<uint64_t, 2>;
 
   explicit BlockMapping(size_t block_size) : block_size_(block_size) {}
 
+  // Returns the hash identifying the block |data| of |size| bytes.
+  static BlockHash HashBlock(const uint8_t* data, size_t size);
+
+  // Reserves space for |num_blocks| unique blocks.
+  void Reserve(size_t num_blocks);
+
   // Add a single data block to the mapping. Returns its unique block id.
   // In case of error returns -1.
   BlockId AddBlock(const brillo::Blob& block_data);
 
   // Add a block from disk reading it from the file descriptor |fd| from the
-  // offset in bytes |byte_offset|. The data block may or may not be cached, so
-  // the file descriptor must be available until the BlockMapping is destroyed.
-  // Returns the unique block id of the added block or -1 in case of error.
+  // offset in bytes |byte_offset|. Returns the unique block id of the added
+  // block or -1 in case of error.
   BlockId AddDiskBlock(int fd, off_t byte_offset);
 
   // This is a helper method to add |num_blocks| contiguous blocks reading them
@@ -58,43 +68,44 @@ class BlockMapping {
                          size_t num_blocks,
                          std::vector<BlockId>* block_ids);
 
+  // Add the blocks whose hashes are |block_hashes|, as returned by HashBlock(),
+  // and stores in |block_ids| the block id for each one of them.
+  void AddBlockHashes(const std::vector<BlockHash>& block_hashes,
+                      std::vector<BlockId>* block_ids);
+
  private:
-  FRIEND_TEST(BlockMappingTest, BlocksAreNotKeptInMemory);
+  // Returns the block id of the block with the hash |hash|, assigning a new one
+  // if it wasn't added yet.
+  BlockId AddBlockHash(const BlockHash& hash);
 
-  // Add a single block passed in |block_data|. If |fd| is not -1, the block
-  // can be discarded to save RAM and retrieved later from |fd| at the position
-  // |byte_offset|.
-  BlockId AddBlock(int fd, off_t byte_offset, const brillo::Blob& block_data);
+  // Doubles the size of |slots_| and inserts the unique blocks again.
+  void Grow();
 
   size_t block_size_;
 
   BlockId used_block_ids{0};
 
-  // The UniqueBlock represents the data of a block associated to a unique
-  // block id.
-  struct UniqueBlock {
-    brillo::Blob block_data;
-
-    // The block id assigned to this unique block.
-    BlockId block_id;
-
-    // The location on this unique block on disk (if not cached in block_data).
-    int fd{-1};
-    off_t byte_offset{0};
-
-    // Number of times we have seen this data block. Used for caching.
-    uint32_t times_read{0};
-
-    // Compares the UniqueBlock data with the other_block data and stores if
-    // they are equal in |equals|. Returns whether there was an error reading
-    // the block from disk while comparing it.
-    bool CompareData(const brillo::Blob& other_block, bool* equals);
+  // A slot of the hash table, associating the hash of a unique block with its
+  // block id. Unused slots have a |block_id| of -1.
+  struct Slot {
+    BlockHash hash;
+    BlockId block_id{-1};
   };
 
-  // A mapping from hash values to possible block ids.
-  std::map<size_t, std::vector<UniqueBlock>> mapping_;
+  // The hash table of unique blocks, using linear probing. Its size is always
+  // a power of two, and at most half of it is used.
+  std::vector<Slot> slots_;
 };
 
+// Hashes |num_blocks| contiguous blocks of |block_size| bytes of the file
+// descriptor |fd| starting at offset |initial_byte_offset|, in parallel, and
+// stores the hash of each block in |block_hashes|.
+bool HashDiskBlocks(int fd,
+                    off_t initial_byte_offset,
+                    size_t num_blocks,
+                    size_t block_size,
+                    std::vector<BlockMapping::BlockHash>* block_hashes);
+
 // Maps the blocks of the old and new partitions |old_part| and |new_part| whose
 // size in bytes are |old_size| and |new_size| into block ids where two blocks
 // with the same data will have the same block id and vice versa, regardless of
@@ -20,6 +20,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -53,33 +54,27 @@ TEST_F(BlockMappingTest, FirstAddedBlockIsZero) {
   EXPECT_EQ(1, bm_.AddBlock(blob));
 }
 
-TEST_F(BlockMappingTest, BlocksAreNotKeptInMemory) {
+TEST_F(BlockMappingTest, DiskBlocksAreNotReadAgain) {
   test_utils::WriteFileString(old_part_.path(), string(block_size_, 'a'));
   int old_fd = HANDLE_EINTR(open(old_part_.path().c_str(), O_RDONLY));
   ScopedFdCloser old_fd_closer(&old_fd);
 
   EXPECT_EQ(0, bm_.AddDiskBlock(old_fd, 0));
 
-  // Check that the block_data is not stored on memory if we just used the block
-  // once.
-  for (const auto& it : bm_.mapping_) {
-    for (const BlockMapping::UniqueBlock& ublock : it.second) {
-      EXPECT_TRUE(ublock.block_data.empty());
-    }
-  }
-
-  brillo::Blob block(block_size_, 'a');
-  for (int i = 0; i < 5; ++i) {
-    // Re-add the same block 5 times.
-    EXPECT_EQ(0, bm_.AddBlock(block));
-  }
+  // Only the hash of the block is kept, so the block on disk can change.
+  test_utils::WriteFileString(old_part_.path(), string(block_size_, 'b'));
+  EXPECT_EQ(0, bm_.AddBlock(brillo::Blob(block_size_, 'a')));
+  EXPECT_EQ(1, bm_.AddBlock(brillo::Blob(block_size_, 'b')));
+}
 
-  for (const auto& it : bm_.mapping_) {
-    for (const BlockMapping::UniqueBlock& ublock : it.second) {
-      EXPECT_FALSE(ublock.block_data.empty());
-      // The block was loaded from disk only 4 times, and after that the counter
-      // is not updated anymore.
-      EXPECT_EQ(4U, ublock.times_read);
+TEST_F(BlockMappingTest, ManyUniqueBlocks) {
+  // Enough blocks to grow the hash table a few times.
+  constexpr size_t kNumBlocks = 10000;
+  brillo::Blob blob(block_size_);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (size_t i = 0; i < kNumBlocks; ++i) {
+      memcpy(blob.data(), &i, sizeof(i));
+      EXPECT_EQ(static_cast<BlockMapping::BlockId>(i), bm_.AddBlock(blob));
     }
   }
 }
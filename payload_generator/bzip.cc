@@ -27,40 +27,65 @@
 namespace chromeos_update_engine {
 
 bool BzipCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return BzipCompress(in, nullptr, out);
+}
+
+bool BzipCompress(const brillo::Blob& in,
+                  const std::atomic<size_t>* max_size,
+                  brillo::Blob* out) {
   TEST_AND_RETURN_FALSE(out);
   out->clear();
   if (in.size() == 0)
     return true;
 
-  // We expect a compression ratio of about 35% with bzip2, so we start with
-  // that much output space, which will then be doubled if needed.
-  size_t buf_size = 40 + in.size() * 35 / 100;
-  out->resize(buf_size);
-
-  // Try increasing buffer size until it works
-  for (;;) {
-    if (buf_size > std::numeric_limits<uint32_t>::max())
-      return false;
-    uint32_t data_size = buf_size;
-    int rc = BZ2_bzBuffToBuffCompress(
-        reinterpret_cast<char*>(out->data()),
-        &data_size,
-        reinterpret_cast<char*>(const_cast<uint8_t*>(in.data())),
-        in.size(),
-        9,   // Best compression
-        0,   // Silent verbosity
-        0);  // Default work factor
-    TEST_AND_RETURN_FALSE(rc == BZ_OUTBUFF_FULL || rc == BZ_OK);
-    if (rc == BZ_OK) {
-      // we're done!
-      out->resize(data_size);
-      return true;
+  bz_stream stream{};
+  TEST_AND_RETURN_FALSE(BZ2_bzCompressInit(&stream,
+                                           9,  // Best compression
+                                           0,  // Silent verbosity
+                                           0)  // Default work factor
+                        == BZ_OK);
+  // The input is fed in chunks so that |max_size| is checked regularly. The
+  // output is the same as compressing it all at once.
+  constexpr size_t kChunkSize = 1024 * 1024;
+  size_t in_pos = 0;
+  size_t out_pos = 0;
+  int rc = BZ_RUN_OK;
+  while (rc != BZ_STREAM_END) {
+    if (stream.avail_in == 0 && in_pos < in.size()) {
+      const size_t size = std::min(kChunkSize, in.size() - in_pos);
+      stream.next_in =
+          reinterpret_cast<char*>(const_cast<uint8_t*>(in.data() + in_pos));
+      stream.avail_in = size;
+      in_pos += size;
     }
-
-    // Data didn't fit; double the buffer size.
-    buf_size *= 2;
-    out->resize(buf_size);
+    // We expect a compression ratio of about 35% with bzip2, so we start with
+    // that much output space, which will then be grown if needed.
+    if (out->size() - out_pos < kChunkSize / 4)
+      out->resize(std::max(40 + in.size() * 35 / 100, out->size() * 2));
+    const size_t avail_out =
+        std::min(out->size() - out_pos,
+                 static_cast<size_t>(std::numeric_limits<uint32_t>::max()));
+    stream.next_out = reinterpret_cast<char*>(out->data() + out_pos);
+    stream.avail_out = avail_out;
+    const bool finish = stream.avail_in == 0 && in_pos == in.size();
+    rc = BZ2_bzCompress(&stream, finish ? BZ_FINISH : BZ_RUN);
+    out_pos += avail_out - stream.avail_out;
+    if (rc != BZ_RUN_OK && rc != BZ_FINISH_OK && rc != BZ_STREAM_END) {
+      LOG(ERROR) << "BZ2_bzCompress failed: " << rc;
+      break;
+    }
+    if (max_size && out_pos > max_size->load(std::memory_order_relaxed)) {
+      rc = BZ_OUTBUFF_FULL;
+      break;
+    }
+  }
+  BZ2_bzCompressEnd(&stream);
+  if (rc != BZ_STREAM_END) {
+    out->clear();
+    return false;
   }
+  out->resize(out_pos);
+  return true;
 }
 
 }  // namespace chromeos_update_engine
@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BZIP_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BZIP_H_
 
+#include <atomic>
+
 #include <brillo/secure_blob.h>
 
 namespace chromeos_update_engine {
@@ -24,6 +26,13 @@ namespace chromeos_update_engine {
 // Compresses the input buffer |in| into |out| with bzip2.
 bool BzipCompress(const brillo::Blob& in, brillo::Blob* out);
 
+// Like BzipCompress(), but gives up and returns false as soon as the
+// compressed data grows larger than |*max_size| bytes. |*max_size| may be
+// lowered by other threads meanwhile. A null |max_size| means no limit.
+bool BzipCompress(const brillo::Blob& in,
+                  const std::atomic<size_t>* max_size,
+                  brillo::Blob* out);
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_BZIP_H_
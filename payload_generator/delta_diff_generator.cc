@@ -24,12 +24,12 @@
 
 #include <algorithm>
 #include <memory>
+#include <numeric>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <base/logging.h>
-#include <base/threading/simple_thread.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
@@ -40,6 +40,7 @@
 #include "update_engine/payload_generator/blob_file_writer.h"
 #include "update_engine/payload_generator/cow_size_estimator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/diff_task_scheduler.h"
 #include "update_engine/payload_generator/full_update_generator.h"
 #include "update_engine/payload_generator/merge_sequence_generator.h"
 #include "update_engine/payload_generator/payload_file.h"
@@ -54,7 +55,7 @@ namespace chromeos_update_engine {
 // bytes
 const size_t kRootFSPartitionSize = static_cast<size_t>(2) * 1024 * 1024 * 1024;
 
-class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
+class PartitionProcessor {
   bool IsDynamicPartition(const std::string& partition_name) {
     for (const auto& group :
          config_.target.dynamic_partition_metadata->groups()) {
@@ -87,7 +88,7 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
         strategy_(std::move(strategy)) {}
   PartitionProcessor(PartitionProcessor&&) noexcept = default;
 
-  void Run() override {
+  void Run() {
     LOG(INFO) << "Started an async task to process partition "
               << new_part_.name;
     bool success = strategy_->GenerateOperations(
@@ -191,10 +192,10 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
     std::vector<size_t> all_cow_sizes(config.target.partitions.size(), 0);
 
     std::vector<PartitionProcessor> partition_tasks{};
-    auto thread_count = std::min<int>(diff_utils::GetMaxThreads(),
-                                      config.target.partitions.size());
-    base::DelegateSimpleThreadPool thread_pool{"partition-thread-pool",
-                                               thread_count};
+    // The partitions, and the files and chunks within them, are all processed
+    // on the same threads.
+    DiffTaskScheduler::SetMaxThreads(config.max_threads);
+    DiffTaskScheduler* scheduler = DiffTaskScheduler::Get();
     for (size_t i = 0; i < config.target.partitions.size(); i++) {
       const PartitionConfig& old_part =
           config.is_delta ? config.source.partitions[i] : empty_part;
@@ -226,11 +227,39 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                                    &all_cow_sizes[i],
                                                    std::move(strategy)));
     }
-    thread_pool.Start();
-    for (auto& processor : partition_tasks) {
-      thread_pool.AddWork(&processor);
+    // Start with the largest partitions, so that they don't end up running
+    // alone at the end.
+    vector<size_t> task_order(partition_tasks.size());
+    std::iota(task_order.begin(), task_order.end(), 0);
+    std::stable_sort(
+        task_order.begin(), task_order.end(), [&config](size_t a, size_t b) {
+          return config.target.partitions[a].size >
+                 config.target.partitions[b].size;
+        });
+    DiffTaskScheduler::TaskGroup group(scheduler);
+    for (size_t i : task_order) {
+      group.Submit([&processor = partition_tasks[i]] { processor.Run(); });
     }
-    thread_pool.JoinAll();
+    group.Wait();
+
+    // Blobs replaced while generating the operations stay in the data file, so
+    // it can be larger than what the payload references.
+    uint64_t referenced_bytes = 0;
+    for (const auto& aops : all_aops) {
+      for (const auto& aop : aops)
+        referenced_bytes += aop.op.data_length();
+    }
+    const BlobFileWriter::Stats blob_stats = blob_file.GetStats();
+    const double write_amplification =
+        referenced_bytes > 0
+            ? static_cast<double>(blob_stats.stored_bytes) / referenced_bytes
+            : 1.0;
+    LOG(INFO) << "Stored " << blob_stats.stored_blobs << " blobs, "
+              << blob_stats.stored_bytes << " bytes, of which "
+              << referenced_bytes << " are in the payload (write amplification "
+              << write_amplification << "). " << blob_stats.concurrent_stores
+              << " blobs were written concurrently with others, at most "
+              << blob_stats.max_concurrent_stores << " at once.";
 
     for (size_t i = 0; i < config.target.partitions.size(); i++) {
       const PartitionConfig& old_part =
@@ -30,6 +30,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <limits>
 #include <list>
@@ -43,7 +44,7 @@
 #include <base/format_macros.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
-#include <base/threading/simple_thread.h>
+#include <base/time/time.h>
 #include <brillo/data_encoding.h>
 #include <bsdiff/bsdiff.h>
 #include <bsdiff/constants.h>
@@ -65,6 +66,9 @@
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
+#include "update_engine/payload_generator/diff_predictor.h"
+#include "update_engine/payload_generator/diff_task_scheduler.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/xz.h"
@@ -95,6 +99,22 @@ const uint64_t kMaxZucchiniDestinationSize = 150 * 1024 * 1024;  // bytes
 
 const int kBrotliCompressionQuality = 11;
 
+// A compressor for a full operation, giving up once its output is larger than
+// |*max_size| bytes.
+using FullOperationCompressor = bool (*)(const brillo::Blob& in,
+                                         const std::atomic<size_t>* max_size,
+                                         brillo::Blob* out);
+
+// The compressors GenerateBestFullOperation() picks from, for each full
+// operation type the payload supports. On ties, the earliest one wins.
+const struct {
+  InstallOperation::Type type;
+  FullOperationCompressor compress;
+} kFullOperationCompressors[] = {
+    {InstallOperation::REPLACE_XZ, XzCompress},
+    {InstallOperation::REPLACE_BZ, BzipCompress},
+};
+
 // Storing a diff operation has more overhead over replace operation in the
 // manifest, we need to store an additional src_sha256_hash which is 32 bytes
 // and not compressible, and also src_extents which could use anywhere from a
@@ -187,6 +207,59 @@ void AppendXorBlock(std::vector<CowMergeOperation>* ops,
   }
 }
 
+// Identifies the format of the keys of the diff cache entries. It must be
+// changed whenever the diffs generated for the same inputs change.
+constexpr char kDiffCacheKeyVersion[] = "delta-diff-cache-1";
+// Identifies the diff predictor in the keys of the diffs generated with it,
+// as the diffs it skips change the result.
+constexpr char kDiffPredictorVersion[] = "diff-predictor-1";
+
+// Whether zucchini should be tried on the file |name|.
+bool IsZucchiniCandidate(const string& name) {
+  // zip files are ignored for now. We expect puffin to perform better on those.
+  // Investigate whether puffin over zucchini yields better results on those.
+  return deflate_utils::IsFileExtensions(
+      name,
+      {".ko",
+       ".so",
+       ".art",
+       ".odex",
+       ".vdex",
+       "<kernel>",
+       "<modem-partition>",
+       /*, ".capex",".jar", ".apk", ".apex"*/});
+}
+
+bool HashUint64(uint64_t value, HashCalculator* hasher) {
+  return hasher->Update(&value, sizeof(value));
+}
+
+bool HashBytes(const void* data, size_t size, HashCalculator* hasher) {
+  return HashUint64(size, hasher) && hasher->Update(data, size);
+}
+
+bool HashBitExtents(const vector<puffin::BitExtent>& extents,
+                    HashCalculator* hasher) {
+  TEST_AND_RETURN_FALSE(HashUint64(extents.size(), hasher));
+  for (const auto& extent : extents) {
+    TEST_AND_RETURN_FALSE(HashUint64(extent.offset, hasher));
+    TEST_AND_RETURN_FALSE(HashUint64(extent.length, hasher));
+  }
+  return true;
+}
+
+bool HashCompressedFile(const CompressedFile& file, HashCalculator* hasher) {
+  TEST_AND_RETURN_FALSE(HashUint64(file.blocks.size(), hasher));
+  for (const auto& block : file.blocks) {
+    TEST_AND_RETURN_FALSE(HashUint64(block.uncompressed_offset, hasher));
+    TEST_AND_RETURN_FALSE(HashUint64(block.compressed_length, hasher));
+    TEST_AND_RETURN_FALSE(HashUint64(block.uncompressed_length, hasher));
+  }
+  const string algo = file.algo.SerializeAsString();
+  TEST_AND_RETURN_FALSE(HashBytes(algo.data(), algo.size(), hasher));
+  return HashUint64(file.zero_padding_enabled, hasher);
+}
+
 }  // namespace
 
 namespace diff_utils {
@@ -213,6 +286,107 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
     brillo::Blob* data_blob) {
   CHECK(aop);
   CHECK(data_blob);
+  if (config_.diff_cache_dir.empty()) {
+    return GenerateBestDiffOperationUncached(diff_candidates, aop, data_blob);
+  }
+
+  DiffCache diff_cache(config_.diff_cache_dir);
+  brillo::Blob key;
+  TEST_AND_RETURN_FALSE(
+      GetDiffCacheKey(diff_candidates, *aop, *data_blob, &key));
+  // The full operation is part of the key, so entries keeping it don't need to
+  // store its data again.
+  const InstallOperation::Type full_op_type = aop->op.type();
+  InstallOperation::Type op_type{};
+  brillo::Blob patch;
+  if (diff_cache.Lookup(key, &op_type, &patch)) {
+    if (op_type != full_op_type) {
+      // The XOR ops refer to the source blocks, which aren't part of the key,
+      // so they are computed again from the patch.
+      if (config_.enable_vabc_xor &&
+          (op_type == InstallOperation::SOURCE_BSDIFF ||
+           op_type == InstallOperation::BROTLI_BSDIFF)) {
+        StoreExtents(src_extents_, aop->op.mutable_src_extents());
+        diff_utils::PopulateXorOps(aop, patch);
+      }
+      aop->op.set_type(op_type);
+      *data_blob = std::move(patch);
+    }
+    return true;
+  }
+
+  TEST_AND_RETURN_FALSE(
+      GenerateBestDiffOperationUncached(diff_candidates, aop, data_blob));
+  // Failing to update the cache only costs the next generations some time.
+  if (aop->op.type() == full_op_type) {
+    diff_cache.Store(key, full_op_type, {});
+  } else {
+    diff_cache.Store(key, aop->op.type(), *data_blob);
+  }
+  return true;
+}
+
+bool BestDiffGenerator::GetDiffCacheKey(
+    const std::vector<std::pair<InstallOperation_Type, size_t>>&
+        diff_candidates,
+    const AnnotatedOperation& aop,
+    const brillo::Blob& data_blob,
+    brillo::Blob* key) const {
+  HashCalculator hasher;
+  TEST_AND_RETURN_FALSE(HashBytes(
+      kDiffCacheKeyVersion, sizeof(kDiffCacheKeyVersion) - 1, &hasher));
+
+  // The configuration affecting the diffs.
+  TEST_AND_RETURN_FALSE(HashUint64(config_.version.major, &hasher));
+  TEST_AND_RETURN_FALSE(HashUint64(config_.version.minor, &hasher));
+  for (auto op_type : {InstallOperation::SOURCE_BSDIFF,
+                       InstallOperation::BROTLI_BSDIFF,
+                       InstallOperation::PUFFDIFF,
+                       InstallOperation::ZUCCHINI,
+                       InstallOperation::LZ4DIFF_BSDIFF,
+                       InstallOperation::LZ4DIFF_PUFFDIFF}) {
+    TEST_AND_RETURN_FALSE(
+        HashUint64(config_.OperationEnabled(op_type), &hasher));
+  }
+  TEST_AND_RETURN_FALSE(HashUint64(config_.compressors.size(), &hasher));
+  for (auto compressor : config_.compressors) {
+    TEST_AND_RETURN_FALSE(
+        HashUint64(static_cast<uint64_t>(compressor), &hasher));
+  }
+  TEST_AND_RETURN_FALSE(HashUint64(diff_candidates.size(), &hasher));
+  for (const auto& [op_type, limit] : diff_candidates) {
+    TEST_AND_RETURN_FALSE(HashUint64(op_type, &hasher));
+    TEST_AND_RETURN_FALSE(HashUint64(limit, &hasher));
+  }
+  TEST_AND_RETURN_FALSE(HashUint64(IsZucchiniCandidate(aop.name), &hasher));
+  if (config_.predict_diff_methods) {
+    TEST_AND_RETURN_FALSE(HashBytes(
+        kDiffPredictorVersion, sizeof(kDiffPredictorVersion) - 1, &hasher));
+  }
+
+  // The full operation the diffs are compared with.
+  TEST_AND_RETURN_FALSE(HashUint64(aop.op.type(), &hasher));
+  TEST_AND_RETURN_FALSE(HashUint64(data_blob.size(), &hasher));
+  TEST_AND_RETURN_FALSE(HashUint64(src_extents_.size(), &hasher));
+
+  // The data and what is known about its content.
+  TEST_AND_RETURN_FALSE(HashBytes(old_data_.data(), old_data_.size(), &hasher));
+  TEST_AND_RETURN_FALSE(HashBytes(new_data_.data(), new_data_.size(), &hasher));
+  TEST_AND_RETURN_FALSE(HashBitExtents(old_deflates_, &hasher));
+  TEST_AND_RETURN_FALSE(HashBitExtents(new_deflates_, &hasher));
+  TEST_AND_RETURN_FALSE(HashCompressedFile(old_block_info_, &hasher));
+  TEST_AND_RETURN_FALSE(HashCompressedFile(new_block_info_, &hasher));
+
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *key = hasher.raw_hash();
+  return true;
+}
+
+bool BestDiffGenerator::GenerateBestDiffOperationUncached(
+    const std::vector<std::pair<InstallOperation_Type, size_t>>&
+        diff_candidates,
+    AnnotatedOperation* aop,
+    brillo::Blob* data_blob) {
   if (!old_block_info_.blocks.empty() && !new_block_info_.blocks.empty() &&
       config_.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) &&
       config_.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF)) {
@@ -235,6 +409,13 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
   const uint64_t input_bytes = std::max(utils::BlocksInExtents(src_extents_),
                                         utils::BlocksInExtents(dst_extents_)) *
                                kBlockSize;
+  const bool record_stats = !config_.diff_stats_file.empty();
+  DiffStats stats;
+  if (config_.predict_diff_methods || record_stats) {
+    stats.features = ComputeDiffFeatures(old_data_, new_data_, new_deflates_);
+  }
+  stats.full_size = data_blob->size();
+  tried_diffs_.clear();
 
   for (auto [op_type, limit] : diff_candidates) {
     if (!config_.OperationEnabled(op_type)) {
@@ -254,6 +435,11 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       op_type = InstallOperation::BROTLI_BSDIFF;
     }
 
+    if (config_.predict_diff_methods && !DiffMayWin(op_type, stats.features)) {
+      stats.skipped.push_back(op_type);
+      continue;
+    }
+
     switch (op_type) {
       case InstallOperation::SOURCE_BSDIFF:
       case InstallOperation::BROTLI_BSDIFF:
@@ -271,9 +457,22 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
     }
   }
 
+  if (record_stats) {
+    stats.name = aop->name;
+    stats.new_size = new_data_.size();
+    stats.tried = std::move(tried_diffs_);
+    stats.chosen_type = aop->op.type();
+    // Failing to record the stats doesn't affect the payload.
+    AppendDiffStats(config_.diff_stats_file, stats);
+  }
   return true;
 }
 
+void BestDiffGenerator::RecordTriedDiff(InstallOperation_Type op_type,
+                                        size_t patch_size) {
+  tried_diffs_.emplace_back(op_type, patch_size);
+}
+
 bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
     InstallOperation_Type operation_type,
     AnnotatedOperation* aop,
@@ -300,6 +499,7 @@ bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
 
   TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), &bsdiff_delta));
   TEST_AND_RETURN_FALSE(!bsdiff_delta.empty());
+  RecordTriedDiff(operation_type, bsdiff_delta.size());
 
   InstallOperation& operation = aop->op;
   if (IsDiffOperationBetter(operation,
@@ -332,6 +532,7 @@ bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
                                            temp_file.path(),
                                            &puffdiff_delta));
     TEST_AND_RETURN_FALSE(!puffdiff_delta.empty());
+    RecordTriedDiff(InstallOperation::PUFFDIFF, puffdiff_delta.size());
 
     InstallOperation& operation = aop->op;
     if (IsDiffOperationBetter(operation,
@@ -347,18 +548,7 @@ bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
 
 bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
                                                       brillo::Blob* data_blob) {
-  // zip files are ignored for now. We expect puffin to perform better on those.
-  // Investigate whether puffin over zucchini yields better results on those.
-  if (!deflate_utils::IsFileExtensions(
-          aop->name,
-          {".ko",
-           ".so",
-           ".art",
-           ".odex",
-           ".vdex",
-           "<kernel>",
-           "<modem-partition>",
-           /*, ".capex",".jar", ".apk", ".apex"*/})) {
+  if (!IsZucchiniCandidate(aop->name)) {
     return true;
   }
   zucchini::ConstBufferView src_bytes(old_data_.data(), old_data_.size());
@@ -377,6 +567,7 @@ bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
   brillo::Blob compressed_delta;
   TEST_AND_RETURN_FALSE(puffin::BrotliEncode(
       zucchini_delta.data(), zucchini_delta.size(), &compressed_delta));
+  RecordTriedDiff(InstallOperation::ZUCCHINI, compressed_delta.size());
 
   InstallOperation& operation = aop->op;
   if (IsDiffOperationBetter(operation,
@@ -393,7 +584,7 @@ bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
 // This class encapsulates a file delta processing thread work. The
 // processor computes the delta between the source and target files;
 // and write the compressed delta to the blob.
-class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
+class FileDeltaProcessor {
  public:
   FileDeltaProcessor(const string& old_part,
                      const string& new_part,
@@ -417,12 +608,11 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
     return new_extents_blocks_ > other.new_extents_blocks_;
   }
 
-  ~FileDeltaProcessor() override = default;
+  ~FileDeltaProcessor() = default;
 
-  // Overrides DelegateSimpleThread::Delegate.
   // Calculate the list of operations and write their corresponding deltas to
   // the blob_file.
-  void Run() override;
+  void Run();
 
   // Merge each file processor's ops list to aops.
   bool MergeOperation(vector<AnnotatedOperation>* aops);
@@ -514,7 +704,7 @@ FilesystemInterface::File GetOldFile(
 }
 
 std::vector<Extent> RemoveDuplicateBlocks(const std::vector<Extent>& extents) {
-  ExtentRanges extent_set;
+  FlatExtentRanges extent_set;
   std::vector<Extent> ret;
   for (const auto& extent : extents) {
     auto vec = FilterExtentRanges({extent}, extent_set);
@@ -534,8 +724,10 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                         const PayloadGenerationConfig& config,
                         BlobFileWriter* blob_file) {
   const auto& version = config.version;
-  ExtentRanges old_visited_blocks;
-  ExtentRanges new_visited_blocks;
+  // The visited blocks are added and filtered for every file, so they are kept
+  // in flat ranges.
+  FlatExtentRanges old_visited_blocks;
+  FlatExtentRanges new_visited_blocks;
 
   // If verity is enabled, mark those blocks as visited to skip generating
   // operations for them.
@@ -557,7 +749,6 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
       new_part, &new_files, puffdiff_allowed));
 
-  ExtentRanges old_zero_blocks;
   // Prematurely removing moved blocks will render compression info useless.
   // Even if a single block inside a 100MB file is filtered out, the entire
   // 100MB file can't be decompressed. In this case we will fallback to BSDIFF,
@@ -570,6 +761,10 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
       });
   if (!config.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) ||
       no_compressed_files) {
+    ExtentRanges old_moved_blocks;
+    ExtentRanges new_moved_blocks;
+    ExtentRanges old_zero_blocks;
+    new_moved_blocks.AddExtents(new_visited_blocks.ToExtents());
     TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(aops,
                                                   old_part.path,
                                                   new_part.path,
@@ -578,9 +773,11 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                                   soft_chunk_blocks,
                                                   config,
                                                   blob_file,
-                                                  &old_visited_blocks,
-                                                  &new_visited_blocks,
+                                                  &old_moved_blocks,
+                                                  &new_moved_blocks,
                                                   &old_zero_blocks));
+    old_visited_blocks.AddRanges(FlatExtentRanges(old_moved_blocks));
+    new_visited_blocks.AddRanges(FlatExtentRanges(new_moved_blocks));
   }
 
   map<string, FilesystemInterface::File> old_files_map;
@@ -675,25 +872,18 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                        blob_file);
   }
 
-  size_t max_threads = GetMaxThreads();
-
-  if (config.max_threads > 0) {
-    max_threads = config.max_threads;
-  }
-
   // Sort the files in descending order based on number of new blocks to make
   // sure we start the largest ones first.
-  if (file_delta_processors.size() > max_threads) {
-    file_delta_processors.sort(std::greater<FileDeltaProcessor>());
-  }
+  file_delta_processors.sort(std::greater<FileDeltaProcessor>());
 
-  base::DelegateSimpleThreadPool thread_pool("incremental-update-generator",
-                                             max_threads);
-  thread_pool.Start();
+  // The files are processed on the threads shared with the other partitions,
+  // which are already busy when several partitions are generated at once.
+  DiffTaskScheduler::SetMaxThreads(config.max_threads);
+  DiffTaskScheduler::TaskGroup group(DiffTaskScheduler::Get());
   for (auto& processor : file_delta_processors) {
-    thread_pool.AddWork(&processor);
+    group.Submit([&processor] { processor.Run(); });
   }
-  thread_pool.JoinAll();
+  group.Wait();
 
   for (auto& processor : file_delta_processors) {
     TEST_AND_RETURN_FALSE(processor.MergeOperation(aops));
@@ -935,40 +1125,59 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     return true;
   }
 
-  bool out_blob_set = false;
-
-  // Try compressing |new_data| with xz first.
-  if (version.OperationAllowed(InstallOperation::REPLACE_XZ)) {
-    brillo::Blob new_data_xz;
-    if (XzCompress(new_data, &new_data_xz) && !new_data_xz.empty()) {
-      *out_type = InstallOperation::REPLACE_XZ;
-      *out_blob = std::move(new_data_xz);
-      out_blob_set = true;
+  // Try all the allowed compressors at once. Each gives up as soon as its
+  // output is larger than the best one found so far, or than |new_data|.
+  struct CompressorTrial {
+    InstallOperation::Type type;
+    FullOperationCompressor compress;
+    brillo::Blob blob;
+    bool success = false;
+  };
+  vector<CompressorTrial> trials;
+  for (const auto& compressor : kFullOperationCompressors) {
+    if (version.OperationAllowed(compressor.type))
+      trials.push_back({compressor.type, compressor.compress});
+  }
+  std::atomic<size_t> max_size{new_data.size() - 1};
+  auto run_trial = [&new_data, &max_size](CompressorTrial* trial) {
+    trial->success = trial->compress(new_data, &max_size, &trial->blob) &&
+                     !trial->blob.empty();
+    if (!trial->success)
+      return;
+    // Compressors producing the same size as this one still finish, so ties
+    // are settled by the order of the table as if they ran one by one.
+    size_t size = max_size.load();
+    while (trial->blob.size() < size &&
+           !max_size.compare_exchange_weak(size, trial->blob.size())) {
     }
+  };
+  if (!trials.empty()) {
+    DiffTaskScheduler::TaskGroup group(DiffTaskScheduler::Get());
+    for (size_t i = 1; i < trials.size(); i++)
+      group.Submit([&run_trial, trial = &trials[i]] { run_trial(trial); });
+    run_trial(&trials[0]);
+    group.Wait();
   }
 
-  // Try compressing it with bzip2.
-  if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
-    brillo::Blob new_data_bz;
-    // TODO(deymo): Implement some heuristic to determine if it is worth trying
-    // to compress the blob with bzip2 if we already have a good REPLACE_XZ.
-    if (BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty() &&
-        (!out_blob_set || out_blob->size() > new_data_bz.size())) {
-      // A REPLACE_BZ is better or nothing else was set.
-      *out_type = InstallOperation::REPLACE_BZ;
-      *out_blob = std::move(new_data_bz);
-      out_blob_set = true;
+  CompressorTrial* best = nullptr;
+  for (auto& trial : trials) {
+    if (trial.success && trial.blob.size() < new_data.size() &&
+        (!best || trial.blob.size() < best->blob.size())) {
+      best = &trial;
     }
   }
+  if (best) {
+    *out_type = best->type;
+    *out_blob = std::move(best->blob);
+    return true;
+  }
 
   // If nothing else worked or it was badly compressed we try a REPLACE.
-  if (!out_blob_set || out_blob->size() >= new_data.size()) {
-    *out_type = InstallOperation::REPLACE;
-    // This needs to make a copy of the data in the case bzip or xz didn't
-    // compress well, which is not the common case so the performance hit is
-    // low.
-    *out_blob = new_data;
-  }
+  *out_type = InstallOperation::REPLACE;
+  // This needs to make a copy of the data in the case bzip or xz didn't
+  // compress well, which is not the common case so the performance hit is
+  // low.
+  *out_blob = new_data;
   return true;
 }
 
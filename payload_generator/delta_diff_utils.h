@@ -219,6 +219,22 @@ class BestDiffGenerator {
       brillo::Blob* data_blob);
 
  private:
+  // Does the work of GenerateBestDiffOperation(), without looking up the diff
+  // cache.
+  bool GenerateBestDiffOperationUncached(
+      const std::vector<std::pair<InstallOperation_Type, size_t>>&
+          diff_candidates,
+      AnnotatedOperation* aop,
+      brillo::Blob* data_blob);
+  // Computes in |key| the key of the DiffCache entry of the diff of this data
+  // with the |diff_candidates|, starting from the full operation |aop| and
+  // |data_blob|.
+  bool GetDiffCacheKey(
+      const std::vector<std::pair<InstallOperation_Type, size_t>>&
+          diff_candidates,
+      const AnnotatedOperation& aop,
+      const brillo::Blob& data_blob,
+      brillo::Blob* key) const;
   std::vector<bsdiff::CompressorType> GetUsableCompressorTypes() const;
   bool TryBsdiffAndUpdateOperation(InstallOperation_Type operation_type,
                                    AnnotatedOperation* aop,
@@ -227,6 +243,8 @@ class BestDiffGenerator {
                                      brillo::Blob* data_blob);
   bool TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
                                      brillo::Blob* data_blob);
+  // Records the size of a patch of |op_type| in |tried_diffs_|.
+  void RecordTriedDiff(InstallOperation_Type op_type, size_t patch_size);
 
   const brillo::Blob& old_data_;
   const brillo::Blob& new_data_;
@@ -237,6 +255,9 @@ class BestDiffGenerator {
   const CompressedFile& old_block_info_;
   const CompressedFile& new_block_info_;
   const PayloadGenerationConfig& config_;
+  // The diffs tried by GenerateBestDiffOperationUncached() with the size of
+  // their patch, for the diff stats.
+  std::vector<std::pair<InstallOperation_Type, uint64_t>> tried_diffs_;
 };
 
 }  // namespace diff_utils
@@ -21,8 +21,11 @@
 #include <string>
 #include <vector>
 
+#include <base/files/file_enumerator.h>
 #include <base/files/scoped_file.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
+#include <base/strings/string_number_conversions.h>
 #include <base/strings/stringprintf.h>
 #include <bsdiff/patch_writer.h>
 #include <gtest/gtest.h>
@@ -30,10 +33,13 @@
 #include "payload_generator/filesystem_interface.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/fake_filesystem.h"
+#include "update_engine/payload_generator/xz.h"
 
 using std::string;
 using std::vector;
@@ -433,6 +439,66 @@ TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_FullOperationBetter) {
   ASSERT_EQ(InstallOperation::REPLACE_XZ, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_DiffCache) {
+  brillo::Blob dst_data_blob(kBlockSize);
+  test_utils::FillWithData(&dst_data_blob);
+  brillo::Blob src_data_blob = dst_data_blob;
+  src_data_blob[0]++;
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  const FilesystemInterface::File empty;
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kZucchiniMinorPayloadVersion),
+      .diff_cache_dir = cache_dir.GetPath().value()};
+  auto generate = [&](AnnotatedOperation* aop, brillo::Blob* data) {
+    aop->name = "data.so";
+    aop->op.set_type(InstallOperation::REPLACE);
+    *data = dst_data_blob;  // Fake the full operation
+    diff_utils::BestDiffGenerator best_diff_generator(src_data_blob,
+                                                      dst_data_blob,
+                                                      old_extents,
+                                                      new_extents,
+                                                      empty,
+                                                      empty,
+                                                      config);
+    return best_diff_generator.GenerateBestDiffOperation(
+        {{InstallOperation::ZUCCHINI, 1024 * 1024}}, aop, data);
+  };
+
+  AnnotatedOperation aop;
+  brillo::Blob data;
+  ASSERT_TRUE(generate(&aop, &data));
+  ASSERT_EQ(InstallOperation::ZUCCHINI, aop.op.type());
+
+  // Replace the only cache entry, to tell whether the next generation uses it.
+  base::FileEnumerator entries(
+      cache_dir.GetPath(), false, base::FileEnumerator::FILES);
+  const base::FilePath entry = entries.Next();
+  ASSERT_FALSE(entry.empty());
+  ASSERT_TRUE(entries.Next().empty());
+  brillo::Blob key;
+  ASSERT_TRUE(base::HexStringToBytes(entry.BaseName().value(), &key));
+  const brillo::Blob cached_patch = {1, 2, 3};
+  ASSERT_TRUE(DiffCache(cache_dir.GetPath().value())
+                  .Store(key, InstallOperation::PUFFDIFF, cached_patch));
+
+  AnnotatedOperation cached_aop;
+  ASSERT_TRUE(generate(&cached_aop, &data));
+  EXPECT_EQ(InstallOperation::PUFFDIFF, cached_aop.op.type());
+  EXPECT_EQ(cached_patch, data);
+
+  // Different data doesn't hit the cache.
+  src_data_blob[1]++;
+  AnnotatedOperation other_aop;
+  ASSERT_TRUE(generate(&other_aop, &data));
+  EXPECT_EQ(InstallOperation::ZUCCHINI, other_aop.op.type());
+  EXPECT_NE(cached_patch, data);
+}
+
 TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   brillo::Blob data_blob(kBlockSize);
   vector<Extent> extents = {ExtentForRange(1, 1)};
@@ -467,6 +533,39 @@ TEST_F(DeltaDiffUtilsTest, PreferReplaceTest) {
   ASSERT_EQ(InstallOperation::REPLACE_BZ, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperationTest) {
+  const PayloadVersion version(kBrilloMajorPayloadVersion,
+                               kSourceMinorPayloadVersion);
+  brillo::Blob new_data(kBlockSize * 4);
+  for (size_t i = 0; i < new_data.size(); i++)
+    new_data[i] = i % 251 < 10 ? i : 'a';
+
+  // The smallest of the compressed blobs is picked, xz on a tie, the same as
+  // when compressing with each in turn.
+  brillo::Blob xz_blob, bz_blob;
+  ASSERT_TRUE(XzCompress(new_data, &xz_blob));
+  ASSERT_TRUE(BzipCompress(new_data, &bz_blob));
+  brillo::Blob blob;
+  InstallOperation::Type op_type;
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      new_data, version, &blob, &op_type));
+  if (bz_blob.size() < xz_blob.size()) {
+    EXPECT_EQ(InstallOperation::REPLACE_BZ, op_type);
+    EXPECT_EQ(bz_blob, blob);
+  } else {
+    EXPECT_EQ(InstallOperation::REPLACE_XZ, op_type);
+    EXPECT_EQ(xz_blob, blob);
+  }
+
+  // Data which doesn't compress is stored as is.
+  std::mt19937 gen(1234);
+  std::generate(new_data.begin(), new_data.end(), gen);
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      new_data, version, &blob, &op_type));
+  EXPECT_EQ(InstallOperation::REPLACE, op_type);
+  EXPECT_EQ(new_data, blob);
+}
+
 // Test the simple case where all the blocks are different and no new blocks are
 // zeroed.
 TEST_F(DeltaDiffUtilsTest, NoZeroedOrUniqueBlocksDetected) {
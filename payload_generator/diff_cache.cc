@@ -0,0 +1,104 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <stdio.h>
+
+#include <cstring>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// An entry is made of this magic, the operation type as a 32 bit integer, the
+// size of the data as a 64 bit integer and the data itself, all in host byte
+// order.
+constexpr char kEntryMagic[] = "CrAUdiff";
+constexpr size_t kEntryMagicSize = sizeof(kEntryMagic) - 1;
+constexpr size_t kEntryHeaderSize =
+    kEntryMagicSize + sizeof(uint32_t) + sizeof(uint64_t);
+
+}  // namespace
+
+bool DiffCache::Lookup(const brillo::Blob& key,
+                       InstallOperation::Type* op_type,
+                       brillo::Blob* data_blob) const {
+  const std::string path = GetEntryPath(key);
+  brillo::Blob entry;
+  if (!base::PathExists(base::FilePath(path)) ||
+      !utils::ReadFile(path, &entry)) {
+    return false;
+  }
+
+  uint32_t type{};
+  uint64_t size{};
+  if (entry.size() >= kEntryHeaderSize) {
+    memcpy(&type, entry.data() + kEntryMagicSize, sizeof(type));
+    memcpy(&size, entry.data() + kEntryMagicSize + sizeof(type), sizeof(size));
+  }
+  if (entry.size() < kEntryHeaderSize ||
+      memcmp(entry.data(), kEntryMagic, kEntryMagicSize) != 0 ||
+      !InstallOperation::Type_IsValid(type) ||
+      size != entry.size() - kEntryHeaderSize) {
+    LOG(WARNING) << "Ignoring invalid diff cache entry " << path;
+    return false;
+  }
+  *op_type = static_cast<InstallOperation::Type>(type);
+  data_blob->assign(entry.begin() + kEntryHeaderSize, entry.end());
+  return true;
+}
+
+bool DiffCache::Store(const brillo::Blob& key,
+                      InstallOperation::Type op_type,
+                      const brillo::Blob& data_blob) const {
+  const uint32_t type = op_type;
+  const uint64_t size = data_blob.size();
+  brillo::Blob entry(kEntryMagic, kEntryMagic + kEntryMagicSize);
+  entry.resize(kEntryHeaderSize);
+  memcpy(entry.data() + kEntryMagicSize, &type, sizeof(type));
+  memcpy(entry.data() + kEntryMagicSize + sizeof(type), &size, sizeof(size));
+  entry.insert(entry.end(), data_blob.begin(), data_blob.end());
+
+  // Write to a unique temporary file in the same directory, so that other
+  // threads or processes storing the same entry don't clobber it, and readers
+  // never see partial entries.
+  base::FilePath temp_path;
+  TEST_AND_RETURN_FALSE(
+      base::CreateTemporaryFileInDir(base::FilePath(cache_dir_), &temp_path));
+  ScopedPathUnlinker unlinker(temp_path.value());
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(temp_path.value().c_str(), entry.data(), entry.size()));
+  const std::string path = GetEntryPath(key);
+  if (rename(temp_path.value().c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to rename " << temp_path.value() << " to " << path;
+    return false;
+  }
+  unlinker.set_should_remove(false);
+  return true;
+}
+
+std::string DiffCache::GetEntryPath(const brillo::Blob& key) const {
+  return base::FilePath(cache_dir_).Append(HexEncode(key)).value();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,64 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+
+#include <string>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// An on-disk cache of the diff operations generated for pairs of old and new
+// data, so that payload generations sharing files with previous ones, even
+// across invocations, don't diff them again.
+//
+// Entries are stored in |cache_dir| in files named after the hex encoded
+// |key|, which must identify all the inputs of the diff. They are written to
+// a temporary file first and then renamed, so several generators can share
+// the same directory. The cache is never pruned.
+class DiffCache {
+ public:
+  explicit DiffCache(const std::string& cache_dir) : cache_dir_(cache_dir) {}
+
+  // Looks up the entry for |key|. Returns whether it was found, in which case
+  // its operation type and data are stored in |op_type| and |data_blob|.
+  // Invalid entries are treated as missing.
+  bool Lookup(const brillo::Blob& key,
+              InstallOperation::Type* op_type,
+              brillo::Blob* data_blob) const;
+
+  // Stores |op_type| and |data_blob| as the entry for |key|, replacing the
+  // previous one if any.
+  bool Store(const brillo::Blob& key,
+             InstallOperation::Type op_type,
+             const brillo::Blob& data_blob) const;
+
+ private:
+  std::string GetEntryPath(const brillo::Blob& key) const;
+
+  const std::string cache_dir_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
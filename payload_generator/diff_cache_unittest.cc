@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_path.h>
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class DiffCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_TRUE(temp_dir_.CreateUniqueTempDir()); }
+
+  // Returns the number of files in the cache directory.
+  size_t CountFiles() {
+    base::FileEnumerator files(
+        temp_dir_.GetPath(), false, base::FileEnumerator::FILES);
+    size_t count = 0;
+    for (auto path = files.Next(); !path.empty(); path = files.Next()) {
+      count++;
+    }
+    return count;
+  }
+
+  base::ScopedTempDir temp_dir_;
+  const brillo::Blob key_{0x01, 0x23, 0x45, 0x67};
+};
+
+TEST_F(DiffCacheTest, StoreAndLookupTest) {
+  DiffCache cache(temp_dir_.GetPath().value());
+  brillo::Blob patch(1000);
+  test_utils::FillWithData(&patch);
+  ASSERT_TRUE(cache.Store(key_, InstallOperation::BROTLI_BSDIFF, patch));
+  // The temporary file was renamed.
+  EXPECT_EQ(1u, CountFiles());
+
+  // Another instance on the same directory sees the entry.
+  DiffCache other_cache(temp_dir_.GetPath().value());
+  InstallOperation::Type op_type{};
+  brillo::Blob data;
+  ASSERT_TRUE(other_cache.Lookup(key_, &op_type, &data));
+  EXPECT_EQ(InstallOperation::BROTLI_BSDIFF, op_type);
+  EXPECT_EQ(patch, data);
+
+  // Entries can be replaced, and may have no data.
+  ASSERT_TRUE(cache.Store(key_, InstallOperation::REPLACE_XZ, {}));
+  ASSERT_TRUE(cache.Lookup(key_, &op_type, &data));
+  EXPECT_EQ(InstallOperation::REPLACE_XZ, op_type);
+  EXPECT_TRUE(data.empty());
+  EXPECT_EQ(1u, CountFiles());
+}
+
+TEST_F(DiffCacheTest, LookupMissingKeyTest) {
+  DiffCache cache(temp_dir_.GetPath().value());
+  ASSERT_TRUE(cache.Store(key_, InstallOperation::PUFFDIFF, {1, 2, 3}));
+  InstallOperation::Type op_type{};
+  brillo::Blob data;
+  EXPECT_FALSE(cache.Lookup({0x01, 0x23}, &op_type, &data));
+}
+
+TEST_F(DiffCacheTest, InvalidEntryIgnoredTest) {
+  DiffCache cache(temp_dir_.GetPath().value());
+  brillo::Blob patch(100);
+  test_utils::FillWithData(&patch);
+  ASSERT_TRUE(cache.Store(key_, InstallOperation::ZUCCHINI, patch));
+
+  // Truncate the entry.
+  const base::FilePath path = temp_dir_.GetPath().Append(HexEncode(key_));
+  brillo::Blob entry;
+  ASSERT_TRUE(utils::ReadFile(path.value(), &entry));
+  entry.resize(entry.size() - 1);
+  ASSERT_TRUE(
+      utils::WriteFile(path.value().c_str(), entry.data(), entry.size()));
+
+  InstallOperation::Type op_type{};
+  brillo::Blob data;
+  EXPECT_FALSE(cache.Lookup(key_, &op_type, &data));
+
+  // Garbage is ignored too.
+  ASSERT_TRUE(utils::WriteFile(path.value().c_str(), "garbage", 7));
+  EXPECT_FALSE(cache.Lookup(key_, &op_type, &data));
+}
+
+}  // namespace chromeos_update_engine
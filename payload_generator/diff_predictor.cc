@@ -0,0 +1,167 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_predictor.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_set>
+
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The data is compared in windows of this many bytes, of which about one in
+// 2^kSampleBits is sampled, chosen by content so that the same windows are
+// sampled in both the old and new data wherever they are.
+constexpr size_t kWindowSize = 32;
+constexpr uint32_t kSampleBits = 6;
+constexpr uint32_t kHashBase = 0x9e3779b1;
+
+constexpr char kDiffStatsHeader[] =
+    "name,new_size,full_size,similarity,deflate_fraction,chosen_type,tried,"
+    "skipped\n";
+
+uint32_t MixHash(uint32_t hash) {
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  return hash ^ (hash >> 16);
+}
+
+// Calls |callback| with the hash of each sampled window of |data|.
+template <typename Callback>
+void ForEachSampledWindow(const brillo::Blob& data, Callback callback) {
+  if (data.size() < kWindowSize)
+    return;
+  uint32_t top_power = 1;
+  for (size_t i = 1; i < kWindowSize; i++)
+    top_power *= kHashBase;
+  uint32_t hash = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    if (i >= kWindowSize)
+      hash -= data[i - kWindowSize] * top_power;
+    hash = hash * kHashBase + data[i];
+    if (i + 1 < kWindowSize)
+      continue;
+    const uint32_t mixed = MixHash(hash);
+    if (mixed >> (32 - kSampleBits) == 0)
+      callback(mixed);
+  }
+}
+
+}  // namespace
+
+DiffFeatures ComputeDiffFeatures(
+    const brillo::Blob& old_data,
+    const brillo::Blob& new_data,
+    const std::vector<puffin::BitExtent>& new_deflates) {
+  DiffFeatures features;
+  std::unordered_set<uint32_t> old_windows;
+  old_windows.reserve((old_data.size() >> kSampleBits) * 2);
+  ForEachSampledWindow(old_data, [&old_windows](uint32_t hash) {
+    old_windows.insert(hash);
+  });
+  uint64_t sampled = 0, found = 0;
+  ForEachSampledWindow(new_data, [&](uint32_t hash) {
+    sampled++;
+    found += old_windows.count(hash);
+  });
+  if (sampled > 0)
+    features.similarity = static_cast<double>(found) / sampled;
+
+  uint64_t deflate_bits = 0;
+  for (const auto& deflate : new_deflates)
+    deflate_bits += deflate.length;
+  if (!new_data.empty()) {
+    features.deflate_fraction = std::min(
+        1.0, static_cast<double>(deflate_bits) / (new_data.size() * 8));
+  }
+  return features;
+}
+
+bool DiffMayWin(InstallOperation::Type op_type, const DiffFeatures& features) {
+  switch (op_type) {
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::ZUCCHINI:
+      return features.similarity >= kMinDiffSimilarity;
+    case InstallOperation::PUFFDIFF:
+      return features.deflate_fraction >= kMinPuffdiffDeflateFraction;
+    default:
+      return true;
+  }
+}
+
+bool AppendDiffStats(const std::string& path, const DiffStats& stats) {
+  std::string name = stats.name;
+  for (size_t pos = name.find('"'); pos != std::string::npos;
+       pos = name.find('"', pos + 2)) {
+    name.insert(pos, 1, '"');
+  }
+  std::string tried, skipped;
+  for (const auto& [op_type, size] : stats.tried) {
+    base::StringAppendF(&tried,
+                        "%s%s:%" PRIu64,
+                        tried.empty() ? "" : " ",
+                        InstallOperationTypeName(op_type),
+                        size);
+  }
+  for (auto op_type : stats.skipped) {
+    base::StringAppendF(&skipped,
+                        "%s%s",
+                        skipped.empty() ? "" : " ",
+                        InstallOperationTypeName(op_type));
+  }
+  const std::string row =
+      base::StringPrintf("\"%s\",%" PRIu64 ",%" PRIu64 ",%.4f,%.4f,%s,%s,%s\n",
+                         name.c_str(),
+                         stats.new_size,
+                         stats.full_size,
+                         stats.features.similarity,
+                         stats.features.deflate_fraction,
+                         InstallOperationTypeName(stats.chosen_type),
+                         tried.c_str(),
+                         skipped.c_str());
+
+  // Chunks are diffed on many threads.
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  FILE* file = fopen(path.c_str(), "a");
+  if (file == nullptr) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  bool success = fseek(file, 0, SEEK_END) == 0;
+  if (success && ftell(file) == 0)
+    success = fputs(kDiffStatsHeader, file) >= 0;
+  success = success && fputs(row.c_str(), file) >= 0;
+  success = fclose(file) == 0 && success;
+  if (!success)
+    PLOG(ERROR) << "Failed to write diff stats to " << path;
+  return success;
+}
+
+}  // namespace chromeos_update_engine
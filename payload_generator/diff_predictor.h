@@ -0,0 +1,83 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_PREDICTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_PREDICTOR_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <puffin/puffdiff.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Below this similarity, the old data shares too little with the new data for
+// bsdiff or zucchini to beat the full operation.
+constexpr double kMinDiffSimilarity = 0.02;
+
+// Below this fraction of the new data in deflate streams, puffdiff can't do
+// noticeably better than bsdiff, which it runs on the inflated data anyway.
+constexpr double kMinPuffdiffDeflateFraction = 0.05;
+
+// Cheap features of a pair of old and new data, telling which diff algorithms
+// have a chance to produce a patch smaller than the full operation.
+struct DiffFeatures {
+  // The fraction of the new data also found in the old data, estimated from
+  // windows sampled by content, in [0, 1]. 1 if there is too little data to
+  // sample any window.
+  double similarity = 1;
+  // The fraction of the new data in deflate streams that differ from the old
+  // ones, in [0, 1].
+  double deflate_fraction = 0;
+};
+
+// Computes the features of diffing |old_data| into |new_data|, whose changed
+// deflate streams are |new_deflates|. This takes time linear in the size of
+// the data, much less than any of the diff algorithms.
+DiffFeatures ComputeDiffFeatures(
+    const brillo::Blob& old_data,
+    const brillo::Blob& new_data,
+    const std::vector<puffin::BitExtent>& new_deflates);
+
+// Returns whether a diff of type |op_type| may be smaller than the full
+// operation given |features|, so it is worth trying.
+bool DiffMayWin(InstallOperation::Type op_type, const DiffFeatures& features);
+
+// The outcome of diffing a chunk of a file, for tuning the predictor.
+struct DiffStats {
+  std::string name;
+  uint64_t new_size = 0;
+  // The size of the data of the full operation the diffs are compared with.
+  uint64_t full_size = 0;
+  DiffFeatures features;
+  // The diffs tried, with the size of their patch, and the ones skipped as
+  // predicted to lose.
+  std::vector<std::pair<InstallOperation::Type, uint64_t>> tried;
+  std::vector<InstallOperation::Type> skipped;
+  InstallOperation::Type chosen_type{};
+};
+
+// Appends |stats| as a row to the CSV file |path|, created with a header if
+// missing. Thread-safe.
+bool AppendDiffStats(const std::string& path, const DiffStats& stats);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_PREDICTOR_H_
@@ -0,0 +1,112 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_predictor.h"
+
+#include <random>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+brillo::Blob RandomBlob(size_t size, uint32_t seed) {
+  std::mt19937 gen(seed);
+  brillo::Blob blob(size);
+  for (auto& byte : blob)
+    byte = gen();
+  return blob;
+}
+}  // namespace
+
+class DiffPredictorTest : public ::testing::Test {
+ protected:
+  const brillo::Blob old_data_ = RandomBlob(64 * 1024, 1);
+};
+
+TEST_F(DiffPredictorTest, SimilarityTest) {
+  EXPECT_DOUBLE_EQ(1.0,
+                   ComputeDiffFeatures(old_data_, old_data_, {}).similarity);
+
+  // Data moved around is still found.
+  brillo::Blob new_data = RandomBlob(1000, 2);
+  new_data.insert(new_data.end(), old_data_.begin() + 20000, old_data_.end());
+  new_data.insert(
+      new_data.end(), old_data_.begin(), old_data_.begin() + 20000);
+  const DiffFeatures features = ComputeDiffFeatures(old_data_, new_data, {});
+  EXPECT_GT(features.similarity, 0.9);
+  EXPECT_TRUE(DiffMayWin(InstallOperation::BROTLI_BSDIFF, features));
+
+  const DiffFeatures unrelated_features =
+      ComputeDiffFeatures(old_data_, RandomBlob(64 * 1024, 3), {});
+  EXPECT_LT(unrelated_features.similarity, kMinDiffSimilarity);
+  EXPECT_FALSE(
+      DiffMayWin(InstallOperation::BROTLI_BSDIFF, unrelated_features));
+  EXPECT_FALSE(DiffMayWin(InstallOperation::ZUCCHINI, unrelated_features));
+}
+
+TEST_F(DiffPredictorTest, TooLittleDataIsSimilarTest) {
+  const DiffFeatures features =
+      ComputeDiffFeatures(old_data_, RandomBlob(16, 2), {});
+  EXPECT_DOUBLE_EQ(1.0, features.similarity);
+  EXPECT_TRUE(DiffMayWin(InstallOperation::SOURCE_BSDIFF, features));
+}
+
+TEST_F(DiffPredictorTest, DeflateFractionTest) {
+  const brillo::Blob new_data = RandomBlob(4000, 2);
+  DiffFeatures features =
+      ComputeDiffFeatures(old_data_, new_data, {puffin::BitExtent(0, 8000)});
+  EXPECT_DOUBLE_EQ(0.25, features.deflate_fraction);
+  EXPECT_TRUE(DiffMayWin(InstallOperation::PUFFDIFF, features));
+
+  features = ComputeDiffFeatures(old_data_, new_data, {});
+  EXPECT_DOUBLE_EQ(0.0, features.deflate_fraction);
+  EXPECT_FALSE(DiffMayWin(InstallOperation::PUFFDIFF, features));
+}
+
+TEST_F(DiffPredictorTest, AppendDiffStatsTest) {
+  ScopedTempFile stats_file("DiffPredictorTest-stats.XXXXXX");
+  DiffStats stats;
+  stats.name = "app/\"quoted\".apk";
+  stats.new_size = 8192;
+  stats.full_size = 4000;
+  stats.features = {0.5, 0.25};
+  stats.tried = {{InstallOperation::BROTLI_BSDIFF, 3000},
+                 {InstallOperation::PUFFDIFF, 2000}};
+  stats.skipped = {InstallOperation::ZUCCHINI};
+  stats.chosen_type = InstallOperation::PUFFDIFF;
+  ASSERT_TRUE(AppendDiffStats(stats_file.path(), stats));
+  stats.name = "lib.so";
+  stats.tried.clear();
+  stats.skipped.clear();
+  stats.chosen_type = InstallOperation::REPLACE_XZ;
+  ASSERT_TRUE(AppendDiffStats(stats_file.path(), stats));
+
+  std::string contents;
+  ASSERT_TRUE(utils::ReadFile(stats_file.path(), &contents));
+  EXPECT_EQ(
+      "name,new_size,full_size,similarity,deflate_fraction,chosen_type,tried,"
+      "skipped\n"
+      "\"app/\"\"quoted\"\".apk\",8192,4000,0.5000,0.2500,PUFFDIFF,"
+      "BROTLI_BSDIFF:3000 PUFFDIFF:2000,ZUCCHINI\n"
+      "\"lib.so\",8192,4000,0.5000,0.2500,REPLACE_XZ,,\n",
+      contents);
+}
+
+}  // namespace chromeos_update_engine
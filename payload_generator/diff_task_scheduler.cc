@@ -0,0 +1,203 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_task_scheduler.h"
+
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_generator/delta_diff_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The scheduler and worker index of the calling thread, if it's a worker.
+thread_local const DiffTaskScheduler* current_scheduler = nullptr;
+thread_local size_t current_worker_index = 0;
+
+std::mutex global_scheduler_mutex;
+size_t global_max_threads = 0;
+std::unique_ptr<DiffTaskScheduler> global_scheduler;
+
+}  // namespace
+
+void DiffTaskScheduler::TaskGroup::Submit(Task task) {
+  scheduler_->Submit(this, std::move(task));
+}
+
+void DiffTaskScheduler::TaskGroup::Wait() {
+  scheduler_->Wait(this);
+}
+
+DiffTaskScheduler::DiffTaskScheduler(size_t num_threads) {
+  CHECK_GT(num_threads, 0U);
+  for (size_t i = 0; i <= num_threads; i++) {
+    queues_.push_back(std::make_unique<TaskQueue>());
+  }
+  threads_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    threads_.emplace_back(&DiffTaskScheduler::WorkerLoop, this, i);
+  }
+}
+
+DiffTaskScheduler::~DiffTaskScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CHECK_EQ(num_queued_, 0U);
+    shutdown_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+// static
+DiffTaskScheduler* DiffTaskScheduler::Get() {
+  std::lock_guard<std::mutex> lock(global_scheduler_mutex);
+  if (!global_scheduler) {
+    size_t num_threads = global_max_threads > 0 ? global_max_threads
+                                                : diff_utils::GetMaxThreads();
+    LOG(INFO) << "Generating the payload on " << num_threads << " threads.";
+    global_scheduler = std::make_unique<DiffTaskScheduler>(num_threads);
+  }
+  return global_scheduler.get();
+}
+
+// static
+void DiffTaskScheduler::SetMaxThreads(size_t max_threads) {
+  std::lock_guard<std::mutex> lock(global_scheduler_mutex);
+  if (global_scheduler) {
+    if (max_threads > 0 && max_threads != global_scheduler->num_threads()) {
+      LOG(WARNING) << "The scheduler already runs "
+                   << global_scheduler->num_threads()
+                   << " threads, ignoring the new limit of " << max_threads;
+    }
+    return;
+  }
+  global_max_threads = max_threads;
+}
+
+void DiffTaskScheduler::Submit(TaskGroup* group, Task task) {
+  const size_t worker_index = CurrentWorkerIndex();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    group->pending_++;
+  }
+  {
+    // Count the task while its queue is still locked, so that it can't be
+    // taken before. The locks are taken in the same order as in TakeTask().
+    std::lock_guard<std::mutex> queue_lock(queues_[worker_index]->mutex);
+    queues_[worker_index]->tasks.push_back({std::move(task), group});
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_queued_++;
+  }
+  // Wake everyone up, as threads waiting for a group which don't run tasks
+  // share the condition variable.
+  cv_.notify_all();
+}
+
+void DiffTaskScheduler::Wait(TaskGroup* group) {
+  const size_t worker_index = CurrentWorkerIndex();
+  const bool is_worker = worker_index < threads_.size();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (group->pending_ > 0) {
+    if (!is_worker) {
+      cv_.wait(lock, [group] { return group->pending_ == 0; });
+      break;
+    }
+    cv_.wait(lock, [this, group] {
+      return group->pending_ == 0 || num_queued_ > 0;
+    });
+    if (group->pending_ == 0) {
+      break;
+    }
+    lock.unlock();
+    QueuedTask task;
+    if (TakeTask(worker_index, true, &task)) {
+      RunTask(&task);
+    }
+    lock.lock();
+  }
+}
+
+void DiffTaskScheduler::WorkerLoop(size_t worker_index) {
+  current_scheduler = this;
+  current_worker_index = worker_index;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return shutdown_ || num_queued_ > 0; });
+      if (shutdown_) {
+        return;
+      }
+    }
+    QueuedTask task;
+    if (TakeTask(worker_index, false, &task)) {
+      RunTask(&task);
+    }
+  }
+}
+
+bool DiffTaskScheduler::TakeTask(size_t worker_index,
+                                 bool waiting,
+                                 QueuedTask* task) {
+  const size_t num_workers = threads_.size();
+  // Visit the own queue first, then either the other workers' queues or the
+  // queue of the other threads first.
+  std::vector<size_t> order{worker_index};
+  if (!waiting) {
+    order.push_back(num_workers);
+  }
+  for (size_t i = 1; i < num_workers; i++) {
+    order.push_back((worker_index + i) % num_workers);
+  }
+  if (waiting) {
+    order.push_back(num_workers);
+  }
+
+  for (size_t index : order) {
+    TaskQueue* queue = queues_[index].get();
+    std::lock_guard<std::mutex> queue_lock(queue->mutex);
+    if (queue->tasks.empty()) {
+      continue;
+    }
+    *task = std::move(queue->tasks.front());
+    queue->tasks.pop_front();
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_queued_--;
+    return true;
+  }
+  return false;
+}
+
+void DiffTaskScheduler::RunTask(QueuedTask* task) {
+  task->task();
+  // Release the resources held by the task before signaling its group.
+  task->task = nullptr;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--task->group->pending_ == 0) {
+    cv_.notify_all();
+  }
+}
+
+size_t DiffTaskScheduler::CurrentWorkerIndex() const {
+  return current_scheduler == this ? current_worker_index : threads_.size();
+}
+
+}  // namespace chromeos_update_engine
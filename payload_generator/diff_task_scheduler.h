@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_TASK_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_TASK_SCHEDULER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// A pool of worker threads shared by all the stages of payload generation, so
+// that partitions, files and chunks are all processed on at most
+// num_threads() threads.
+//
+// Each worker has its own queue of tasks. Tasks submitted from a worker go to
+// its queue, and idle workers steal tasks from the other queues. Tasks are
+// taken in the order they were submitted, so submitting the largest ones first
+// keeps them from becoming the long pole at the end. A worker waiting for a
+// TaskGroup runs the pending tasks meanwhile, so tasks can submit and wait for
+// nested tasks without deadlocking or holding a thread idle.
+class DiffTaskScheduler {
+ public:
+  using Task = std::function<void()>;
+
+  // A set of tasks which can be waited for together.
+  class TaskGroup {
+   public:
+    explicit TaskGroup(DiffTaskScheduler* scheduler) : scheduler_(scheduler) {}
+    // Waits for the tasks submitted to this group.
+    ~TaskGroup() { Wait(); }
+
+    void Submit(Task task);
+
+    // Returns once all the tasks submitted to this group have run.
+    void Wait();
+
+   private:
+    friend class DiffTaskScheduler;
+
+    DiffTaskScheduler* scheduler_;
+    // Number of tasks of this group which haven't finished yet. Guarded by
+    // |scheduler_->mutex_|.
+    size_t pending_{0};
+
+    DISALLOW_COPY_AND_ASSIGN(TaskGroup);
+  };
+
+  explicit DiffTaskScheduler(size_t num_threads);
+  // All the TaskGroups must have been waited for already.
+  ~DiffTaskScheduler();
+
+  // Returns the scheduler shared by the whole process, which is created on
+  // first use with the number of threads set by SetMaxThreads(), or
+  // diff_utils::GetMaxThreads() by default.
+  static DiffTaskScheduler* Get();
+
+  // Sets the number of threads of the scheduler returned by Get(). Must be
+  // called before its first use; later calls are ignored. 0 keeps the
+  // default.
+  static void SetMaxThreads(size_t max_threads);
+
+  size_t num_threads() const { return threads_.size(); }
+
+ private:
+  struct QueuedTask {
+    Task task;
+    TaskGroup* group;
+  };
+
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<QueuedTask> tasks;
+  };
+
+  void Submit(TaskGroup* group, Task task);
+  void Wait(TaskGroup* group);
+  void WorkerLoop(size_t worker_index);
+
+  // Takes the next task for the worker |worker_index|: from its own queue
+  // first, then from the other workers' queues and the queue of tasks
+  // submitted by other threads. A worker waiting for a group prefers stealing
+  // from other workers, whose tasks are usually nested ones, over starting new
+  // top-level tasks.
+  bool TakeTask(size_t worker_index, bool waiting, QueuedTask* task);
+
+  // Runs |task| and marks it done in its group.
+  void RunTask(QueuedTask* task);
+
+  // Returns the index of the calling worker thread of this scheduler, or
+  // |threads_.size()| if the caller isn't one of them.
+  size_t CurrentWorkerIndex() const;
+
+  // One queue per worker, followed by the queue of the tasks submitted by
+  // other threads.
+  std::vector<std::unique_ptr<TaskQueue>> queues_;
+
+  std::mutex mutex_;
+  // Signaled when a task is queued, when a group is done and on shutdown.
+  std::condition_variable cv_;
+  // Number of tasks in |queues_|.
+  size_t num_queued_{0};
+  bool shutdown_{false};
+
+  std::vector<std::thread> threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiffTaskScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_TASK_SCHEDULER_H_
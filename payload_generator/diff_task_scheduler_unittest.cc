@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_task_scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(DiffTaskSchedulerTest, RunsAllTasksTest) {
+  DiffTaskScheduler scheduler(4);
+  std::atomic<int> count{0};
+  {
+    DiffTaskScheduler::TaskGroup group(&scheduler);
+    for (int i = 0; i < 100; i++) {
+      group.Submit([&count] { count++; });
+    }
+    group.Wait();
+    EXPECT_EQ(100, count);
+    // A group can be reused once waited for.
+    group.Submit([&count] { count++; });
+  }
+  EXPECT_EQ(101, count);
+}
+
+TEST(DiffTaskSchedulerTest, NestedGroupsTest) {
+  // With a single worker, the nested tasks only run if the worker runs them
+  // while waiting for them.
+  DiffTaskScheduler scheduler(1);
+  std::atomic<int> count{0};
+  DiffTaskScheduler::TaskGroup group(&scheduler);
+  for (int i = 0; i < 4; i++) {
+    group.Submit([&scheduler, &count] {
+      DiffTaskScheduler::TaskGroup nested_group(&scheduler);
+      for (int j = 0; j < 10; j++) {
+        nested_group.Submit([&count] { count++; });
+      }
+      nested_group.Wait();
+    });
+  }
+  group.Wait();
+  EXPECT_EQ(40, count);
+}
+
+TEST(DiffTaskSchedulerTest, ConcurrencyLimitTest) {
+  constexpr size_t kNumThreads = 3;
+  DiffTaskScheduler scheduler(kNumThreads);
+  std::atomic<size_t> running{0};
+  std::atomic<size_t> max_running{0};
+  auto task = [&running, &max_running] {
+    size_t now = ++running;
+    size_t max = max_running;
+    while (now > max && !max_running.compare_exchange_weak(max, now)) {
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    running--;
+  };
+  DiffTaskScheduler::TaskGroup group(&scheduler);
+  for (int i = 0; i < 8; i++) {
+    group.Submit([&scheduler, &task] {
+      DiffTaskScheduler::TaskGroup nested_group(&scheduler);
+      for (int j = 0; j < 8; j++) {
+        nested_group.Submit(task);
+      }
+    });
+  }
+  group.Wait();
+  EXPECT_EQ(0U, running);
+  EXPECT_LE(max_running, kNumThreads);
+  EXPECT_GE(max_running, 1U);
+}
+
+}  // namespace chromeos_update_engine
@@ -17,6 +17,7 @@
 #include "update_engine/payload_generator/extent_ranges.h"
 
 #include <algorithm>
+#include <iterator>
 #include <set>
 #include <utility>
 #include <vector>
@@ -374,4 +375,342 @@ Extent GetOverlapExtent(const Extent& extent1, const Extent& extent2) {
   return ExtentForRange(start_block, end_block - start_block);
 }
 
+bool operator==(const BlockInterval& a, const BlockInterval& b) {
+  return a.start_block == b.start_block && a.num_blocks == b.num_blocks;
+}
+
+namespace {
+
+bool IsValidExtent(const Extent& extent) {
+  return extent.start_block() != kSparseHole && extent.num_blocks() != 0;
+}
+
+BlockInterval IntervalForExtent(const Extent& extent) {
+  return {extent.start_block(), extent.num_blocks()};
+}
+
+// Returns the first interval of |intervals| ending after |block|, which is the
+// first one which could contain it.
+FlatExtentRanges::IntervalVector::const_iterator FirstEndingAfter(
+    const FlatExtentRanges::IntervalVector& intervals, uint64_t block) {
+  return std::partition_point(
+      intervals.begin(), intervals.end(), [block](const BlockInterval& x) {
+        return x.end_block() <= block;
+      });
+}
+
+}  // namespace
+
+FlatExtentRanges::FlatExtentRanges(const ExtentRanges& ranges) {
+  intervals_.reserve(ranges.extent_set().size());
+  for (const Extent& extent : ranges.extent_set()) {
+    AppendInterval(&intervals_, IntervalForExtent(extent));
+  }
+  blocks_ = ranges.blocks();
+}
+
+void FlatExtentRanges::AddBlock(uint64_t block) {
+  AddExtent(ExtentForRange(block, 1));
+}
+
+void FlatExtentRanges::SubtractBlock(uint64_t block) {
+  SubtractExtent(ExtentForRange(block, 1));
+}
+
+void FlatExtentRanges::AddExtent(const Extent& extent) {
+  if (!IsValidExtent(extent))
+    return;
+  BlockInterval interval = IntervalForExtent(extent);
+  // The intervals to merge with |interval| are the ones overlapping it, or
+  // touching it if |merge_touching_extents_| is set.
+  auto first = std::partition_point(
+      intervals_.begin(), intervals_.end(), [&](const BlockInterval& x) {
+        return merge_touching_extents_ ? x.end_block() < interval.start_block
+                                       : x.end_block() <= interval.start_block;
+      });
+  auto last = first;
+  uint64_t end_block = interval.end_block();
+  while (last != intervals_.end() &&
+         (merge_touching_extents_ ? last->start_block <= end_block
+                                  : last->start_block < end_block)) {
+    interval.start_block = std::min(interval.start_block, last->start_block);
+    end_block = std::max(end_block, last->end_block());
+    blocks_ -= last->num_blocks;
+    ++last;
+  }
+  interval.num_blocks = end_block - interval.start_block;
+  blocks_ += interval.num_blocks;
+  if (first == last) {
+    intervals_.insert(first, interval);
+  } else {
+    *first = interval;
+    intervals_.erase(first + 1, last);
+  }
+}
+
+void FlatExtentRanges::SubtractExtent(const Extent& extent) {
+  if (!IsValidExtent(extent))
+    return;
+  const BlockInterval interval = IntervalForExtent(extent);
+  auto first = std::partition_point(
+      intervals_.begin(), intervals_.end(), [&](const BlockInterval& x) {
+        return x.end_block() <= interval.start_block;
+      });
+  auto last = first;
+  // Only the beginning of the first overlapping interval and the end of the
+  // last one can remain.
+  BlockInterval remaining[2];
+  size_t num_remaining = 0;
+  while (last != intervals_.end() &&
+         last->start_block < interval.end_block()) {
+    if (last->start_block < interval.start_block) {
+      remaining[num_remaining++] = {
+          last->start_block, interval.start_block - last->start_block};
+    }
+    if (last->end_block() > interval.end_block()) {
+      remaining[num_remaining++] = {interval.end_block(),
+                                    last->end_block() - interval.end_block()};
+    }
+    blocks_ -= last->num_blocks;
+    ++last;
+  }
+  for (size_t i = 0; i < num_remaining; i++) {
+    blocks_ += remaining[i].num_blocks;
+  }
+  first = intervals_.erase(first, last);
+  intervals_.insert(first, remaining, remaining + num_remaining);
+}
+
+void FlatExtentRanges::AddExtents(const vector<Extent>& extents) {
+  if (extents.size() == 1) {
+    AddExtent(extents[0]);
+    return;
+  }
+  *this = Union(*this, FromExtents(extents));
+}
+
+void FlatExtentRanges::SubtractExtents(const vector<Extent>& extents) {
+  if (extents.size() == 1) {
+    SubtractExtent(extents[0]);
+    return;
+  }
+  *this = Subtract(*this, FromExtents(extents));
+}
+
+void FlatExtentRanges::AddRepeatedExtents(
+    const ::google::protobuf::RepeatedPtrField<Extent>& exts) {
+  *this = Union(*this, FromExtents(exts));
+}
+
+void FlatExtentRanges::SubtractRepeatedExtents(
+    const ::google::protobuf::RepeatedPtrField<Extent>& exts) {
+  *this = Subtract(*this, FromExtents(exts));
+}
+
+void FlatExtentRanges::AddRanges(const FlatExtentRanges& ranges) {
+  *this = Union(*this, ranges);
+}
+
+void FlatExtentRanges::SubtractRanges(const FlatExtentRanges& ranges) {
+  *this = Subtract(*this, ranges);
+}
+
+void FlatExtentRanges::IntersectRanges(const FlatExtentRanges& ranges) {
+  *this = Intersect(*this, ranges);
+}
+
+// static
+FlatExtentRanges FlatExtentRanges::Union(const FlatExtentRanges& a,
+                                         const FlatExtentRanges& b) {
+  IntervalVector merged;
+  merged.reserve(a.intervals_.size() + b.intervals_.size());
+  std::merge(a.intervals_.begin(),
+             a.intervals_.end(),
+             b.intervals_.begin(),
+             b.intervals_.end(),
+             std::back_inserter(merged),
+             [](const BlockInterval& x, const BlockInterval& y) {
+               return x.start_block < y.start_block;
+             });
+  FlatExtentRanges ret(a.merge_touching_extents_);
+  ret.SetIntervals(merged);
+  return ret;
+}
+
+// static
+FlatExtentRanges FlatExtentRanges::Subtract(const FlatExtentRanges& a,
+                                            const FlatExtentRanges& b) {
+  IntervalVector result;
+  result.reserve(a.intervals_.size());
+  auto b_it = b.intervals_.begin();
+  for (const BlockInterval& x : a.intervals_) {
+    uint64_t start_block = x.start_block;
+    while (b_it != b.intervals_.end() && b_it->end_block() <= start_block)
+      ++b_it;
+    // An interval of |b| may overlap several intervals of |a|, so |b_it| is
+    // only advanced past the ones ending before them.
+    for (auto it = b_it;
+         it != b.intervals_.end() && it->start_block < x.end_block() &&
+         start_block < x.end_block();
+         ++it) {
+      if (it->start_block > start_block)
+        result.push_back({start_block, it->start_block - start_block});
+      start_block = std::max(start_block, it->end_block());
+    }
+    if (start_block < x.end_block())
+      result.push_back({start_block, x.end_block() - start_block});
+  }
+  FlatExtentRanges ret(a.merge_touching_extents_);
+  ret.SetIntervals(result);
+  return ret;
+}
+
+// static
+FlatExtentRanges FlatExtentRanges::Intersect(const FlatExtentRanges& a,
+                                             const FlatExtentRanges& b) {
+  IntervalVector result;
+  auto a_it = a.intervals_.begin();
+  auto b_it = b.intervals_.begin();
+  while (a_it != a.intervals_.end() && b_it != b.intervals_.end()) {
+    const uint64_t start_block = std::max(a_it->start_block, b_it->start_block);
+    const uint64_t end_block = std::min(a_it->end_block(), b_it->end_block());
+    if (start_block < end_block)
+      result.push_back({start_block, end_block - start_block});
+    if (a_it->end_block() < b_it->end_block()) {
+      ++a_it;
+    } else {
+      ++b_it;
+    }
+  }
+  FlatExtentRanges ret(a.merge_touching_extents_);
+  ret.SetIntervals(result);
+  return ret;
+}
+
+bool FlatExtentRanges::OverlapsWithExtent(const Extent& extent) const {
+  if (!IsValidExtent(extent))
+    return false;
+  auto it = FirstEndingAfter(intervals_, extent.start_block());
+  return it != intervals_.end() &&
+         it->start_block < extent.start_block() + extent.num_blocks();
+}
+
+bool FlatExtentRanges::ContainsBlock(uint64_t block) const {
+  auto it = FirstEndingAfter(intervals_, block);
+  return it != intervals_.end() && it->start_block <= block;
+}
+
+void FlatExtentRanges::Dump() const {
+  LOG(INFO) << "FlatExtentRanges Dump. blocks: " << blocks_;
+  for (const BlockInterval& interval : intervals_) {
+    LOG(INFO) << "{" << interval.start_block << ", " << interval.num_blocks
+              << "}";
+  }
+}
+
+vector<Extent> FlatExtentRanges::ToExtents() const {
+  vector<Extent> ret;
+  ret.reserve(intervals_.size());
+  for (const BlockInterval& interval : intervals_) {
+    ret.push_back(ExtentForRange(interval.start_block, interval.num_blocks));
+  }
+  return ret;
+}
+
+vector<Extent> FlatExtentRanges::GetIntersectingExtents(
+    const Extent& extent) const {
+  vector<Extent> result;
+  for (const BlockInterval& interval : GetCandidateRange(extent)) {
+    const uint64_t start_block =
+        std::max(interval.start_block, extent.start_block());
+    const uint64_t end_block = std::min(
+        interval.end_block(), extent.start_block() + extent.num_blocks());
+    result.push_back(ExtentForRange(start_block, end_block - start_block));
+  }
+  return result;
+}
+
+Range<FlatExtentRanges::IntervalVector::const_iterator>
+FlatExtentRanges::GetCandidateRange(const Extent& extent) const {
+  if (!IsValidExtent(extent))
+    return {intervals_.end(), intervals_.end()};
+  const uint64_t end_block = extent.start_block() + extent.num_blocks();
+  auto lower_it = FirstEndingAfter(intervals_, extent.start_block());
+  auto upper_it = std::partition_point(
+      lower_it, intervals_.end(), [end_block](const BlockInterval& x) {
+        return x.start_block < end_block;
+      });
+  return {lower_it, upper_it};
+}
+
+template <typename T>
+FlatExtentRanges FlatExtentRanges::FromExtents(const T& extents) const {
+  IntervalVector intervals;
+  intervals.reserve(extents.size());
+  for (const Extent& extent : extents) {
+    if (IsValidExtent(extent))
+      intervals.push_back(IntervalForExtent(extent));
+  }
+  std::sort(intervals.begin(),
+            intervals.end(),
+            [](const BlockInterval& x, const BlockInterval& y) {
+              return x.start_block < y.start_block;
+            });
+  FlatExtentRanges ret(merge_touching_extents_);
+  ret.SetIntervals(intervals);
+  return ret;
+}
+
+void FlatExtentRanges::AppendInterval(IntervalVector* intervals,
+                                      const BlockInterval& interval) const {
+  if (!intervals->empty()) {
+    BlockInterval* last = &intervals->back();
+    if (merge_touching_extents_ ? interval.start_block <= last->end_block()
+                                : interval.start_block < last->end_block()) {
+      last->num_blocks =
+          std::max(last->end_block(), interval.end_block()) - last->start_block;
+      return;
+    }
+  }
+  intervals->push_back(interval);
+}
+
+void FlatExtentRanges::SetIntervals(const IntervalVector& intervals) {
+  intervals_.clear();
+  intervals_.reserve(intervals.size());
+  for (const BlockInterval& interval : intervals) {
+    AppendInterval(&intervals_, interval);
+  }
+  blocks_ = 0;
+  for (const BlockInterval& interval : intervals_) {
+    blocks_ += interval.num_blocks;
+  }
+}
+
+vector<Extent> FilterExtentRanges(const vector<Extent>& extents,
+                                  const FlatExtentRanges& ranges) {
+  vector<Extent> result;
+  const FlatExtentRanges::IntervalVector& intervals = ranges.intervals();
+  for (const Extent& extent : extents) {
+    // Like with ExtentRanges, sparse holes are never filtered out.
+    if (extent.start_block() == kSparseHole) {
+      result.push_back(extent);
+      continue;
+    }
+    uint64_t start_block = extent.start_block();
+    const uint64_t end_block = start_block + extent.num_blocks();
+    for (auto it = FirstEndingAfter(intervals, start_block);
+         it != intervals.end() && it->start_block < end_block;
+         ++it) {
+      if (it->start_block > start_block)
+        result.push_back(
+            ExtentForRange(start_block, it->start_block - start_block));
+      start_block = it->end_block();
+    }
+    if (start_block < end_block)
+      result.push_back(ExtentForRange(start_block, end_block - start_block));
+  }
+  return result;
+}
+
 }  // namespace chromeos_update_engine
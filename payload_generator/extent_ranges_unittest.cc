@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_generator/extent_ranges.h"
 
+#include <random>
 #include <vector>
 
 #include <base/stl_util.h>
@@ -390,4 +391,100 @@ TEST(ExtentRangesTest, OverlapsWithExtent) {
   ASSERT_TRUE(ranges.OverlapsWithExtent(ExtentForRange(19, 1)));
 }
 
+TEST(ExtentRangesTest, FlatExtentRangesAddSubtractTest) {
+  FlatExtentRanges ranges;
+  ranges.AddExtent(ExtentForRange(10, 10));
+  ranges.AddExtent(ExtentForRange(30, 10));
+  ranges.AddExtent(ExtentForRange(20, 5));
+  ranges.AddBlock(29);
+  EXPECT_EQ((FlatExtentRanges::IntervalVector{{10, 15}, {29, 11}}),
+            ranges.intervals());
+  EXPECT_EQ(26U, ranges.blocks());
+
+  ranges.SubtractExtent(ExtentForRange(12, 20));
+  EXPECT_EQ((FlatExtentRanges::IntervalVector{{10, 2}, {32, 8}}),
+            ranges.intervals());
+  EXPECT_EQ(10U, ranges.blocks());
+
+  ranges.AddExtents({ExtentForRange(50, 5), ExtentForRange(0, 11)});
+  EXPECT_EQ((FlatExtentRanges::IntervalVector{{0, 12}, {32, 8}, {50, 5}}),
+            ranges.intervals());
+  EXPECT_EQ(25U, ranges.blocks());
+  EXPECT_TRUE(ranges.ContainsBlock(0));
+  EXPECT_TRUE(ranges.ContainsBlock(39));
+  EXPECT_FALSE(ranges.ContainsBlock(40));
+  EXPECT_FALSE(ranges.ContainsBlock(kSparseHole));
+}
+
+TEST(ExtentRangesTest, FlatExtentRangesDontMergeTouchingTest) {
+  FlatExtentRanges ranges{false};
+  ranges.AddExtent(ExtentForRange(5, 5));
+  ranges.AddExtent(ExtentForRange(10, 5));
+  ranges.AddExtent(ExtentForRange(12, 5));
+  EXPECT_EQ((FlatExtentRanges::IntervalVector{{5, 5}, {10, 7}}),
+            ranges.intervals());
+  const auto candidates = ranges.GetCandidateRange(ExtentForRange(9, 2));
+  EXPECT_EQ(2, std::distance(candidates.begin(), candidates.end()));
+}
+
+TEST(ExtentRangesTest, FlatExtentRangesSetOperationsTest) {
+  FlatExtentRanges a;
+  a.AddExtents({ExtentForRange(0, 10), ExtentForRange(20, 10)});
+  FlatExtentRanges b;
+  b.AddExtents({ExtentForRange(5, 20), ExtentForRange(28, 1)});
+
+  EXPECT_EQ((FlatExtentRanges::IntervalVector{{0, 30}}),
+            FlatExtentRanges::Union(a, b).intervals());
+  EXPECT_EQ((FlatExtentRanges::IntervalVector{{0, 5}, {25, 3}, {29, 1}}),
+            FlatExtentRanges::Subtract(a, b).intervals());
+  EXPECT_EQ((FlatExtentRanges::IntervalVector{{5, 5}, {20, 5}, {28, 1}}),
+            FlatExtentRanges::Intersect(a, b).intervals());
+  EXPECT_EQ(9U, FlatExtentRanges::Subtract(a, b).blocks());
+}
+
+// Checks that FlatExtentRanges holds the same blocks as ExtentRanges for random
+// sequences of operations.
+TEST(ExtentRangesTest, FlatExtentRangesMatchExtentRangesTest) {
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<uint64_t> start_dist(0, 200);
+  std::uniform_int_distribution<uint64_t> size_dist(1, 20);
+  auto random_extents = [&](size_t count) {
+    vector<Extent> extents;
+    for (size_t i = 0; i < count; i++)
+      extents.push_back(ExtentForRange(start_dist(gen), size_dist(gen)));
+    return extents;
+  };
+
+  ExtentRanges ranges;
+  FlatExtentRanges flat_ranges;
+  for (int i = 0; i < 200; i++) {
+    const vector<Extent> extents = random_extents(1 + i % 4);
+    if (i % 3 == 2) {
+      ranges.SubtractExtents(extents);
+      flat_ranges.SubtractExtents(extents);
+    } else {
+      ranges.AddExtents(extents);
+      flat_ranges.AddExtents(extents);
+    }
+    ASSERT_EQ(ranges.blocks(), flat_ranges.blocks());
+    ASSERT_EQ(vector<Extent>(ranges.extent_set().begin(),
+                             ranges.extent_set().end()),
+              flat_ranges.ToExtents());
+
+    const vector<Extent> filtered = random_extents(3);
+    ASSERT_EQ(FilterExtentRanges(filtered, ranges),
+              FilterExtentRanges(filtered, flat_ranges));
+    for (const Extent& extent : filtered) {
+      ASSERT_EQ(ranges.OverlapsWithExtent(extent),
+                flat_ranges.OverlapsWithExtent(extent));
+      ASSERT_EQ(ranges.GetIntersectingExtents(extent),
+                flat_ranges.GetIntersectingExtents(extent));
+      ASSERT_EQ(ranges.ContainsBlock(extent.start_block()),
+                flat_ranges.ContainsBlock(extent.start_block()));
+    }
+  }
+  ASSERT_EQ(ranges.blocks(), FlatExtentRanges(ranges).blocks());
+  ASSERT_EQ(flat_ranges.intervals(), FlatExtentRanges(ranges).intervals());
+}
+
 }  // namespace chromeos_update_engine
@@ -27,11 +27,11 @@
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <base/synchronization/lock.h>
-#include <base/threading/simple_thread.h>
 #include <brillo/secure_blob.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/diff_task_scheduler.h"
 
 using std::vector;
 
@@ -44,7 +44,7 @@ const size_t kDefaultFullChunkSize = 1024 * 1024;  // 1 MiB
 // This class encapsulates a full update chunk processing thread work. The
 // processor reads a chunk of data from the input file descriptor and compresses
 // it. The processor will destroy itself when the work is done.
-class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
+class ChunkProcessor {
  public:
   // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
   ChunkProcessor(const PayloadVersion& version,
@@ -61,14 +61,13 @@ class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
         aop_(aop) {}
   // We use a default move constructor since all the data members are POD types.
   ChunkProcessor(ChunkProcessor&&) = default;
-  ~ChunkProcessor() override = default;
+  ~ChunkProcessor() = default;
 
-  // Overrides DelegateSimpleThread::Delegate.
   // Run() handles the read from |fd| in a thread-safe way, and stores the
   // new operation to generate the region starting at |offset| of size |size|
   // in the output operation |aop|. The associated blob data is stored in
   // |blob_fd| and |blob_file_size| is updated.
-  void Run() override;
+  void Run();
 
  private:
   bool ProcessChunk();
@@ -136,18 +135,19 @@ bool FullUpdateGenerator::GenerateOperations(
   TEST_AND_RETURN_FALSE(full_chunk_size % config.block_size == 0);
 
   size_t chunk_blocks = full_chunk_size / config.block_size;
-  size_t max_threads = diff_utils::GetMaxThreads();
+  DiffTaskScheduler::SetMaxThreads(config.max_threads);
+  DiffTaskScheduler* scheduler = DiffTaskScheduler::Get();
   LOG(INFO) << "Compressing partition " << new_part.name << " from "
             << new_part.path << " splitting in chunks of " << chunk_blocks
             << " blocks (" << config.block_size << " bytes each) using "
-            << max_threads << " threads";
+            << scheduler->num_threads() << " threads";
 
   int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
   TEST_AND_RETURN_FALSE(in_fd >= 0);
   ScopedFdCloser in_fd_closer(&in_fd);
 
-  // We potentially have all the ChunkProcessors in memory but only
-  // |max_threads| will actually hold a block in memory while we process.
+  // We potentially have all the ChunkProcessors in memory but only one per
+  // scheduler thread will actually hold a block in memory while we process.
   size_t partition_blocks = new_part.size / config.block_size;
   size_t num_chunks = utils::DivRoundUp(partition_blocks, chunk_blocks);
   aops->resize(num_chunks);
@@ -179,13 +179,10 @@ bool FullUpdateGenerator::GenerateOperations(
         aop);
   }
 
-  // Thread pool used for worker threads.
-  base::DelegateSimpleThreadPool thread_pool("full-update-generator",
-                                             max_threads);
-  thread_pool.Start();
+  DiffTaskScheduler::TaskGroup group(scheduler);
   for (ChunkProcessor& processor : chunk_processors)
-    thread_pool.AddWork(&processor);
-  thread_pool.JoinAll();
+    group.Submit([&processor] { processor.Run(); });
+  group.Wait();
 
   // All the operations must have a type set at this point. Otherwise, a
   // ChunkProcessor failed to complete.
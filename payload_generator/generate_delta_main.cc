@@ -450,6 +450,12 @@ DEFINE_bool(
     true,
     "Whether to enable zucchini feature when processing executable files.");
 
+DEFINE_bool(reorder_operations,
+            false,
+            "Whether to reorder the operations of delta partitions so that "
+            "consecutive operations read nearby source blocks, reducing the "
+            "seeks on the device while applying the payload.");
+
 DEFINE_string(erofs_compression_param,
               "",
               "Compression parameter passed to mkfs.erofs's -z option. "
@@ -460,6 +466,24 @@ DEFINE_int64(max_threads,
              "The maximum number of threads allowed for generating "
              "ota.");
 
+DEFINE_string(diff_cache_dir,
+              "",
+              "Directory caching the diffs of previous invocations, to reuse "
+              "them for the same pairs of old and new data. Created if "
+              "missing. Empty to disable the cache.");
+
+DEFINE_bool(predict_diff_methods,
+            false,
+            "Whether to skip the diff algorithms unlikely to beat the full "
+            "operation, predicted from the similarity of the old and new data "
+            "and their deflate streams.");
+
+DEFINE_string(diff_stats_file,
+              "",
+              "CSV file to append the predictor features, patch sizes and "
+              "chosen operation of each diff to, to tune the predictor. Diffs "
+              "found in the diff cache aren't recorded.");
+
 void RoundDownPartitions(const ImageConfig& config) {
   for (const auto& part : config.partitions) {
     if (part.path.empty()) {
@@ -612,6 +636,7 @@ int Main(int argc, char** argv) {
   payload_config.enable_vabc_xor = FLAGS_enable_vabc_xor;
   payload_config.enable_lz4diff = FLAGS_enable_lz4diff;
   payload_config.enable_zucchini = FLAGS_enable_zucchini;
+  payload_config.reorder_operations = FLAGS_reorder_operations;
 
   payload_config.ParseCompressorTypes(FLAGS_compressor_types);
 
@@ -771,6 +796,14 @@ int Main(int argc, char** argv) {
 
   payload_config.max_threads = FLAGS_max_threads;
 
+  if (!FLAGS_diff_cache_dir.empty()) {
+    CHECK(base::CreateDirectory(base::FilePath(FLAGS_diff_cache_dir)))
+        << "Failed to create diff cache directory " << FLAGS_diff_cache_dir;
+    payload_config.diff_cache_dir = FLAGS_diff_cache_dir;
+  }
+  payload_config.predict_diff_methods = FLAGS_predict_diff_methods;
+  payload_config.diff_stats_file = FLAGS_diff_stats_file;
+
   if (!FLAGS_partition_timestamps.empty()) {
     CHECK(ParsePerPartitionTimestamps(FLAGS_partition_timestamps,
                                       &payload_config));
@@ -17,9 +17,13 @@
 #include "update_engine/payload_generator/merge_sequence_generator.h"
 
 #include <algorithm>
+#include <iterator>
 #include <limits>
+#include <map>
+#include <utility>
 
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_task_scheduler.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
@@ -197,61 +201,243 @@ std::unique_ptr<MergeSequenceGenerator> MergeSequenceGenerator::Create(
       new MergeSequenceGenerator(sequence));
 }
 
+namespace {
+
+// Number of operations whose dependencies are found by each parallel task.
+constexpr size_t kFindDependencyBatchSize = 4096;
+
+// Largest cycle of operations for which all the ways to break it are tried.
+constexpr size_t kMaxExactCycleBreakSize = 12;
+
+constexpr size_t kNotFound = std::numeric_limits<size_t>::max();
+
+// Returns the position of |op| in the sorted |ops|, or kNotFound.
+size_t FindOperation(const std::vector<size_t>& ops, size_t op) {
+  const auto it = std::lower_bound(ops.begin(), ops.end(), op);
+  return it != ops.end() && *it == op ? it - ops.begin() : kNotFound;
+}
+
+// Returns the edges of |merge_after| between the operations |ops|, as
+// positions in |ops|.
+std::vector<std::vector<size_t>> GetSubgraph(
+    const std::vector<std::vector<size_t>>& merge_after,
+    const std::vector<size_t>& ops) {
+  std::vector<std::vector<size_t>> subgraph(ops.size());
+  for (size_t i = 0; i < ops.size(); i++) {
+    for (size_t blocked : merge_after[ops[i]]) {
+      const size_t j = FindOperation(ops, blocked);
+      if (j != kNotFound)
+        subgraph[i].push_back(j);
+    }
+  }
+  return subgraph;
+}
+
+// Returns the cycles among the sorted operations |ops|, i.e. the strongly
+// connected components of more than one operation, each sorted.
+std::vector<std::vector<size_t>> FindCycles(
+    const std::vector<std::vector<size_t>>& merge_after,
+    const std::vector<size_t>& ops) {
+  const auto graph = GetSubgraph(merge_after, ops);
+  // Tarjan's algorithm, iterative so that long chains don't overflow the
+  // stack.
+  std::vector<size_t> index(ops.size(), kNotFound);
+  std::vector<size_t> lowlink(ops.size());
+  std::vector<bool> on_stack(ops.size(), false);
+  std::vector<size_t> stack;
+  // The operations being visited, with the position of their next edge.
+  std::vector<std::pair<size_t, size_t>> visiting;
+  size_t next_index = 0;
+  std::vector<std::vector<size_t>> cycles;
+  for (size_t root = 0; root < ops.size(); root++) {
+    if (index[root] != kNotFound)
+      continue;
+    index[root] = lowlink[root] = next_index++;
+    stack.push_back(root);
+    on_stack[root] = true;
+    visiting.emplace_back(root, 0);
+    while (!visiting.empty()) {
+      const size_t v = visiting.back().first;
+      const size_t edge = visiting.back().second++;
+      if (edge < graph[v].size()) {
+        const size_t w = graph[v][edge];
+        if (index[w] == kNotFound) {
+          index[w] = lowlink[w] = next_index++;
+          stack.push_back(w);
+          on_stack[w] = true;
+          visiting.emplace_back(w, 0);
+        } else if (on_stack[w]) {
+          lowlink[v] = std::min(lowlink[v], index[w]);
+        }
+        continue;
+      }
+      visiting.pop_back();
+      if (!visiting.empty()) {
+        const size_t parent = visiting.back().first;
+        lowlink[parent] = std::min(lowlink[parent], lowlink[v]);
+      }
+      if (lowlink[v] != index[v])
+        continue;
+      std::vector<size_t> component;
+      size_t w;
+      do {
+        w = stack.back();
+        stack.pop_back();
+        on_stack[w] = false;
+        component.push_back(ops[w]);
+      } while (w != v);
+      if (component.size() > 1) {
+        std::sort(component.begin(), component.end());
+        cycles.push_back(std::move(component));
+      }
+    }
+  }
+  return cycles;
+}
+
+// Returns whether the operations of |graph| not in |removed| form no cycle.
+bool IsAcyclic(const std::vector<std::vector<size_t>>& graph,
+               uint32_t removed) {
+  std::vector<size_t> incoming_edges(graph.size(), 0);
+  for (size_t i = 0; i < graph.size(); i++) {
+    if (removed & (1u << i))
+      continue;
+    for (size_t j : graph[i])
+      incoming_edges[j]++;
+  }
+  std::vector<size_t> free_operations;
+  size_t remaining = 0;
+  for (size_t i = 0; i < graph.size(); i++) {
+    if (removed & (1u << i))
+      continue;
+    remaining++;
+    if (incoming_edges[i] == 0)
+      free_operations.push_back(i);
+  }
+  while (!free_operations.empty()) {
+    const size_t i = free_operations.back();
+    free_operations.pop_back();
+    remaining--;
+    for (size_t j : graph[i]) {
+      if (!(removed & (1u << j)) && --incoming_edges[j] == 0)
+        free_operations.push_back(j);
+    }
+  }
+  return remaining == 0;
+}
+
+}  // namespace
+
 bool MergeSequenceGenerator::FindDependency(
-    std::map<CowMergeOperation, std::set<CowMergeOperation>>* result) const {
+    std::vector<std::vector<size_t>>* result) const {
   CHECK(result);
   LOG(INFO) << "Finding dependencies";
 
-  // Since the OTA operation may reuse some source blocks, use the binary
-  // search on sorted dst extents to find overlaps.
-  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
-  for (const auto& op : operations_) {
-    // lower bound (inclusive): dst extent's end block >= src extent's start
-    // block.
-    const auto lower_it = std::lower_bound(
-        operations_.begin(),
-        operations_.end(),
-        op,
-        [](const CowMergeOperation& it, const CowMergeOperation& op) {
-          auto dst_end_block =
-              it.dst_extent().start_block() + it.dst_extent().num_blocks() - 1;
-          return dst_end_block < op.src_extent().start_block();
-        });
-    // upper bound: dst extent's start block > src extent's end block
-    const auto upper_it = std::upper_bound(
-        lower_it,
-        operations_.end(),
-        op,
-        [](const CowMergeOperation& op, const CowMergeOperation& it) {
-          auto src_end_block =
-              op.src_extent().start_block() + op.src_extent().num_blocks() - 1;
-          return src_end_block < it.dst_extent().start_block();
-        });
-
-    // TODO(xunchang) skip inserting the empty set to merge_after.
-    if (lower_it == upper_it) {
-      merge_after.insert({op, {}});
-    } else {
-      std::set<CowMergeOperation> operations(lower_it, upper_it);
-      auto it = operations.find(op);
-      if (it != operations.end()) {
-        LOG(INFO) << "Self overlapping " << op;
-        operations.erase(it);
+  // The dst extents are sorted and disjoint, so the operations whose dst
+  // extent overlaps a src extent are a range of them, found with a binary
+  // search on the start and end blocks copied out of the operations.
+  const size_t num_ops = operations_.size();
+  std::vector<uint64_t> dst_start_blocks(num_ops), dst_end_blocks(num_ops);
+  for (size_t i = 0; i < num_ops; i++) {
+    const Extent& dst_extent = operations_[i].dst_extent();
+    dst_start_blocks[i] = dst_extent.start_block();
+    dst_end_blocks[i] = dst_extent.start_block() + dst_extent.num_blocks() - 1;
+  }
+
+  std::vector<std::vector<size_t>> merge_after(num_ops);
+  auto find_batch = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      const Extent& src_extent = operations_[i].src_extent();
+      const uint64_t src_start_block = src_extent.start_block();
+      const uint64_t src_end_block =
+          src_extent.start_block() + src_extent.num_blocks() - 1;
+      // lower bound (inclusive): dst extent's end block >= src extent's start
+      // block.
+      const size_t lower = std::lower_bound(dst_end_blocks.begin(),
+                                            dst_end_blocks.end(),
+                                            src_start_block) -
+                           dst_end_blocks.begin();
+      // upper bound: dst extent's start block > src extent's end block
+      const size_t upper = std::upper_bound(dst_start_blocks.begin() + lower,
+                                            dst_start_blocks.end(),
+                                            src_end_block) -
+                           dst_start_blocks.begin();
+      for (size_t j = lower; j < upper; j++) {
+        if (j == i) {
+          LOG(INFO) << "Self overlapping " << operations_[i];
+          continue;
+        }
+        merge_after[i].push_back(j);
       }
-      auto ret = merge_after.emplace(op, std::move(operations));
-      // Check the insertion indeed happens.
-      CHECK(ret.second) << op;
     }
+  };
+  DiffTaskScheduler::TaskGroup group(DiffTaskScheduler::Get());
+  for (size_t begin = 0; begin < num_ops; begin += kFindDependencyBatchSize) {
+    const size_t end = std::min(num_ops, begin + kFindDependencyBatchSize);
+    group.Submit([&find_batch, begin, end] { find_batch(begin, end); });
   }
+  group.Wait();
 
   *result = std::move(merge_after);
   return true;
 }
 
+std::vector<size_t> MergeSequenceGenerator::PickOperationsToConvert(
+    const std::vector<std::vector<size_t>>& merge_after,
+    const std::vector<size_t>& cycle) const {
+  const auto graph = GetSubgraph(merge_after, cycle);
+  std::vector<uint64_t> num_blocks(cycle.size());
+  for (size_t i = 0; i < cycle.size(); i++)
+    num_blocks[i] = operations_[cycle[i]].dst_extent().num_blocks();
+
+  if (cycle.size() <= kMaxExactCycleBreakSize) {
+    // Try all the sets of operations, for the one with the fewest blocks
+    // leaving no cycle. On ties, the one found first is kept.
+    uint32_t best_set = 0;
+    uint64_t best_blocks = std::numeric_limits<uint64_t>::max();
+    for (uint32_t set = 1; set < (1u << cycle.size()); set++) {
+      uint64_t blocks = 0;
+      for (size_t i = 0; i < cycle.size(); i++) {
+        if (set & (1u << i))
+          blocks += num_blocks[i];
+      }
+      if (blocks < best_blocks && IsAcyclic(graph, set)) {
+        best_set = set;
+        best_blocks = blocks;
+      }
+    }
+    std::vector<size_t> to_convert;
+    for (size_t i = 0; i < cycle.size(); i++) {
+      if (best_set & (1u << i))
+        to_convert.push_back(cycle[i]);
+    }
+    return to_convert;
+  }
+
+  // Too many to try them all. Pick the operation with the fewest blocks for
+  // the most cycles it may be part of, estimated by the product of its
+  // degrees.
+  std::vector<uint64_t> in_degree(cycle.size(), 0);
+  for (const auto& edges : graph) {
+    for (size_t j : edges)
+      in_degree[j]++;
+  }
+  size_t best = 0;
+  uint64_t best_degree = in_degree[0] * graph[0].size();
+  for (size_t i = 1; i < cycle.size(); i++) {
+    const uint64_t degree = in_degree[i] * graph[i].size();
+    if (num_blocks[i] * best_degree < num_blocks[best] * degree) {
+      best = i;
+      best_degree = degree;
+    }
+  }
+  return {cycle[best]};
+}
+
 bool MergeSequenceGenerator::Generate(
     std::vector<CowMergeOperation>* sequence) const {
   sequence->clear();
-  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
+  std::vector<std::vector<size_t>> merge_after;
   if (!FindDependency(&merge_after)) {
     LOG(ERROR) << "Failed to find dependencies";
     return false;
@@ -262,105 +448,136 @@ bool MergeSequenceGenerator::Generate(
   // Use the non-DFS version of the topology sort. So we can control the
   // operations to discard to break cycles; thus yielding a deterministic
   // sequence.
-  std::map<CowMergeOperation, int> incoming_edges;
-  for (const auto& it : merge_after) {
-    for (const auto& blocked : it.second) {
-      // Value is default initialized to 0.
-      incoming_edges[blocked] += 1;
-    }
+  const size_t num_ops = operations_.size();
+  std::vector<size_t> incoming_edges(num_ops, 0);
+  for (const auto& blocked_ops : merge_after) {
+    for (size_t blocked : blocked_ops)
+      incoming_edges[blocked]++;
   }
 
-  // Technically, we can use std::unordered_set or just a std::vector. but
-  // std::set gives the benefit where operations are sorted by dst blocks. This
-  // will ensure that operations that do not have dependency constraints appear
-  // in increasing block order. Such order would help snapuserd batch merges and
+  // Operations are kept sorted by index, which is by dst blocks. This will
+  // ensure that operations that do not have dependency constraints appear in
+  // increasing block order. Such order would help snapuserd batch merges and
   // improve boot time, but isn't strictly needed for correctness.
-  std::set<CowMergeOperation> free_operations;
-  for (const auto& op : operations_) {
-    if (incoming_edges.find(op) == incoming_edges.end()) {
-      free_operations.insert(op);
-    }
+  std::vector<size_t> free_operations;
+  for (size_t i = 0; i < num_ops; i++) {
+    if (incoming_edges[i] == 0)
+      free_operations.push_back(i);
   }
 
-  std::vector<CowMergeOperation> merge_sequence;
-  std::set<CowMergeOperation> convert_to_raw;
-  while (!incoming_edges.empty()) {
+  // Operations are done once merged or converted to raw.
+  std::vector<bool> done(num_ops, false);
+  size_t num_done = 0;
+  // The cycles left to break, by their first operation. They are found the
+  // first time no operation is free.
+  std::map<size_t, std::vector<size_t>> cycles;
+  bool cycles_found = false;
+
+  std::vector<size_t> merge_sequence;
+  std::vector<size_t> convert_to_raw;
+  while (num_done < num_ops) {
     if (!free_operations.empty()) {
       merge_sequence.insert(
           merge_sequence.end(), free_operations.begin(), free_operations.end());
     } else {
-      auto to_convert = incoming_edges.begin()->first;
-      free_operations.insert(to_convert);
-      convert_to_raw.insert(to_convert);
-      LOG(INFO) << "Converting operation to raw " << to_convert;
+      // All the operations left are blocked by a cycle, or by operations
+      // blocked by one. Break the first cycle by converting as few blocks of
+      // it as possible to raw.
+      if (!cycles_found) {
+        std::vector<size_t> remaining;
+        for (size_t i = 0; i < num_ops; i++) {
+          if (!done[i])
+            remaining.push_back(i);
+        }
+        for (auto& cycle : FindCycles(merge_after, remaining))
+          cycles.emplace(cycle.front(), std::move(cycle));
+        cycles_found = true;
+      }
+      if (cycles.empty()) {
+        LOG(ERROR) << "No cycle found among the " << num_ops - num_done
+                   << " blocked operations";
+        return false;
+      }
+      const std::vector<size_t> cycle = std::move(cycles.begin()->second);
+      cycles.erase(cycles.begin());
+      free_operations = PickOperationsToConvert(merge_after, cycle);
+      for (size_t op : free_operations) {
+        LOG(INFO) << "Converting operation to raw " << operations_[op];
+      }
+      convert_to_raw.insert(
+          convert_to_raw.end(), free_operations.begin(), free_operations.end());
+      // Operations of the cycle may still form smaller cycles.
+      std::vector<size_t> rest;
+      std::set_difference(cycle.begin(),
+                          cycle.end(),
+                          free_operations.begin(),
+                          free_operations.end(),
+                          std::back_inserter(rest));
+      for (auto& smaller_cycle : FindCycles(merge_after, rest))
+        cycles.emplace(smaller_cycle.front(), std::move(smaller_cycle));
     }
 
-    std::set<CowMergeOperation> next_free_operations;
-    for (const auto& op : free_operations) {
-      incoming_edges.erase(op);
+    std::vector<size_t> next_free_operations;
+    for (size_t op : free_operations) {
+      done[op] = true;
+      num_done++;
 
       // Now that this particular operation is merged, other operations
       // blocked by this one may be free. Decrement the count of blocking
       // operations, and set up the free operations for the next iteration.
-      for (const auto& blocked : merge_after[op]) {
-        auto it = incoming_edges.find(blocked);
-        if (it == incoming_edges.end()) {
+      for (size_t blocked : merge_after[op]) {
+        if (done[blocked])
           continue;
-        }
-
-        auto blocking_transfer_count = &it->second;
-        if (*blocking_transfer_count <= 0) {
-          LOG(ERROR) << "Unexpected count in merge after map "
-                     << blocking_transfer_count;
+        if (incoming_edges[blocked] == 0) {
+          LOG(ERROR) << "Unexpected count in merge after map for "
+                     << operations_[blocked];
           return false;
         }
         // This operation is no longer blocked by anyone. Add it to the merge
         // sequence in the next iteration.
-        *blocking_transfer_count -= 1;
-        if (*blocking_transfer_count == 0) {
-          next_free_operations.insert(blocked);
+        if (--incoming_edges[blocked] == 0) {
+          next_free_operations.push_back(blocked);
         }
       }
     }
+    std::sort(next_free_operations.begin(), next_free_operations.end());
 
-    LOG(INFO) << "Remaining transfers " << incoming_edges.size()
+    LOG(INFO) << "Remaining transfers " << num_ops - num_done
               << ", free transfers " << free_operations.size()
               << ", merge_sequence size " << merge_sequence.size();
     free_operations = std::move(next_free_operations);
   }
 
-  if (!free_operations.empty()) {
-    merge_sequence.insert(
-        merge_sequence.end(), free_operations.begin(), free_operations.end());
-  }
-
   CHECK_EQ(operations_.size(), merge_sequence.size() + convert_to_raw.size());
 
   size_t blocks_in_sequence = 0;
-  for (const CowMergeOperation& transfer : merge_sequence) {
-    blocks_in_sequence += transfer.dst_extent().num_blocks();
+  std::vector<CowMergeOperation> result;
+  result.reserve(merge_sequence.size());
+  for (size_t op : merge_sequence) {
+    blocks_in_sequence += operations_[op].dst_extent().num_blocks();
+    result.push_back(operations_[op]);
   }
 
   size_t blocks_in_raw = 0;
-  for (const CowMergeOperation& transfer : convert_to_raw) {
-    blocks_in_raw += transfer.dst_extent().num_blocks();
+  for (size_t op : convert_to_raw) {
+    blocks_in_raw += operations_[op].dst_extent().num_blocks();
   }
 
   LOG(INFO) << "Blocks in merge sequence " << blocks_in_sequence
             << ", blocks in raw " << blocks_in_raw;
-  if (!ValidateSequence(merge_sequence)) {
+  if (!ValidateSequence(result)) {
     LOG(ERROR) << "Invalid Sequence";
     return false;
   }
 
-  *sequence = std::move(merge_sequence);
+  *sequence = std::move(result);
   return true;
 }
 
 bool MergeSequenceGenerator::ValidateSequence(
     const std::vector<CowMergeOperation>& sequence) {
   LOG(INFO) << "Validating merge sequence";
-  ExtentRanges visited;
+  FlatExtentRanges visited;
   for (const auto& op : sequence) {
     // If |src_offset| is greater than zero, dependency should include 1 extra
     // block at end of src_extent, as the OP actually references data past
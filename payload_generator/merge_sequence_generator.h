@@ -64,10 +64,18 @@ class MergeSequenceGenerator {
   explicit MergeSequenceGenerator(std::vector<CowMergeOperation> transfers)
       : operations_(std::move(transfers)) {}
 
-  // For a given merge operation, finds all the operations that should merge
-  // after myself. Put the result in |merge_after|.
-  bool FindDependency(std::map<CowMergeOperation, std::set<CowMergeOperation>>*
-                          merge_after) const;
+  // For each merge operation, finds all the operations that should merge
+  // after it, as indexes in |operations_|. Put the result in |merge_after|.
+  // Operations are looked up by a binary search on their dst extents, which
+  // are sorted and disjoint, and batches of them are processed in parallel.
+  bool FindDependency(std::vector<std::vector<size_t>>* merge_after) const;
+  // Picks operations of |cycle|, a strongly connected component of the graph
+  // |merge_after|, to convert to raw so that the rest of them form no cycle.
+  // Small cycles are broken with as few blocks as possible, larger ones one
+  // operation at a time.
+  std::vector<size_t> PickOperationsToConvert(
+      const std::vector<std::vector<size_t>>& merge_after,
+      const std::vector<size_t>& cycle) const;
   // The list of CowMergeOperations to sort.
   const std::vector<CowMergeOperation> operations_;
 };
@@ -44,7 +44,15 @@ class MergeSequenceGeneratorTest : public ::testing::Test {
       std::map<CowMergeOperation, std::set<CowMergeOperation>>* result) {
     std::sort(transfers.begin(), transfers.end());
     MergeSequenceGenerator generator(std::move(transfers));
-    ASSERT_TRUE(generator.FindDependency(result));
+    std::vector<std::vector<size_t>> merge_after;
+    ASSERT_TRUE(generator.FindDependency(&merge_after));
+    result->clear();
+    const auto& operations = generator.operations_;
+    for (size_t i = 0; i < operations.size(); i++) {
+      auto& blocked_operations = (*result)[operations[i]];
+      for (size_t blocked : merge_after[i])
+        blocked_operations.insert(operations[blocked]);
+    }
   }
 
   void GenerateSequence(std::vector<CowMergeOperation> transfers,
@@ -215,6 +223,25 @@ TEST_F(MergeSequenceGeneratorTest, GenerateSequenceMultipleCycles) {
   GenerateSequence(transfers, expected);
 }
 
+TEST_F(MergeSequenceGeneratorTest, GenerateSequenceConvertsFewestBlocks) {
+  std::vector<CowMergeOperation> transfers = {
+      // The second operation has fewer blocks, so it is converted to raw even
+      // if its dst extent is after the first one's.
+      CreateCowMergeOperation(ExtentForRange(50, 10), ExtentForRange(10, 10)),
+      CreateCowMergeOperation(ExtentForRange(10, 2), ExtentForRange(50, 2)),
+  };
+  GenerateSequence(transfers, {transfers[0]});
+
+  transfers = {
+      // Blocked by the cycle, but not part of it, so it is never converted.
+      CreateCowMergeOperation(ExtentForRange(100, 2), ExtentForRange(0, 2)),
+      // cycle
+      CreateCowMergeOperation(ExtentForRange(20, 10), ExtentForRange(2, 10)),
+      CreateCowMergeOperation(ExtentForRange(0, 10), ExtentForRange(20, 10)),
+  };
+  GenerateSequence(transfers, {transfers[2], transfers[0]});
+}
+
 void ValidateSplitSequence(const Extent& src_extent, const Extent& dst_extent) {
   std::vector<CowMergeOperation> sequence;
   SplitSelfOverlapping(src_extent, dst_extent, &sequence);
@@ -17,8 +17,10 @@
 #include "update_engine/payload_generator/payload_file.h"
 
 #include <endian.h>
+#include <sys/stat.h>
 
 #include <algorithm>
+#include <iterator>
 #include <map>
 #include <utility>
 
@@ -50,12 +52,20 @@ struct DeltaObject {
   off_t size;
 };
 
-// Writes the uint64_t passed in in host-endian to the file as big-endian.
-// Returns true on success.
-bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
+// The size of the buffer the data blobs are copied through.
+constexpr size_t kBlobCopyBufferSize = 1024 * 1024;
+
+// Appends the value passed in in host-endian to |blob| as big-endian.
+void AppendUint64AsBigEndian(brillo::Blob* blob, const uint64_t value) {
   uint64_t value_be = htobe64(value);
-  TEST_AND_RETURN_FALSE(writer->Write(&value_be, sizeof(value_be)));
-  return true;
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value_be);
+  blob->insert(blob->end(), bytes, bytes + sizeof(value_be));
+}
+
+void AppendUint32AsBigEndian(brillo::Blob* blob, const uint32_t value) {
+  uint32_t value_be = htobe32(value);
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value_be);
+  blob->insert(blob->end(), bytes, bytes + sizeof(value_be));
 }
 
 }  // namespace
@@ -121,10 +131,14 @@ bool PayloadFile::WritePayload(const string& payload_file,
                                const string& data_blobs_path,
                                const string& private_key_path,
                                uint64_t* metadata_size_out) {
-  // Reorder the data blobs with the manifest_.
-  ScopedTempFile ordered_blobs_file("CrAU_temp_data.ordered.XXXXXX");
-  TEST_AND_RETURN_FALSE(
-      ReorderDataBlobs(data_blobs_path, ordered_blobs_file.path()));
+  int blobs_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(blobs_fd >= 0);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+
+  // Reorder the data blobs with the manifest_. They are copied in that order
+  // straight from |data_blobs_path| into the payload.
+  vector<BlobRange> blob_ranges;
+  TEST_AND_RETURN_FALSE(ReorderDataBlobs(blobs_fd, &blob_ranges));
 
   // Check that install op blobs are in order.
   uint64_t next_blob_offset = 0;
@@ -197,12 +211,13 @@ bool PayloadFile::WritePayload(const string& payload_file,
     PayloadSigner::AddSignatureToManifest(
         next_blob_offset, signature_blob_length, &manifest_);
   }
-  WritePayload(payload_file,
-               ordered_blobs_file.path(),
-               private_key_path,
-               major_version_,
-               manifest_,
-               metadata_size_out);
+  TEST_AND_RETURN_FALSE(WritePayloadFromBlobs(payload_file,
+                                              blobs_fd,
+                                              blob_ranges,
+                                              private_key_path,
+                                              major_version_,
+                                              manifest_,
+                                              metadata_size_out));
 
   ReportPayloadUsage(*metadata_size_out);
   return true;
@@ -214,124 +229,140 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
                                uint64_t major_version_,
                                const DeltaArchiveManifest& manifest,
                                uint64_t* metadata_size_out) {
-  std::string serialized_manifest;
+  int blobs_fd = open(ordered_blobs_file.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(blobs_fd >= 0);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+  struct stat blobs_stat;
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(blobs_fd, &blobs_stat) == 0);
+  vector<BlobRange> blob_ranges;
+  if (blobs_stat.st_size > 0)
+    blob_ranges.push_back({0, static_cast<uint64_t>(blobs_stat.st_size)});
+  return WritePayloadFromBlobs(payload_file,
+                               blobs_fd,
+                               blob_ranges,
+                               private_key_path,
+                               major_version_,
+                               manifest,
+                               metadata_size_out);
+}
 
+bool PayloadFile::WritePayloadFromBlobs(const std::string& payload_file,
+                                        int blobs_fd,
+                                        const vector<BlobRange>& blob_ranges,
+                                        const std::string& private_key_path,
+                                        uint64_t major_version_,
+                                        const DeltaArchiveManifest& manifest,
+                                        uint64_t* metadata_size_out) {
+  std::string serialized_manifest;
   TEST_AND_RETURN_FALSE(manifest.SerializeToString(&serialized_manifest));
-  uint64_t metadata_size =
-      sizeof(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
-  LOG(INFO) << "Writing final delta file header...";
-  DirectFileWriter writer;
-  TEST_AND_RETURN_FALSE_ERRNO(writer.Open(payload_file.c_str(),
-                                          O_WRONLY | O_CREAT | O_TRUNC,
-                                          0644) == 0);
-  ScopedFileWriterCloser writer_closer(&writer);
-
-  // Write header
-  TEST_AND_RETURN_FALSE_ERRNO(writer.Write(kDeltaMagic, sizeof(kDeltaMagic)));
-
-  // Write major version number
-  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer, major_version_));
-
-  // Write protobuf length
-  TEST_AND_RETURN_FALSE(
-      WriteUint64AsBigEndian(&writer, serialized_manifest.size()));
 
   // Metadata signature has the same size as payload signature, because they
   // are both the same kind of signature for the same kind of hash.
   const auto signature_blob_length = manifest.signatures_size();
-  // Adding a new scope here so code down below can't access
-  // metadata_signature_size, as the integer is in big endian, not host
-  // endianess.
-  {
-    const uint32_t metadata_signature_size = htobe32(signature_blob_length);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(&metadata_signature_size,
-                                             sizeof(metadata_signature_size)));
-    metadata_size += sizeof(metadata_signature_size);
-  }
 
-  // Write protobuf
-  LOG(INFO) << "Writing final delta file protobuf... "
+  // The metadata is put together in memory, so that it is hashed without
+  // reading it back.
+  brillo::Blob metadata(std::begin(kDeltaMagic), std::end(kDeltaMagic));
+  AppendUint64AsBigEndian(&metadata, major_version_);
+  AppendUint64AsBigEndian(&metadata, serialized_manifest.size());
+  AppendUint32AsBigEndian(&metadata, signature_blob_length);
+  metadata.insert(
+      metadata.end(), serialized_manifest.begin(), serialized_manifest.end());
+
+  LOG(INFO) << "Writing final delta file header and protobuf... "
             << serialized_manifest.size();
-  TEST_AND_RETURN_FALSE_ERRNO(
-      writer.Write(serialized_manifest.data(), serialized_manifest.size()));
+  DirectFileWriter writer;
+  TEST_AND_RETURN_FALSE_ERRNO(writer.Open(payload_file.c_str(),
+                                          O_WRONLY | O_CREAT | O_TRUNC,
+                                          0644) == 0);
+  ScopedFileWriterCloser writer_closer(&writer);
+  TEST_AND_RETURN_FALSE_ERRNO(writer.Write(metadata.data(), metadata.size()));
+
+  // The payload signature covers the whole payload but the signature blobs,
+  // hashed as it is written.
+  const bool sign = !private_key_path.empty();
+  HashCalculator payload_hasher;
+  if (sign)
+    TEST_AND_RETURN_FALSE(
+        payload_hasher.Update(metadata.data(), metadata.size()));
 
   // Write metadata signature blob.
-  if (!private_key_path.empty()) {
+  if (sign) {
     brillo::Blob metadata_hash;
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(
-        payload_file, metadata_size, &metadata_hash));
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfData(metadata, &metadata_hash));
     string metadata_signature;
     TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
         metadata_hash, {private_key_path}, &metadata_signature));
+    TEST_AND_RETURN_FALSE(metadata_signature.size() == signature_blob_length);
     TEST_AND_RETURN_FALSE_ERRNO(
         writer.Write(metadata_signature.data(), metadata_signature.size()));
   }
 
   // Append the data blobs.
   LOG(INFO) << "Writing final delta file data blobs...";
-  int blobs_fd = open(ordered_blobs_file.c_str(), O_RDONLY, 0);
-  ScopedFdCloser blobs_fd_closer(&blobs_fd);
-  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-  for (;;) {
-    vector<char> buf(1024 * 1024);
-    ssize_t rc = read(blobs_fd, buf.data(), buf.size());
-    if (0 == rc) {
-      // EOF
-      break;
+  brillo::Blob buf(kBlobCopyBufferSize);
+  uint64_t blobs_size = 0;
+  for (const auto& range : blob_ranges) {
+    for (uint64_t pos = 0; pos < range.length;) {
+      const size_t size = std::min<uint64_t>(buf.size(), range.length - pos);
+      ssize_t rc = pread(blobs_fd, buf.data(), size, range.offset + pos);
+      TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+      // The blobs must be all there.
+      TEST_AND_RETURN_FALSE(rc > 0);
+      if (sign)
+        TEST_AND_RETURN_FALSE(payload_hasher.Update(buf.data(), rc));
+      TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), rc));
+      pos += rc;
     }
-    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), rc));
+    blobs_size += range.length;
   }
+
   // Write payload signature blob.
-  if (!private_key_path.empty()) {
+  if (sign) {
     LOG(INFO) << "Signing the update...";
+    TEST_AND_RETURN_FALSE(blobs_size == manifest.signatures_offset());
+    TEST_AND_RETURN_FALSE(payload_hasher.Finalize());
     string signature;
-    TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(
-        payload_file,
-        {private_key_path},
-        metadata_size,
-        signature_blob_length,
-        metadata_size + signature_blob_length + manifest.signatures_offset(),
-        &signature));
+    TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
+        payload_hasher.raw_hash(), {private_key_path}, &signature));
     TEST_AND_RETURN_FALSE_ERRNO(
         writer.Write(signature.data(), signature.size()));
   }
   if (metadata_size_out) {
-    *metadata_size_out = metadata_size;
+    *metadata_size_out = metadata.size();
   }
   return true;
 }
 
-bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
-                                   const string& new_data_blobs_path) {
-  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
-
-  DirectFileWriter writer;
-  int rc = writer.Open(
-      new_data_blobs_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644);
-  if (rc != 0) {
-    PLOG(ERROR) << "Error creating " << new_data_blobs_path;
-    return false;
-  }
-  ScopedFileWriterCloser writer_closer(&writer);
+bool PayloadFile::ReorderDataBlobs(int data_blobs_fd,
+                                   vector<BlobRange>* blob_ranges) {
+  blob_ranges->clear();
   uint64_t out_file_size = 0;
+  brillo::Blob buf;
 
   for (auto& part : part_vec_) {
     for (AnnotatedOperation& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
       CHECK(aop.op.has_data_length());
-      brillo::Blob buf(aop.op.data_length());
-      ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
+      buf.resize(aop.op.data_length());
+      ssize_t rc =
+          pread(data_blobs_fd, buf.data(), buf.size(), aop.op.data_offset());
       TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
 
       // Add the hash of the data blobs for this operation
       TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
 
+      // Blobs stored one after the other are copied at once.
+      if (!blob_ranges->empty() &&
+          blob_ranges->back().offset + blob_ranges->back().length ==
+              aop.op.data_offset()) {
+        blob_ranges->back().length += buf.size();
+      } else {
+        blob_ranges->push_back({aop.op.data_offset(), buf.size()});
+      }
       aop.op.set_data_offset(out_file_size);
-      TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), buf.size()));
       out_file_size += buf.size();
     }
   }
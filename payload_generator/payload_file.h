@@ -50,12 +50,17 @@ class PayloadFile {
   // Write the payload to the |payload_file| file. The operations reference
   // blobs in the |data_blobs_path| file and the blobs will be reordered in the
   // payload file to match the order of the operations. The size of the metadata
-  // section of the payload is stored in |metadata_size_out|.
+  // section of the payload is stored in |metadata_size_out|. The blobs are
+  // read from |data_blobs_path| twice, to hash them and then to copy them, and
+  // written once.
   bool WritePayload(const std::string& payload_file,
                     const std::string& data_blobs_path,
                     const std::string& private_key_path,
                     uint64_t* metadata_size_out);
 
+  // Write the payload with |manifest| to the |payload_file| file. The blobs
+  // are in the |ordered_blobs_file| file already in the order of the
+  // operations.
   static bool WritePayload(const std::string& payload_file,
                            const std::string& ordered_blobs_file,
                            const std::string& private_key_path,
@@ -65,6 +70,24 @@ class PayloadFile {
 
  private:
   FRIEND_TEST(PayloadFileTest, ReorderBlobsTest);
+  FRIEND_TEST(PayloadFileTest, WriteSignedPayloadTest);
+
+  // A range of bytes in a data blobs file.
+  struct BlobRange {
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  // Writes the payload with |manifest| to the |payload_file| file, in a single
+  // pass. The data blobs are copied from the |blob_ranges| of |blobs_fd|, one
+  // after the other, and the payload is hashed for signing along the way.
+  static bool WritePayloadFromBlobs(const std::string& payload_file,
+                                    int blobs_fd,
+                                    const std::vector<BlobRange>& blob_ranges,
+                                    const std::string& private_key_path,
+                                    uint64_t major_version_,
+                                    const DeltaArchiveManifest& manifest,
+                                    uint64_t* out_metadata_size);
 
   // Computes a SHA256 hash of the given buf and sets the hash value in the
   // operation so that update_engine could verify. This hash should be set
@@ -75,14 +98,14 @@ class PayloadFile {
   static bool AddOperationHash(InstallOperation* op, const brillo::Blob& buf);
 
   // Install operations in the manifest may reference data blobs, which
-  // are in data_blobs_path. This function creates a new data blobs file
-  // with the data blobs in the same order as the referencing install
-  // operations in the manifest. E.g. if manifest[0] has a data blob
-  // "X" at offset 1, manifest[1] has a data blob "Y" at offset 0,
-  // and data_blobs_path's file contains "YX", new_data_blobs_path
-  // will set to be a file that contains "XY".
-  bool ReorderDataBlobs(const std::string& data_blobs_path,
-                        const std::string& new_data_blobs_path);
+  // are in |data_blobs_fd|. This function moves the data blobs, without
+  // copying them, to be in the same order as the referencing install
+  // operations in the manifest, and adds their hashes to the operations. The
+  // ranges of |data_blobs_fd| to copy, in the new order, are stored in
+  // |blob_ranges|. E.g. if manifest[0] has a data blob "X" at offset 1,
+  // manifest[1] has a data blob "Y" at offset 0, and |data_blobs_fd| contains
+  // "YX", the ranges will be [1, 1] and [0, 1], giving "XY".
+  bool ReorderDataBlobs(int data_blobs_fd, std::vector<BlobRange>* blob_ranges);
 
   // Print in stderr the Payload usage report.
   void ReportPayloadUsage(uint64_t metadata_size) const;
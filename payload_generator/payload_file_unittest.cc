@@ -23,7 +23,10 @@
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/testing_constants.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_signer.h"
 
 using std::string;
 using std::vector;
@@ -36,7 +39,7 @@ class PayloadFileTest : public ::testing::Test {
 };
 
 TEST_F(PayloadFileTest, ReorderBlobsTest) {
-  ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX");
+  ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX", true);
 
   // The operations have three blob and one gap (the whitespace):
   // Rootfs operation 1: [8, 3] bcd
@@ -45,8 +48,6 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   string orig_data = "kernel abcd";
   EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), orig_data));
 
-  ScopedTempFile new_blobs("ReorderBlobsTest.new.XXXXXX");
-
   payload_.part_vec_.resize(2);
 
   vector<AnnotatedOperation> aops;
@@ -64,14 +65,17 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   aop.op.set_data_length(6);
   payload_.part_vec_[1].aops = {aop};
 
-  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.fd(), &blob_ranges));
 
   const vector<AnnotatedOperation>& part0_aops = payload_.part_vec_[0].aops;
   const vector<AnnotatedOperation>& part1_aops = payload_.part_vec_[1].aops;
   string new_data;
-  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
+  for (const auto& range : blob_ranges)
+    new_data += orig_data.substr(range.offset, range.length);
   // Kernel blobs should appear at the end.
   EXPECT_EQ("bcdakernel", new_data);
+  EXPECT_EQ(3U, blob_ranges.size());
 
   EXPECT_EQ(2U, part0_aops.size());
   EXPECT_EQ(0U, part0_aops[0].op.data_offset());
@@ -84,4 +88,43 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   EXPECT_EQ(6U, part1_aops[0].op.data_length());
 }
 
+TEST_F(PayloadFileTest, WriteSignedPayloadTest) {
+  ScopedTempFile blobs("WriteSignedPayloadTest.blobs.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(blobs.path(), "kernel abcd"));
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  EXPECT_TRUE(payload_.Init(config));
+  payload_.part_vec_.resize(1);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(7);
+  aop.op.set_data_length(4);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(6);
+  payload_.part_vec_[0].aops.push_back(aop);
+
+  ScopedTempFile payload_file("WriteSignedPayloadTest.payload.XXXXXX");
+  uint64_t metadata_size;
+  EXPECT_TRUE(payload_.WritePayload(
+      payload_file.path(),
+      blobs.path(),
+      test_utils::GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &metadata_size));
+  // The payload signature and metadata signature, written as the payload is,
+  // match the ones computed on the whole payload.
+  EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+      payload_file.path(),
+      test_utils::GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload_file.path(), &payload_data));
+  uint64_t signature_length = 0;
+  EXPECT_TRUE(PayloadSigner::SignatureBlobLength(
+      {test_utils::GetBuildArtifactsPath(kUnittestPrivateKeyPath)},
+      &signature_length));
+  EXPECT_EQ("abcdkernel",
+            payload_data.substr(metadata_size + signature_length, 10));
+}
+
 }  // namespace chromeos_update_engine
@@ -261,10 +261,26 @@ struct PayloadGenerationConfig {
   // Whether to enable zucchini ops
   bool enable_zucchini = true;
 
+  // Whether to order the operations of delta partitions by source locality
+  // rather than by destination, see ABGenerator::SortOperationsByLocality().
+  bool reorder_operations = false;
+
   std::string security_patch_level;
 
   uint32_t max_threads = 0;
 
+  // Directory of the on-disk cache of diff operations shared across
+  // invocations, see DiffCache. Empty to disable the cache.
+  std::string diff_cache_dir;
+
+  // Whether to skip the diff algorithms predicted to lose against the full
+  // operation, see DiffMayWin().
+  bool predict_diff_methods = false;
+
+  // CSV file to append the features and outcome of each diff to, for tuning
+  // the diff predictor. Empty to not record them.
+  std::string diff_stats_file;
+
   std::vector<bsdiff::CompressorType> compressors{
       bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli};
 
@@ -51,8 +51,10 @@ struct BlobReaderStream : public ISeqInStream {
 };
 
 // An ISeqOutStream implementation that writes all the data to the passed Blob.
+// Writing fails once the Blob would grow larger than |*max_size|, if set.
 struct BlobWriterStream : public ISeqOutStream {
-  explicit BlobWriterStream(brillo::Blob* data) : data_(data) {
+  BlobWriterStream(brillo::Blob* data, const std::atomic<size_t>* max_size)
+      : data_(data), max_size_(max_size) {
     Write = &BlobWriterStream::WriteStatic;
   }
 
@@ -60,12 +62,18 @@ struct BlobWriterStream : public ISeqOutStream {
                             const void* buf,
                             size_t size) {
     auto* self = static_cast<const BlobWriterStream*>(p);
+    if (self->max_size_ &&
+        self->data_->size() + size >
+            self->max_size_->load(std::memory_order_relaxed)) {
+      return 0;
+    }
     const uint8_t* buffer = reinterpret_cast<const uint8_t*>(buf);
     self->data_->insert(self->data_->end(), buffer, buffer + size);
     return size;
   }
 
   brillo::Blob* data_;
+  const std::atomic<size_t>* max_size_;
 };
 
 // Returns the filter id to be used to compress |data|.
@@ -114,6 +122,12 @@ void XzCompressInit() {
 }
 
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return XzCompress(in, nullptr, out);
+}
+
+bool XzCompress(const brillo::Blob& in,
+                const std::atomic<size_t>* max_size,
+                brillo::Blob* out) {
   CHECK(xz_initialized) << "Initialize XzCompress first";
   out->clear();
   if (in.empty())
@@ -141,10 +155,15 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
 
   props.filterProps.id = GetFilterID(in);
 
-  BlobWriterStream out_writer(out);
+  BlobWriterStream out_writer(out, max_size);
   BlobReaderStream in_reader(in);
   SRes res = Xz_Encode(&out_writer, &in_reader, &props, nullptr /* progress */);
-  return res == SZ_OK;
+  if (res != SZ_OK) {
+    // SZ_ERROR_WRITE if the output grew larger than |*max_size|.
+    out->clear();
+    return false;
+  }
+  return true;
 }
 
 }  // namespace chromeos_update_engine
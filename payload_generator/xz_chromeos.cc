@@ -16,6 +16,8 @@
 
 #include "update_engine/payload_generator/xz.h"
 
+#include <algorithm>
+
 #include <base/logging.h>
 #include <lzma.h>
 
@@ -24,13 +26,23 @@ namespace chromeos_update_engine {
 void XzCompressInit() {}
 
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return XzCompress(in, nullptr, out);
+}
+
+bool XzCompress(const brillo::Blob& in,
+                const std::atomic<size_t>* max_size,
+                brillo::Blob* out) {
   out->clear();
   if (in.empty())
     return true;
 
   // Resize the output buffer to get enough memory for writing the compressed
-  // data.
-  out->resize(lzma_stream_buffer_bound(in.size()));
+  // data. The single-call encoder only honors |*max_size| as it is now, by
+  // running out of output space.
+  size_t out_size = lzma_stream_buffer_bound(in.size());
+  if (max_size)
+    out_size = std::min(out_size, max_size->load(std::memory_order_relaxed));
+  out->resize(out_size);
 
   const uint32_t kLzmaPreset = 6;
   size_t out_pos = 0;
@@ -42,6 +54,10 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
                                    out->data(),
                                    &out_pos,
                                    out->size());
+  if (rc == LZMA_BUF_ERROR && max_size) {
+    out->clear();
+    return false;
+  }
   if (rc != LZMA_OK) {
     LOG(ERROR) << "Failed to compress data to LZMA stream with return code: "
                << rc;
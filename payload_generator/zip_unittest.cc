@@ -17,6 +17,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
 #include <vector>
@@ -82,6 +83,9 @@ template <typename T>
 class ZipTest : public ::testing::Test {
  public:
   bool ZipCompress(const brillo::Blob& in, brillo::Blob* out) const = 0;
+  bool ZipCompressBounded(const brillo::Blob& in,
+                          const std::atomic<size_t>* max_size,
+                          brillo::Blob* out) const = 0;
   bool ZipDecompress(const brillo::Blob& in, brillo::Blob* out) const = 0;
 };
 
@@ -93,6 +97,11 @@ class ZipTest<BzipTest> : public ::testing::Test {
   bool ZipCompress(const brillo::Blob& in, brillo::Blob* out) const {
     return BzipCompress(in, out);
   }
+  bool ZipCompressBounded(const brillo::Blob& in,
+                          const std::atomic<size_t>* max_size,
+                          brillo::Blob* out) const {
+    return BzipCompress(in, max_size, out);
+  }
   bool ZipDecompress(const brillo::Blob& in, brillo::Blob* out) const {
     return DecompressWithWriter<BzipExtentWriter>(in, out);
   }
@@ -106,6 +115,11 @@ class ZipTest<XzTest> : public ::testing::Test {
   bool ZipCompress(const brillo::Blob& in, brillo::Blob* out) const {
     return XzCompress(in, out);
   }
+  bool ZipCompressBounded(const brillo::Blob& in,
+                          const std::atomic<size_t>* max_size,
+                          brillo::Blob* out) const {
+    return XzCompress(in, max_size, out);
+  }
   bool ZipDecompress(const brillo::Blob& in, brillo::Blob* out) const {
     return DecompressWithWriter<XzExtentWriter>(in, out);
   }
@@ -145,6 +159,23 @@ TYPED_TEST(ZipTest, PoorCompressionTest) {
   EXPECT_EQ(in, decompressed);
 }
 
+TYPED_TEST(ZipTest, BoundedCompressionTest) {
+  brillo::Blob in(std::begin(kRandomString), std::end(kRandomString));
+  brillo::Blob out;
+  EXPECT_TRUE(this->ZipCompress(in, &out));
+
+  // Giving up once the output is larger than the limit.
+  std::atomic<size_t> max_size{out.size() - 1};
+  brillo::Blob bounded_out;
+  EXPECT_FALSE(this->ZipCompressBounded(in, &max_size, &bounded_out));
+  EXPECT_TRUE(bounded_out.empty());
+
+  // The output is the same when it fits.
+  max_size = out.size();
+  EXPECT_TRUE(this->ZipCompressBounded(in, &max_size, &bounded_out));
+  EXPECT_EQ(out, bounded_out);
+}
+
 TYPED_TEST(ZipTest, MalformedZipTest) {
   brillo::Blob in(std::begin(kRandomString), std::end(kRandomString));
   brillo::Blob out;